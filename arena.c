@@ -0,0 +1,184 @@
+/* arena.c
+ *
+ * The arena module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/*!
+ * \defgroup arena Arena Module
+ * This is a bump pointer allocator for the small data of a session, like
+ * the addresses of a mail. Allocating just moves a pointer forward in a
+ * block, nothing is freed one by one. arena_release() frees an allocation
+ * together with all newer ones at once, so a session releases the data of a
+ * mail with one call at its end.
+ * The first block is allocated with the arena and kept until arena_free(),
+ * a session with small data does not call malloc() after its start.
+ * @{
+ */
+
+//! The size of the first block of an arena, later ones are at least this big.
+#define ARENA_BLOCK 2048
+
+//! The alignment of the allocations.
+#define ARENA_ALIGN sizeof(void *)
+
+//! A block of an arena
+struct arena_block {
+    struct arena_block * block_prev;  //!< The previous block or NULL for the first one.
+    size_t               block_size;  //!< The usable size of the block.
+    size_t               block_used;  //!< The used bytes of the block.
+    char *               block_data;  //!< The data of the block, it follows this struct.
+};
+
+//! An arena
+/*!
+ * The arena and its first block are allocated together.
+ */
+struct arena {
+    struct arena_block * arena_block; //!< The current (newest) block.
+    struct arena_block   arena_first; //!< The first block.
+};
+
+//! Create a new arena
+/*!
+ * \return The new arena or NULL if there is no memory.
+ */
+arena_t * arena_new(){
+    arena_t * arena = malloc(sizeof(arena_t) + ARENA_BLOCK);
+
+    if (NULL == arena) {
+        return NULL;
+    }
+    arena->arena_first.block_prev = NULL;
+    arena->arena_first.block_size = ARENA_BLOCK;
+    arena->arena_first.block_used = 0;
+    arena->arena_first.block_data = (char *)(arena + 1);
+    arena->arena_block            = &(arena->arena_first);
+    return arena;
+}
+
+//! Allocate memory from an arena
+/*!
+ * If the current block is full, a new one is allocated which is big enough
+ * for the request.
+ * \param arena The arena.
+ * \param len   The size of the memory.
+ * \return The memory or NULL if there is no memory.
+ */
+void * arena_alloc(arena_t * arena, size_t len){
+    struct arena_block * block = arena->arena_block;
+    size_t               start = (block->block_used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    size_t               size;
+
+    if (start + len > block->block_size) {
+        size  = (len > ARENA_BLOCK ? len : ARENA_BLOCK);
+        if (NULL == (block = malloc(sizeof(struct arena_block) + size))) {
+            return NULL;
+        }
+        block->block_prev  = arena->arena_block;
+        block->block_size  = size;
+        block->block_data  = (char *)(block + 1);
+        arena->arena_block = block;
+        start              = 0;
+    }
+    block->block_used = start + len;
+    return block->block_data + start;
+}
+
+//! Copy a string into an arena
+/*!
+ * \param arena The arena.
+ * \param str   The string, it does not need to be terminated.
+ * \param len   The length of the string.
+ * \return The terminated copy or NULL if there is no memory.
+ */
+char * arena_strndup(arena_t * arena, const char * str, size_t len){
+    char * copy = arena_alloc(arena, len + 1);
+
+    if (NULL != copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+//! Get a mark of an arena
+/*!
+ * Releasing the mark with arena_release() frees all memory allocated after
+ * this call.
+ * \param arena The arena.
+ * \return The mark.
+ */
+void * arena_mark(arena_t * arena){
+    return arena->arena_block->block_data + arena->arena_block->block_used;
+}
+
+//! Free memory of an arena
+/*!
+ * This frees the given allocation or mark and everything allocated after
+ * it. Blocks which become empty are returned to the system, except the
+ * first one.
+ * \param arena The arena.
+ * \param mark  The allocation or mark, NULL frees everything.
+ */
+void arena_release(arena_t * arena, void * mark){
+    struct arena_block * block = arena->arena_block;
+    char *               pos   = mark;
+
+    while (NULL != block->block_prev
+            && (NULL == pos || pos < block->block_data || pos > block->block_data + block->block_used)) {
+        arena->arena_block = block->block_prev;
+        free(block);
+        block = arena->arena_block;
+    }
+    block->block_used = (NULL == pos ? 0 : (size_t)(pos - block->block_data));
+}
+
+//! Free an arena
+/*!
+ * \param arena The arena, may be NULL.
+ */
+void arena_free(arena_t * arena){
+    if (NULL != arena) {
+        arena_release(arena, NULL);
+        free(arena);
+    }
+}
+
+/** @} */
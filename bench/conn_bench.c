@@ -0,0 +1,336 @@
+/* bench/conn_bench.c
+ *
+ * A benchmark of the event backends for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*!
+ * \defgroup bench Benchmarks
+ * @{
+ */
+
+/*
+ * This is a load generator for a running server, it is run once against a
+ * server started with "-e epoll" and once against one with "-e uring":
+ *
+ *   ./mailtool -p 2525,2110,2995 -u user.csv -e uring &
+ *   bench/conn_bench -P $! -c 16 -n 200
+ *
+ * First one mail is delivered to an empty mailbox. Then one client does its
+ * rounds of POP3 sessions with a RETR of this mail, each on a new connection
+ * (the mailbox is locked by a session, so there is only one POP3 client).
+ * Then each of the clients does its rounds of SMTP transactions, also each on
+ * a new connection. With -P the CPU time the server used for each phase is
+ * taken from /proc, it is dominated by the syscalls of the event loop.
+ */
+
+//! The size of the read buffer of a client
+#define BUF_SIZE 65536
+
+//! A blocking client connection with a read buffer
+typedef struct client {
+    int    cl_fd;               //!< The socket.
+    size_t cl_start;            //!< Offset of the first unread byte.
+    size_t cl_end;              //!< Offset behind the last received byte.
+    char   cl_buf[BUF_SIZE];    //!< The received data.
+} client_t;
+
+static const char * host      = "127.0.0.1";  //!< The address of the server.
+static int          smtp_port = 2525;         //!< The SMTP port of the server.
+static int          pop_port  = 2110;         //!< The POP3 port of the server.
+static const char * user      = "jan";        //!< The local user the mails go to.
+static const char * passwd    = "test";       //!< The POP3 password of the user.
+
+//! Get the time in seconds
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//! Get the CPU time of a process in seconds or 0 without a pid
+static double cpu_time(pid_t pid){
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    char          path[64];
+    char          buf[1024];
+    char *        pos;
+    FILE *        f;
+
+    if (0 == pid) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (NULL == (f = fopen(path, "r"))) {
+        return 0;
+    }
+    buf[fread(buf, 1, sizeof(buf) - 1, f)] = '\0';
+    fclose(f);
+
+    /* utime and stime are the 12th and 13th field after the command name */
+    if (NULL != (pos = strrchr(buf, ')'))) {
+        sscanf(pos + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+//! Connect a client
+static int cl_connect(client_t * cl, int port){
+    struct sockaddr_in sa;
+    int                one = 1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port   = htons(port);
+    inet_pton(AF_INET, host, &sa.sin_addr);
+
+    cl->cl_start = cl->cl_end = 0;
+    if (-1 == (cl->cl_fd = socket(AF_INET, SOCK_STREAM, 0))) {
+        return -1;
+    }
+    setsockopt(cl->cl_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (-1 == connect(cl->cl_fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        close(cl->cl_fd);
+        return -1;
+    }
+    return 0;
+}
+
+//! Send a string
+static int cl_send(client_t * cl, const char * str, size_t len){
+    ssize_t done;
+
+    while (0 < len) {
+        if (1 > (done = send(cl->cl_fd, str, len, MSG_NOSIGNAL))) {
+            return -1;
+        }
+        str += done;
+        len -= done;
+    }
+    return 0;
+}
+
+//! Read a line
+/*!
+ * \return The line (terminated by the \p LF, not null terminated) or NULL if
+ *         the connection is closed.
+ */
+static const char * cl_line(client_t * cl){
+    const char * line;
+    char *       lf;
+    ssize_t      len;
+
+    while (NULL == (lf = memchr(cl->cl_buf + cl->cl_start, '\n', cl->cl_end - cl->cl_start))) {
+        if (0 < cl->cl_start) {
+            memmove(cl->cl_buf, cl->cl_buf + cl->cl_start, cl->cl_end - cl->cl_start);
+            cl->cl_end  -= cl->cl_start;
+            cl->cl_start = 0;
+        }
+        if (cl->cl_end == BUF_SIZE) {
+            cl->cl_end = 0;     /* a line this long is not checked anyway */
+        }
+        if (1 > (len = recv(cl->cl_fd, cl->cl_buf + cl->cl_end, BUF_SIZE - cl->cl_end, 0))) {
+            return NULL;
+        }
+        cl->cl_end += len;
+    }
+    line         = cl->cl_buf + cl->cl_start;
+    cl->cl_start = lf + 1 - cl->cl_buf;
+    return line;
+}
+
+//! Read a reply line and check its start
+static int cl_expect(client_t * cl, const char * start){
+    const char * line = cl_line(cl);
+
+    return (NULL != line && 0 == strncmp(line, start, strlen(start)) ? 0 : -1);
+}
+
+//! Do a SMTP transaction on a new connection
+static int smtp_round(client_t * cl, const char * body, size_t len){
+    char cmd[256];
+    int  ret = -1;
+
+    if (0 != cl_connect(cl, smtp_port)) {
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "HELO bench\r\nMAIL FROM:<bench@localhost>\r\n"
+            "RCPT TO:<%s@localhost>\r\nDATA\r\n", user);
+
+    if (0 == cl_expect(cl, "220")
+            && 0 == cl_send(cl, cmd, strlen(cmd))
+            && 0 == cl_expect(cl, "250") && 0 == cl_expect(cl, "250")
+            && 0 == cl_expect(cl, "250") && 0 == cl_expect(cl, "250")
+            && 0 == cl_send(cl, body, len)
+            && 0 == cl_send(cl, ".\r\nQUIT\r\n", 9)
+            && 0 == cl_expect(cl, "250") && 0 == cl_expect(cl, "250")) {
+        ret = 0;
+    }
+    close(cl->cl_fd);
+    return ret;
+}
+
+//! Do a POP3 session with a RETR on a new connection
+static int pop_round(client_t * cl){
+    const char * line;
+    char         cmd[256];
+    int          ret = -1;
+
+    if (0 != cl_connect(cl, pop_port)) {
+        return -1;
+    }
+    snprintf(cmd, sizeof(cmd), "USER %s\r\nPASS %s\r\nRETR 1\r\n", user, passwd);
+
+    if (0 == cl_expect(cl, "+OK")
+            && 0 == cl_send(cl, cmd, strlen(cmd))
+            && 0 == cl_expect(cl, "+OK") && 0 == cl_expect(cl, "+OK")
+            && 0 == cl_expect(cl, "+OK")) {
+        while (NULL != (line = cl_line(cl)) && 0 != strncmp(line, ".\r\n", 3));
+        if (NULL != line && 0 == cl_send(cl, "QUIT\r\n", 6) && 0 == cl_expect(cl, "+OK")) {
+            ret = 0;
+        }
+    }
+    close(cl->cl_fd);
+    return ret;
+}
+
+//! Build a mail body of about \p size bytes
+static char * build_body(size_t size, size_t * len){
+    char * buf = malloc(size + 80);
+    size_t pos = 0;
+
+    pos += sprintf(buf, "Subject: bench\r\n\r\n");
+    while (pos < size) {
+        memset(buf + pos, 'x', 76);
+        pos += 76;
+        buf[pos++] = '\r';
+        buf[pos++] = '\n';
+    }
+    *len = pos;
+    return buf;
+}
+
+//! Run a phase and print its results
+/*!
+ * Forks \p clients processes which do \p rounds rounds each and waits for
+ * them.
+ */
+static void run_phase(const char * name, int clients, int rounds, pid_t pid,
+        const char * body, size_t len){
+    client_t * cl = malloc(sizeof(client_t));
+    double     t, cpu;
+    int        failed = 0;
+    int        status;
+    int        i, j;
+
+    fflush(stdout);
+    t   = now();
+    cpu = cpu_time(pid);
+    for (i = 0; i < clients; i++) {
+        if (0 == fork()) {
+            for (j = 0; j < rounds; j++) {
+                if (0 != (NULL == body ? pop_round(cl) : smtp_round(cl, body, len))) {
+                    failed++;
+                }
+            }
+            exit(failed > 255 ? 255 : failed);
+        }
+    }
+    for (i = 0; i < clients; i++) {
+        wait(&status);
+        failed += WEXITSTATUS(status);
+    }
+    t   = now() - t;
+    cpu = cpu_time(pid) - cpu;
+
+    printf("%-5s %6d rounds in %7.3f s: %8.1f rounds/s", name, clients * rounds, t, clients * rounds / t);
+    if (0 != pid) {
+        printf(", server cpu %6.1f us/round", cpu * 1e6 / (clients * rounds));
+    }
+    printf(", %d failed\n", failed);
+    free(cl);
+}
+
+//! Run the benchmark
+int main(int argc, char * argv[]){
+    int    clients = 8;
+    int    rounds  = 100;
+    size_t size    = 4096;
+    pid_t  pid     = 0;
+    size_t len;
+    char * body;
+    int    c;
+
+    while (-1 != (c = getopt(argc, argv, "H:s:p:u:w:c:n:b:P:"))) {
+        switch (c) {
+            case 'H': host      = optarg;       break;
+            case 's': smtp_port = atoi(optarg); break;
+            case 'p': pop_port  = atoi(optarg); break;
+            case 'u': user      = optarg;       break;
+            case 'w': passwd    = optarg;       break;
+            case 'c': clients   = atoi(optarg); break;
+            case 'n': rounds    = atoi(optarg); break;
+            case 'b': size      = atol(optarg); break;
+            case 'P': pid       = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-H host] [-s smtp port] [-p pop3 port] "
+                        "[-u user] [-w passwd] [-c clients] [-n rounds] "
+                        "[-b body size] [-P server pid]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    body = build_body(size, &len);
+    printf("%d clients, %d rounds each, body %zu bytes\n", clients, rounds, len);
+
+    run_phase("MAIL", 1, 1, 0, body, len);
+    run_phase("POP3", 1, rounds, pid, NULL, 0);
+    run_phase("SMTP", clients, rounds, pid, body, len);
+
+    free(body);
+    return 0;
+}
+
+/** @} */
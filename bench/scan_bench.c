@@ -0,0 +1,192 @@
+/* bench/scan_bench.c
+ *
+ * A benchmark of the scan module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../scan.h"
+
+/*!
+ * \defgroup bench Benchmarks
+ * @{
+ */
+
+//! The size of the reads the connection module does
+#define CHUNK   (4096*4)
+
+//! The count of runs per method
+#define RUNS    10
+
+//! A line of the old tokenizer
+typedef struct line {
+    char *        line_data;
+    int           line_len;
+    struct line * line_next;
+} line_t;
+
+//! Get the time in seconds
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//! Build a mail body
+/*!
+ * Builds a body of about \p size bytes, made of base64 like lines of 76 chars
+ * and terminated by the DATA terminator.
+ */
+static char * build_body(size_t size, size_t * len){
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char * buf = malloc(size + 80);
+    size_t pos = 0;
+    int    i;
+
+    while (pos < size) {
+        for (i = 0; i < 76; i++) {
+            buf[pos] = b64[(pos * 7 + i) & 63];
+            pos++;
+        }
+        buf[pos++] = '\r';
+        buf[pos++] = '\n';
+    }
+    memcpy(buf + pos, ".\r\n", 3);
+    *len = pos + 3;
+    return buf;
+}
+
+//! The old way
+/*!
+ * This is the tokenizer and terminator check the connection and smtp
+ * modules used before the scan module: strtok() on each read, a copy of
+ * every line and a strncmp() per line.
+ */
+static size_t run_strtok(const char * body, size_t len){
+    static char readbuf[CHUNK];
+    size_t off   = 0;
+    size_t lines = 0;
+    size_t l;
+    char * next;
+    line_t * line;
+
+    while (off < len) {
+        l = (len - off < CHUNK - 1 ? len - off : CHUNK - 1);
+        memcpy(readbuf, body + off, l);
+        readbuf[l] = '\0';
+        off += l;
+
+        next = strtok(readbuf, "\n");
+        while (NULL != next) {
+            l = strlen(next) + 1;
+            line = malloc(sizeof(line_t));
+            line->line_data = malloc(l + 1);
+            memcpy(line->line_data, next, l);
+            line->line_data[l] = '\0';
+            line->line_len = l;
+            if (0 == strncmp(line->line_data, ".\r\n", 3)) {
+                lines++;
+            }
+            lines++;
+            free(line->line_data);
+            free(line);
+            next = strtok(NULL, "\n");
+        }
+    }
+    return lines;
+}
+
+//! The new way
+/*!
+ * This works like the bulk mode of the connection module: each read is
+ * appended to a buffer, scan_data_end() consumes the complete lines.
+ */
+static size_t run_scan(const char * body, size_t len){
+    static char inbuf[CHUNK * 2];
+    size_t off   = 0;
+    size_t fill  = 0;
+    size_t found = 0;
+    size_t complete;
+    size_t l;
+
+    while (off < len) {
+        l = (len - off < CHUNK ? len - off : CHUNK);
+        memcpy(inbuf + fill, body + off, l);
+        fill += l;
+        off  += l;
+
+        if (NULL != scan_data_end(inbuf, fill, &complete)) {
+            found++;
+            break;
+        }
+        memmove(inbuf, inbuf + complete, fill - complete);
+        fill -= complete;
+    }
+    return found;
+}
+
+//! Run the benchmark
+int main(int argc, char * argv[]){
+    size_t size = (argc > 1 ? atol(argv[1]) : 32) * 1024 * 1024;
+    size_t len;
+    char * body = build_body(size, &len);
+    double t, t_old = 0, t_new = 0;
+    int    i;
+
+    printf("body: %zu bytes, scan implementation: %s\n", len, scan_impl_name());
+
+    for (i = 0; i < RUNS; i++) {
+        t = now();
+        run_strtok(body, len);
+        t_old += now() - t;
+
+        t = now();
+        if (1 != run_scan(body, len)) {
+            printf("terminator not found!\n");
+            return 1;
+        }
+        t_new += now() - t;
+    }
+
+    printf("strtok tokenizer: %8.2f ms  %8.1f MB/s\n", t_old / RUNS * 1000, len / (t_old / RUNS) / 1e6);
+    printf("scan_data_end:    %8.2f ms  %8.1f MB/s\n", t_new / RUNS * 1000, len / (t_new / RUNS) / 1e6);
+
+    free(body);
+    return 0;
+}
+
+/** @} */
@@ -37,7 +37,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
 
@@ -84,6 +86,22 @@ userlist_t * userlist_head = NULL; //! The head of the userlist
 #define DFLT_POP3S_PORT "995"
 #define DFLT_DFFILE     "mailboxes.sqlite"
 
+#define DFLT_BACKLOG    1024
+#define DFLT_CLIENT_CONNS 50
+#define DFLT_SPOOLDIR   "/tmp"
+#define DFLT_SPOOL_WINDOW 1024
+#define DFLT_SPOOL_BUDGET 65536
+#define DFLT_MAX_SIZE   10240
+
+#define MAX_WORKERS     1024
+#define MAX_BACKLOG     65535
+#define MAX_CLIENT_CONNS 65535
+#define MAX_CLIENT_RATE  10000
+#define MAX_SPOOL_WINDOW 1048576
+#define MAX_SPOOL_BUDGET 16777216
+#define MAX_MAX_SIZE     4194304
+#define MAX_NUMBER_LEN   10      //! The max digits of a number option, enough for any int.
+
 char * smtp_port = NULL;        //! The SMTP Port
 char * pop_port  = NULL;       //! The POP3 Port
 char * pops_port = NULL;       //! The POP3S Port
@@ -94,6 +112,30 @@ char * relayhost = NULL;        //! The ost where all non-local mails should be
 
 char * dbfile    = NULL;  //! The filename of the mailbox database file.
 
+char * nameserver = NULL; //! The nameserver to use instead of the ones of resolv.conf.
+
+int    workers   = 1;     //! The count of worker threads.
+
+int    backend   = CONFIG_BACKEND_EPOLL; //! The event backend of the workers.
+
+int    backlog   = DFLT_BACKLOG; //! The backlog of the listening sockets.
+
+int    client_conns  = DFLT_CLIENT_CONNS; //! The max count of connections of a client or 0.
+
+int    client_prefix = 32; //! The prefix length the clients are grouped by.
+
+int    client_rate   = 0;  //! The max count of new connections of a client per second or 0.
+
+int    client_burst  = 0;  //! The count of new connections a client may open at once.
+
+char * spooldir  = NULL;  //! The directory of the temporary files of big mails.
+
+int    spool_window  = DFLT_SPOOL_WINDOW; //! The max size of a mail in memory in KiB.
+
+int    spool_budget  = DFLT_SPOOL_BUDGET; //! The max size of all mails in memory in KiB.
+
+int    max_size      = DFLT_MAX_SIZE; //! The max size of a mail in KiB or 0.
+
 
 //! Init default options
 /*!
@@ -104,6 +146,7 @@ static inline void config_init_defaults(){
     pop_port  = DFLT_POP3_PORT;
     pops_port = DFLT_POP3S_PORT;
     dbfile    = DFLT_DFFILE;
+    spooldir  = DFLT_SPOOLDIR;
 }
 
 //! Get the SMTP port
@@ -154,6 +197,104 @@ const char* config_get_dbfile(){
     return dbfile;
 }
 
+//! Get the nameserver
+/*! 
+ * \return The nameserver given on the commandline or NULL.
+ */
+const char* config_get_nameserver(){
+    return nameserver;
+}
+
+//! Get the count of worker threads
+/*! 
+ * \return The count of worker threads.
+ */
+int config_get_workers(){
+    return workers;
+}
+
+//! Get the event backend
+/*! 
+ * \return The requested event backend, CONFIG_BACKEND_EPOLL or
+ *         CONFIG_BACKEND_URING.
+ */
+int config_get_backend(){
+    return backend;
+}
+
+//! Get the listen backlog
+/*! 
+ * \return The backlog of the listening sockets.
+ */
+int config_get_backlog(){
+    return backlog;
+}
+
+//! Get the connection limit of a client
+/*! 
+ * \return The max count of open connections of a client or 0 if unlimited.
+ */
+int config_get_client_conns(){
+    return client_conns;
+}
+
+//! Get the prefix length of a client
+/*! 
+ * \return The prefix length of the addresses the client limits apply to.
+ */
+int config_get_client_prefix(){
+    return client_prefix;
+}
+
+//! Get the connect rate of a client
+/*! 
+ * \return The max count of new connections of a client per second or 0 if
+ *         unlimited.
+ */
+int config_get_client_rate(){
+    return client_rate;
+}
+
+//! Get the connect burst of a client
+/*! 
+ * \return The count of new connections a client may open at once.
+ */
+int config_get_client_burst(){
+    return client_burst;
+}
+
+//! Get the spool directory
+/*! 
+ * \return The directory for the temporary files of big mails.
+ */
+const char* config_get_spooldir(){
+    return spooldir;
+}
+
+//! Get the spool window
+/*! 
+ * \return The max size of a mail in memory in KiB, bigger ones go to a file.
+ */
+int config_get_spool_window(){
+    return spool_window;
+}
+
+//! Get the spool budget
+/*! 
+ * \return The max size of all mails in memory in KiB.
+ */
+int config_get_spool_budget(){
+    return spool_budget;
+}
+
+//! Get the max mail size
+/*! 
+ * \return The max size of a mail in KiB or 0 if unlimited.
+ */
+int config_get_max_size(){
+    return max_size;
+}
+
 //! Converts a String to lowercase
 /*!
  * Convers a char sequence to lower case for better matching with strcmp(). The
@@ -278,23 +419,15 @@ int config_parse_csv(const char* filename){
  */
 static inline user_t * config_get_user(const char* name){
     userlist_t * tmp = userlist_head;
-    size_t len = strlen(name) + 1;
-    char * lower_name = malloc(sizeof(char) * len);
-    int i = 1;
-
-    memcpy(lower_name, name, len);
-    config_to_lower(lower_name, len - 1);
 
+    /* the names in the table are lower case already */
     while (NULL != tmp) {
-        if (0 == strcmp(lower_name, tmp->userlist_user.user_name)){
-            free(lower_name);
+        if (0 == strcasecmp(name, tmp->userlist_user.user_name)){
             return &(tmp->userlist_user);
         }
         tmp = tmp->userlist_next;
-        i++;
     }
 
-    free(lower_name);
     return NULL;
 }
 
@@ -338,7 +471,8 @@ int config_user_locked(const char* name){
 //! Set or reset the lock flag
 /*! 
  * This sets or resets the mailbox lock flag for a given user. If the user dored
- * not exist in the list, CONFIG_ERROR will be returned.
+ * not exist in the list or the flag is already set, CONFIG_ERROR will be
+ * returned.
  * The User will be searched with the helper config_get_user(), therfore the
  * search is case insensitive and the provided buffer will not be modified.
  * \param name The name of the searched user.
@@ -351,15 +485,21 @@ static inline int config_set_user_mbox_lock(const char* name, int lock){
     if ( NULL == (user = config_get_user(name)) ) {
         return CONFIG_ERROR;
     }
-    user->user_mboxlock = lock;
+    if (lock) {
+        return (__sync_bool_compare_and_swap(&(user->user_mboxlock), 0, 1) ? CONFIG_OK : CONFIG_ERROR);
+    }
+    __sync_lock_release(&(user->user_mboxlock));
     return CONFIG_OK;
 }
 
 //! Set the lock flag
 /*! 
- * This wrapps config_set_user_mbox_lock() to set the mailbox lock flag.
+ * This wrapps config_set_user_mbox_lock() to set the mailbox lock flag. The
+ * flag is tested and set atomically, as the sessions of a user may be served
+ * by different worker threads.
  * \param name The username to reset the lock flag
- * \return CONFIG_ERROR if the user does not exist localy, CONFIG_OK else.
+ * \return CONFIG_ERROR if the user does not exist localy or the mailbox is
+ *         already locked, CONFIG_OK else.
  * \sa config_set_user_mbox_lock()
  */
 int config_lock_mbox(const char * name){
@@ -472,9 +612,158 @@ int config_parse_ports(const char* buf){
     return CONFIG_OK;
 }
 
+//! Parse a number option
+/*!
+ * Parses a decimal number which must be between min and max. Only digits
+ * are allowed, no sign or white space.
+ * \param buf The number as char sequence, null terminated.
+ * \param min The smallest allowed value.
+ * \param max The largest allowed value.
+ * \param val The parsed value is stored here on success.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+static inline int config_parse_number(const char *buf, int min, int max, int *val){
+    char * end;
+    long   num;
+
+    if (!isdigit((unsigned char) buf[0])) {
+        return CONFIG_ERROR;
+    }
+    errno = 0;
+    num = strtol(buf, &end, 10);
+    if (0 != errno || '\0' != *end || num < min || num > max) {
+        return CONFIG_ERROR;
+    }
+    *val = (int) num;
+    return CONFIG_OK;
+}
+
+//! Parse a worker option
+/*!
+ * Parses the count of worker threads. It must be a number between 1 and
+ * MAX_WORKERS.
+ * \param buf The count as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_workers(const char *buf){
+    return config_parse_number(buf, 1, MAX_WORKERS, &workers);
+}
+
+//! Parse a backlog option
+/*!
+ * Parses the backlog of the listening sockets. It must be a number between 1
+ * and MAX_BACKLOG. The kernel limits it further to net.core.somaxconn.
+ * \param buf The backlog as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_backlog(const char *buf){
+    return config_parse_number(buf, 1, MAX_BACKLOG, &backlog);
+}
+
+//! Parse a number with an optional second number
+/*!
+ * Parses a option of the form \<number>[\<delim>\<number>]. The numbers are
+ * checked by config_parse_number().
+ * \param buf   The option, null terminated.
+ * \param delim The char between the numbers.
+ * \param max   The largest allowed first number (the smallest is 0).
+ * \param val   The first number is stored here on success.
+ * \param min2  The smallest allowed second number.
+ * \param max2  The largest allowed second number.
+ * \param val2  The second number is stored here if it is given.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+static inline int config_parse_pair(const char *buf, char delim, int max, int *val,
+        int min2, int max2, int *val2){
+    char   first[MAX_NUMBER_LEN + 1];
+    char * sep = strchr(buf, delim);
+    size_t len = (NULL == sep ? strlen(buf) : (size_t)(sep - buf));
+
+    if (sizeof(first) <= len) {
+        return CONFIG_ERROR;
+    }
+    memcpy(first, buf, len);
+    first[len] = '\0';
+    if (CONFIG_ERROR == config_parse_number(first, 0, max, val)) {
+        return CONFIG_ERROR;
+    }
+    if (NULL != sep) {
+        return config_parse_number(sep + 1, min2, max2, val2);
+    }
+    return CONFIG_OK;
+}
+
+//! Parse a client limit option
+/*!
+ * Parses the max count of connections of a client, optional followed by
+ * /prefix to apply the limit to whole networks. 0 disables the limit.
+ * \param buf The option as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_client_conns(const char *buf){
+    return config_parse_pair(buf, '/', MAX_CLIENT_CONNS, &client_conns, 1, 32, &client_prefix);
+}
+
+//! Parse a client rate option
+/*!
+ * Parses the max count of new connections of a client per second, optional
+ * followed by :burst. The burst defaults to the rate. 0 disables the limit.
+ * \param buf The option as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_client_rate(const char *buf){
+    client_burst = 0;
+    if (CONFIG_ERROR == config_parse_pair(buf, ':', MAX_CLIENT_RATE, &client_rate,
+                1, MAX_CLIENT_CONNS, &client_burst)) {
+        return CONFIG_ERROR;
+    }
+    if (0 == client_burst) {
+        client_burst = client_rate;
+    }
+    return CONFIG_OK;
+}
+
+//! Parse a backend option
+/*!
+ * Parses the name of the event backend, "epoll" or "uring".
+ * \param buf The name, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_backend(const char *buf){
+    if (0 == strcmp(buf, "epoll")) {
+        backend = CONFIG_BACKEND_EPOLL;
+    } else if (0 == strcmp(buf, "uring")) {
+        backend = CONFIG_BACKEND_URING;
+    } else {
+        return CONFIG_ERROR;
+    }
+    return CONFIG_OK;
+}
+
+//! Parse a max size option
+/*!
+ * Parses the max size of a mail in KiB. 0 disables the limit.
+ * \param buf The size as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_max_size(const char *buf){
+    return config_parse_number(buf, 0, MAX_MAX_SIZE, &max_size);
+}
+
+//! Parse a spool memory option
+/*!
+ * Parses the max size of a single mail in memory in KiB, optional followed
+ * by :budget, the max size of all mails in memory in KiB.
+ * \param buf The option as char sequence, null terminated.
+ * \return CONFIG_OK on success, CONFIG_ERROR else.
+ */
+int config_parse_spool_memory(const char *buf){
+    return config_parse_pair(buf, ':', MAX_SPOOL_WINDOW, &spool_window, 0, MAX_SPOOL_BUDGET, &spool_budget);
+}
+
 //! Parse a host option
 /*!
- * Parses a hostname. It does a gethostbyname() lookup to ensure that the given
+ * Parses a hostname. It does a getaddrinfo() lookup to ensure that the given
  * parameter is a valid hostname.
  * On success the hostname will be returned in a fresh new buffer. Else NULL
  * will be returned.
@@ -484,10 +773,16 @@ int config_parse_ports(const char* buf){
 char *config_parse_host(const char *buf){
     char * new_host;
     size_t len; 
+    struct addrinfo   hints;
+    struct addrinfo * res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
 
-    if(gethostbyname(buf) == NULL) {
+    if(0 != getaddrinfo(buf, NULL, &hints, &res)) {
         return NULL;
     }
+    freeaddrinfo(res);
 
     len = strlen(buf) + 1;
     new_host = malloc(sizeof(char) * len);
@@ -514,7 +809,7 @@ int config_init(int argc, char * argv[]){
 
     config_init_defaults();
 
-    while ((c = getopt (argc, argv, "d:p:u:H:R:hV")) != -1){
+    while ((c = getopt (argc, argv, "d:p:u:H:R:N:w:e:b:c:r:t:m:s:hV")) != -1){
         switch (c) {
             case 'p':
                 if (CONFIG_ERROR == config_parse_ports(optarg)) 
@@ -533,11 +828,49 @@ int config_init(int argc, char * argv[]){
                     return CONFIG_ERROR;
                 init_ok = 1;
                 break;
+             case 'w':
+                if (CONFIG_ERROR == config_parse_workers(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 'e':
+                if (CONFIG_ERROR == config_parse_backend(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 'b':
+                if (CONFIG_ERROR == config_parse_backlog(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 'c':
+                if (CONFIG_ERROR == config_parse_client_conns(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 'r':
+                if (CONFIG_ERROR == config_parse_client_rate(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 'm':
+                if (CONFIG_ERROR == config_parse_spool_memory(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 's':
+                if (CONFIG_ERROR == config_parse_max_size(optarg))
+                    return CONFIG_ERROR;
+                break;
+             case 't':
+                len = strlen(optarg) + 1;
+                spooldir = malloc(sizeof(char) * len);
+                memcpy(spooldir, optarg, len);
+                break;
              case 'd':
                 len = strlen(optarg) + 1;
                 dbfile = malloc(sizeof(char) * len);
                 memcpy(dbfile, optarg, len);
                 break;
+             case 'N':
+                len = strlen(optarg) + 1;
+                nameserver = malloc(sizeof(char) * len);
+                memcpy(nameserver, optarg, len);
+                break;
         }
     }
 
@@ -39,6 +39,9 @@
 #define CONFIG_ERROR -1
 #define CONFIG_OK     0
 
+#define CONFIG_BACKEND_EPOLL 0
+#define CONFIG_BACKEND_URING 1
+
 inline char * config_get_smtp_port();
 
 inline char * config_get_pop_port();
@@ -51,6 +54,30 @@ const char* config_get_relayhost();
 
 const char* config_get_dbfile();
 
+const char* config_get_nameserver();
+
+int config_get_workers();
+
+int config_get_backend();
+
+int config_get_backlog();
+
+int config_get_client_conns();
+
+int config_get_client_prefix();
+
+int config_get_client_rate();
+
+int config_get_client_burst();
+
+const char* config_get_spooldir();
+
+int config_get_spool_window();
+
+int config_get_spool_budget();
+
+int config_get_max_size();
+
 inline void config_to_lower(char * str, size_t len);
 inline void config_to_upper(char * str, size_t len);
 
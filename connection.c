@@ -33,14 +33,24 @@
  * files in the program, then also delete it here.
  */
 
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netdb.h>
+#include <arpa/inet.h>
 
 
 #include "fail.h"
@@ -50,14 +60,105 @@
 #include "pop3.h"
 #include "forward.h"
 #include "ssl.h"
+#include "scan.h"
+#include "uring.h"
+#include "dns.h"
+#include "wheel.h"
+#include "limit.h"
+#include "pool.h"
 
 /*!
  * \defgroup connection Connection Module
  * @{
  */
 
-//! The size of the read buffer
-#define BUF_SIZE 4096*4
+//! The initial size of the input buffer of a connection
+#define INBUF_SIZE 4096
+
+//! The max size of the input buffer, longer lines are passed in pieces
+#define INBUF_MAX  (4096*16)
+
+//! The size of the chunks of the output buffer of a connection
+#define OUTBUF_CHUNK (4096*16)
+
+//! The max count of chunks written by one writev()
+#define OUTBUF_IOV   64
+
+//! The max count of written chunks a worker keeps for reuse
+#define OUTBUF_SPARE 16
+
+//! The count of socket elements a worker allocates at once
+#define SOCKET_POOL  64
+
+//! The count of ssl data structs a worker allocates at once
+#define SSL_POOL     16
+
+//! The count of queued output bytes which pauses the input of a connection
+#define OUTBUF_HIGH (4096*64)
+
+//! The count of queued output bytes which resumes the input of a connection
+#define OUTBUF_LOW  (4096*16)
+
+//! The max count of events fetched by one epoll_wait()
+#define MAX_EVENTS 64
+
+//! The max count of clients accepted on a listening socket per wakeup
+#define MAX_ACCEPTS 64
+
+//! The time in milliseconds an outbound connect may take
+#define CONNECT_TIMEOUT 30000
+
+//! Events for sockets which are drained on every wakeup (edge triggered).
+#define EVENTS_EDGE  (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+//! Events for listening and ssl sockets (level triggered).
+#define EVENTS_LEVEL (EPOLLIN)
+
+//! The epoll data of the stop event, it does not match any socket.
+#define STOP_EVENT   UINT64_MAX
+
+//! The count of submission entries of the io_uring of a worker
+#define URING_ENTRIES    256
+
+//! The count of completion entries of the io_uring of a worker
+#define URING_CQ_ENTRIES 4096
+
+//! The count of buffers in the buffer ring for received data
+#define URING_BUFS       512
+
+//! The size of the buffers in the buffer ring
+#define URING_BUF_SIZE   INBUF_SIZE
+
+//! The group id of the buffer ring
+#define URING_BUF_GROUP  0
+
+/*
+ * The kind of an io_uring request. It is stored in the low bits of the user
+ * data of the request, the rest is the pointer to the socket element (which
+ * is aligned to 16 bytes by the socket pool).
+ */
+#define OP_ACCEPT   1 //!< Multishot accept of a listener.
+#define OP_RECV     2 //!< Receive into the buffer ring.
+#define OP_SEND     3 //!< Send of an output chunk, completes only on failure.
+#define OP_SEND_END 4 //!< The last send of a chain.
+#define OP_POLL_IN  5 //!< Wait until the socket is readable.
+#define OP_POLL_OUT 6 //!< Wait until the socket is writable.
+#define OP_STOP     7 //!< Wait for the stop event.
+#define OP_CANCEL   8 //!< Cancel all requests on shutdown.
+#define OP_WATCH    9 //!< Wait for the events of a watched fd.
+#define OP_MASK     15
+
+//! An io_uring request for the input of the socket is pending
+#define ARMED_IN  1
+
+//! An io_uring request for the output of the socket is pending
+#define ARMED_OUT 2
+
+//! The input is paused until the queued output is written
+#define PAUSED_OUTPUT  1
+
+//! The input is paused by the session until conn_resume()
+#define PAUSED_SESSION 2
 
 //! Typedef for the mysocket struct
 typedef struct mysocket mysocket_t;
@@ -71,9 +172,56 @@ typedef int   (* data_deleter_t)(void * data);
 //! Function prototype for data handling functions
 typedef int   (* data_handler_t)(char * msg, ssize_t msglen, void * data);
 
+//! Function prototype for bulk data handling functions
+typedef ssize_t (* bulk_handler_t)(char * buf, ssize_t buflen, void * data);
+
 //! Function prototype for data reading functions
 typedef int   (* read_handler_t)(mysocket_t*);
 
+//! Function prototype for session timeout functions
+typedef int   (* timeout_handler_t)(void * data);
+
+
+//! Input buffer of a connection
+/*!
+ * This holds the readed, but not yet processed data of a connection. Complete
+ * lines are passed as slices of this buffer to the data handler, an incomplete
+ * line at the end stays in the buffer until the rest of it is readed.
+ * The processed bytes are between buf_data and buf_start, the unprocessed
+ * between buf_start and buf_end.
+ */
+typedef struct inbuf {
+    char * buf_data;    //!< The buffer memory (NULL until the first read).
+    size_t buf_size;    //!< The allocated size of the buffer.
+    size_t buf_start;   //!< Offset of the first unprocessed byte.
+    size_t buf_end;     //!< Offset behind the last readed byte.
+} inbuf_t;
+
+//! Chunk of an output buffer
+/*!
+ * The written bytes of a chunk are between chunk_data and chunk_start, the
+ * pending between chunk_start and chunk_end.
+ */
+typedef struct outchunk {
+    struct outchunk * chunk_next;   //!< The next chunk of the buffer.
+    size_t            chunk_size;   //!< The allocated size of chunk_data.
+    size_t            chunk_start;  //!< Offset of the first pending byte.
+    size_t            chunk_end;    //!< Offset behind the last queued byte.
+    char              chunk_data[]; //!< The data.
+} outchunk_t;
+
+//! Output buffer of a connection
+/*!
+ * This holds the data queued by conn_enqueue() and conn_printf(), which was
+ * not written to the socket yet. The data is kept in a list of chunks of at
+ * least OUTBUF_CHUNK bytes, so many small replies are formatted into a few
+ * contiguous buffers which are written with a single writev().
+ */
+typedef struct outbuf {
+    outchunk_t * buf_head;  //!< The first chunk (NULL if nothing is queued).
+    outchunk_t * buf_tail;  //!< The last chunk, new data is appended here.
+    size_t       buf_len;   //!< The count of pending bytes in all chunks.
+} outbuf_t;
 
 //! Socket and assigned data
 /*! 
@@ -81,33 +229,102 @@ typedef int   (* read_handler_t)(mysocket_t*);
  */
 struct mysocket {
     int            socket_fd;		//!< The file descriptor.
+    uint32_t       socket_generation;   //!< The generation of the socket, to detect stale events of a reused fd.
     void *         socket_data;         //!< The assigned data or (in the special case of listening sockets the accept callback).
     read_handler_t socket_read_handler; //!< The callback to read data from the socket.
     data_handler_t socket_data_handler; //!< The callback to deal with readed data.
     data_deleter_t socket_data_deleter; //!< The callback to destroy session assigned data.
+    bulk_handler_t socket_bulk_handler; //!< The callback to deal with readed data in bulk mode.
+    int            socket_bulk;         //!< Flag that indicate if the data is passed in bulk or linewise.
     int            socket_is_ssl;       //!< Flag that indicate if we have ssl or not.
+    inbuf_t        socket_inbuf;        //!< The readed data which is not processed yet.
+    outbuf_t       socket_outbuf;       //!< The queued data which is not written yet.
+    uint32_t       socket_events;       //!< The epoll events the socket is watched for.
+    int            socket_paused;       //!< The reasons the input is paused for (PAUSED_OUTPUT, PAUSED_SESSION).
+    int            socket_resume;       //!< Flag that indicate if the input must be processed when the socket is not paused anymore.
+    int            socket_closing;      //!< Flag that indicate if the socket is closed as soon as the output is written.
+    int            socket_dirty;        //!< Flag that indicate if the socket is in the dirty list.
+    mysocket_t *   socket_next_dirty;   //!< Link in the list of sockets with new output.
+    mysocket_t *   socket_next_closed;  //!< Link in the list of closed sockets waiting to be freed.
+    int            socket_ops;          //!< The count of pending io_uring requests of the socket.
+    int            socket_armed;        //!< The pending io_uring requests (ARMED_IN, ARMED_OUT).
+    int            socket_nobufs;       //!< Flag that indicate if the socket ran out of ring buffers and waits with a poll.
+    size_t         socket_sending;      //!< The count of bytes of the pending send chain.
+    size_t         socket_send_last;    //!< The length of the last send of the pending chain.
+    int            socket_send_failed;  //!< Flag that indicate if a send of the pending chain failed.
+    int            socket_rbuf;         //!< The id of the ring buffer with unprocessed input or -1.
+    size_t         socket_rbuf_start;   //!< Offset of the first unprocessed byte of the ring buffer.
+    size_t         socket_rbuf_end;     //!< Offset behind the last byte of the ring buffer.
+    int            socket_connecting;   //!< Flag that indicate if a non blocking connect is in progress.
+    wheel_timer_t  socket_timer;        //!< The timer of the connect and session timeouts.
+    int            socket_timeout;      //!< The session timeout in milliseconds or 0 (see conn_set_timeout()).
+    int            socket_timeout_next; //!< The session timeout which is armed when the connect is done.
+    int            socket_progress;     //!< Flag that indicate if output was written since the timer was (re)armed.
+    timeout_handler_t socket_timeout_handler; //!< The callback for expired session timeouts or NULL.
+    drain_handler_t socket_drain_handler; //!< The callback to produce more output when the queue drained (see conn_set_drain()) or NULL.
+    struct sockaddr_in socket_peer;     //!< The address of the client.
+    int            socket_limited;      //!< Flag that indicate if the connection is counted by the limit module.
+    const char *   socket_reject;       //!< The reply to clients over the limits (listening sockets only) or NULL.
+    watch_handler_t socket_watch_handler; //!< The callback of a watched fd (see conn_watch_fd()) or NULL.
+    int            socket_watch_events; //!< The events the watched fd is watched for (CONN_WATCH_*).
 };
 
+/*
+ * Each worker thread runs its own event loop with its own listeners and
+ * sockets, so all the state of the loop is thread local.
+ */
+
+//! Socket table
+/*!
+ * This holds all sockets of the worker, indexed by their file descriptor. As the
+ * kernel always hands out the lowest free fd, the table stays dense.
+ */
+__thread mysocket_t ** socket_table      = NULL;
+
+__thread int           socket_table_size = 0; //! The allocated size of the socket table.
+
+__thread uint32_t      socket_generation = 0; //! The generation of the last created socket.
 
-//! Socket list
+//! Closed sockets
 /*!
- * This is a linked list, holding all sockets of the app.
+ * Sockets deleted while the main loop dispatches events are only unlinked
+ * from the table. They are freed with conn_free_closed() after the event batch
+ * is done, so a handler can safely close its own (or any other) socket.
  */
-typedef struct mysocket_list {
-    mysocket_t             list_socket; //!< The sochet.
-    struct mysocket_list * list_next;   //!< The pointer to the next element.
-} mysocket_list_t;
+__thread mysocket_t *  socket_closed     = NULL;
 
-//! The readed data
+//! Sockets with new output
 /*!
- * Former a own struct, now a alias for body_line_t.
+ * Sockets which got new data by conn_enqueue() are linked here. The main loop
+ * writes their output after each batch of events, so a handler never sees its
+ * own socket closed because of a write error.
  */
-typedef  body_line_t readbuf_t;
+__thread mysocket_t *  socket_dirty      = NULL;
+
+//! Spare output chunks
+/*!
+ * Written chunks of OUTBUF_CHUNK bytes are kept here (up to OUTBUF_SPARE),
+ * so the reply to the next command of a session does not need a malloc().
+ */
+__thread outchunk_t *  outbuf_spare       = NULL;
+
+__thread int           outbuf_spare_count = 0; //! The count of chunks in outbuf_spare.
+
+__thread pool_t *      socket_pool        = NULL; //! The socket elements of the worker.
+
+__thread pool_t *      ssl_pool           = NULL; //! The ssl data of the ssl clients of the worker.
+
+__thread int epoll_fd = -1; //! The epoll instance of the main loop
+
+__thread int conn_backend = CONFIG_BACKEND_EPOLL; //! The event backend of the worker
 
-mysocket_list_t * socketlist_head = NULL; //! Head of the socket list
+__thread uring_t      conn_ring; //! The io_uring of the main loop (io_uring backend)
 
-//! A static buffer to read data.
-char  readbuf[BUF_SIZE];
+__thread uring_bufs_t conn_bufs; //! The buffer ring for received data (io_uring backend)
+
+__thread read_handler_t conn_read_plain = NULL; //! The read handler of non-ssl sockets, depends on the backend
+
+int stop_fd = -1; //! The eventfd which tells all workers to stop
 
 
 //! Helper for addrinfo
@@ -137,14 +354,15 @@ static inline struct addrinfo * conn_build_addrinfo(const char * port){
 //! Setup a listening socket
 /*!
  * This creates a listening socket on the given port. It will be bound to the
- * hostname of the app or INET ANY if none specified.
+ * hostname of the app or INET ANY if none specified. The socket is non
+ * blocking, so the accept handlers can take all pending clients until EAGAIN.
  * \param port The port to bind.
  * \return The new created listening socket or -1 on failture.
  */
 int conn_setup_listen(const char * port) {
     int new_sock = 0;
 
-    if((new_sock = socket(PF_INET, SOCK_STREAM, 0)) == -1){
+    if((new_sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1){
 	ERROR_SYS2("socket creation, Port: %s", port);
 	return -1;
     }
@@ -154,6 +372,11 @@ int conn_setup_listen(const char * port) {
     int so_opt = 1;
     setsockopt(new_sock, SOL_SOCKET, SO_REUSEADDR, (char*)&so_opt, sizeof(so_opt));
 
+    /* each worker has its own listener, the kernel spreads the clients */
+    if (1 < config_get_workers()) {
+        setsockopt(new_sock, SOL_SOCKET, SO_REUSEPORT, (char*)&so_opt, sizeof(so_opt));
+    }
+
     if(bind(new_sock, info->ai_addr, info->ai_addrlen) == -1){
 	ERROR_SYS2("socket binding, Port: %s", port);
 	return -1;
@@ -161,7 +384,7 @@ int conn_setup_listen(const char * port) {
 
     freeaddrinfo(info);
 
-    if(listen(new_sock, 2) == -1){
+    if(listen(new_sock, config_get_backlog()) == -1){
 	ERROR_SYS("socket listening");
 	return -1;
     }
@@ -169,10 +392,11 @@ int conn_setup_listen(const char * port) {
     return new_sock;
 }
 
-//! Helper for socket list elements
+static void conn_timer_expired(void * data);
+
+//! Helper for socket elements
 /*!
- * This creates a new mysocket struct and pack it in a mysocket_list struct. On
- * failture, NULL will be returned.
+ * This creates a new mysocket struct. On failture, NULL will be returned.
  * \param fd           The file descriptor of the new socket.
  * \param data         The data of the new session.
  * \param is_ssl       Flag to indicate if a session is ssl or not.
@@ -181,612 +405,2298 @@ int conn_setup_listen(const char * port) {
  * \param data_deleter The callback to delete data.
  * \return The new element or NULL on failture.
  */
-static inline mysocket_list_t * conn_build_socket_elem(int fd, void * data, int is_ssl,
+static inline mysocket_t * conn_build_socket_elem(int fd, void * data, int is_ssl,
 	read_handler_t read_handler, 
         data_handler_t data_handler, 
         data_deleter_t data_deleter){
-    mysocket_list_t * elem;
+    mysocket_t * elem;
 
-    elem = malloc(sizeof(mysocket_list_t));
-    
-    elem->list_next                       = NULL;
-    elem->list_socket.socket_data         = data;
-    elem->list_socket.socket_read_handler = read_handler;
-    elem->list_socket.socket_data_handler = data_handler;
-    elem->list_socket.socket_data_deleter = data_deleter;
-    elem->list_socket.socket_is_ssl       = is_ssl;
-    
-    if ( -1 == (elem->list_socket.socket_fd = fd) ) {
-        free(elem);
+    if (-1 == fd) {
+        return NULL;
+    }
+
+    if (NULL == (elem = pool_alloc(socket_pool))) {
         return NULL;
     }
+    
+    elem->socket_fd           = fd;
+    elem->socket_generation   = ++socket_generation;
+    elem->socket_data         = data;
+    elem->socket_read_handler = read_handler;
+    elem->socket_data_handler = data_handler;
+    elem->socket_data_deleter = data_deleter;
+    elem->socket_bulk_handler = NULL;
+    elem->socket_bulk         = 0;
+    elem->socket_is_ssl       = is_ssl;
+    elem->socket_events       = 0;
+    elem->socket_paused       = 0;
+    elem->socket_resume       = 0;
+    elem->socket_closing      = 0;
+    elem->socket_dirty        = 0;
+    elem->socket_next_dirty   = NULL;
+    elem->socket_next_closed  = NULL;
+    elem->socket_ops          = 0;
+    elem->socket_armed        = 0;
+    elem->socket_nobufs       = 0;
+    elem->socket_sending      = 0;
+    elem->socket_send_last    = 0;
+    elem->socket_send_failed  = 0;
+    elem->socket_rbuf         = -1;
+    elem->socket_rbuf_start   = 0;
+    elem->socket_rbuf_end     = 0;
+    elem->socket_connecting   = 0;
+    elem->socket_timeout      = 0;
+    elem->socket_timeout_next = 0;
+    elem->socket_progress     = 0;
+    elem->socket_timeout_handler = NULL;
+    elem->socket_drain_handler = NULL;
+    elem->socket_limited      = 0;
+    elem->socket_reject       = NULL;
+    elem->socket_watch_handler = NULL;
+    elem->socket_watch_events  = 0;
+
+    wheel_timer_init(&(elem->socket_timer), conn_timer_expired, elem);
+    memset(&(elem->socket_peer), 0, sizeof(struct sockaddr_in));
+    memset(&(elem->socket_inbuf), 0, sizeof(inbuf_t));
+    memset(&(elem->socket_outbuf), 0, sizeof(outbuf_t));
+    
     return elem;
 }
 
-//! Append a socket list element
+//! Append a socket element
 /*!
- * Append a mysocket_list_t element to the list of sockets.
- * \param new The new socket element to append.#
+ * Puts a mysocket_t element in the socket table at the index of its fd. The
+ * table will be grown if the fd does not fit.
+ * \param new The new socket element to append.
  * \return CONN_OK on success, CONN_FAIL else.
  */
-static inline int conn_append_socket_elem(mysocket_list_t * new){
-    mysocket_list_t * elem;
+static inline int conn_append_socket_elem(mysocket_t * new){
+    mysocket_t ** table;
+    int           size;
 
     if (NULL == new) {
         return CONN_FAIL;
     }
 
-    elem = socketlist_head;
-    if (NULL == elem) {
-        socketlist_head = elem;
-    } else {
-        while (NULL != elem) {
-            if (NULL == elem->list_next) {
-                elem->list_next = new;
-                break;
-            } else {
-                elem = elem->list_next;
-            }
+    if (new->socket_fd >= socket_table_size) {
+        size = (0 == socket_table_size ? 64 : socket_table_size * 2);
+        while (new->socket_fd >= size) {
+            size *= 2;
+        }
+        if (NULL == (table = realloc(socket_table, sizeof(mysocket_t*) * size))) {
+            ERROR_SYS("growing socket table");
+            return CONN_FAIL;
         }
+        memset(table + socket_table_size, 0, sizeof(mysocket_t*) * (size - socket_table_size));
+        socket_table      = table;
+        socket_table_size = size;
     }
+
+    socket_table[new->socket_fd] = new;
     return CONN_OK;
 }
 
-
-//! Delete element from socket list
-/*! 
- * Delete the socket element with the given file descriptor from the socket
- * list and frees all resources. The data delete callback of the socket object
- * to free all the session assigned data.
- * \param fd The file descriptor of the element to delete.
- * \return CONN_OK on success, CONN_FAIL else.
+//! Find a socket element
+/*!
+ * Looks up the socket element of a fd in the socket table.
+ * \param fd The file descriptor to search.
+ * \return The socket element or NULL if none is registered for the fd.
  */
-static inline int conn_delete_socket_elem(int fd){
-    mysocket_list_t * elem;
-    mysocket_list_t * prev;
-    mysocket_list_t * next;
-    void            * data;
-
-    elem = socketlist_head;
-    prev = NULL;
-    next = NULL;
-
-    while (NULL != elem){
-	if (fd == elem->list_socket.socket_fd){
-	    next = elem->list_next;
-	    if(NULL != prev){
-	        prev->list_next = next;
-	    } else {
-		socketlist_head = next;
-	    }
-	    if (elem->list_socket.socket_is_ssl >= 0 && NULL != elem->list_socket.socket_data_deleter) {
-                if(1 == elem->list_socket.socket_is_ssl) {
-                    data = ((ssl_data_t*)elem->list_socket.socket_data)->ssl_data;
-		} else {
-		    data = elem->list_socket.socket_data;
-		}
-		(elem->list_socket.socket_data_deleter)(data);
-	    }
-	    close(fd);
-            prev = elem;
-	    free(elem);
-	    return CONN_OK;
-	} else {
-            prev = elem;
-        }
-	elem = prev->list_next;
-    }
-
-    INFO_MSG("Socket closed");
-    return CONN_FAIL;
-}
-
-//! Cut the readed data at the newline char
-/*! 
- * This cuts the readed buffer in tokens on the newline char and puts the token
- * in a readbuf_t list.
- * If the buffer is empty a fingle readbuf_t element will be returned with
- * line_len set to <1.
- * \param readbuf The readed buffer.
- * \param l       The length of the data.
- * \return the readbuf_t list or NULL.
- */
-static inline readbuf_t * conn_tokenize_output(char * readbuf, ssize_t l) {
-    ssize_t len = l;
-    char * next;
-    char * buf;
-    readbuf_t * ret = NULL;
-    readbuf_t * tmp = NULL;
-
-    if (len < 1){
-        ret = malloc(sizeof(readbuf_t));
-        ret->line_data = NULL;
-        ret->line_len  = len;
-        ret->line_next = NULL;
-        return ret;
-    }
-
-    readbuf[len] = '\0';
-
-    next = strtok(readbuf, "\n");
-    while (NULL != next){
-        len = strlen(next) +1;
-        buf = malloc(sizeof(char) * (len + 1));
-        memcpy(buf, next, len);
-        buf[len] = '\0';
-        buf[len-1] = '\n';
-        if(NULL == tmp){
-            tmp = malloc(sizeof(readbuf_t));
-            ret = tmp;
-        } else {
-            tmp->line_next = malloc(sizeof(readbuf_t));
-            tmp = tmp->line_next;
-        }
-
-        tmp->line_len  = len;
-        tmp->line_next = NULL;
-        tmp->line_data = buf;
-
-        next = strtok(NULL, "\n");
+static inline mysocket_t * conn_find_socket_elem(int fd){
+    if (0 > fd || fd >= socket_table_size) {
+        return NULL;
     }
-        
-    return ret;
+    return socket_table[fd];
 }
 
-//! Read some normal data
+//! Get a submission entry for a socket
 /*!
- * Reads some data from a normal socket, cut them in a readbuf_t list and
- * returns this.
- * \param socket The socket to read from.
- * \return The readbuf_t list.
+ * This takes a submission entry of the io_uring and tags it with the socket
+ * and the kind of the request, so the completion can be assigned. The socket
+ * element is not freed before all its requests are completed, a send chain is
+ * counted once, by its last send.
+ * \param socket The socket or NULL for requests without socket.
+ * \param op     The kind of the request (OP_*).
+ * \return The entry or NULL if the ring is broken.
  */
-static inline readbuf_t * conn_read_normal_buff(int socket){
-    ssize_t len;
-    len = read(socket,readbuf,BUF_SIZE-1);
-    return conn_tokenize_output(readbuf, len);
+static inline struct io_uring_sqe * conn_uring_sqe(mysocket_t * socket, int op){
+    struct io_uring_sqe * sqe;
+
+    if (NULL == (sqe = uring_get_sqe(&conn_ring))) {
+        return NULL;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)socket | op;
+    if (NULL != socket && OP_SEND != op) {
+        socket->socket_ops++;
+    }
+    return sqe;
 }
 
-//! Read some ssl data
+//! Wait for the readiness of a socket with io_uring
 /*!
- * This reads some data from a ssl enabled socket, cut them in a readbuf_t list
- * and returns it.
- * \param socket The socket to read from.
- * \param ssl    The ssl_data struct of the socket.
- * \return The readbuf_t list.
+ * \param socket The socket.
+ * \param op     OP_POLL_IN, OP_POLL_OUT or OP_WATCH.
+ * \param events The poll events to wait for.
+ * \return CONN_OK on success, CONN_FAIL else.
  */
-static inline readbuf_t * conn_read_ssl_buff(int socket, ssl_data_t * ssl){
-    ssize_t len;
+static inline int conn_uring_poll(mysocket_t * socket, int op, uint32_t events){
+    struct io_uring_sqe * sqe;
 
-    len = ssl_read(socket, ssl->ssl_ssl, readbuf, BUF_SIZE-1);
-    return conn_tokenize_output(readbuf, len);
+    if (NULL == (sqe = conn_uring_sqe(socket, op))) {
+        return CONN_FAIL;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = socket->socket_fd;
+    sqe->poll32_events = events;
+    return CONN_OK;
 }
 
-//! Read some normal data
+//! Receive data of a socket with io_uring
 /*!
- * This reads and processes normal data from a given socket. This function will
- * be called if the main event loop think there is some data to read from a
- * specific not-ssl socket.
- * It also calls the callback for processing the data at the right module. If
- * the size of the data is 0, the socketd element will be removed from the list, 
- * destroyed and the socked closed.
- * \param socket The socket element to read data from.
- * \return 0 in every case.
+ * The kernel picks a buffer of the buffer ring when the data arrives, so idle
+ * connections do not hold any buffer.
+ * \param socket The socket.
+ * \return CONN_OK on success, CONN_FAIL else.
  */
-int conn_read_normal(mysocket_t * socket){
-    readbuf_t * buf = conn_read_normal_buff(socket->socket_fd);
-    readbuf_t * tmp = NULL;
-    int status      = CONN_CONT;;
-
-    if (0 < buf->line_len){
-
-        while (NULL != buf) {
-            tmp = buf;
-            buf = buf->line_next;
-
-
-            if (CONN_CONT == status) {
-                status = socket->socket_data_handler(tmp->line_data, 
-                        tmp->line_len, socket->socket_data);
-            }
+static inline int conn_uring_recv(mysocket_t * socket){
+    struct io_uring_sqe * sqe;
 
-            if (CONN_QUIT == status) {
-                INFO_MSG("End connection");
-                conn_delete_socket_elem(socket->socket_fd);
-            }
-
-            free(tmp->line_data);
-            free(tmp);
-        }
-    } else {
-        conn_delete_socket_elem(socket->socket_fd);
-        free(buf);
+    if (NULL == (sqe = conn_uring_sqe(socket, OP_RECV))) {
+        return CONN_FAIL;
     }
-    return 0;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = socket->socket_fd;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    return CONN_OK;
 }
 
-//! Find ssl data
+//! Send the queued output of a socket with io_uring
 /*!
- * Searches for the ssl data of a given fd in the socket list. The data will be
- * returned.
- * \param socket The fd to search.
- * \return The ssl data or NULL on failture.
+ * This submits one send per chunk of the output buffer (up to OUTBUF_IOV),
+ * linked so the kernel does them in order. Each send waits until its chunk is
+ * written completely. Only the last send of the chain posts a completion on
+ * success, so a chain costs no extra wakeup of the main loop. If a send fails,
+ * it completes with the error and the rest of the chain is canceled.
+ * The chunks are not touched until the chain is completed, new output is only
+ * appended behind the sent data.
+ * \param socket The socket.
+ * \return CONN_OK on success, CONN_FAIL else.
  */
-static inline ssl_data_t * conn_find_ssl_data(int socket){
-    mysocket_list_t * elem = socketlist_head;
-
-    while (elem != NULL) {
-	if (socket == elem->list_socket.socket_fd) {
-	    return (ssl_data_t *)elem->list_socket.socket_data;
-	}
+static inline int conn_uring_send(mysocket_t * socket){
+    struct io_uring_sqe * sqe = NULL;
+    outchunk_t *          chunk;
+    unsigned              cnt = 0;
+
+    /* a chain must not be split by the submit of a full ring */
+    for (chunk = socket->socket_outbuf.buf_head; NULL != chunk && cnt < OUTBUF_IOV; chunk = chunk->chunk_next) {
+        cnt++;
+    }
+    if (uring_sq_space(&conn_ring) < cnt && 0 > uring_submit(&conn_ring, 0)) {
+        ERROR_SYS("io_uring submission");
+        return CONN_FAIL;
+    }
 
-	elem = elem->list_next;
+    for (chunk = socket->socket_outbuf.buf_head; NULL != chunk && 0 < cnt; chunk = chunk->chunk_next, cnt--) {
+        if (chunk->chunk_end == chunk->chunk_start) {
+            continue;
+        }
+        if (NULL != sqe) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        if (NULL == (sqe = conn_uring_sqe(socket, OP_SEND))) {
+            return CONN_FAIL;
+        }
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->flags     = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->fd        = socket->socket_fd;
+        sqe->addr      = (uintptr_t)(chunk->chunk_data + chunk->chunk_start);
+        sqe->len       = chunk->chunk_end - chunk->chunk_start;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        socket->socket_sending += sqe->len;
+    }
+    if (NULL == sqe) {
+        return CONN_OK;
     }
-    return NULL;
-}
 
+    sqe->user_data           = (uint64_t)(uintptr_t)socket | OP_SEND_END;
+    sqe->flags              &= ~IOSQE_CQE_SKIP_SUCCESS;
+    socket->socket_send_last = sqe->len;
+    socket->socket_armed    |= ARMED_OUT;
+    socket->socket_ops++;
+    return CONN_OK;
+}
 
-//! Read some ssl data
+//! Arm the io_uring requests of a socket
 /*!
- * This reads and processes normal data from a given socket. This function will
- * be called if the main event loop think there is some data to read from a
- * specific ssl socket.
- * It also calls the callback for processing the data at the right module. If
- * the size of the data is 0, the socketd element will be removed from the list, 
- * destroyed and the socked closed.
- * \param socket The socket element to read data from.
- * \return 0 in every case.
+ * This is the io_uring counterpart of the epoll registration. The requests of
+ * a client socket are one shot, so the socket gets new ones after each
+ * completion, depending on its state: Input is received into the buffer ring
+ * as long as the socket is not paused or closing and queued output is sent
+ * with linked sends. Ssl sockets (which do their I/O in openssl) and sockets
+ * which ran out of ring buffers wait with a poll instead. A connecting socket
+ * only waits with a poll for POLLOUT, a watched fd with a poll for its
+ * events.
+ * \param socket The socket.
  */
-int conn_read_ssl(mysocket_t * socket){
-    ssl_data_t * data = socket->socket_data;
-    readbuf_t * buf   = conn_read_ssl_buff(socket->socket_fd, data);
-    readbuf_t * tmp   = NULL;
-    int status        = CONN_CONT;
-
-    if (0 < buf->line_len){
-
-        while (NULL != buf) {
-            tmp = buf;
-            buf = buf->line_next;
+static inline void conn_uring_arm(mysocket_t * socket){
+    int ret = CONN_OK;
+
+    if (NULL != socket->socket_watch_handler) {
+        if (!(socket->socket_armed & ARMED_IN) && 0 != socket->socket_watch_events
+                && CONN_OK == conn_uring_poll(socket, OP_WATCH,
+                    (socket->socket_watch_events & CONN_WATCH_IN ? POLLIN : 0)
+                    | (socket->socket_watch_events & CONN_WATCH_OUT ? POLLOUT : 0))) {
+            socket->socket_armed |= ARMED_IN;
+        }
+        return;
+    }
 
+    /* a connecting socket only waits until it is connected */
+    if (socket->socket_connecting) {
+        if (!(socket->socket_armed & ARMED_OUT)
+                && CONN_OK == conn_uring_poll(socket, OP_POLL_OUT, POLLOUT)) {
+            socket->socket_armed |= ARMED_OUT;
+        }
+        return;
+    }
 
-            if (CONN_CONT == status) {
-                status = socket->socket_data_handler(tmp->line_data, 
-                        tmp->line_len, data->ssl_data);
-            }
+    if (!(socket->socket_armed & ARMED_IN) && -1 == socket->socket_rbuf
+            && !socket->socket_paused && !socket->socket_closing) {
+        if (1 == socket->socket_is_ssl || socket->socket_nobufs) {
+            ret = conn_uring_poll(socket, OP_POLL_IN, POLLIN);
+        } else {
+            ret = conn_uring_recv(socket);
+        }
+        if (CONN_OK == ret) {
+            socket->socket_armed |= ARMED_IN;
+        }
+    }
 
-            if (CONN_QUIT == status) {
-                INFO_MSG("Close connection");
-		ssl_quit_client(data->ssl_ssl, socket->socket_fd);
-                conn_delete_socket_elem(socket->socket_fd);
+    if (!(socket->socket_armed & ARMED_OUT) && 0 < socket->socket_outbuf.buf_len) {
+        if (1 == socket->socket_is_ssl) {
+            if (CONN_OK == conn_uring_poll(socket, OP_POLL_OUT, POLLOUT)) {
+                socket->socket_armed |= ARMED_OUT;
             }
-
-            free(tmp->line_data);
-            free(tmp);
+        } else {
+            conn_uring_send(socket);
         }
-    } else {
-        conn_delete_socket_elem(socket->socket_fd);
-        free(buf);
     }
-    return 0;
 }
 
-//! Accept a normal connection
+//! Register a socket at the event loop
 /*!
- * This accepts a normal client connection on a listening socket. The socket
- * data will be initialized with the right callback and with the socket queued
- * to the socket list.
- * \param socket The socket struct to accept.
- * \return CONN_OK on succes, CONN_FAIL else.
+ * This adds the socket to the epoll set of the main loop. It must be called
+ * exactly once per socket, the registration is dropped automatically by the
+ * kernel on \p close().
+ * Sockets registered with EVENTS_EDGE will only be reported again if new data
+ * arrives, so their read handler must read until \p EAGAIN.
+ * With the io_uring backend the first requests of the socket are armed
+ * instead, \p events is not used then.
+ * \param socket The socket to watch.
+ * \param events The epoll events to watch for.
+ * \return CONN_OK on success, CONN_FAIL else.
  */
-int conn_accept_normal_client(mysocket_t * socket){
-    int               new;
-    struct            sockaddr sa;
-    size_t            len = sizeof(sa);
-    mysocket_list_t * elem;
-    void *            data;
-    data_init_t       init_handler = (data_init_t)socket->socket_data;
+static inline int conn_watch_socket(mysocket_t * socket, uint32_t events){
+    struct epoll_event ev;
 
-    INFO_MSG("Accept new Client");
-    if ( -1 == (new = accept(socket->socket_fd, &sa, (uint32_t*)&len)) ) {
-        return CONN_FAIL;
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        conn_uring_arm(socket);
+        return (0 == socket->socket_ops ? CONN_FAIL : CONN_OK);
     }
 
-    if( NULL == (data = init_handler(new)) ) {
-        close(new);
-        return CONN_FAIL;
-    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u64 = ((uint64_t)socket->socket_generation << 32) | (uint32_t)socket->socket_fd;
 
-    elem = conn_build_socket_elem(new, data, 0,
-            conn_read_normal, 
-            (data_handler_t)socket->socket_data_handler,
-            (data_deleter_t)socket->socket_data_deleter);
-    if (NULL == elem) {
-        socket->socket_data_deleter(data);
-        close(new);
-    }
-    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
-        socket->socket_data_deleter(data);
-        free(elem);
-        close(new);
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket->socket_fd, &ev)) {
+        ERROR_SYS("epoll registration");
         return CONN_FAIL;
     }
-
+    socket->socket_events = events;
     return CONN_OK;
 }
 
-//! Accept a normal connection
+//! Update the watched events of a socket
 /*!
- * This accepts a ssl client connection on a listening socket. It also performs
- * the ssl handshake. The socket data will be initialized with the right 
- * callback and with the socket queued
- * to the socket list.
- * \param socket The socket struct to accept.
- * \return CONN_OK on succes, CONN_FAIL else.
+ * This adjusts the epoll registration of a client socket to its state: The
+ * input is not watched while the socket is paused or closing and the socket
+ * is watched for EPOLLOUT as long as there is queued output or a connect is
+ * in progress.
+ * With the io_uring backend the missing requests of the socket are armed.
+ * \param socket The socket to update.
  */
-int conn_accept_ssl_client(mysocket_t * socket){
-    int               new;
-    struct            sockaddr sa;
-    size_t            len = sizeof(sa);
-    ssl_data_t      * data;
-    data_init_t       init_handler = (data_init_t)socket->socket_data;
-    mysocket_list_t * elem;
-
-
+static inline void conn_update_events(mysocket_t * socket){
+    struct epoll_event ev;
+    uint32_t           events = (1 == socket->socket_is_ssl ? EVENTS_LEVEL : EVENTS_EDGE);
 
-    INFO_MSG("Accept new SSL Client");
-    if ( -1 == (new = accept(socket->socket_fd, &sa, (uint32_t*)&len)) ) {
-	return CONN_FAIL;
+    if (-1 == socket->socket_fd) {
+        return;
     }
-
-    data = malloc(sizeof(ssl_data_t));
-
-    data->ssl_ssl = ssl_accept_client(new);
-
-    elem = conn_build_socket_elem(new, data, 1,
-	    conn_read_ssl,
-	    (data_handler_t)socket->socket_data_handler,
-	    (data_deleter_t)socket->socket_data_deleter);
-
-    if (NULL == elem) {
-	socket->socket_data_deleter(data);
-	ssl_quit_client(data->ssl_ssl, new);
-	close(new);
-	return CONN_FAIL;
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        conn_uring_arm(socket);
+        return;
+    }
+    if (NULL != socket->socket_watch_handler) {
+        return;
     }
 
-    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
-	socket->socket_data_deleter(data);
-	free(elem);
-	ssl_quit_client(data->ssl_ssl, new);
-	close(new);
-	return CONN_FAIL;
+    if (socket->socket_paused || socket->socket_closing) {
+        events &= ~(EPOLLIN | EPOLLRDHUP);
     }
-    if( NULL == (data->ssl_data = init_handler(new)) ) {
-	ssl_quit_client(data->ssl_ssl, new);
-	close(new);
-	return CONN_FAIL;
+    if (0 < socket->socket_outbuf.buf_len || socket->socket_connecting) {
+        events |= EPOLLOUT;
+    }
+    if (events == socket->socket_events) {
+        return;
     }
 
-    return CONN_OK;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u64 = ((uint64_t)socket->socket_generation << 32) | (uint32_t)socket->socket_fd;
+
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket->socket_fd, &ev)) {
+        ERROR_SYS("epoll modification");
+        return;
+    }
+    socket->socket_events = events;
 }
 
-//! Init listening connections
+//! Make a socket non blocking
 /*!
- * Initialize the listening sockets for SMTP, POP3 and POP3S. The sokets will
- * also be queued to the socket list.
- * This should be called only once on app start.
+ * Client sockets are non blocking, so a slow peer cannot stall the main loop.
+ * \param fd The socket.
  * \return CONN_OK on success, CONN_FAIL else.
  */
-int conn_init(){
-    mysocket_list_t * elem;
-    int fd;
-
-    /* Setup SMTP */
-    INFO_MSG("Init SMTP socket");
-    fd = conn_setup_listen(config_get_smtp_port());
-    elem = conn_build_socket_elem(fd, smtp_create_session, -1, conn_accept_normal_client, 
-            (data_handler_t)smtp_process_input, (data_deleter_t)smtp_destroy_session);
-    if (NULL == elem) 
-        return CONN_FAIL;
-    socketlist_head = elem;
-
-    /* Setup POP3 */
-    INFO_MSG("Init POP3 socket");
-    fd = conn_setup_listen(config_get_pop_port());
-    elem->list_next = conn_build_socket_elem(fd, pop3_create_normal_session, -1, conn_accept_normal_client, 
-	(data_handler_t)pop3_process_input, (data_deleter_t)pop3_destroy_session);
-    elem = elem->list_next;
-    if (NULL == elem) 
-        return CONN_FAIL;
+static inline int conn_set_nonblock(int fd){
+    int flags;
 
-    /* Setup POP3S */
-    INFO_MSG("Init POP3S socket");
-    fd = conn_setup_listen(config_get_pops_port());
-    elem->list_next = conn_build_socket_elem(fd, pop3_create_ssl_session, -1, conn_accept_ssl_client, 
-	(data_handler_t)pop3_process_input, (data_deleter_t)pop3_destroy_session);
-    elem = elem->list_next;
-    if (NULL == elem) 
+    if (-1 == (flags = fcntl(fd, F_GETFL)) || -1 == fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+        ERROR_SYS("set socket non blocking");
         return CONN_FAIL;
-    
-    INFO_MSG("Connection init ok");
-
+    }
     return CONN_OK;
 }
 
-//! Do the connection wait loop
-/*! 
- * This is the main event loop. It performs a select() on all sockets in the
- * socket list to watch them for input. If the select returns it iterate trough
- * the socket list and calls the read_handler callback for each active socket.
- * This should be called once in the app to perform the client handling. If it
- * returns, the app should be quit.
- * \return 0 in any case.
+//! Get the session data of a socket
+/*!
+ * \param socket The socket.
+ * \return The data which is passed to the callbacks of the socket.
  */
-int conn_wait_loop(){
-    mysocket_list_t * elem;
-    fd_set rfds;
-    int fd;
-    int num;
-    int max = 0;
-    int i;
-    
-    while (1) {
-        FD_ZERO(&rfds);
-
-        elem = socketlist_head;
-        while (elem != NULL){
-            fd = elem->list_socket.socket_fd;
-            FD_SET(fd, &rfds);
-            if(max < fd)
-                max = fd;
-            elem = elem->list_next;
-        }
-
-        num = select(max + 1, &rfds, NULL, NULL, NULL);
-
-        elem = socketlist_head;
-        for (i = 0; (i < num) && elem != NULL; ){
-            fd = elem->list_socket.socket_fd;
-            if (FD_ISSET(fd, &rfds)) {
-                (elem->list_socket.socket_read_handler)(&(elem->list_socket));
-                i++;
-            }
-            elem = elem->list_next;
-        }
+static inline void * conn_session_data(mysocket_t * socket){
+    if (1 == socket->socket_is_ssl) {
+        return ((ssl_data_t*)socket->socket_data)->ssl_data;
     }
-
-    return 0;
+    return socket->socket_data;
 }
 
-//! Close all connections
-/*! This claoses all elements in the socket list. It can be used to cleanup
- * after SIGTERM etc.
- * \return CONN_OK.
+//! Release an output chunk
+/*!
+ * This puts a chunk which is not used anymore to the spare chunks of the
+ * worker, or frees it if it has an other size or there are enough spares.
+ * \param chunk The chunk.
  */
-int conn_close() {
-    mysocket_list_t * elem = socketlist_head;
-    int fd;
-
-    while (elem != NULL){
-	fd = elem->list_socket.socket_fd;
-	elem = elem->list_next;
-        conn_delete_socket_elem(fd);
+static inline void conn_outchunk_release(outchunk_t * chunk){
+    if (OUTBUF_CHUNK == chunk->chunk_size && OUTBUF_SPARE > outbuf_spare_count) {
+        chunk->chunk_next = outbuf_spare;
+        outbuf_spare      = chunk;
+        outbuf_spare_count++;
+    } else {
+        free(chunk);
     }
-
-    INFO_MSG("All connections closed");
-
-    return CONN_OK;
 }
 
-//! Write data to the ssl client
+//! Drop an output buffer
 /*!
- * This is a function to write data back to a ssl client.
- * \param fd  The socket to the client.
- * \param buf The data to write.
- * \param len The length of the data.
- * \return >0 on success.
+ * This drops all queued data of an output buffer.
+ * \param out The output buffer.
  */
-ssize_t conn_writeback_ssl(int fd, char * buf, ssize_t len) {
-    ssl_data_t * data = conn_find_ssl_data(fd);
+static inline void conn_outbuf_free(outbuf_t * out){
+    outchunk_t * chunk;
 
-    return ssl_write(fd, data->ssl_ssl, buf, len);
+    while (NULL != (chunk = out->buf_head)) {
+        out->buf_head = chunk->chunk_next;
+        conn_outchunk_release(chunk);
+    }
+    out->buf_tail = NULL;
+    out->buf_len  = 0;
 }
 
-//! Write data to the client
+//! Get space in an output buffer
 /*!
- * This is a function to write data back to a client.
- * \param fd  The socket to the client.
+ * This returns the chunk the next data should be appended to. If the last
+ * chunk has less than \p min free bytes, a new one is appended, big enough
+ * for \p min bytes.
+ * \param out The output buffer.
+ * \param min The count of bytes needed or 1 if any space will do.
+ * \return The chunk or NULL if the memory is exhausted.
+ */
+static inline outchunk_t * conn_outbuf_reserve(outbuf_t * out, size_t min){
+    outchunk_t * chunk = out->buf_tail;
+    size_t       size  = (min > OUTBUF_CHUNK ? min : OUTBUF_CHUNK);
+
+    if (NULL != chunk && chunk->chunk_size - chunk->chunk_end >= min) {
+        return chunk;
+    }
+    if (OUTBUF_CHUNK == size && NULL != outbuf_spare) {
+        chunk        = outbuf_spare;
+        outbuf_spare = chunk->chunk_next;
+        outbuf_spare_count--;
+    } else if (NULL == (chunk = malloc(sizeof(outchunk_t) + size))) {
+        ERROR_SYS("growing output buffer");
+        return NULL;
+    }
+    chunk->chunk_next  = NULL;
+    chunk->chunk_size  = size;
+    chunk->chunk_start = 0;
+    chunk->chunk_end   = 0;
+
+    if (NULL == out->buf_tail) {
+        out->buf_head = chunk;
+    } else {
+        out->buf_tail->chunk_next = chunk;
+    }
+    out->buf_tail = chunk;
+    return chunk;
+}
+
+//! Give the ring buffer of a socket back
+/*!
+ * This drops the unprocessed input of a socket which is still in a buffer of
+ * the buffer ring and gives the buffer back to the ring.
+ * \param socket The socket.
+ */
+static inline void conn_rbuf_release(mysocket_t * socket){
+    if (-1 != socket->socket_rbuf) {
+        uring_bufs_recycle(&conn_bufs, socket->socket_rbuf);
+        socket->socket_rbuf = -1;
+    }
+}
+
+//! Delete element from socket table
+/*! 
+ * Delete the socket element with the given file descriptor from the socket
+ * table, calls the data delete callback of the socket object to free all the
+ * session assigned data, ends the ssl session if any and closes the fd.
+ * Queued output which was not written yet is dropped.
+ * The element itself is queued to the closed list and freed later by
+ * conn_free_closed(), so callers up the stack may still use it. Pending
+ * io_uring requests of the socket are ended by a shutdown, the element and
+ * its buffers are kept until they are completed.
+ * \param fd The file descriptor of the element to delete.
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+static inline int conn_delete_socket_elem(int fd){
+    mysocket_t * elem;
+    void       * data;
+
+    if (NULL == (elem = conn_find_socket_elem(fd))) {
+        return CONN_FAIL;
+    }
+    socket_table[fd] = NULL;
+
+    wheel_cancel(&(elem->socket_timer));
+    if (elem->socket_limited) {
+        limit_release(&(elem->socket_peer));
+    }
+    if (elem->socket_is_ssl >= 0) {
+        data = conn_session_data(elem);
+        if (NULL != data && NULL != elem->socket_data_deleter) {
+            (elem->socket_data_deleter)(data);
+        }
+        if (1 == elem->socket_is_ssl) {
+            ssl_quit_client(((ssl_data_t*)elem->socket_data)->ssl_ssl, fd);
+            pool_release(ssl_pool, elem->socket_data);
+        }
+    }
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        conn_rbuf_release(elem);
+        if (0 < elem->socket_ops) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    close(fd);
+
+    elem->socket_fd          = -1;
+    elem->socket_next_closed = socket_closed;
+    socket_closed            = elem;
+
+    INFO_MSG("Socket closed");
+    return CONN_OK;
+}
+
+//! Free closed sockets
+/*!
+ * Frees all socket elements deleted since the last call, with their input and
+ * output buffers. This is called by the main loop after each batch of events.
+ * Elements which still have pending io_uring requests stay in the list.
+ */
+static inline void conn_free_closed(){
+    mysocket_t *  elem;
+    mysocket_t ** link = &socket_closed;
+
+    while (NULL != (elem = *link)) {
+        if (0 < elem->socket_ops) {
+            link = &(elem->socket_next_closed);
+            continue;
+        }
+        *link = elem->socket_next_closed;
+        free(elem->socket_inbuf.buf_data);
+        conn_outbuf_free(&(elem->socket_outbuf));
+        pool_release(socket_pool, elem);
+    }
+}
+
+//! Make space in a input buffer
+/*!
+ * This ensures that there is space for at least one more byte plus a spare
+ * byte behind the data (used to terminate the lines). The unprocessed data is
+ * moved to the start of the buffer and the buffer is allocated or grown if
+ * needed.
+ * \param in The input buffer.
+ * \return The count of bytes which can be readed into the buffer at
+ *         in->buf_data + in->buf_end or 0 if the buffer cannot be grown.
+ */
+static inline size_t conn_inbuf_reserve(inbuf_t * in){
+    size_t size;
+    char * data;
+
+    if (0 < in->buf_start) {
+        memmove(in->buf_data, in->buf_data + in->buf_start, in->buf_end - in->buf_start);
+        in->buf_end  -= in->buf_start;
+        in->buf_start = 0;
+    }
+
+    if (in->buf_end + 1 >= in->buf_size) {
+        size = (0 == in->buf_size ? INBUF_SIZE : in->buf_size * 2);
+        if (size > INBUF_MAX) {
+            return 0;
+        }
+        if (NULL == (data = realloc(in->buf_data, size))) {
+            return 0;
+        }
+        in->buf_data = data;
+        in->buf_size = size;
+    }
+
+    return in->buf_size - in->buf_end - 1;
+}
+
+//! Pass readed lines to the data handler
+/*!
+ * This calls the data handler of the socket for every complete line in the
+ * input buffer of the socket. The lines are passed as slices of the buffer,
+ * including the newline char and temporary null terminated. An incomplete
+ * line at the end stays in the buffer, except the buffer is full, then it is
+ * passed as it is.
+ * If the socket is switched to bulk mode (see conn_set_bulk()), the whole
+ * unprocessed data is passed to the bulk handler instead, which tells how
+ * much of it was consumed. The handler can switch back to line mode at any
+ * time, the rest of the data is then processed linewise.
+ * If the handler wants to quit the connection, the remaining data is dropped.
+ * If the socket gets paused by a handler (see conn_enqueue()), the remaining
+ * data stays in the buffer until the socket is resumed.
+ * Replies of the handlers are only queued, so the answers to a group of
+ * pipelined commands (rfc 2920) are written at once by conn_flush_dirty()
+ * after the whole read was dispatched or the socket was paused.
+ * \param socket The socket element the data was read from.
+ * \param data   The session data passed to the handler.
+ * \return CONN_QUIT if the connection should be closed, CONN_CONT else.
+ */
+static inline int conn_dispatch_lines(mysocket_t * socket, void * data){
+    inbuf_t *    in     = &(socket->socket_inbuf);
+    int          status = CONN_CONT;
+    ssize_t      used;
+    char *       line;
+    const char * next;
+    char         save;
+
+    while (CONN_CONT == status && in->buf_start < in->buf_end && !socket->socket_paused) {
+        line = in->buf_data + in->buf_start;
+
+        if (socket->socket_bulk) {
+            used = socket->socket_bulk_handler(line, in->buf_end - in->buf_start, data);
+            if (CONN_QUIT == used) {
+                status = CONN_QUIT;
+            } else if (0 == used) {
+                break;
+            } else {
+                in->buf_start += used;
+            }
+            continue;
+        }
+
+        if (NULL == (next = scan_lf(line, in->buf_end - in->buf_start))) {
+            if (in->buf_end + 1 < INBUF_MAX) {
+                break;
+            }
+            next = in->buf_data + in->buf_end - 1;
+        }
+        next++;
+
+        in->buf_start = next - in->buf_data;
+        save  = *next;
+        *(char *)next = '\0';
+        status = socket->socket_data_handler(line, next - line, data);
+        *(char *)next = save;
+    }
+
+    if (in->buf_start == in->buf_end) {
+        in->buf_start = in->buf_end = 0;
+        if (in->buf_size > INBUF_SIZE) {
+            free(in->buf_data);
+            in->buf_data = NULL;
+            in->buf_size = 0;
+        }
+    }
+    return status;
+}
+
+//! Quit a connection
+/*!
+ * This closes a socket on request of its data handler. If there is still
+ * queued output, the socket is only marked as closing and closed by the main
+ * loop as soon as the output is written.
+ * \param socket The socket to close.
+ */
+static inline void conn_quit_socket(mysocket_t * socket){
+    if (0 < socket->socket_outbuf.buf_len) {
+        socket->socket_closing = 1;
+        conn_update_events(socket);
+        return;
+    }
+    INFO_MSG("End connection");
+    conn_delete_socket_elem(socket->socket_fd);
+}
+
+//! Read some normal data
+/*!
+ * This reads and processes normal data from a given socket. This function will
+ * be called if the main event loop think there is some data to read from a
+ * specific not-ssl socket. As these sockets are watched edge triggered, the
+ * socket is read until no more data is available or the socket is paused.
+ * It also calls the callback for processing the data at the right module. If
+ * the size of the data is 0, the socketd element will be removed from the list, 
+ * destroyed and the socked closed.
+ * \param socket The socket element to read data from.
+ * \return 0 in every case.
+ */
+int conn_read_normal(mysocket_t * socket){
+    inbuf_t * in = &(socket->socket_inbuf);
+    size_t    space;
+    ssize_t   len;
+
+    while (!socket->socket_paused) {
+        if (0 == (space = conn_inbuf_reserve(in))) {
+            ERROR_CUSTM("Input buffer exceeded");
+            conn_delete_socket_elem(socket->socket_fd);
+            break;
+        }
+
+        do {
+            len = recv(socket->socket_fd, in->buf_data + in->buf_end, space, MSG_DONTWAIT);
+        } while (-1 == len && EINTR == errno);
+
+        if (-1 == len && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            break;
+        }
+        if (1 > len) {
+            conn_delete_socket_elem(socket->socket_fd);
+            break;
+        }
+        in->buf_end += len;
+
+        if (CONN_QUIT == conn_dispatch_lines(socket, socket->socket_data)) {
+            conn_quit_socket(socket);
+            break;
+        }
+    }
+    return 0;
+}
+
+//! Read some ssl data
+/*!
+ * This reads and processes normal data from a given socket. This function will
+ * be called if the main event loop think there is some data to read from a
+ * specific ssl socket.
+ * It also calls the callback for processing the data at the right module. If
+ * the size of the data is 0, the socketd element will be removed from the list, 
+ * destroyed and the socked closed.
+ * \param socket The socket element to read data from.
+ * \return 0 in every case.
+ */
+int conn_read_ssl(mysocket_t * socket){
+    ssl_data_t * data = socket->socket_data;
+    inbuf_t *    in   = &(socket->socket_inbuf);
+    size_t       space;
+    int          len;
+
+    /* read all data openssl has already decrypted, epoll will not tell */
+    do {
+        if (0 == (space = conn_inbuf_reserve(in))) {
+            ERROR_CUSTM("Input buffer exceeded");
+            conn_delete_socket_elem(socket->socket_fd);
+            break;
+        }
+        len = ssl_read(socket->socket_fd, data->ssl_ssl, in->buf_data + in->buf_end, space);
+        if (SSL_AGAIN == len) {
+            break;
+        }
+        if (1 > len) {
+            conn_delete_socket_elem(socket->socket_fd);
+            break;
+        }
+        in->buf_end += len;
+
+        if (CONN_QUIT == conn_dispatch_lines(socket, data->ssl_data)) {
+            conn_quit_socket(socket);
+            break;
+        }
+    } while (!socket->socket_paused && 0 < ssl_pending(data->ssl_ssl));
+    return 0;
+}
+
+//! Read some data received by io_uring
+/*!
+ * This processes the data a receive of the io_uring backend put into a buffer
+ * of the buffer ring. The data is copied to the input buffer of the socket and
+ * passed to the data handler like conn_read_normal() does. If the socket gets
+ * paused, the rest stays in the ring buffer until the socket is resumed. The
+ * buffer is given back to the ring as soon as it is processed.
+ * \param socket The socket element to read data from.
+ * \return 0 in every case.
+ */
+int conn_read_uring(mysocket_t * socket){
+    inbuf_t * in = &(socket->socket_inbuf);
+    size_t    space;
+    size_t    len;
+
+    while (-1 != socket->socket_rbuf && !socket->socket_paused && !socket->socket_closing) {
+        if (0 == (space = conn_inbuf_reserve(in))) {
+            ERROR_CUSTM("Input buffer exceeded");
+            conn_delete_socket_elem(socket->socket_fd);
+            break;
+        }
+        len = socket->socket_rbuf_end - socket->socket_rbuf_start;
+        len = (len > space ? space : len);
+
+        memcpy(in->buf_data + in->buf_end,
+                uring_bufs_get(&conn_bufs, socket->socket_rbuf) + socket->socket_rbuf_start, len);
+        in->buf_end               += len;
+        socket->socket_rbuf_start += len;
+        if (socket->socket_rbuf_start == socket->socket_rbuf_end) {
+            conn_rbuf_release(socket);
+        }
+
+        if (CONN_QUIT == conn_dispatch_lines(socket, socket->socket_data)) {
+            conn_quit_socket(socket);
+            break;
+        }
+    }
+
+    /* input of a closing socket is not processed any more */
+    if (socket->socket_closing) {
+        conn_rbuf_release(socket);
+    }
+    return 0;
+}
+
+//! Drop written data from an output buffer
+/*!
+ * This removes \p len written bytes from the start of an output buffer and
+ * frees the chunks which are done (and empty chunks at the start).
+ * \param out The output buffer.
+ * \param len The count of written bytes.
+ */
+static inline void conn_outbuf_consume(outbuf_t * out, size_t len){
+    outchunk_t * chunk;
+    size_t       pending;
+
+    out->buf_len -= len;
+    while (NULL != (chunk = out->buf_head)) {
+        pending = chunk->chunk_end - chunk->chunk_start;
+        if (pending > len) {
+            chunk->chunk_start += len;
+            break;
+        }
+        len          -= pending;
+        out->buf_head = chunk->chunk_next;
+        conn_outchunk_release(chunk);
+    }
+    if (NULL == out->buf_head) {
+        out->buf_tail = NULL;
+    }
+}
+
+//! Note written output
+/*!
+ * The session timeout counts from the time the output is written completely,
+ * so it is restarted then. Partial writes only mark the progress, which
+ * extends the timeout when it expires before the output is done.
+ * \param socket The socket some output was written to.
+ */
+static inline void conn_written(mysocket_t * socket){
+    if (0 == socket->socket_outbuf.buf_len && wheel_armed(&(socket->socket_timer))
+            && !socket->socket_closing) {
+        wheel_arm(&(socket->socket_timer), socket->socket_timeout);
+        socket->socket_progress = 0;
+    } else {
+        socket->socket_progress = 1;
+    }
+}
+
+//! Write queued data
+/*!
+ * This writes as much of the queued output of a socket as the socket takes
+ * without blocking. Plain sockets get up to OUTBUF_IOV chunks with one
+ * sendmsg(), ssl sockets are written chunk by chunk.
+ * With the io_uring backend plain sockets are not written here, but by the
+ * sends conn_uring_arm() submits.
+ * \param socket The socket to write.
+ * \return CONN_OK if the data was written or the socket is not writable at the
+ *         moment, CONN_FAIL on a write error.
+ */
+static inline int conn_flush(mysocket_t * socket){
+    outbuf_t *    out = &(socket->socket_outbuf);
+    struct iovec  iov[OUTBUF_IOV];
+    struct msghdr msg;
+    outchunk_t *  chunk;
+    ssize_t       len;
+    int           cnt;
+
+    if (CONFIG_BACKEND_URING == conn_backend && 1 != socket->socket_is_ssl) {
+        return CONN_OK;
+    }
+
+    conn_outbuf_consume(out, 0);
+
+    while (0 < out->buf_len) {
+        chunk = out->buf_head;
+
+        if (1 == socket->socket_is_ssl) {
+            len = ssl_write(socket->socket_fd, ((ssl_data_t*)socket->socket_data)->ssl_ssl,
+                    chunk->chunk_data + chunk->chunk_start, chunk->chunk_end - chunk->chunk_start);
+            if (SSL_AGAIN == len) {
+                break;
+            }
+        } else {
+            for (cnt = 0; NULL != chunk && cnt < OUTBUF_IOV; chunk = chunk->chunk_next, cnt++) {
+                iov[cnt].iov_base = chunk->chunk_data + chunk->chunk_start;
+                iov[cnt].iov_len  = chunk->chunk_end - chunk->chunk_start;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = cnt;
+
+            do {
+                len = sendmsg(socket->socket_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            } while (-1 == len && EINTR == errno);
+
+            if (-1 == len && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                break;
+            }
+        }
+        if (1 > len) {
+            return CONN_FAIL;
+        }
+        conn_outbuf_consume(out, len);
+        conn_written(socket);
+    }
+    return CONN_OK;
+}
+
+//! Process the output of a socket
+/*!
+ * This is called by the main loop if a socket got new output or became
+ * writable. It writes the queued data and closes the socket if this fails or
+ * the socket is closing and all data is written. A socket paused for its output
+ * is resumed if the queued data dropped below OUTBUF_LOW, then the drain
+ * handler gets the chance to queue more. When a socket is not paused anymore
+ * (this also happens by conn_resume()), the data which was read meanwhile is
+ * processed.
+ * \param socket The socket to process.
+ */
+static inline void conn_process_output(mysocket_t * socket){
+    outbuf_t * out = &(socket->socket_outbuf);
+
+    if (CONN_FAIL == conn_flush(socket)) {
+        INFO_MSG("Write to socket failed");
+        conn_delete_socket_elem(socket->socket_fd);
+        return;
+    }
+
+    if (socket->socket_closing && 0 == out->buf_len) {
+        INFO_MSG("End connection");
+        conn_delete_socket_elem(socket->socket_fd);
+        return;
+    }
+
+    if (NULL != socket->socket_drain_handler && out->buf_len <= OUTBUF_LOW
+            && !socket->socket_closing) {
+        if (CONN_QUIT == (socket->socket_drain_handler)(socket->socket_data)) {
+            conn_quit_socket(socket);
+            return;
+        }
+    }
+
+    if ((socket->socket_paused & PAUSED_OUTPUT) && out->buf_len <= OUTBUF_LOW) {
+        socket->socket_paused &= ~PAUSED_OUTPUT;
+        socket->socket_resume  = 1;
+    }
+
+    if (socket->socket_resume && !socket->socket_paused) {
+        socket->socket_resume = 0;
+        conn_update_events(socket);
+
+        if (CONN_QUIT == conn_dispatch_lines(socket, conn_session_data(socket))) {
+            conn_quit_socket(socket);
+            return;
+        }
+        if (!socket->socket_paused) {
+            (socket->socket_read_handler)(socket);
+        }
+    }
+
+    conn_update_events(socket);
+}
+
+//! Process the output of all dirty sockets
+/*!
+ * This writes the new output of all sockets in the dirty list. Output queued
+ * meanwhile (e.g. by a resumed socket) is written too.
+ */
+static inline void conn_flush_dirty(){
+    mysocket_t * elem;
+
+    while (NULL != (elem = socket_dirty)) {
+        socket_dirty            = elem->socket_next_dirty;
+        elem->socket_next_dirty = NULL;
+        elem->socket_dirty      = 0;
+
+        if (-1 != elem->socket_fd) {
+            conn_process_output(elem);
+        }
+    }
+}
+
+//! Pass the events of a watched fd to its callback
+/*!
+ * \param socket The socket element of the watched fd.
+ * \param events The reported events (CONN_WATCH_*), errors are reported as
+ *               both.
+ */
+static inline void conn_watch_event(mysocket_t * socket, int events){
+    events &= socket->socket_watch_events;
+    if (0 != events) {
+        (socket->socket_watch_handler)(socket->socket_fd, events, socket->socket_data);
+    }
+}
+
+//! Fail the connect of a socket
+/*!
+ * This tells the forward module why the connect failed and closes the socket.
+ * \param socket The connecting socket.
+ * \param err    The error of the connect.
+ */
+static inline void conn_connect_failed(mysocket_t * socket, int err){
+    ERROR_CUSTM2("Connecting forward host failed: %s", strerror(err));
+    fwd_connect_failed((fwd_conn_t*)socket->socket_data, strerror(err));
+    conn_delete_socket_elem(socket->socket_fd);
+}
+
+//! Finish the connect of a socket
+/*!
+ * This is called by the main loop when a connecting socket got writable or an
+ * error. The result of the connect is fetched with SO_ERROR, on success the
+ * socket is watched for input (the server greeting) from now on.
+ * \param socket The connecting socket.
+ */
+static inline void conn_connect_done(mysocket_t * socket){
+    int       err = 0;
+    socklen_t len = sizeof(err);
+
+    if (-1 == getsockopt(socket->socket_fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+        err = errno;
+    }
+    if (EINPROGRESS == err || EALREADY == err) {
+        return;
+    }
+    if (0 != err) {
+        conn_connect_failed(socket, err);
+        return;
+    }
+    INFO_MSG("Connected to forward host");
+    socket->socket_connecting = 0;
+    wheel_cancel(&(socket->socket_timer));
+    if (0 < socket->socket_timeout_next) {
+        conn_set_timeout(socket->socket_fd, socket->socket_timeout_next);
+    }
+    conn_update_events(socket);
+}
+
+//! Handle the expired timer of a socket
+/*!
+ * This is called by the timer wheel. A connect in progress is failed. For a
+ * session the timeout is extended if some output was written since the timer
+ * was armed (see conn_written()), so a slow but working client is not dropped
+ * while a long reply drains. Else the timeout handler of the socket is called,
+ * which can queue a last reply. The connection is closed if the handler wants
+ * to quit or there is no handler. Closing sockets are closed at once, with
+ * their output.
+ * \param data The socket.
+ */
+static void conn_timer_expired(void * data){
+    mysocket_t * socket = (mysocket_t*)data;
+    void *       session;
+
+    if (socket->socket_connecting) {
+        conn_connect_failed(socket, ETIMEDOUT);
+        return;
+    }
+    if (socket->socket_progress && !socket->socket_closing) {
+        socket->socket_progress = 0;
+        wheel_arm(&(socket->socket_timer), socket->socket_timeout);
+        return;
+    }
+    INFO_MSG("Connection timed out");
+    session = conn_session_data(socket);
+    if (socket->socket_closing || NULL == socket->socket_timeout_handler || NULL == session) {
+        conn_delete_socket_elem(socket->socket_fd);
+        return;
+    }
+    if (CONN_QUIT == (socket->socket_timeout_handler)(session)) {
+        conn_quit_socket(socket);
+        /* give the last reply some time, then drop it */
+        if (socket->socket_closing) {
+            wheel_arm(&(socket->socket_timer), socket->socket_timeout);
+        }
+    }
+}
+
+//! Get the wait timeout of the main loop
+/*!
+ * \return The milliseconds until the next timer expires, 0 if a DNS result is
+ *         ready or -1 if there is nothing to wait for.
+ */
+static inline int conn_wait_timeout(){
+    if (0 == dns_timeout()) {
+        return 0;
+    }
+    return wheel_timeout();
+}
+
+//! Check the limits of a new client
+/*!
+ * This counts a new client with the limit module. A client over its limits is
+ * rejected right away: it gets the reject reply of the listening socket (if
+ * any) with a single non blocking write and the socket is closed, before any
+ * session data is allocated.
+ * \param socket The listening socket the client was accepted on.
+ * \param new    The accepted socket.
+ * \param peer   The address of the client.
+ * \return CONN_OK if the client is counted, CONN_FAIL if it was rejected.
+ */
+static inline int conn_admit_client(mysocket_t * socket, int new, const struct sockaddr_in * peer){
+    char msg[256];
+    char addr[INET_ADDRSTRLEN];
+    int  ret;
+    int  len;
+
+    if (LIMIT_OK == (ret = limit_acquire(peer))) {
+        return CONN_OK;
+    }
+    inet_ntop(AF_INET, &(peer->sin_addr), addr, sizeof(addr));
+    INFO_MSG3("Rejecting client %s: %s", addr,
+            (LIMIT_CONNS == ret ? "too many connections" : "connecting too fast"));
+
+    if (NULL != socket->socket_reject) {
+        len = snprintf(msg, sizeof(msg), socket->socket_reject,
+                (NULL == config_get_hostname() ? "localhost" : config_get_hostname()));
+        if (0 < len && len < (int)sizeof(msg)) {
+            send(new, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    }
+    close(new);
+    return CONN_FAIL;
+}
+
+//! Add a normal connection
+/*!
+ * This adds a normal client connection accepted on a listening socket. The
+ * socket data will be initialized with the right callback and with the socket
+ * queued to the socket table. The session is created after that, so the
+ * session can already queue output (like a greeting).
+ * The accepted socket must already be non blocking.
+ * \param socket The listening socket the client was accepted on.
+ * \param new    The accepted socket.
+ * \param peer   The address of the client.
+ * \return CONN_OK on succes, CONN_FAIL else.
+ */
+static int conn_add_normal_client(mysocket_t * socket, int new, const struct sockaddr_in * peer){
+    mysocket_t * elem;
+    void *            data;
+    data_init_t       init_handler = (data_init_t)socket->socket_data;
+
+    if (CONN_FAIL == conn_admit_client(socket, new, peer)) {
+        return CONN_FAIL;
+    }
+    INFO_MSG("Accept new Client");
+
+    elem = conn_build_socket_elem(new, NULL, 0,
+            conn_read_plain, 
+            (data_handler_t)socket->socket_data_handler,
+            (data_deleter_t)socket->socket_data_deleter);
+    if (NULL == elem) {
+        limit_release(peer);
+        close(new);
+        return CONN_FAIL;
+    }
+    elem->socket_bulk_handler    = socket->socket_bulk_handler;
+    elem->socket_timeout_handler = socket->socket_timeout_handler;
+    elem->socket_peer            = *peer;
+    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
+        limit_release(peer);
+        pool_release(socket_pool, elem);
+        close(new);
+        return CONN_FAIL;
+    }
+    elem->socket_limited = 1;
+    if ( CONN_FAIL == conn_watch_socket(elem, EVENTS_EDGE) ) {
+        conn_delete_socket_elem(new);
+        return CONN_FAIL;
+    }
+    if( NULL == (data = init_handler(new)) ) {
+        conn_delete_socket_elem(new);
+        return CONN_FAIL;
+    }
+    elem->socket_data = data;
+
+    return CONN_OK;
+}
+
+//! Accept pending clients on a listening socket
+/*!
+ * This accepts the pending clients of a listening socket until EAGAIN, but
+ * at most MAX_ACCEPTS per call so the established connections are not
+ * starved during a connection storm. The listener is level triggered, the
+ * rest is reported by the next wakeup.
+ * \param socket The listening socket.
+ * \param flags  The flags for accept4().
+ * \param add    The function which adds an accepted client.
+ * \return CONN_OK if the backlog was drained or the cap reached, CONN_FAIL on
+ *         an error of accept4().
+ */
+static inline int conn_accept_clients(mysocket_t * socket, int flags,
+        int (* add)(mysocket_t *, int, const struct sockaddr_in *)){
+    struct sockaddr_in peer;
+    socklen_t          len;
+    int                new;
+    int                i;
+
+    for (i = 0; i < MAX_ACCEPTS; i++) {
+        len = sizeof(peer);
+        if (-1 == (new = accept4(socket->socket_fd, (struct sockaddr *)&peer, &len, flags))) {
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                break;
+            }
+            /* the client is already gone, try the next one */
+            if (EINTR == errno || ECONNABORTED == errno) {
+                continue;
+            }
+            ERROR_SYS("accept client");
+            return CONN_FAIL;
+        }
+        add(socket, new, &peer);
+    }
+    return CONN_OK;
+}
+
+//! Accept normal connections
+/*!
+ * This accepts the pending normal client connections on a listening socket
+ * and adds them with conn_add_normal_client().
+ * \param socket The socket struct to accept.
+ * \return CONN_OK on succes, CONN_FAIL else.
+ */
+int conn_accept_normal_client(mysocket_t * socket){
+    return conn_accept_clients(socket, SOCK_NONBLOCK | SOCK_CLOEXEC,
+            conn_add_normal_client);
+}
+
+//! Add a ssl connection
+/*!
+ * This adds a ssl client connection accepted on a listening socket. It also
+ * performs the ssl handshake. The socket data will be initialized with the
+ * right callback and with the socket queued to the socket table.
+ * \param socket The listening socket the client was accepted on.
+ * \param new    The accepted socket.
+ * \param peer   The address of the client.
+ * \return CONN_OK on succes, CONN_FAIL else.
+ */
+static int conn_add_ssl_client(mysocket_t * socket, int new, const struct sockaddr_in * peer){
+    ssl_data_t      * data;
+    data_init_t       init_handler = (data_init_t)socket->socket_data;
+    mysocket_t * elem;
+
+    /* checked before the handshake, so rejected clients cost no ssl work */
+    if (CONN_FAIL == conn_admit_client(socket, new, peer)) {
+        return CONN_FAIL;
+    }
+    INFO_MSG("Accept new SSL Client");
+
+    if (NULL == (data = pool_alloc(ssl_pool))) {
+        limit_release(peer);
+        close(new);
+        return CONN_FAIL;
+    }
+
+    data->ssl_data = NULL;
+    data->ssl_ssl  = ssl_accept_client(new);
+
+    elem = conn_build_socket_elem(new, data, 1,
+	    conn_read_ssl,
+	    (data_handler_t)socket->socket_data_handler,
+	    (data_deleter_t)socket->socket_data_deleter);
+
+    if (NULL == elem) {
+	limit_release(peer);
+	ssl_quit_client(data->ssl_ssl, new);
+	pool_release(ssl_pool, data);
+	close(new);
+	return CONN_FAIL;
+    }
+    elem->socket_bulk_handler    = socket->socket_bulk_handler;
+    elem->socket_timeout_handler = socket->socket_timeout_handler;
+    elem->socket_peer            = *peer;
+
+    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
+	limit_release(peer);
+	pool_release(socket_pool, elem);
+	ssl_quit_client(data->ssl_ssl, new);
+	pool_release(ssl_pool, data);
+	close(new);
+	return CONN_FAIL;
+    }
+    elem->socket_limited = 1;
+    if ( CONN_FAIL == conn_set_nonblock(new)
+	    || CONN_FAIL == conn_watch_socket(elem, EVENTS_LEVEL) ) {
+	conn_delete_socket_elem(new);
+	return CONN_FAIL;
+    }
+    if( NULL == (data->ssl_data = init_handler(new)) ) {
+	conn_delete_socket_elem(new);
+	return CONN_FAIL;
+    }
+
+    return CONN_OK;
+}
+
+//! Accept ssl connections
+/*!
+ * This accepts the pending ssl client connections on a listening socket and
+ * adds them with conn_add_ssl_client(). The clients stay blocking for the
+ * handshake.
+ * \param socket The socket struct to accept.
+ * \return CONN_OK on succes, CONN_FAIL else.
+ */
+int conn_accept_ssl_client(mysocket_t * socket){
+    return conn_accept_clients(socket, SOCK_CLOEXEC, conn_add_ssl_client);
+}
+
+//! Accept connections with io_uring
+/*!
+ * This submits a multishot accept for a listening socket, so each new client
+ * is reported by a completion without further submissions. Plain clients are
+ * accepted non blocking, ssl clients stay blocking for the handshake.
+ * \param socket The listening socket.
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+static inline int conn_uring_accept(mysocket_t * socket){
+    struct io_uring_sqe * sqe;
+
+    if (NULL == (sqe = conn_uring_sqe(socket, OP_ACCEPT))) {
+        return CONN_FAIL;
+    }
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = socket->socket_fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC |
+        (conn_accept_ssl_client == socket->socket_read_handler ? 0 : SOCK_NONBLOCK);
+    return CONN_OK;
+}
+
+//! Add a client accepted with io_uring
+/*!
+ * The multishot accept does not deliver the address of the client, so it is
+ * fetched here.
+ * \param socket The listening socket.
+ * \param new    The accepted socket.
+ */
+static inline void conn_uring_add_client(mysocket_t * socket, int new){
+    struct sockaddr_in peer;
+    socklen_t          len = sizeof(peer);
+
+    if (-1 == getpeername(new, (struct sockaddr *)&peer, &len)) {
+        close(new);
+        return;
+    }
+    if (conn_accept_ssl_client == socket->socket_read_handler) {
+        conn_add_ssl_client(socket, new, &peer);
+    } else {
+        conn_add_normal_client(socket, new, &peer);
+    }
+}
+
+//! Init a listening connection
+/*!
+ * Creates a listening socket on the given port and puts it in the socket
+ * table and the epoll set. The given callbacks are used for the accepted
+ * clients.
+ * \param port          The port to listen on.
+ * \param init_handler  The callback to create the session of a new client.
+ * \param accept        The callback to accept a new client.
+ * \param data_handler  The callback to deal with data of the clients.
+ * \param data_deleter  The callback to destroy the sessions of the clients.
+ * \param bulk_handler  The callback to deal with data in bulk mode or NULL.
+ * \param timeout_handler The callback for expired session timeouts of the
+ *                        clients (see conn_set_timeout()).
+ * \param reject        The reply to clients over their limits (a format
+ *                      string taking the hostname) or NULL to just close them.
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+static inline int conn_init_listener(const char * port, data_init_t init_handler,
+        read_handler_t accept,
+        data_handler_t data_handler,
+        data_deleter_t data_deleter,
+        bulk_handler_t bulk_handler,
+        timeout_handler_t timeout_handler,
+        const char * reject){
+    mysocket_t * elem;
+
+    elem = conn_build_socket_elem(conn_setup_listen(port), init_handler, -1,
+            accept, data_handler, data_deleter);
+    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
+        pool_release(socket_pool, elem);
+        return CONN_FAIL;
+    }
+    elem->socket_bulk_handler    = bulk_handler;
+    elem->socket_timeout_handler = timeout_handler;
+    elem->socket_reject          = reject;
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        return conn_uring_accept(elem);
+    }
+    if ( CONN_FAIL == conn_watch_socket(elem, EVENTS_LEVEL) ) {
+        return CONN_FAIL;
+    }
+    return CONN_OK;
+}
+
+//! Init the io_uring backend
+/*!
+ * This creates the ring and the buffer ring of the worker and submits the
+ * wait for the stop event.
+ * \return CONN_OK on success, CONN_FAIL if the kernel cannot do it.
+ */
+static inline int conn_uring_init(){
+    struct io_uring_sqe * sqe;
+
+    if (URING_OK != uring_init(&conn_ring, URING_ENTRIES, URING_CQ_ENTRIES)) {
+        return CONN_FAIL;
+    }
+    if (URING_OK != uring_bufs_init(&conn_ring, &conn_bufs, URING_BUF_GROUP, URING_BUFS, URING_BUF_SIZE)) {
+        uring_exit(&conn_ring);
+        return CONN_FAIL;
+    }
+
+    if (NULL == (sqe = conn_uring_sqe(NULL, OP_STOP))) {
+        uring_bufs_exit(&conn_ring, &conn_bufs);
+        uring_exit(&conn_ring);
+        return CONN_FAIL;
+    }
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = stop_fd;
+    sqe->poll32_events = POLLIN;
+    return CONN_OK;
+}
+
+//! Init listening connections
+/*!
+ * Initialize the listening sockets for SMTP, POP3 and POP3S. The sokets will
+ * also be queued to the socket table.
+ * This should be called once by each worker thread, after conn_init_app().
+ * If there are more than one worker, the listeners are bound with
+ * SO_REUSEPORT, so each worker has its own and the kernel distributes the
+ * new connections.
+ * The io_uring backend is used if it was selected with config_get_backend()
+ * and the kernel supports it, the epoll backend else.
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+int conn_init(){
+    struct epoll_event ev;
+
+    conn_backend    = CONFIG_BACKEND_EPOLL;
+    conn_read_plain = conn_read_normal;
+
+    if (NULL == (socket_pool = pool_new("socket", sizeof(mysocket_t), SOCKET_POOL))
+            || NULL == (ssl_pool = pool_new("ssl", sizeof(ssl_data_t), SSL_POOL))) {
+        return CONN_FAIL;
+    }
+
+    if (CONFIG_BACKEND_URING == config_get_backend()) {
+        if (CONN_OK == conn_uring_init()) {
+            conn_backend    = CONFIG_BACKEND_URING;
+            conn_read_plain = conn_read_uring;
+            INFO_MSG("Using the io_uring backend");
+        } else {
+            ERROR_CUSTM("io_uring not usable, falling back to epoll");
+        }
+    }
+
+    if (CONFIG_BACKEND_EPOLL == conn_backend) {
+        if ( -1 == (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) ) {
+            ERROR_SYS("epoll creation");
+            return CONN_FAIL;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.u64 = STOP_EVENT;
+        if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev)) {
+            ERROR_SYS("epoll registration");
+            return CONN_FAIL;
+        }
+    }
+
+    /* Setup SMTP */
+    INFO_MSG("Init SMTP socket");
+    if ( CONN_FAIL == conn_init_listener(config_get_smtp_port(), 
+                (data_init_t)smtp_create_session, conn_accept_normal_client, 
+                (data_handler_t)smtp_process_input, (data_deleter_t)smtp_destroy_session,
+                (bulk_handler_t)smtp_process_body_block, (timeout_handler_t)smtp_timeout,
+                SMTP_MSG_LIMIT) )
+        return CONN_FAIL;
+
+    /* Setup POP3 */
+    INFO_MSG("Init POP3 socket");
+    if ( CONN_FAIL == conn_init_listener(config_get_pop_port(), 
+                (data_init_t)pop3_create_normal_session, conn_accept_normal_client, 
+                (data_handler_t)pop3_process_input, (data_deleter_t)pop3_destroy_session,
+                NULL, (timeout_handler_t)pop3_timeout, POP3_MSG_LIMIT) )
+        return CONN_FAIL;
+
+    /* Setup POP3S */
+    INFO_MSG("Init POP3S socket");
+    if ( CONN_FAIL == conn_init_listener(config_get_pops_port(), 
+                (data_init_t)pop3_create_ssl_session, conn_accept_ssl_client, 
+                (data_handler_t)pop3_process_input, (data_deleter_t)pop3_destroy_session,
+                NULL, (timeout_handler_t)pop3_timeout, NULL) )
+        return CONN_FAIL;
+    
+    INFO_MSG("Connection init ok");
+
+    return CONN_OK;
+}
+
+//! Process an io_uring completion
+/*!
+ * This is the io_uring counterpart of the event dispatch of the epoll loop: It
+ * takes the result of a request of a socket, calls the handler for it and arms
+ * the next requests of the socket. Completions of sockets which were closed
+ * meanwhile only release the socket element (and the ring buffer).
+ * \param cqe The completion.
+ * \return 1 if the stop event was completed, 0 else.
+ */
+static inline int conn_uring_complete(struct io_uring_cqe * cqe){
+    mysocket_t * socket = (mysocket_t *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    int          op     = cqe->user_data & OP_MASK;
+    int          res    = cqe->res;
+
+    if (OP_STOP == op) {
+        return 1;
+    }
+    if (NULL == socket) {
+        return 0;
+    }
+    if (OP_SEND != op && !(cqe->flags & IORING_CQE_F_MORE)) {
+        socket->socket_ops--;
+    }
+
+    if (-1 == socket->socket_fd) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uring_bufs_recycle(&conn_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (OP_ACCEPT == op && 0 <= res) {
+            close(res);
+        }
+        return 0;
+    }
+
+    switch (op) {
+        case OP_ACCEPT:
+            if (0 <= res) {
+                conn_uring_add_client(socket, res);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                conn_uring_accept(socket);
+            }
+            return 0;
+
+        case OP_RECV:
+            socket->socket_armed &= ~ARMED_IN;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                socket->socket_rbuf       = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                socket->socket_rbuf_start = 0;
+                socket->socket_rbuf_end   = (0 < res ? res : 0);
+                if (0 >= res) {
+                    conn_rbuf_release(socket);
+                }
+            }
+            if (0 < res) {
+                (socket->socket_read_handler)(socket);
+            } else if (-ENOBUFS == res || -EAGAIN == res) {
+                /* all ring buffers are in use, wait and read directly */
+                socket->socket_nobufs = 1;
+            } else {
+                conn_delete_socket_elem(socket->socket_fd);
+            }
+            break;
+
+        case OP_POLL_IN:
+            socket->socket_armed &= ~ARMED_IN;
+            socket->socket_nobufs = 0;
+            if (socket->socket_paused || socket->socket_closing) {
+                if (0 > res || (res & (POLLERR | POLLHUP)))
+                    conn_delete_socket_elem(socket->socket_fd);
+            } else if (1 == socket->socket_is_ssl) {
+                (socket->socket_read_handler)(socket);
+            } else {
+                conn_read_normal(socket);
+            }
+            break;
+
+        case OP_SEND:
+            /* a send in the middle of a chain failed, the end follows */
+            socket->socket_send_failed = 1;
+            return 0;
+
+        case OP_SEND_END:
+            socket->socket_armed &= ~ARMED_OUT;
+            if (socket->socket_send_failed || res != (int)socket->socket_send_last) {
+                INFO_MSG("Write to socket failed");
+                conn_delete_socket_elem(socket->socket_fd);
+                return 0;
+            }
+            conn_outbuf_consume(&(socket->socket_outbuf), socket->socket_sending);
+            socket->socket_sending = 0;
+            conn_written(socket);
+            conn_process_output(socket);
+            break;
+
+        case OP_WATCH:
+            socket->socket_armed &= ~ARMED_IN;
+            if (0 > res || (res & (POLLERR | POLLHUP))) {
+                res = POLLIN | POLLOUT;
+            }
+            conn_watch_event(socket, ((res & POLLIN) ? CONN_WATCH_IN : 0)
+                    | ((res & POLLOUT) ? CONN_WATCH_OUT : 0));
+            break;
+
+        case OP_POLL_OUT:
+            socket->socket_armed &= ~ARMED_OUT;
+            if (socket->socket_connecting) {
+                conn_connect_done(socket);
+                break;
+            }
+            conn_process_output(socket);
+            break;
+    }
+
+    conn_update_events(socket);
+    return 0;
+}
+
+//! Do the io_uring wait loop
+/*!
+ * This is the main loop of the io_uring backend. The requests armed while the
+ * completions of a batch are processed are submitted together with the wait
+ * for the next completions, so a whole batch costs a single syscall.
+ * \return 0 in any case.
+ */
+static inline int conn_uring_wait_loop(){
+    struct io_uring_cqe * cqe;
+    struct io_uring_cqe   done;
+    int                   stop = 0;
+
+    while (!stop) {
+        if (0 > uring_wait(&conn_ring, conn_wait_timeout())
+                && EINTR != errno && EAGAIN != errno && EBUSY != errno && ETIME != errno) {
+            ERROR_SYS("io_uring wait");
+            break;
+        }
+
+        while (NULL != (cqe = uring_peek_cqe(&conn_ring))) {
+            done = *cqe;
+            uring_cqe_seen(&conn_ring);
+            stop |= conn_uring_complete(&done);
+        }
+
+        wheel_expire();
+        dns_expire();
+        conn_flush_dirty();
+        conn_free_closed();
+    }
+
+    return 0;
+}
+
+//! Do the connection wait loop
+/*! 
+ * This is the main event loop. It waits with epoll_wait() for events on the
+ * sockets registered with conn_watch_socket() and calls the read_handler
+ * callback for each reported socket. Writable sockets get their queued output
+ * written, the output queued during a batch is written after the batch. Events
+ * of sockets which were closed (and maybe replaced by a new socket with the
+ * same fd) during the batch are detected by the generation stored with the
+ * event and skipped. The cost of a wakeup only depends on the number of ready
+ * sockets, not on the number of connections.
+ * This should be called once by each worker to perform the client handling.
+ * It returns after conn_stop() was called.
+ * With the io_uring backend conn_uring_wait_loop() is run instead.
+ * \return 0 in any case.
+ */
+int conn_wait_loop(){
+    struct epoll_event events[MAX_EVENTS];
+    mysocket_t *       socket;
+    uint32_t           ev;
+    int                num;
+    int                i;
+    int                stop = 0;
+
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        return conn_uring_wait_loop();
+    }
+    
+    while (!stop) {
+        num = epoll_wait(epoll_fd, events, MAX_EVENTS, conn_wait_timeout());
+
+        if (-1 == num) {
+            if (EINTR == errno)
+                continue;
+            ERROR_SYS("epoll wait");
+            break;
+        }
+
+        for (i = 0; i < num; i++) {
+            if (STOP_EVENT == events[i].data.u64) {
+                stop = 1;
+                continue;
+            }
+            socket = conn_find_socket_elem((int)(events[i].data.u64 & 0xffffffff));
+
+            /* the socket was closed by a previous handler of this batch */
+            if (NULL == socket || socket->socket_generation != (uint32_t)(events[i].data.u64 >> 32))
+                continue;
+
+            ev = events[i].events;
+            if (NULL != socket->socket_watch_handler) {
+                conn_watch_event(socket, ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? CONN_WATCH_IN : 0)
+                        | ((ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? CONN_WATCH_OUT : 0));
+                continue;
+            }
+            if (socket->socket_connecting) {
+                conn_connect_done(socket);
+                continue;
+            }
+            if (ev & EPOLLOUT) {
+                conn_process_output(socket);
+                if (-1 == socket->socket_fd)
+                    continue;
+            }
+
+            /* no input is read from paused and closing sockets */
+            if (socket->socket_paused || socket->socket_closing) {
+                if (ev & (EPOLLERR | EPOLLHUP))
+                    conn_delete_socket_elem(socket->socket_fd);
+                continue;
+            }
+
+            if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+                (socket->socket_read_handler)(socket);
+        }
+
+        wheel_expire();
+        dns_expire();
+        conn_flush_dirty();
+        conn_free_closed();
+    }
+
+    return 0;
+}
+
+//! Close all connections
+/*! This claoses all elements in the socket table of the calling worker. It
+ * can be used to cleanup after SIGTERM etc.
+ * \return CONN_OK.
+ */
+int conn_close() {
+    struct io_uring_sqe * sqe;
+    struct io_uring_cqe * cqe;
+    outchunk_t *          chunk;
+    int                   fd;
+
+    for (fd = 0; fd < socket_table_size; fd++) {
+        conn_delete_socket_elem(fd);
+    }
+    socket_dirty = NULL;
+
+    /* wait until the ring is done with the closed sockets */
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        if (NULL != (sqe = conn_uring_sqe(NULL, OP_CANCEL))) {
+            sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        }
+        conn_free_closed();
+        while (NULL != socket_closed) {
+            if (0 > uring_submit(&conn_ring, 1) && EINTR != errno) {
+                ERROR_SYS("io_uring wait");
+                break;
+            }
+            while (NULL != (cqe = uring_peek_cqe(&conn_ring))) {
+                conn_uring_complete(cqe);
+                uring_cqe_seen(&conn_ring);
+            }
+            conn_free_closed();
+        }
+        uring_bufs_exit(&conn_ring, &conn_bufs);
+        uring_exit(&conn_ring);
+        conn_backend = CONFIG_BACKEND_EPOLL;
+    }
+    conn_free_closed();
+
+    free(socket_table);
+    socket_table      = NULL;
+    socket_table_size = 0;
+
+    while (NULL != (chunk = outbuf_spare)) {
+        outbuf_spare = chunk->chunk_next;
+        free(chunk);
+    }
+    outbuf_spare_count = 0;
+
+    pool_free(socket_pool);
+    pool_free(ssl_pool);
+    socket_pool = NULL;
+    ssl_pool    = NULL;
+
+    if (-1 != epoll_fd) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+
+    INFO_MSG("All connections closed");
+
+    return CONN_OK;
+}
+
+//! Init the connection module
+/*!
+ * This creates the resources shared by all workers. It must be called once
+ * on app start, before the workers call conn_init().
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+int conn_init_app(){
+    if ( -1 == (stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) ) {
+        ERROR_SYS("eventfd creation");
+        return CONN_FAIL;
+    }
+    return CONN_OK;
+}
+
+//! Stop all workers
+/*!
+ * This makes conn_wait_loop() of all workers return. It may be called from
+ * any thread. The stop event stays pending, so all workers see it.
+ */
+void conn_stop(){
+    uint64_t one = 1;
+
+    if (sizeof(one) != write(stop_fd, &one, sizeof(one))) {
+        ERROR_SYS("signal workers to stop");
+    }
+}
+
+//! Shut down the connection module
+/*!
+ * This frees the resources of conn_init_app(). It must be called after all
+ * workers are done.
+ */
+void conn_close_app(){
+    if (-1 != stop_fd) {
+        close(stop_fd);
+        stop_fd = -1;
+    }
+}
+
+//! Link a connection to the dirty list
+/*!
+ * The main loop processes the output of the sockets in the dirty list after
+ * the current batch of events, see conn_process_output().
+ * \param elem The socket.
+ */
+static inline void conn_mark_dirty(mysocket_t * elem){
+    if (!elem->socket_dirty) {
+        elem->socket_dirty      = 1;
+        elem->socket_next_dirty = socket_dirty;
+        socket_dirty            = elem;
+    }
+}
+
+//! Note new output of a connection
+/*!
+ * This pauses the connection if too much output is queued and links it to the
+ * dirty list, so the output is written after the current batch of events.
+ * \param elem The socket with the new output.
+ */
+static inline void conn_output_added(mysocket_t * elem){
+    if (elem->socket_outbuf.buf_len > OUTBUF_HIGH) {
+        elem->socket_paused |= PAUSED_OUTPUT;
+    }
+    conn_mark_dirty(elem);
+}
+
+//! Switch the bulk mode of a connection
+/*!
+ * In bulk mode, the readed data of a connection is not cut into lines, but
+ * passed as a whole to the bulk handler of the socket. This is used by
+ * modules which know where their data ends, like the SMTP DATA block.
+ * \param fd     The socket of the connection.
+ * \param enable 1 to enable the bulk mode, 0 to disable it.
+ * \return CONN_OK on success, CONN_FAIL if the socket has no bulk handler.
+ */
+int conn_set_bulk(int fd, int enable){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem || NULL == elem->socket_bulk_handler) {
+        return CONN_FAIL;
+    }
+    elem->socket_bulk = enable;
+    return CONN_OK;
+}
+
+//! Set the drain handler of a connection
+/*!
+ * The drain handler is called each time the queued output of a connection
+ * dropped to OUTBUF_LOW bytes, until it is removed again. This lets a module
+ * stream big data (like a spooled mail body) in parts, without queueing it
+ * as a whole.
+ * \param fd      The socket of the connection.
+ * \param handler The handler, it gets the session data and returns CONN_QUIT
+ *                to close the connection, CONN_CONT else. NULL removes it.
+ * \return CONN_OK on success, CONN_FAIL if there is no such connection.
+ */
+int conn_set_drain(int fd, drain_handler_t handler){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem) {
+        return CONN_FAIL;
+    }
+    elem->socket_drain_handler = handler;
+    return CONN_OK;
+}
+
+//! Set the timeout of a connection
+/*!
+ * This (re)arms the timer of a connection. If nothing happens on the
+ * connection until it expires, the timeout handler of the session is called
+ * (see conn_init_listener()). Written output extends the timeout. A session
+ * calls this again after each step to set the timeout of the next one, so
+ * different timeouts are possible for the greeting, the commands and the
+ * transfer of data. The timeout of a forward connection which is still
+ * connecting is armed when the connect is done.
+ * \param fd    The socket of the connection.
+ * \param msecs The timeout in milliseconds or 0 to cancel it.
+ * \return CONN_OK on success, CONN_FAIL if the connection is unknown.
+ */
+int conn_set_timeout(int fd, int msecs){
+    mysocket_t * socket;
+
+    if (NULL == (socket = conn_find_socket_elem(fd))) {
+        return CONN_FAIL;
+    }
+    if (socket->socket_connecting) {
+        socket->socket_timeout_next = msecs;
+        return CONN_OK;
+    }
+    socket->socket_timeout  = msecs;
+    socket->socket_progress = 0;
+    if (0 < msecs) {
+        wheel_arm(&(socket->socket_timer), msecs);
+    } else {
+        wheel_cancel(&(socket->socket_timer));
+    }
+    return CONN_OK;
+}
+
+//! Suspend the input of a connection
+/*!
+ * No more data of the connection is passed to the session until
+ * conn_resume() is called. This is used by sessions which wait for something
+ * else than the client, like a DNS answer. Already received data stays in
+ * the input buffer.
+ * \param fd The socket of the connection.
+ * \return CONN_OK on success, CONN_FAIL if the connection is unknown.
+ */
+int conn_suspend(int fd){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem) {
+        return CONN_FAIL;
+    }
+    elem->socket_paused |= PAUSED_SESSION;
+    return CONN_OK;
+}
+
+//! Resume the input of a connection
+/*!
+ * This ends a conn_suspend(). The data received meanwhile is passed to the
+ * session after the current batch of events, not within this call.
+ * \param fd The socket of the connection.
+ * \return CONN_OK on success, CONN_FAIL if the connection is unknown.
+ */
+int conn_resume(int fd){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem) {
+        return CONN_FAIL;
+    }
+    if (elem->socket_paused & PAUSED_SESSION) {
+        elem->socket_paused &= ~PAUSED_SESSION;
+        elem->socket_resume  = 1;
+        conn_mark_dirty(elem);
+    }
+    return CONN_OK;
+}
+
+//! Watch a fd
+/*!
+ * This registers a fd of another module (like the DNS resolver) at the event
+ * loop. The callback is called by the main loop while the fd is readable or
+ * writable, depending on the events it is watched for (level triggered).
+ * Errors are reported as both events. The fd is closed by conn_unwatch_fd()
+ * or when the worker shuts down.
+ * \param fd      The fd, it should be non blocking.
+ * \param events  The events to watch for (CONN_WATCH_IN, CONN_WATCH_OUT).
+ * \param handler The callback.
+ * \param data    The data passed to the callback.
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+int conn_watch_fd(int fd, int events, watch_handler_t handler, void * data){
+    mysocket_t * elem;
+
+    if (NULL == (elem = conn_build_socket_elem(fd, data, -1, NULL, NULL, NULL))) {
+        return CONN_FAIL;
+    }
+    elem->socket_watch_handler = handler;
+    elem->socket_watch_events  = events;
+
+    if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
+        pool_release(socket_pool, elem);
+        return CONN_FAIL;
+    }
+    if ( CONN_FAIL == conn_watch_socket(elem, ((events & CONN_WATCH_IN) ? EPOLLIN : 0)
+                | ((events & CONN_WATCH_OUT) ? EPOLLOUT : 0)) ) {
+        socket_table[fd] = NULL;
+        pool_release(socket_pool, elem);
+        return CONN_FAIL;
+    }
+    return CONN_OK;
+}
+
+//! Change the watched events of a fd
+/*!
+ * With the io_uring backend the change takes effect when the pending wait of
+ * the fd is completed, so the callback may still see the old events once.
+ * \param fd     The fd registered with conn_watch_fd().
+ * \param events The events to watch for (CONN_WATCH_IN, CONN_WATCH_OUT).
+ * \return CONN_OK on success, CONN_FAIL else.
+ */
+int conn_watch_fd_events(int fd, int events){
+    mysocket_t *       elem = conn_find_socket_elem(fd);
+    struct epoll_event ev;
+
+    if (NULL == elem || NULL == elem->socket_watch_handler) {
+        return CONN_FAIL;
+    }
+    elem->socket_watch_events = events;
+
+    if (CONFIG_BACKEND_URING == conn_backend) {
+        conn_uring_arm(elem);
+        return CONN_OK;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = ((events & CONN_WATCH_IN) ? EPOLLIN : 0) | ((events & CONN_WATCH_OUT) ? EPOLLOUT : 0);
+    ev.data.u64 = ((uint64_t)elem->socket_generation << 32) | (uint32_t)fd;
+
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+        ERROR_SYS("epoll modification");
+        return CONN_FAIL;
+    }
+    elem->socket_events = ev.events;
+    return CONN_OK;
+}
+
+//! Stop watching a fd
+/*!
+ * This removes a fd registered with conn_watch_fd() and closes it.
+ * \param fd The fd.
+ * \return CONN_OK on success, CONN_FAIL if the fd is not watched.
+ */
+int conn_unwatch_fd(int fd){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem || NULL == elem->socket_watch_handler) {
+        return CONN_FAIL;
+    }
+    return conn_delete_socket_elem(fd);
+}
+
+//! Find the socket element for new output
+/*!
+ * \param fd The socket of the connection.
+ * \return The socket element or NULL if the connection is unknown or closing.
+ */
+static inline mysocket_t * conn_find_writable_elem(int fd){
+    mysocket_t * elem = conn_find_socket_elem(fd);
+
+    if (NULL == elem || elem->socket_closing) {
+        return NULL;
+    }
+    return elem;
+}
+
+//! Queue data for a connection
+/*!
+ * This appends data to the output queue of a connection. The data is written
+ * by the main loop as soon as the socket is writable, plain or encrypted
+ * depending on the connection. So this never blocks.
+ * If more than OUTBUF_HIGH bytes are queued, the connection is paused: no more
+ * input is read and processed until the queue drained to OUTBUF_LOW bytes.
+ * \param fd  The socket of the connection.
  * \param buf The data to write.
  * \param len The length of the data.
- * \return >0 on success.
+ * \return CONN_OK on success, CONN_FAIL if the connection is unknown or
+ *         closing or the memory is exhausted.
+ */
+int conn_enqueue(int fd, const char * buf, size_t len) {
+    mysocket_t * elem = conn_find_writable_elem(fd);
+    outchunk_t * chunk;
+    size_t       part;
+
+    if (NULL == elem) {
+        return CONN_FAIL;
+    }
+
+    /* fill up the last chunk, the rest goes to a new one */
+    chunk = elem->socket_outbuf.buf_tail;
+    if (NULL != chunk && chunk->chunk_end < chunk->chunk_size) {
+        part = chunk->chunk_size - chunk->chunk_end;
+        part = (part > len ? len : part);
+        memcpy(chunk->chunk_data + chunk->chunk_end, buf, part);
+        chunk->chunk_end             += part;
+        elem->socket_outbuf.buf_len  += part;
+        buf += part;
+        len -= part;
+    }
+    if (0 < len) {
+        if (NULL == (chunk = conn_outbuf_reserve(&(elem->socket_outbuf), len))) {
+            return CONN_FAIL;
+        }
+        memcpy(chunk->chunk_data + chunk->chunk_end, buf, len);
+        chunk->chunk_end            += len;
+        elem->socket_outbuf.buf_len += len;
+    }
+
+    conn_output_added(elem);
+    return CONN_OK;
+}
+
+//! Queue a formatted message for a connection
+/*!
+ * This works like conn_printf(), but takes a va_list.
+ * \param fd  The socket of the connection.
+ * \param fmt The format string.
+ * \param ap  The values of the placeholders.
+ * \return CONN_OK on success, CONN_FAIL else.
+ * \sa conn_printf()
  */
-ssize_t conn_writeback(int fd, char * buf, ssize_t len) {
-    return write(fd, buf, len);
+int conn_vprintf(int fd, const char * fmt, va_list ap) {
+    mysocket_t * elem = conn_find_writable_elem(fd);
+    outchunk_t * chunk;
+    va_list      aq;
+    size_t       space;
+    int          len;
+
+    if (NULL == elem || NULL == (chunk = conn_outbuf_reserve(&(elem->socket_outbuf), 1))) {
+        return CONN_FAIL;
+    }
+
+    space = chunk->chunk_size - chunk->chunk_end;
+    va_copy(aq, ap);
+    len = vsnprintf(chunk->chunk_data + chunk->chunk_end, space, fmt, aq);
+    va_end(aq);
+
+    if (0 > len) {
+        return CONN_FAIL;
+    }
+    if ((size_t)len >= space) {
+        if (NULL == (chunk = conn_outbuf_reserve(&(elem->socket_outbuf), len + 1))) {
+            return CONN_FAIL;
+        }
+        vsnprintf(chunk->chunk_data + chunk->chunk_end, len + 1, fmt, ap);
+    }
+    chunk->chunk_end            += len;
+    elem->socket_outbuf.buf_len += len;
+
+    conn_output_added(elem);
+    return CONN_OK;
+}
+
+//! Queue a formatted message for a connection
+/*!
+ * This is the response builder for the protocol modules: The message is
+ * formatted directly into the output buffer of the connection, so a reply of
+ * many lines (like a LIST) ends up in a few contiguous chunks, which are
+ * written with one syscall per OUTBUF_IOV chunks.
+ * \param fd  The socket of the connection.
+ * \param fmt The \p printf format string.
+ * \param ... The values of the placeholders.
+ * \return CONN_OK on success, CONN_FAIL if the connection is unknown or
+ *         closing or the memory is exhausted.
+ */
+int conn_printf(int fd, const char * fmt, ...) {
+    va_list ap;
+    int     ret;
+
+    va_start(ap, fmt);
+    ret = conn_vprintf(fd, fmt, ap);
+    va_end(ap);
+    return ret;
 }
 
 //! Queue a socket of a forward
 /*! This is used by the mail forward module to queu the socket to the relay host
- * in the socket list. 
+ * in the socket table. 
  * If it is in the list it can be watched for input in the main loop to reduce
- * blocking.
- * \param fd   The fd to the relay host.
- * \param data The data of the forward session.
+ * blocking. A socket with a connect in progress is watched for writability
+ * until the connect is done or its timer fails it after CONNECT_TIMEOUT.
+ * \param fd         The fd to the relay host, already non blocking.
+ * \param data       The forward connection.
+ * \param connecting 1 if the connect is still in progress, 0 else.
  * \return CONN_OK on success, CONN_FAIL else.
  */
-static inline int conn_queue_forward_socket(int fd, fwd_mail_t * data){
-    mysocket_list_t * elem;
+static inline int conn_queue_forward_socket(int fd, fwd_conn_t * data, int connecting){
+    mysocket_t *  elem;
 
     elem = conn_build_socket_elem(fd, data, 0,
-            (read_handler_t)conn_read_normal,
+            conn_read_plain,
             (data_handler_t)fwd_process_input,
-            (data_deleter_t)fwd_free_mail);
+            (data_deleter_t)fwd_free_conn);
 
     if (NULL == elem) {
-        fwd_free_mail(data);
         close(fd);
+        return CONN_FAIL;
     }
 
     if ( CONN_FAIL == conn_append_socket_elem(elem) ) {
-        fwd_free_mail(data);
-        free(elem);
+        pool_release(socket_pool, elem);
         close(fd);
         return CONN_FAIL;
     }
+    elem->socket_timeout_handler = (timeout_handler_t)fwd_timeout;
+    if (connecting) {
+        elem->socket_connecting = 1;
+        wheel_arm(&(elem->socket_timer), CONNECT_TIMEOUT);
+    }
+    if ( CONN_FAIL == conn_watch_socket(elem, EVENTS_EDGE | (connecting ? EPOLLOUT : 0)) ) {
+        /* the data stays with the caller */
+        elem->socket_data = NULL;
+        conn_delete_socket_elem(fd);
+        return CONN_FAIL;
+    }
     return CONN_OK;
 }
 
 //! Connect to relay host
-/*! This is used to connect to a relayhost. 
- * \param host The hostname of the relayhost.
- * \param port The port of the connection.
+/*! This is used to connect to a relayhost. The connect is non blocking, it
+ * is finished by the main loop. The host must be given as address, it is
+ * resolved by the DNS module before.
+ * \param host       The address of the relayhost in dotted notation.
+ * \param port       The port of the connection.
+ * \param connecting Is set to 1 if the connect is still in progress, to 0 if
+ *                   it is already done.
  * \return The new socket to the relayhost on success or CONN_FAIL.
  */
-static inline int conn_connect_socket(char * host, char * port) {
+static inline int conn_connect_socket(char * host, char * port, int * connecting) {
     int new = 0;
     struct addrinfo hints;
     struct addrinfo* res;
 
     INFO_MSG3("connecting to host: %s:%s", host, port);
 
-    if((new = socket(PF_INET, SOCK_STREAM, 0)) == -1){
-        ERROR_SYS("socket creation");
-        return CONN_FAIL;
-    }
-
     memset(&hints, 0, sizeof(hints));
 
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
 
-    getaddrinfo(host, port, &hints, &res);
+    if (NULL == host || 0 != getaddrinfo(host, port, &hints, &res)) {
+        ERROR_CUSTM2("cannot resolve host: %s", (NULL == host ? "" : host));
+        return CONN_FAIL;
+    }
 
-    if (connect(new, res->ai_addr, res->ai_addrlen) == -1) {
+    if((new = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1){
         ERROR_SYS("socket creation");
+        freeaddrinfo(res);
         return CONN_FAIL;
     }
 
+    *connecting = 0;
+    if (connect(new, res->ai_addr, res->ai_addrlen) == -1) {
+        if (EINPROGRESS != errno) {
+            ERROR_SYS("socket connect");
+            freeaddrinfo(res);
+            close(new);
+            return CONN_FAIL;
+        }
+        *connecting = 1;
+    }
+
     freeaddrinfo(res);
     return new;
 }
 
 //! Create a new forward socket and queue it 
 /*!
- * This create a new forward socket by connecting to the relayhost and queues 
- * it to the socket list. 
- * \param host The hostname of the relayhost.
+ * This create a new forward socket by starting the connect to the relayhost
+ * and queues it to the socket table. The call does not wait for the connect,
+ * if it fails later, the forward module is told with fwd_connect_failed().
+ * The data belongs to the connection on success, on failture it stays with
+ * the caller.
+ * \param host The address of the relayhost in dotted notation.
  * \param data The data for the new connection.
  * \return The new socket to the relayhost on success or CONN_FAIL.
  */
 int conn_new_fwd_socket(char * host,  void * data){
     int new = 0;
-    fwd_mail_t * data_ = (fwd_mail_t*) data;
+    int connecting;
+    fwd_conn_t * data_ = (fwd_conn_t*) data;
 
-    if ( CONN_FAIL == (new = conn_connect_socket(host, "25")) ) {
-        fwd_free_mail(data);
+    if ( CONN_FAIL == (new = conn_connect_socket(host, "25", &connecting)) ) {
         return CONN_FAIL;
     }
-    if (CONN_FAIL == conn_queue_forward_socket(new, data_)) {
+    if (CONN_FAIL == conn_queue_forward_socket(new, data_, connecting)) {
         return CONN_FAIL;
     }
     return new;
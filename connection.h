@@ -35,17 +35,37 @@
 
 
 #include <stdlib.h>
+#include <stdarg.h>
 
 #define CONN_FAIL  -1
 #define CONN_OK  0
 #define CONN_QUIT -1
 #define CONN_CONT 0
 
-typedef ssize_t (* conn_writeback_t)(int, char *, ssize_t);
+#define CONN_WATCH_IN  1
+#define CONN_WATCH_OUT 2
 
+//! Function prototype for the callbacks of watched fds
+typedef int (* watch_handler_t)(int fd, int events, void * data);
+
+//! Function prototype for the callbacks of drained output
+typedef int (* drain_handler_t)(void * data);
+
+int conn_init_app();
+void conn_stop();
+void conn_close_app();
 int conn_init();
 int conn_close();
 int conn_wait_loop();
-ssize_t conn_writeback(int fd, char * buf, ssize_t len) ;
-ssize_t conn_writeback_ssl(int fd, char * buf, ssize_t len) ;
+int conn_enqueue(int fd, const char * buf, size_t len);
+int conn_vprintf(int fd, const char * fmt, va_list ap);
+int conn_printf(int fd, const char * fmt, ...);
 int conn_new_fwd_socket(char * host,  void * data);
+int conn_set_bulk(int fd, int enable);
+int conn_set_drain(int fd, drain_handler_t handler);
+int conn_suspend(int fd);
+int conn_resume(int fd);
+int conn_set_timeout(int fd, int msecs);
+int conn_watch_fd(int fd, int events, watch_handler_t handler, void * data);
+int conn_watch_fd_events(int fd, int events);
+int conn_unwatch_fd(int fd);
@@ -0,0 +1,960 @@
+/* dns.c
+ *
+ * The DNS module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "dns.h"
+#include "config.h"
+#include "connection.h"
+#include "fail.h"
+#include "wheel.h"
+
+/*!
+ * \defgroup dns DNS Module
+ * This is a small asynchronous stub resolver. The queries are sent by UDP to
+ * the nameservers of /etc/resolv.conf (or the one given with -N), truncated
+ * answers are fetched again by TCP. The sockets are watched by the event loop
+ * of the worker, so a slow nameserver does not block any connection. Each
+ * worker has its own socket and queries.
+ * @{
+ */
+
+//! The max count of nameservers
+#define DNS_MAX_SERVERS 3
+
+//! The time in milliseconds to wait for an answer before the query is retried
+#define DNS_TIMEOUT 2000
+
+//! The count of tries of a query, the servers are tried in turn
+#define DNS_TRIES   4
+
+//! The max size of a query or an answer by UDP
+#define DNS_UDP_MAX 512
+
+//! The max size of an answer by TCP
+#define DNS_TCP_MAX 65535
+
+//! The max memory of the cache of a worker in bytes
+#define DNS_CACHE_SIZE    (256 * 1024)
+
+//! The count of hash buckets of the cache
+#define DNS_CACHE_BUCKETS 1024
+
+//! The time to live of a negative answer without SOA record in seconds
+#define DNS_NEG_TTL       300
+
+//! The max time an answer is cached in seconds
+#define DNS_MAX_TTL       86400
+
+//! A cached answer
+typedef struct dns_entry dns_entry_t;
+
+struct dns_entry {
+    dns_entry_t *   entry_next;         //!< The next entry in the hash bucket.
+    dns_entry_t *   entry_older;        //!< The entry used before this one.
+    dns_entry_t *   entry_newer;        //!< The entry used after this one.
+    unsigned        entry_hash;         //!< The hash of name and type.
+    int             entry_type;         //!< The type of the query (DNS_A, DNS_MX).
+    int             entry_status;       //!< DNS_FOUND or DNS_NOTFOUND.
+    uint64_t        entry_expires;      //!< The time the entry becomes invalid.
+    size_t          entry_size;         //!< The memory used by the entry.
+    char *          entry_answer;       //!< The answer, points behind entry_name.
+    char            entry_name[];       //!< The queried name in lower case.
+};
+
+//! The cache of a worker
+/*!
+ * The entries are found by a hash table. They are also linked in the order of
+ * their last use, the least recently used entry is dropped first if the cache
+ * is full.
+ */
+typedef struct dns_cache {
+    dns_entry_t *   cache_buckets[DNS_CACHE_BUCKETS]; //!< The hash table.
+    dns_entry_t *   cache_oldest;       //!< The least recently used entry.
+    dns_entry_t *   cache_newest;       //!< The most recently used entry.
+    size_t          cache_size;         //!< The memory used by all entries.
+    unsigned long   cache_hits;         //!< The count of queries answered from the cache.
+    unsigned long   cache_misses;       //!< The count of queries sent to a server.
+} dns_cache_t;
+
+//! A pending query
+typedef struct dns_query dns_query_t;
+
+struct dns_query {
+    dns_query_t *   query_next;         //!< The next query of the worker.
+    int             query_id;           //!< The id of the query in the DNS messages.
+    int             query_type;         //!< The type of the query (DNS_A, DNS_MX).
+    char            query_name[NS_MAXDNAME]; //!< The name to query.
+    unsigned char   query_packet[DNS_UDP_MAX]; //!< The query message.
+    int             query_packet_len;   //!< The length of the query message.
+    int             query_tries;        //!< The count of tries so far.
+    wheel_timer_t   query_timer;        //!< The timer of the current try.
+    int             query_done;         //!< Flag that indicate if the result is ready to be passed.
+    int             query_status;       //!< The result (DNS_FOUND, ...).
+    char            query_answer[NS_MAXDNAME]; //!< The answer if found.
+    uint32_t        query_ttl;          //!< The time to live of the answer in seconds.
+    int             query_tcp_fd;       //!< The TCP socket of the current try or -1.
+    int             query_tcp_sent;     //!< Flag that indicate if the query was sent by TCP.
+    unsigned char * query_tcp_buf;      //!< The answer received by TCP.
+    size_t          query_tcp_len;      //!< The count of bytes in query_tcp_buf.
+    dns_handler_t   query_handler;      //!< The callback for the result.
+    void *          query_data;         //!< The data for the callback.
+};
+
+struct sockaddr_in dns_servers[DNS_MAX_SERVERS]; //! The nameservers.
+
+int dns_server_count = 0; //! The count of nameservers.
+
+__thread int dns_fd = -1; //! The UDP socket of the worker.
+
+__thread dns_query_t * dns_queries = NULL; //! The pending queries of the worker.
+
+__thread dns_cache_t * dns_cache = NULL; //! The cache of the worker.
+
+__thread int dns_ready = 0; //! The count of queries with a result which is not passed yet.
+
+static void dns_tcp_start(dns_query_t * query);
+
+//! Get the current time
+/*!
+ * \return The time of the monotonic clock in milliseconds.
+ */
+static inline uint64_t dns_now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//! Parse a nameserver address
+/*!
+ * \param buf  The address in dotted notation, optional followed by :port.
+ * \param addr The address is stored here.
+ * \return DNS_OK on success, DNS_FAIL else.
+ */
+static int dns_parse_server(const char * buf, struct sockaddr_in * addr){
+    char   host[INET_ADDRSTRLEN];
+    char * port = strchr(buf, ':');
+    char * end;
+    size_t len  = (NULL == port ? strlen(buf) : (size_t)(port - buf));
+    long   p    = NAMESERVER_PORT;
+
+    if (len >= sizeof(host)) {
+        return DNS_FAIL;
+    }
+    memcpy(host, buf, len);
+    host[len] = '\0';
+    if (NULL != port) {
+        if (!isdigit((unsigned char) port[1])) {
+            return DNS_FAIL;
+        }
+        errno = 0;
+        p = strtol(port + 1, &end, 10);
+        if (0 != errno || '\0' != *end) {
+            return DNS_FAIL;
+        }
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_port   = htons(p);
+    if (p < 1 || p > 65535 || 1 != inet_pton(AF_INET, host, &(addr->sin_addr))) {
+        return DNS_FAIL;
+    }
+    return DNS_OK;
+}
+
+//! Init the DNS module
+/*!
+ * This determines the nameservers. It must be called once before the workers
+ * are started. The nameserver given with -N is used, else the IPv4
+ * nameservers of /etc/resolv.conf, else the local host.
+ * \return DNS_OK on success, DNS_FAIL if the -N address is invalid.
+ */
+int dns_init_app(){
+    const char * server = config_get_nameserver();
+    char         line[256];
+    char         addr[64];
+    FILE *       conf;
+
+    srandom(time(NULL) ^ getpid());
+
+    if (NULL != server) {
+        if (DNS_FAIL == dns_parse_server(server, &dns_servers[0])) {
+            ERROR_CUSTM2("Invalid nameserver: %s", server);
+            return DNS_FAIL;
+        }
+        dns_server_count = 1;
+        return DNS_OK;
+    }
+
+    if (NULL != (conf = fopen(_PATH_RESCONF, "r"))) {
+        while (dns_server_count < DNS_MAX_SERVERS && NULL != fgets(line, sizeof(line), conf)) {
+            if (1 == sscanf(line, "nameserver %63s", addr)
+                    && DNS_OK == dns_parse_server(addr, &dns_servers[dns_server_count])) {
+                dns_server_count++;
+            }
+        }
+        fclose(conf);
+    }
+    if (0 == dns_server_count) {
+        dns_parse_server("127.0.0.1", &dns_servers[0]);
+        dns_server_count = 1;
+    }
+    return DNS_OK;
+}
+
+//! Hash a cache key
+/*!
+ * \param name The name in lower case.
+ * \param type The type of the query.
+ * \return The hash value.
+ */
+static inline unsigned dns_cache_hash(const char * name, int type){
+    unsigned hash = 5381 + type;
+
+    while ('\0' != *name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+//! Unlink a entry from the use order
+/*!
+ * \param entry The entry.
+ */
+static inline void dns_cache_unlink(dns_entry_t * entry){
+    if (NULL != entry->entry_older) {
+        entry->entry_older->entry_newer = entry->entry_newer;
+    } else {
+        dns_cache->cache_oldest = entry->entry_newer;
+    }
+    if (NULL != entry->entry_newer) {
+        entry->entry_newer->entry_older = entry->entry_older;
+    } else {
+        dns_cache->cache_newest = entry->entry_older;
+    }
+}
+
+//! Mark a entry as most recently used
+/*!
+ * \param entry The entry, it must not be linked in the use order.
+ */
+static inline void dns_cache_link(dns_entry_t * entry){
+    entry->entry_older = dns_cache->cache_newest;
+    entry->entry_newer = NULL;
+    if (NULL != dns_cache->cache_newest) {
+        dns_cache->cache_newest->entry_newer = entry;
+    } else {
+        dns_cache->cache_oldest = entry;
+    }
+    dns_cache->cache_newest = entry;
+}
+
+//! Remove a entry from the cache
+/*!
+ * \param entry The entry.
+ */
+static void dns_cache_remove(dns_entry_t * entry){
+    dns_entry_t ** link = &(dns_cache->cache_buckets[entry->entry_hash % DNS_CACHE_BUCKETS]);
+
+    while (entry != *link) {
+        link = &((*link)->entry_next);
+    }
+    *link = entry->entry_next;
+    dns_cache_unlink(entry);
+    dns_cache->cache_size -= entry->entry_size;
+    free(entry);
+}
+
+//! Find a cached answer
+/*!
+ * Expired entries are removed on the way.
+ * \param name The name in lower case.
+ * \param type The type of the query.
+ * \return The valid entry or NULL.
+ */
+static dns_entry_t * dns_cache_get(const char * name, int type){
+    unsigned      hash  = dns_cache_hash(name, type);
+    dns_entry_t * entry = dns_cache->cache_buckets[hash % DNS_CACHE_BUCKETS];
+
+    while (NULL != entry) {
+        if (hash == entry->entry_hash && type == entry->entry_type && 0 == strcmp(name, entry->entry_name)) {
+            break;
+        }
+        entry = entry->entry_next;
+    }
+    if (NULL == entry) {
+        return NULL;
+    }
+    if (entry->entry_expires <= dns_now()) {
+        dns_cache_remove(entry);
+        return NULL;
+    }
+    dns_cache_unlink(entry);
+    dns_cache_link(entry);
+    return entry;
+}
+
+//! Cache a answer
+/*!
+ * The least recently used entries are dropped until the new one fits into
+ * DNS_CACHE_SIZE.
+ * \param name   The name in lower case.
+ * \param type   The type of the query.
+ * \param status DNS_FOUND or DNS_NOTFOUND.
+ * \param answer The answer if found, NULL else.
+ * \param ttl    The time to live in seconds, answers with 0 are not cached.
+ */
+static void dns_cache_put(const char * name, int type, int status, const char * answer, uint32_t ttl){
+    dns_entry_t * entry;
+    size_t        name_len   = strlen(name) + 1;
+    size_t        answer_len = (NULL == answer ? 0 : strlen(answer)) + 1;
+    size_t        size       = sizeof(dns_entry_t) + name_len + answer_len;
+
+    if (0 == ttl) {
+        return;
+    }
+    if (NULL != (entry = dns_cache_get(name, type))) {
+        dns_cache_remove(entry);
+    }
+    while (NULL != dns_cache->cache_oldest && DNS_CACHE_SIZE < dns_cache->cache_size + size) {
+        dns_cache_remove(dns_cache->cache_oldest);
+    }
+    if (NULL == (entry = malloc(size))) {
+        return;
+    }
+    memcpy(entry->entry_name, name, name_len);
+    entry->entry_answer = entry->entry_name + name_len;
+    memcpy(entry->entry_answer, (NULL == answer ? "" : answer), answer_len);
+    entry->entry_hash    = dns_cache_hash(name, type);
+    entry->entry_type    = type;
+    entry->entry_status  = status;
+    entry->entry_expires = dns_now() + (uint64_t)(DNS_MAX_TTL < ttl ? DNS_MAX_TTL : ttl) * 1000;
+    entry->entry_size    = size;
+
+    entry->entry_next = dns_cache->cache_buckets[entry->entry_hash % DNS_CACHE_BUCKETS];
+    dns_cache->cache_buckets[entry->entry_hash % DNS_CACHE_BUCKETS] = entry;
+    dns_cache_link(entry);
+    dns_cache->cache_size += size;
+}
+
+//! Free the cache of the worker
+static void dns_cache_free(){
+    if (NULL != dns_cache) {
+        while (NULL != dns_cache->cache_oldest) {
+            dns_cache_remove(dns_cache->cache_oldest);
+        }
+        free(dns_cache);
+        dns_cache = NULL;
+    }
+}
+
+//! Get the cache statistics of the calling worker
+/*!
+ * \param hits   The count of queries answered from the cache is stored here.
+ * \param misses The count of queries sent to a nameserver is stored here.
+ * \param size   The memory used by the cache is stored here.
+ */
+void dns_cache_stats(unsigned long * hits, unsigned long * misses, size_t * size){
+    *hits   = (NULL == dns_cache ? 0 : dns_cache->cache_hits);
+    *misses = (NULL == dns_cache ? 0 : dns_cache->cache_misses);
+    *size   = (NULL == dns_cache ? 0 : dns_cache->cache_size);
+}
+
+//! Log the cache statistics of the calling worker
+/*!
+ * \sa dns_cache_stats()
+ */
+void dns_report(){
+    unsigned long hits;
+    unsigned long misses;
+    size_t        size;
+
+    if (NULL != dns_cache) {
+        dns_cache_stats(&hits, &misses, &size);
+        INFO_MSG4("DNS cache: %lu hits, %lu misses, %lu bytes", hits, misses, (unsigned long)size);
+    }
+}
+
+//! Find a query
+/*!
+ * \param id The id of the query.
+ * \return The query or NULL.
+ */
+static inline dns_query_t * dns_find_query(int id){
+    dns_query_t * query;
+
+    for (query = dns_queries; NULL != query; query = query->query_next) {
+        if (id == query->query_id) {
+            return query;
+        }
+    }
+    return NULL;
+}
+
+//! End the TCP connection of a query
+/*!
+ * \param query The query.
+ */
+static inline void dns_tcp_close(dns_query_t * query){
+    if (-1 != query->query_tcp_fd) {
+        conn_unwatch_fd(query->query_tcp_fd);
+        query->query_tcp_fd = -1;
+    }
+    free(query->query_tcp_buf);
+    query->query_tcp_buf  = NULL;
+    query->query_tcp_len  = 0;
+    query->query_tcp_sent = 0;
+}
+
+//! Unlink and free a query
+/*!
+ * \param query The query.
+ */
+static void dns_free_query(dns_query_t * query){
+    dns_query_t ** link = &dns_queries;
+
+    while (NULL != *link && query != *link) {
+        link = &((*link)->query_next);
+    }
+    if (NULL != *link) {
+        *link = query->query_next;
+    }
+    dns_tcp_close(query);
+    wheel_cancel(&(query->query_timer));
+    if (query->query_done) {
+        dns_ready--;
+    }
+    free(query);
+}
+
+//! Set the result of a query
+/*!
+ * The result is passed to the callback by dns_expire(), which the main loop
+ * calls after the current batch of events.
+ * \param query  The query.
+ * \param status The result.
+ * \param answer The answer or NULL.
+ */
+static inline void dns_finish(dns_query_t * query, int status, const char * answer){
+    dns_tcp_close(query);
+    wheel_cancel(&(query->query_timer));
+    dns_ready++;
+    query->query_done   = 1;
+    query->query_status = status;
+    if (NULL != answer) {
+        snprintf(query->query_answer, sizeof(query->query_answer), "%s", answer);
+    }
+}
+
+//! Send a query by UDP
+/*!
+ * This sends the query to the next server and starts the timeout of the try.
+ * If all tries are used up, the query fails with DNS_ERROR.
+ * \param query The query.
+ */
+static void dns_send(dns_query_t * query){
+    struct sockaddr_in * server;
+
+    dns_tcp_close(query);
+    if (DNS_TRIES <= query->query_tries) {
+        INFO_MSG2("No answer from the nameservers for %s", query->query_name);
+        dns_finish(query, DNS_ERROR, NULL);
+        return;
+    }
+    server = &dns_servers[query->query_tries % dns_server_count];
+    query->query_tries++;
+    wheel_arm(&(query->query_timer), DNS_TIMEOUT);
+
+    if (-1 == sendto(dns_fd, query->query_packet, query->query_packet_len, 0,
+                (struct sockaddr *)server, sizeof(struct sockaddr_in))) {
+        ERROR_SYS("Sending DNS query");
+    }
+}
+
+//! Retry an expired query
+/*!
+ * This is the callback of the timer of a query.
+ * \param data The query.
+ */
+static void dns_retry(void * data){
+    dns_send((dns_query_t*)data);
+}
+
+//! Get the time to live of a negative answer
+/*!
+ * This is the minimum of the TTL and the MINIMUM field of the SOA record in
+ * the authority section (RFC 2308, 5).
+ * \param handle The parsed answer.
+ * \return The time to live in seconds or DNS_NEG_TTL if there is no SOA.
+ */
+static uint32_t dns_negative_ttl(ns_msg * handle){
+    ns_rr                 rr;
+    const unsigned char * pos;
+    int                   len;
+    int                   i;
+    uint32_t              min;
+
+    for (i = 0; i < ns_msg_count(*handle, ns_s_ns); i++) {
+        if (0 > ns_parserr(handle, ns_s_ns, i, &rr) || ns_t_soa != ns_rr_type(rr)) {
+            continue;
+        }
+        /* skip MNAME and RNAME, MINIMUM is the last of five 32 bit fields */
+        pos = ns_rr_rdata(rr);
+        if (0 > (len = dn_skipname(pos, ns_msg_end(*handle)))) {
+            break;
+        }
+        pos += len;
+        if (0 > (len = dn_skipname(pos, ns_msg_end(*handle)))) {
+            break;
+        }
+        pos += len;
+        if (pos + 5 * NS_INT32SZ > ns_rr_rdata(rr) + ns_rr_rdlen(rr)) {
+            break;
+        }
+        min = ns_get32(pos + 4 * NS_INT32SZ);
+        return (ns_rr_ttl(rr) < min ? ns_rr_ttl(rr) : min);
+    }
+    return DNS_NEG_TTL;
+}
+
+//! Process an answer
+/*!
+ * This checks if the answer belongs to the query and takes the result. A
+ * truncated UDP answer is fetched again by TCP, a server failure is retried
+ * with the next server. Found and not existing names are cached with the
+ * lowest TTL of the answer records or the one of the SOA record.
+ * \param query The query.
+ * \param msg   The answer.
+ * \param len   The length of the answer.
+ * \param tcp   1 if the answer was received by TCP, 0 else.
+ */
+static void dns_answer(dns_query_t * query, const unsigned char * msg, int len, int tcp){
+    ns_msg        handle;
+    ns_rr         rr;
+    char          name[NS_MAXDNAME];
+    int           best = -1;
+    int           pref;
+    int           i;
+    uint32_t      ttl  = DNS_MAX_TTL;
+
+    if (0 > ns_initparse(msg, len, &handle) || 1 != ns_msg_count(handle, ns_s_qd)
+            || 0 > ns_parserr(&handle, ns_s_qd, 0, &rr)
+            || query->query_type != ns_rr_type(rr)
+            || 0 != strcasecmp(query->query_name, ns_rr_name(rr))) {
+        return;
+    }
+    if (!tcp && ns_msg_getflag(handle, ns_f_tc)) {
+        dns_tcp_start(query);
+        return;
+    }
+
+    switch (ns_msg_getflag(handle, ns_f_rcode)) {
+        case ns_r_noerror:
+            break;
+        case ns_r_nxdomain:
+            dns_cache_put(query->query_name, query->query_type, DNS_NOTFOUND, NULL, dns_negative_ttl(&handle));
+            dns_finish(query, DNS_NOTFOUND, NULL);
+            return;
+        default:
+            dns_send(query);
+            return;
+    }
+
+    for (i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+        if (0 > ns_parserr(&handle, ns_s_an, i, &rr) || query->query_type != ns_rr_type(rr)) {
+            continue;
+        }
+        if (ns_rr_ttl(rr) < ttl) {
+            ttl = ns_rr_ttl(rr);
+        }
+        if (DNS_A == query->query_type && NS_INADDRSZ == ns_rr_rdlen(rr) && -1 == best) {
+            inet_ntop(AF_INET, ns_rr_rdata(rr), query->query_answer, sizeof(query->query_answer));
+            best = 0;
+        }
+        if (DNS_MX == query->query_type && NS_INT16SZ < ns_rr_rdlen(rr)) {
+            pref = ns_get16(ns_rr_rdata(rr));
+            if ((-1 == best || pref < best)
+                    && 0 <= dn_expand(ns_msg_base(handle), ns_msg_end(handle),
+                        ns_rr_rdata(rr) + NS_INT16SZ, name, sizeof(name))) {
+                best = pref;
+                strcpy(query->query_answer, name);
+            }
+        }
+    }
+    if (-1 == best) {
+        dns_cache_put(query->query_name, query->query_type, DNS_NOTFOUND, NULL, dns_negative_ttl(&handle));
+        dns_finish(query, DNS_NOTFOUND, NULL);
+    } else {
+        dns_cache_put(query->query_name, query->query_type, DNS_FOUND, query->query_answer, ttl);
+        dns_finish(query, DNS_FOUND, NULL);
+    }
+}
+
+//! Handle the events of the TCP socket of a query
+/*!
+ * This sends the query as soon as the socket is connected and reads the
+ * answer, which is prefixed by its length.
+ * \param fd     The TCP socket.
+ * \param events The events of the socket.
+ * \param data   The query.
+ * \return 0 in any case.
+ */
+static int dns_tcp_event(int fd, int events, void * data){
+    dns_query_t * query = data;
+    unsigned char buf[NS_INT16SZ + DNS_UDP_MAX];
+    int           err   = 0;
+    socklen_t     len   = sizeof(err);
+    ssize_t       ret;
+    size_t        need;
+
+    if (!query->query_tcp_sent) {
+        if (-1 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || 0 != err) {
+            dns_send(query);
+            return 0;
+        }
+        ns_put16(query->query_packet_len, buf);
+        memcpy(buf + NS_INT16SZ, query->query_packet, query->query_packet_len);
+        if (NS_INT16SZ + query->query_packet_len != send(fd, buf,
+                    NS_INT16SZ + query->query_packet_len, MSG_NOSIGNAL)) {
+            dns_send(query);
+            return 0;
+        }
+        query->query_tcp_sent = 1;
+        conn_watch_fd_events(fd, CONN_WATCH_IN);
+        return 0;
+    }
+
+    if (NULL == query->query_tcp_buf
+            && NULL == (query->query_tcp_buf = malloc(NS_INT16SZ + DNS_TCP_MAX))) {
+        dns_send(query);
+        return 0;
+    }
+    do {
+        ret = recv(fd, query->query_tcp_buf + query->query_tcp_len,
+                NS_INT16SZ + DNS_TCP_MAX - query->query_tcp_len, MSG_DONTWAIT);
+    } while (-1 == ret && EINTR == errno);
+
+    if (-1 == ret && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+        return 0;
+    }
+    if (1 > ret) {
+        dns_send(query);
+        return 0;
+    }
+    query->query_tcp_len += ret;
+    if (NS_INT16SZ > query->query_tcp_len) {
+        return 0;
+    }
+    need = NS_INT16SZ + ns_get16(query->query_tcp_buf);
+    if (need > query->query_tcp_len) {
+        return 0;
+    }
+    dns_answer(query, query->query_tcp_buf + NS_INT16SZ, need - NS_INT16SZ, 1);
+    if (!query->query_done && -1 != query->query_tcp_fd) {
+        /* not usable, try the next server */
+        dns_send(query);
+    }
+    return 0;
+}
+
+//! Fetch an answer by TCP
+/*!
+ * This connects to the server of the current try, the query is sent by
+ * dns_tcp_event() when the socket is connected.
+ * \param query The query.
+ */
+static void dns_tcp_start(dns_query_t * query){
+    struct sockaddr_in * server = &dns_servers[(query->query_tries - 1) % dns_server_count];
+    int                  fd;
+
+    dns_tcp_close(query);
+    if (-1 == (fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))) {
+        ERROR_SYS("DNS socket creation");
+        dns_send(query);
+        return;
+    }
+    if (-1 == connect(fd, (struct sockaddr *)server, sizeof(struct sockaddr_in))
+            && EINPROGRESS != errno) {
+        close(fd);
+        dns_send(query);
+        return;
+    }
+    if (CONN_FAIL == conn_watch_fd(fd, CONN_WATCH_OUT, dns_tcp_event, query)) {
+        close(fd);
+        dns_send(query);
+        return;
+    }
+    query->query_tcp_fd = fd;
+    wheel_arm(&(query->query_timer), DNS_TIMEOUT);
+}
+
+//! Handle the events of the UDP socket
+/*!
+ * This reads all received answers and assigns them to their queries by the id
+ * and the sender.
+ * \param fd     The UDP socket.
+ * \param events The events of the socket.
+ * \param data   Not used.
+ * \return 0 in any case.
+ */
+static int dns_udp_event(int fd, int events, void * data){
+    unsigned char      buf[DNS_UDP_MAX];
+    struct sockaddr_in from;
+    socklen_t          fromlen;
+    dns_query_t *      query;
+    ssize_t            len;
+    int                i;
+
+    while (1) {
+        fromlen = sizeof(from);
+        len = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+        if (-1 == len) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        if (NS_HFIXEDSZ > len) {
+            continue;
+        }
+        for (i = 0; i < dns_server_count; i++) {
+            if (from.sin_addr.s_addr == dns_servers[i].sin_addr.s_addr
+                    && from.sin_port == dns_servers[i].sin_port) {
+                break;
+            }
+        }
+        query = dns_find_query(ns_get16(buf));
+        if (i == dns_server_count || NULL == query || query->query_done
+                || -1 != query->query_tcp_fd) {
+            continue;
+        }
+        dns_answer(query, buf, len, 0);
+    }
+    return 0;
+}
+
+//! Init the resolver of a worker
+/*!
+ * This creates the UDP socket and the cache of the calling worker and
+ * registers the socket at the event loop. It must be called after conn_init().
+ * \return DNS_OK on success, DNS_FAIL else.
+ */
+int dns_init(){
+    if (NULL == (dns_cache = calloc(1, sizeof(dns_cache_t)))) {
+        return DNS_FAIL;
+    }
+    if (-1 == (dns_fd = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))) {
+        ERROR_SYS("DNS socket creation");
+        return DNS_FAIL;
+    }
+    if (CONN_FAIL == conn_watch_fd(dns_fd, CONN_WATCH_IN, dns_udp_event, NULL)) {
+        close(dns_fd);
+        dns_fd = -1;
+        return DNS_FAIL;
+    }
+    return DNS_OK;
+}
+
+//! Shut down the resolver of a worker
+/*!
+ * This ends all pending queries of the calling worker, their callbacks get
+ * DNS_CANCELED, and frees its cache. It must be called before conn_close().
+ */
+void dns_close(){
+    dns_query_t * query;
+
+    while (NULL != (query = dns_queries)) {
+        dns_queries = query->query_next;
+        dns_tcp_close(query);
+        wheel_cancel(&(query->query_timer));
+        (query->query_handler)(DNS_CANCELED, NULL, query->query_data);
+        free(query);
+    }
+    if (-1 != dns_fd) {
+        conn_unwatch_fd(dns_fd);
+        dns_fd = -1;
+    }
+    if (NULL != dns_cache) {
+        dns_report();
+        dns_cache_free();
+    }
+    dns_ready = 0;
+}
+
+//! Start a query
+/*!
+ * This sends a query and returns at once. The result is passed to the
+ * callback by the main loop, never within this call. IPv4 addresses in dotted
+ * notation are not sent to a server, an A query returns them as they are.
+ * Answers of the cache of the worker are passed the same way.
+ * \param name    The name to query.
+ * \param type    The type of the query (DNS_A, DNS_MX).
+ * \param handler The callback for the result.
+ * \param data    The data for the callback.
+ * \return The id of the query, which can be used with dns_cancel(), or
+ *         DNS_FAIL if the query cannot be sent.
+ */
+int dns_query(const char * name, int type, dns_handler_t handler, void * data){
+    dns_query_t *  query;
+    dns_entry_t *  entry;
+    struct in_addr addr;
+    size_t         len = strlen(name);
+    int            ret;
+
+    if (-1 == dns_fd || 0 == len || len >= NS_MAXDNAME) {
+        return DNS_FAIL;
+    }
+    if (NULL == (query = calloc(1, sizeof(dns_query_t)))) {
+        return DNS_FAIL;
+    }
+    memcpy(query->query_name, name, len + 1);
+    config_to_lower(query->query_name, len);
+    /* the question of the answer does not have the trailing dot */
+    if (1 < len && '.' == query->query_name[len - 1]) {
+        query->query_name[len - 1] = '\0';
+    }
+    query->query_type    = type;
+    query->query_tcp_fd  = -1;
+    query->query_handler = handler;
+    query->query_data    = data;
+    wheel_timer_init(&(query->query_timer), dns_retry, query);
+    do {
+        query->query_id = random() & 0xffff;
+    } while (NULL != dns_find_query(query->query_id));
+
+    query->query_next = dns_queries;
+    dns_queries       = query;
+
+    if (1 == inet_pton(AF_INET, query->query_name, &addr)) {
+        dns_finish(query, (DNS_A == type ? DNS_FOUND : DNS_NOTFOUND),
+                (DNS_A == type ? query->query_name : NULL));
+        return query->query_id;
+    }
+
+    if (NULL != (entry = dns_cache_get(query->query_name, type))) {
+        dns_cache->cache_hits++;
+        dns_finish(query, entry->entry_status, entry->entry_answer);
+        return query->query_id;
+    }
+    dns_cache->cache_misses++;
+
+    /* header: id, recursion desired, one question */
+    memset(query->query_packet, 0, NS_HFIXEDSZ);
+    ns_put16(query->query_id, query->query_packet);
+    query->query_packet[2] = 0x01;
+    ns_put16(1, query->query_packet + 4);
+    ret = dn_comp(query->query_name, query->query_packet + NS_HFIXEDSZ,
+            DNS_UDP_MAX - NS_HFIXEDSZ - NS_QFIXEDSZ, NULL, NULL);
+    if (0 > ret) {
+        dns_free_query(query);
+        return DNS_FAIL;
+    }
+    ns_put16(type, query->query_packet + NS_HFIXEDSZ + ret);
+    ns_put16(ns_c_in, query->query_packet + NS_HFIXEDSZ + ret + NS_INT16SZ);
+    query->query_packet_len = NS_HFIXEDSZ + ret + NS_QFIXEDSZ;
+
+    dns_send(query);
+    return query->query_id;
+}
+
+//! Cancel a query
+/*!
+ * The callback of the query will not be called.
+ * \param id The id returned by dns_query().
+ */
+void dns_cancel(int id){
+    dns_query_t * query = dns_find_query(id);
+
+    if (NULL != query) {
+        dns_free_query(query);
+    }
+}
+
+//! Get the wait timeout of the main loop
+/*!
+ * The retries of the queries are driven by the timer wheel, so only the
+ * results which are not passed yet count here.
+ * \return 0 if a result is ready, -1 else.
+ */
+int dns_timeout(){
+    return (0 < dns_ready ? 0 : -1);
+}
+
+//! Pass the results
+/*!
+ * This is called by the main loop after each batch of events and the timers.
+ * The callbacks may start and cancel queries.
+ */
+void dns_expire(){
+    dns_query_t * query;
+
+    if (0 == dns_ready) {
+        return;
+    }
+
+    /* the list may change within the callbacks, so restart each time */
+    do {
+        for (query = dns_queries; NULL != query && !query->query_done; query = query->query_next);
+        if (NULL != query) {
+            dns_handler_t handler = query->query_handler;
+            void *        data    = query->query_data;
+            int           status  = query->query_status;
+            char          answer[NS_MAXDNAME];
+
+            strcpy(answer, query->query_answer);
+            dns_free_query(query);
+            handler(status, (DNS_FOUND == status ? answer : NULL), data);
+        }
+    } while (NULL != query);
+}
+
+/** @} */
@@ -0,0 +1,69 @@
+/* dns.h
+ *
+ * The DNS module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+
+#define DNS_FAIL -1
+#define DNS_OK    0
+
+#define DNS_A  1  //!< Query the IPv4 address of a host.
+#define DNS_MX 15 //!< Query the mail exchanger of a domain.
+
+#define DNS_FOUND    0 //!< The name has a record of the type, the answer is passed.
+#define DNS_NOTFOUND 1 //!< The name does not exist or has no record of the type.
+#define DNS_ERROR    2 //!< No server gave an answer.
+#define DNS_CANCELED 3 //!< The resolver was shut down before the answer arrived.
+
+//! Function prototype for the callbacks of DNS queries
+/*!
+ * \param status The result of the query (DNS_FOUND, ...).
+ * \param answer The answer if the status is DNS_FOUND, NULL else: the address
+ *               of an A query in dotted notation or the exchanger of a MX
+ *               query with the lowest preference. It is only valid during
+ *               the call.
+ * \param data   The data given to dns_query().
+ */
+typedef void (* dns_handler_t)(int status, const char * answer, void * data);
+
+int dns_init_app();
+int dns_init();
+void dns_close();
+int dns_query(const char * name, int type, dns_handler_t handler, void * data);
+void dns_cancel(int id);
+int dns_timeout();
+void dns_expire();
+void dns_cache_stats(unsigned long * hits, unsigned long * misses, size_t * size);
+void dns_report();
@@ -47,8 +47,8 @@
  * @{
  */
 
-static char msg_buf[2048];
-static char loc_buf[2048];
+static __thread char msg_buf[2048];
+static __thread char loc_buf[2048];
 
 inline int gen_err_msg(const char * pref, const char * msg, const char * file, int line) {
     snprintf(loc_buf, 1023, "%s:%d", file, line);
@@ -64,7 +64,7 @@ inline int gen_err_msg(const char * pref, const char * msg, const char * file, i
 inline char * build_msg(const char * fmt, ...){
     va_list arglist;
     va_start(arglist, fmt);
-    static char buf[2048];
+    static __thread char buf[2048];
     vsnprintf(buf, 2047, fmt, arglist);
     return buf;
 }
@@ -47,6 +47,8 @@
 #define INFO_MSG(msg)                   put_info(INFO_GEN_MSG(msg))
 #define INFO_MSG2(msg_fmt, arg1)        put_info(INFO_GEN_MSG(build_msg(msg_fmt,arg1)))
 #define INFO_MSG3(msg_fmt, arg1, arg2)  put_info(INFO_GEN_MSG(build_msg(msg_fmt,arg1,arg2)))
+#define INFO_MSG4(msg_fmt, arg1, arg2, arg3) put_info(INFO_GEN_MSG(build_msg(msg_fmt,arg1,arg2,arg3)))
+#define INFO_MSG5(msg_fmt, arg1, arg2, arg3, arg4) put_info(INFO_GEN_MSG(build_msg(msg_fmt,arg1,arg2,arg3,arg4)))
 
 
 //DO NOT USE THIS DIRECT
@@ -35,8 +35,11 @@
 
 
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
-#include <netdb.h>
+#include <ctype.h>
+#include <time.h>
+#include <netinet/in.h>
 
 
 #include "forward.h"
@@ -44,6 +47,11 @@
 #include "connection.h"
 #include "fail.h"
 #include "smtp.h"
+#include "dns.h"
+#include "spool.h"
+#include "pool.h"
+#include "mailbox.h"
+#include "wheel.h"
 
 
 /*!
@@ -51,21 +59,67 @@
  * @{
  */
 
-//! Max number of retrys of a command.
+//! Max number of trys of a command or a mail.
 #define SEND_MAXTRY 3
 
-//! States of a forwarding mail
+//! The size of the parts the body is sent in.
+#define FWD_BODY_PIECE 65536
+
+//! The count of forward mails a worker allocates at once
+#define FWD_POOL 16
+
+//! The max count of connections of a worker to one mail server
+#define FWD_CONN_MAX 4
+
+/** \name Reply timeouts
+ * The times in milliseconds to wait for the replies of the mail server
+ * (RFC 5321, 4.5.3.2).
+ * @{ */
+#define FWD_TIMEOUT_COMMAND 300000  //!< Greeting, EHLO, HELO, RSET, MAIL FROM and RCPT TO.
+#define FWD_TIMEOUT_DATA    120000  //!< The 354 reply to DATA.
+#define FWD_TIMEOUT_SEND    600000  //!< The reply after the body was sent.
+#define FWD_TIMEOUT_QUIT    60000   //!< The reply to QUIT.
+/** @} */
+
+//! The time in milliseconds an idle connection waits for the next mail
+#define FWD_TIMEOUT_IDLE    30000
+
+//! The max count of mails a worker sends at the same time
+#define FWD_QUEUE_ACTIVE 64
+
+//! The max time in milliseconds between two looks of a worker into the queue
+#define FWD_QUEUE_POLL 10000
+
+/** \name Queue times
+ * The times in seconds a mail waits in the queue after a temporary
+ * failture. The delay starts at FWD_RETRY_MIN and is doubled with each
+ * retry up to FWD_RETRY_MAX. A mail which is not sent FWD_QUEUE_MAX_AGE
+ * after it was queued is given up (RFC 5321, 4.5.4.1).
+ * @{ */
+#define FWD_RETRY_MIN     300
+#define FWD_RETRY_MAX     14400
+#define FWD_QUEUE_MAX_AGE 432000
+/** @} */
+
+//! The max length of the reason a mail was not sent
+#define FWD_REASON_LEN 512
+
+//! States of a forward connection
 /*!
- * This are the states, a forwarding mail can have before, during an after the 
- * forward process.
+ * This are the states, a connection to a mail server can have before, during
+ * an after the forward of a mail.
  */
 enum fwd_states {
     NEW,        /*!< This value tells that the connection to te target was created, but no datawas send or recived now. */
-    HELO,       /*!< The mail have this state after sending the HELO command and waiting for reply. */
-    MAIL,       /*!< The mail have this state after sending the MAIL FROM command and waiting for reply. */
-    RCPT,       /*!< The mail have this state after sending the RCPT TO command and waiting for reply. */
-    DATA,       /*!< The mail have this state after sending the DATA command and waiting for reply. */
-    SEND,       /*!< The mail have this state after sending the mail body lines accept. */
+    EHLO,       /*!< The connection have this state after sending the EHLO command and waiting for reply. */
+    HELO,       /*!< The connection have this state after sending the HELO command and waiting for reply. */
+    RSET,       /*!< The connection have this state after sending the RSET command before the next mail and waiting for reply. */
+    MAIL,       /*!< The connection have this state after sending the MAIL FROM command and waiting for reply. */
+    RCPT,       /*!< The connection have this state after sending the RCPT TO command and waiting for reply. */
+    DATA,       /*!< The connection have this state after sending the DATA command and waiting for reply. */
+    SEND,       /*!< The connection have this state after sending the mail body lines accept. */
+    SKIP,       /*!< A command of a pipelined batch was refused, the connection waits for the replies of the rest. */
+    IDLE,       /*!< The mail is done and the connection waits for the next one. */
     QUIT        /*!< This indicates, that the forward is over. */
 };
 
@@ -81,116 +135,86 @@ enum response {
     R_FAIL      /*!< The server tells you the sending failed for some reason. */
 };
 
+//! States of a recipient of a forward mail
+/*!
+ * This are the states a recipient can have during the transactions of a mail.
+ */
+enum rcpt_states {
+    RCPT_WAIT,  /*!< The recipient is sent with the next transaction. */
+    RCPT_OK,    /*!< The server accepted the recipient in the current transaction. */
+    RCPT_RETRY, /*!< The server refused the recipient temporary, it is sent again with the next transaction. */
+    RCPT_DONE   /*!< The mail was delivered to the recipient or the sender got an error report. */
+};
+
+//! A recipient of a forward mail
+typedef struct fwd_rcpt {
+    char *           rcpt_to;           /*!< The to adress. */
+    enum rcpt_states rcpt_state;        /*!< The state of the recipient. */
+} fwd_rcpt_t;
+
 //! The stucture representing a forward mail
 /*!
  * This structure holds all data, related to a forwarded mail. This includes the
- * addresses, the body data, the connection fd and so on.
- * It will be initialized during fwd_queue() and freed with fwd_free_mail().
- * \sa fwd_queue(), fwd_free_mail()
+ * addresses, the body data, the address of the mail server and so on.
+ * All recipients of a mail are on the same host (or all go to the relay
+ * host), so the mail is sent with one transaction to all of them.
+ * Each mail is a row of the queue in the database while it is sent.
+ * It will be initialized during fwd_queue() or when it is loaded from the
+ * queue by fwd_queue_run(), and ended with fwd_end_mail().
+ * \sa fwd_queue(), fwd_queue_run(), fwd_end_mail()
  */
 struct fwd_mail {
-    int             fwd_writeback_fd;   /*!< The fd of the connection. */
     char *          fwd_from;           /*!< The from adress. */
-    char *          fwd_to;             /*!< The to adress. */
-    enum fwd_states fwd_state;          /*!< The state of the mail. */
-    int             fwd_trycount;       /*!< The count of trys of the current command. */
+    fwd_rcpt_t *    fwd_rcpts;          /*!< The recipients, allocated together with their addresses. */
+    int             fwd_rcpt_count;     /*!< The count of recipients. */
     int             fwd_failable;       /*!< Flag to tell if a error report should be sended to sender on failture. */
-    body_line_t *   fwd_body;           /*!< The body of the mail. */
+    spool_t *       fwd_body;           /*!< The body of the mail. */
+    size_t          fwd_body_sent;      /*!< The count of body bytes queued on the connection. */
+    char *          fwd_domain;         /*!< The host part of the first recipient, points into fwd_rcpts. */
+    char            fwd_addr[INET_ADDRSTRLEN]; /*!< The address of the mail server, set when it is resolved. */
+    int             fwd_attempts;       /*!< The count of transactions which failed temporary. */
+    long long       fwd_id;             /*!< The id of the mail in the queue. */
+    time_t          fwd_created;        /*!< The time the mail was queued. */
+    int             fwd_retries;        /*!< The count of times the mail was put back into the queue. */
+    char            fwd_reason[FWD_REASON_LEN]; /*!< The last temporary failture, reported if the mail expires. */
+    fwd_mail_t *    fwd_next;           /*!< The next mail waiting for a connection. */
 }; 
 
-//! get thr host for sending
-/*! 
- * This determines the host where the mail should be relayed to. This can be
- * the Relayhost given as commandline option, the host after the @ char of the
- * mail adress (if it is a host) or the dns mx entry of the name after the @
- * sign.
- * The host will be given as char sequence and musst be freed manual!
- * \param addr The mail adress the host should determined for.
- * \return The pointer to host as char sequence.
- * \sa smtp_resolve_mx()
- */
-static inline char * fwd_send_host(char * addr) {
-    char *       buf = NULL;
-    const char * pos = NULL;
-    size_t       len = 0;
-
-    pos = config_get_relayhost();
-
-    if (NULL == pos) {
-        pos = strchr(addr, '@')+1;
-    } 
-    len = strlen(pos) + 1;
-
-    buf = malloc(sizeof(char) * len);
-    memcpy(buf, pos, len);
-
-    if (gethostbyname(buf) == NULL) {
-        free(buf);
-        buf = smtp_resolve_mx(pos);
-    }
-    return buf;
-}
-
-//! Copys existing body lines
-/*! 
- * This copys existing body lines into new memory and returns the pointer to the
- * new head element. This is used to transfer body lines from the smtp to the
- * forward module. In future releases (if anyday this will be performant and
- * MULTITHREADED or better MULTIPROCESSED, this will be solved better.
- * \param old The old body lines to copy.
- * \return The head element of the new body lines.
- */
-static inline body_line_t * copy_body(body_line_t* old){
-    body_line_t * new  = NULL;
-    body_line_t * tmp  = NULL;
-    body_line_t * old_ = old;
-    char *        buf  = NULL;
-
-    while (NULL != old_) {
-        if (NULL == tmp) {
-        tmp = malloc(sizeof(body_line_t));
-        } else {
-            tmp->line_next = malloc(sizeof(body_line_t));
-            tmp = tmp->line_next;
-        }
-        memcpy(tmp, old_, sizeof(body_line_t));
-        tmp->line_next = NULL;
-
-        if (NULL != tmp->line_data && 0 != tmp->line_len){
-            buf = malloc(sizeof(char) * (tmp->line_len + 1));
-            memcpy(buf, tmp->line_data, tmp->line_len);
-            buf[tmp->line_len] = '\0';
-            tmp->line_data = buf;
-        } else {
-            tmp->line_data = NULL;
-        }
-        if (NULL == new) {
-            new = tmp;
-        }
-        old_ = old_->line_next;
-    }
-    return new;
-}
-
-//! Deletes all body lines of a forward
-/*! 
- * Delete the whole given body line list.
- * \param start The head element of the List to delete.
+//! The stucture representing a connection to a mail server
+/*!
+ * This structure holds the state of a connection to a mail server. It sends
+ * one mail at a time, when the mail is done the next mail to the same
+ * address is sent after a RSET. If there is none, the connection waits idle
+ * for FWD_TIMEOUT_IDLE before it quits. If the server announces PIPELINING in
+ * its EHLO reply, the commands of a mail up to DATA are sent as one batch.
+ * It will be created by fwd_dispatch() and freed with fwd_free_conn().
+ * \sa fwd_dispatch(), fwd_free_conn()
  */
-inline void fwd_delete_body_lines(body_line_t * start){
-    body_line_t * tmp1 = start;
-    body_line_t * tmp2 = start;
+struct fwd_conn {
+    int             conn_fd;            /*!< The fd of the connection. */
+    enum fwd_states conn_state;         /*!< The state of the connection. */
+    int             conn_trycount;      /*!< The count of trys of the current command. */
+    int             conn_pipelining;    /*!< Flag to tell that the server supports PIPELINING. */
+    int             conn_batch;         /*!< Flag to tell that the commands of the transaction were sent as one batch. */
+    int             conn_skip;          /*!< The count of replies to skip in the SKIP state. */
+    int             conn_rcpt;          /*!< The recipient of the mail the RCPT TO reply is waited for. */
+    fwd_mail_t *    conn_mail;          /*!< The mail which is sent or NULL. */
+    char            conn_addr[INET_ADDRSTRLEN]; /*!< The address of the mail server. */
+    fwd_conn_t *    conn_next;          /*!< The next connection of the worker. */
+};
 
-    while (NULL != tmp1){
-        tmp2 = tmp1;
-        tmp1 = tmp1->line_next;
-        if(NULL != tmp2->line_data && tmp2->line_len != 0){
-            free(tmp2->line_data);
-        }
-        free(tmp2);
-    }
-}
+__thread pool_t *     fwd_pool      = NULL; //! The forward mails of the worker.
+__thread pool_t *     fwd_conn_pool = NULL; //! The forward connections of the worker.
+__thread fwd_conn_t * fwd_conns     = NULL; //! The forward connections of the worker.
+__thread fwd_mail_t * fwd_waiting   = NULL; //! The mails waiting for a connection, oldest first.
+__thread fwd_mail_t * fwd_pending   = NULL; //! The mails queued but not sent yet, see fwd_send_queued().
+__thread int          fwd_active    = 0;    //! The count of mails the worker sends.
+__thread unsigned int fwd_seed;             //! The seed of the jitter of the retry delays.
+__thread wheel_timer_t fwd_queue_timer;     //! The timer to look into the queue.
+__thread int          fwd_stopped   = 0;    //! Flag to tell that the worker stops.
 
+static void fwd_host_resolved(int status, const char * answer, void * data);
+static void fwd_end_mail(fwd_mail_t * fwd);
 
 //! Extracts the replycode from the string
 /*!
@@ -202,18 +226,17 @@ inline void fwd_delete_body_lines(body_line_t * start){
  * \return The reply code ort 0 (see above).
  */
 int extract_status(char* buff){
-    int ret = 0;
-    char *pos;
+    int i;
 
-    if((pos = strchr(buff, ' ')) != NULL){
-        if ( 3 > (pos - buff))
+    for (i = 0; i < 3; i++) {
+        if (!isdigit((unsigned char)buff[i])) {
             return 0;
-        *pos = '\0';
-        ret = atoi(buff);
-        *pos = ' ';
+        }
     }
-
-    return ret;
+    if ('-' == buff[3]) {
+        return 0;
+    }
+    return atoi(buff);
 }
 
 //! Write a command
@@ -226,25 +249,10 @@ int extract_status(char* buff){
  * \return FWD_OK on success, FWD_FAIL else.
  */
 static inline int fwd_write_command(int remote_fd, const char *command, const char * data){
-    size_t  len1 = strlen(command);
-    size_t  len2 = strlen(data);
-    size_t  len  = len1 + len2;
-    char *  buf  = malloc(sizeof(char) * len + 3);
-
-    memcpy(buf,      command, len1);
-    memcpy(buf+len1, data,    len2);
-
-    buf[len]   = '\r';
-    buf[len+1] = '\n';
-    buf[len+2] = '\0';
-
-    if ( conn_writeback(remote_fd, buf, len + 2) <= 0){
+    if ( CONN_FAIL == conn_printf(remote_fd, "%s%s\r\n", command, data)){
         ERROR_SYS("Writing on Remote Socket");
-        free(buf);
         return FWD_FAIL;
     }
-   
-    free(buf);
     return FWD_OK;
 }
 
@@ -277,87 +285,95 @@ static inline int check_cmd_reply(char * buf, int expected) {
    return R_RETRY;
 }
 
-//! Write the body to th server
+//! Frees all reources assigned to a forwarded mail
 /*!
- * This writes the whole list of given body lines to the server. The lines are
- * sended in wingle \p write()s, each terminated with \p \<cr>\<lf>. At the and a
- * \p '.\<cr>\<lf>' will be sended to indicate the end of the message.
- * \param remote_fd The \p fd to write thr body.
- * \param body      The head element of the body line list.
- * \return \p FWD_OK on success, \p FWD_FAIL else.
+ * Every heap data of the forward mail is freed here, the row in the queue
+ * is left as it is. If the worker sent FWD_QUEUE_ACTIVE mails before, it
+ * looks into the queue for the next one.
+ * \param fwd The structure of the forward mail.
  */
-static inline int fwd_write_body(int remote_fd, body_line_t * body) {
-    body_line_t * elem = body;
-
-    INFO_MSG("write body to client");
-
-    while (NULL != elem) {
-        
-        if (NULL == elem->line_data || 0 == elem->line_len){
-            continue;
+static void fwd_free_mail(fwd_mail_t * fwd) {
+    if (NULL != fwd){
+        if (NULL != fwd->fwd_rcpts)
+            free(fwd->fwd_rcpts);
+        if (NULL != fwd->fwd_from)
+            free(fwd->fwd_from);
+        if (NULL != fwd->fwd_body)
+            spool_free(fwd->fwd_body);
+        pool_release(fwd_pool, fwd);
+        if (FWD_QUEUE_ACTIVE == fwd_active-- && !fwd_stopped) {
+            wheel_arm(&fwd_queue_timer, 0);
         }
+    }
+    INFO_MSG("Forward data cleaned");
+}
 
-        if ( conn_writeback(remote_fd, elem->line_data, elem->line_len ) <= 0){
+//! Writes the next part of the body to the server
+/*!
+ * This is the drain handler of the connection to the server while the body
+ * is sent. Each time the queued output is written, the next FWD_BODY_PIECE
+ * bytes are read from the spool and queued, so a body in a spool file is
+ * never in memory as a whole. After the last part \p .\<cr>\<lf> is queued to
+ * indicate the end of the message. If the body does not end with a line
+ * break, one is added before.
+ * \param conn The structure of the forward connection.
+ * \return CONN_CONT on success, CONN_QUIT else.
+ */
+static int fwd_write_body_part(void * data) {
+    fwd_conn_t * conn = data;
+    fwd_mail_t * fwd  = conn->conn_mail;
+    char         buf[FWD_BODY_PIECE];
+    const char * end = "\r\n.\r\n";
+    ssize_t      len;
+
+    if (fwd->fwd_body_sent < spool_len(fwd->fwd_body)) {
+        if (0 >= (len = spool_read(fwd->fwd_body, fwd->fwd_body_sent, buf, sizeof(buf)))) {
+            ERROR_SYS("Reading the mail body");
+            return CONN_QUIT;
+        }
+        if ( CONN_FAIL == conn_enqueue(conn->conn_fd, buf, len)){
             ERROR_SYS("Writing on Remote Socket");
-            return FWD_FAIL;
+            return CONN_QUIT;
         }
-        
-        elem = elem->line_next;
+        fwd->fwd_body_sent += len;
+        return CONN_CONT;
     }
 
+    if (2 <= fwd->fwd_body_sent
+            && 2 == spool_read(fwd->fwd_body, fwd->fwd_body_sent - 2, buf, 2)
+            && 0 == memcmp(buf, "\r\n", 2)) {
+        end += 2;
+    }
+    conn_set_drain(conn->conn_fd, NULL);
     INFO_MSG("Body sent!");
-    if ( conn_writeback(remote_fd, "\r\n.\r\n", 5) <= 0){
+    if ( CONN_FAIL == conn_enqueue(conn->conn_fd, end, strlen(end))){
         ERROR_SYS("Writing on Remote Socket");
-        return FWD_FAIL;
+        return CONN_QUIT;
     }
-
-    return FWD_OK;
+    return CONN_CONT;
 }
 
-//! Prepend a body line element
+//! Writes the body to the server
 /*!
- * This prepends a body line element on at the mail body head element of the
- * given forward mail.
- * \param msg The content for the element to prepend.
- * \param len The length of the message without null terminator.
- * \param fwd The structure of the forward mail.
- */
-static inline void fwd_prepend_body_msg(char * msg, int len, fwd_mail_t * fwd) {
-    body_line_t * new_head   = malloc(sizeof(fwd_mail_t));
-    new_head->line_len       = len;
-    new_head->line_data      = malloc(sizeof(char) * len+1);
-    new_head->line_next      = fwd->fwd_body;
-    fwd->fwd_body            = new_head;
-    new_head->line_data[len] = '\0';
-    memcpy(new_head->line_data, msg, len);
-}
-
-//! Builds a new body line element and prepend
-/*! 
- * This builds a new body line element of two char sequences. The sequences
- * will simple be concartenated. The new element will be prepended bevore the
- * head element of the given forward structure.
- * \param msg1 The first line part (null terminated).
- * \param msg2 The second line part (null terminated).
- * \param fwd  The structure of the forward mail.
- * \sa fwd_prepend_body_msg()
+ * This starts sending the body. The first part is queued at once, the others
+ * follow from fwd_write_body_part() whenever the output is written.
+ * \param conn The structure of the forward connection.
+ * \return \p FWD_OK on success, \p FWD_FAIL else.
  */
-static inline void fwd_build_and_prepend_body_msg(const char * msg1, const char * msg2, fwd_mail_t * fwd){
-    static char buff[1024];
-    int  len1, len2;
+static inline int fwd_write_body(fwd_conn_t * conn) {
+    INFO_MSG("write body to client");
 
-    len1 = strlen(msg1);
-    len2 = strlen(msg2);
-    memcpy(buff,        msg1, len1);
-    memcpy(buff + len1, msg2, len2);
-    fwd_prepend_body_msg(buff, len1 + len2, fwd);
+    conn->conn_mail->fwd_body_sent = 0;
+    conn_set_drain(conn->conn_fd, fwd_write_body_part);
+    return (CONN_QUIT == fwd_write_body_part(conn) ? FWD_FAIL : FWD_OK);
 }
 
 //! Build and send a error message 
 /*!
  * This will be invoked if a forward has failed to send a error report back to
  * the initial sender. It builds the error mail existing of the error message
- * from the relay host and the original mail data.
+ * from the relay host and the original mail data, which is copied behind
+ * the report into a new body (piece by piece, it may be in a spool file).
  * The error mail will then be forwarded to the sender.
  * \param fwd     The failed forward message.
  * \param msg     The error message from the server.
@@ -366,7 +382,13 @@ static inline void fwd_build_and_prepend_body_msg(const char * msg1, const char
 static inline void fwd_return_failture(fwd_mail_t * fwd, char * msg, int msglen) {
     const char * myhost = "localhost";
     int len1, len2;
-    char * mailaddr;
+    char *    mailaddr;
+    char *    head;
+    char      buf[FWD_BODY_PIECE];
+    int       head_len;
+    size_t    offset = 0;
+    ssize_t   len;
+    spool_t * body;
 
     if (NULL != config_get_hostname()) {
         myhost = config_get_hostname();
@@ -382,182 +404,1260 @@ static inline void fwd_return_failture(fwd_mail_t * fwd, char * msg, int msglen)
     mailaddr[len2 + 1 + len1] = '\0';
 
 
-    fwd_prepend_body_msg(FWD_ERROR_REPLY2, strlen(FWD_ERROR_REPLY2), fwd);
-    fwd_prepend_body_msg(msg, msglen, fwd);
-    fwd_prepend_body_msg(FWD_ERROR_REPLY1, strlen(FWD_ERROR_REPLY1), fwd);
-    fwd_prepend_body_msg(FWD_ERROR_HEAD_SUBJ, strlen(FWD_ERROR_HEAD_SUBJ), fwd);
+    /* the reply of the server ends with a line break already */
+    while (0 < msglen && ('\r' == msg[msglen - 1] || '\n' == msg[msglen - 1])) {
+        msglen--;
+    }
 
-    fwd_build_and_prepend_body_msg(FWD_ERROR_HEAD_TO,   fwd->fwd_from, fwd);
-    fwd_build_and_prepend_body_msg(FWD_ERROR_HEAD_FROM, myhost,        fwd);
+    head_len = snprintf(NULL, 0, FWD_ERROR_HEAD, myhost, fwd->fwd_from, msglen, msg);
+    head = malloc(sizeof(char) * (head_len + 1));
+    snprintf(head, head_len + 1, FWD_ERROR_HEAD, myhost, fwd->fwd_from, msglen, msg);
 
-    fwd_queue(fwd->fwd_body, mailaddr, fwd->fwd_from, 0);
+    if (NULL == (body = spool_new()) || SPOOL_OK != spool_append(body, head, head_len)) {
+        ERROR_CUSTM("Cannot build the error mail");
+        spool_free(body);
+        body = NULL;
+    }
+    while (NULL != body && offset < spool_len(fwd->fwd_body)) {
+        if (0 >= (len = spool_read(fwd->fwd_body, offset, buf, sizeof(buf)))
+                || SPOOL_OK != spool_append(body, buf, len)) {
+            ERROR_CUSTM("Cannot build the error mail");
+            spool_free(body);
+            body = NULL;
+            break;
+        }
+        offset += len;
+    }
+    free(head);
+
+    if (NULL != body && FWD_OK == fwd_queue(body, mailaddr, &(fwd->fwd_from), 1, 0)) {
+        fwd_send_queued();
+    }
     free(mailaddr);
 }
 
-//! Queue a message to forward
-/*! 
- * This is the start point for a forward message. In this function the
- * structure will be builded and the connection to the relayhost created.
- * The given data will all be copied, so it can be freed outside.
- * \param body     The body line list of the mail.
+//! Note a temporary failture of a mail
+/*!
+ * The reason is kept until the mail is put back into the queue, the sender
+ * gets it if the mail expires there.
+ * \param fwd    The structure of the forward mail.
+ * \param prefix A text to put in front of the message.
+ * \param msg    The message, a reply of the server may end with a line break.
+ * \param msglen The length of the message without null terminator.
+ */
+static void fwd_set_reason(fwd_mail_t * fwd, const char * prefix, const char * msg, int msglen){
+    while (0 < msglen && ('\r' == msg[msglen - 1] || '\n' == msg[msglen - 1])) {
+        msglen--;
+    }
+    snprintf(fwd->fwd_reason, sizeof(fwd->fwd_reason), "%s%.*s", prefix, msglen, msg);
+}
+
+//! Report a mail which cannot be sent
+/*!
+ * The sender gets an error report if the mail is failable, all recipients
+ * which are not done yet are done with it.
+ * \param fwd    The structure of the forward mail.
+ * \param msg    The reason of the failture.
+ * \param msglen The length of the reason without null terminator.
+ */
+static void fwd_bounce(fwd_mail_t * fwd, char * msg, int msglen){
+    int i;
+
+    if (fwd->fwd_failable) {
+        fwd_return_failture(fwd, msg, msglen);
+    }
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        fwd->fwd_rcpts[i].rcpt_state = RCPT_DONE;
+    }
+}
+
+//! Set the reply timeout
+/*!
+ * This sets the timeout of the forward connection for the reply expected in
+ * the current state of the connection.
+ * \param conn The structure of the forward connection.
+ */
+static inline void fwd_set_timeout(fwd_conn_t * conn) {
+    int msecs = FWD_TIMEOUT_COMMAND;
+
+    switch (conn->conn_state) {
+        case DATA:
+            msecs = FWD_TIMEOUT_DATA;
+            break;
+        case SEND:
+            msecs = FWD_TIMEOUT_SEND;
+            break;
+        case IDLE:
+            msecs = FWD_TIMEOUT_IDLE;
+            break;
+        case QUIT:
+            msecs = FWD_TIMEOUT_QUIT;
+            break;
+        default:
+            break;
+    }
+    conn_set_timeout(conn->conn_fd, msecs);
+}
+
+//! Send a mail again
+/*!
+ * This passes a mail which was not started on its connection to
+ * fwd_dispatch() again. The address is given to the DNS module, which passes
+ * it back from the main loop, so this can be called while a connection is
+ * closed. The mail is put back into the queue if that fails.
+ * \param fwd The structure of the forward mail.
+ */
+static void fwd_redispatch(fwd_mail_t * fwd) {
+    if (DNS_FAIL == dns_query(fwd->fwd_addr, DNS_A, fwd_host_resolved, fwd)) {
+        fwd_set_reason(fwd, FWD_ERROR_CONNECT, fwd->fwd_addr, strlen(fwd->fwd_addr));
+        fwd_end_mail(fwd);
+    }
+}
+
+//! Find the next recipient of a transaction
+/*!
+ * \param fwd   The structure of the forward mail.
+ * \param first The index to start the search at.
+ * \return The index of the next recipient to be sent with the transaction or
+ *         fwd_rcpt_count if there is none.
+ */
+static inline int fwd_next_rcpt(fwd_mail_t * fwd, int first) {
+    while (first < fwd->fwd_rcpt_count && RCPT_WAIT != fwd->fwd_rcpts[first].rcpt_state) {
+        first++;
+    }
+    return first;
+}
+
+//! Count the recipients in a state
+/*!
+ * \param fwd   The structure of the forward mail.
+ * \param state The state of the recipients.
+ * \return The count of recipients of the mail in the state.
+ */
+static int fwd_count_rcpts(fwd_mail_t * fwd, int state) {
+    int i;
+    int count = 0;
+
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        if (state == fwd->fwd_rcpts[i].rcpt_state) {
+            count++;
+        }
+    }
+    return count;
+}
+
+//! Set the state of the recipients
+/*!
+ * This sets all recipients of a mail which are not done yet to a new state.
+ * \param fwd   The structure of the forward mail.
+ * \param state The new state.
+ */
+static void fwd_set_rcpts(fwd_mail_t * fwd, int state) {
+    int i;
+
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        if (RCPT_DONE != fwd->fwd_rcpts[i].rcpt_state) {
+            fwd->fwd_rcpts[i].rcpt_state = state;
+        }
+    }
+}
+
+//! Join the recipients which are not done
+/*!
+ * \param fwd The structure of the forward mail.
+ * \return The adresses separated by line feeds in new allocated memory or
+ *         NULL on failture.
+ */
+static char * fwd_rcpt_list(fwd_mail_t * fwd) {
+    char * list;
+    char * pos;
+    size_t len = 1;
+    int    i;
+
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        if (RCPT_DONE != fwd->fwd_rcpts[i].rcpt_state) {
+            len += strlen(fwd->fwd_rcpts[i].rcpt_to) + 1;
+        }
+    }
+    if (NULL == (list = malloc(len))) {
+        return NULL;
+    }
+    pos = list;
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        if (RCPT_DONE != fwd->fwd_rcpts[i].rcpt_state) {
+            if (pos != list) {
+                *(pos++) = '\n';
+            }
+            len = strlen(fwd->fwd_rcpts[i].rcpt_to);
+            memcpy(pos, fwd->fwd_rcpts[i].rcpt_to, len);
+            pos += len;
+        }
+    }
+    *pos = '\0';
+    return list;
+}
+
+//! The delay before a mail is tried again
+/*!
+ * The delay is doubled with each retry from FWD_RETRY_MIN up to
+ * FWD_RETRY_MAX. A random part of up to the half of it is taken off, so
+ * mails which failed together are not tried again all at once.
+ * \param retries The count of times the mail was put back before.
+ * \return The delay in seconds.
+ */
+static time_t fwd_retry_delay(int retries) {
+    time_t delay = FWD_RETRY_MIN;
+
+    while (0 < retries-- && FWD_RETRY_MAX > delay) {
+        delay *= 2;
+    }
+    if (FWD_RETRY_MAX < delay) {
+        delay = FWD_RETRY_MAX;
+    }
+    return delay - rand_r(&fwd_seed) % (delay / 2 + 1);
+}
+
+//! End a mail on this worker
+/*!
+ * This is called when the worker is done with a mail. If it was sent to all
+ * recipients (or the sender got an error report), it is removed from the
+ * queue. Else it is put back for the recipients left, to be tried again
+ * after fwd_retry_delay(). A mail which would be tried after
+ * FWD_QUEUE_MAX_AGE is given up, the sender gets an error report with the
+ * last failture if the mail is failable. The mail is freed. If the worker
+ * stops, the mail is left active in the queue, so it is sent again at the
+ * next start.
+ * \param fwd The structure of the forward mail.
+ */
+static void fwd_end_mail(fwd_mail_t * fwd) {
+    char   buff[FWD_REASON_LEN + 64];
+    char * rcpts;
+    time_t next = time(NULL) + fwd_retry_delay(fwd->fwd_retries);
+    int    len;
+    int    ret;
+
+    if (fwd_stopped) {
+        fwd_free_mail(fwd);
+        return;
+    }
+
+    if (fwd->fwd_rcpt_count > fwd_count_rcpts(fwd, RCPT_DONE) && fwd->fwd_created + FWD_QUEUE_MAX_AGE < next) {
+        INFO_MSG2("Giving up a mail after %d tries", fwd->fwd_retries + 1);
+        len = snprintf(buff, sizeof(buff), "%s%s", FWD_ERROR_EXPIRED, fwd->fwd_reason);
+        if (len >= (int)sizeof(buff)) {
+            len = sizeof(buff) - 1;
+        }
+        fwd_bounce(fwd, buff, len);
+    }
+
+    if (fwd->fwd_rcpt_count == fwd_count_rcpts(fwd, RCPT_DONE)) {
+        ret = mbox_queue_done(fwd->fwd_id);
+    } else if (NULL == (rcpts = fwd_rcpt_list(fwd))) {
+        ret = MAILBOX_ERROR;
+    } else {
+        INFO_MSG2("Mail deferred: %s", fwd->fwd_reason);
+        ret = mbox_queue_delay(fwd->fwd_id, rcpts, next, fwd->fwd_retries + 1);
+        free(rcpts);
+    }
+    if (MAILBOX_OK != ret) {
+        ERROR_CUSTM2("Cannot update the queue: %s", mbox_get_error_msg());
+    }
+    fwd_free_mail(fwd);
+}
+
+//! Write the command of a state
+/*!
+ * This writes the command which is answered in the given state. RCPT TO is
+ * written for the recipient conn_rcpt.
+ * \param conn  The structure of the forward connection.
+ * \param state The state (EHLO, HELO, RSET, MAIL, RCPT or DATA).
+ * \return FWD_OK on success, FWD_FAIL else.
+ */
+static int fwd_send_command(fwd_conn_t * conn, int state) {
+    const char * myhost = "localhost";
+
+    if (NULL != config_get_hostname()) {
+        myhost = config_get_hostname();
+    }
+    switch (state) {
+        case EHLO:
+            return fwd_write_command(conn->conn_fd, "EHLO ", myhost);
+        case HELO:
+            return fwd_write_command(conn->conn_fd, "HELO ", myhost);
+        case RSET:
+            return fwd_write_command(conn->conn_fd, "RSET", "");
+        case MAIL:
+            return fwd_write_command(conn->conn_fd, "MAIL FROM:", conn->conn_mail->fwd_from);
+        case RCPT:
+            return fwd_write_command(conn->conn_fd, "RCPT TO:", conn->conn_mail->fwd_rcpts[conn->conn_rcpt].rcpt_to);
+        case DATA:
+            return fwd_write_command(conn->conn_fd, "DATA", "");
+        default:
+            return FWD_FAIL;
+    }
+}
+
+//! Start the transaction of a mail
+/*!
+ * This sends the commands of the mail of the connection, starting with
+ * \p first: MAIL after the greeting or RSET if the connection was used
+ * before. One RCPT TO is sent for each recipient which is waiting. If the
+ * server supports PIPELINING, all commands up to DATA are sent at once and
+ * the replies are checked in order (RFC 2920). Else only the first one is
+ * sent, the others follow the replies.
+ * \param conn  The structure of the forward connection.
+ * \param first The state of the first command (RSET or MAIL).
+ * \return FWD_OK on success, FWD_FAIL else.
+ */
+static int fwd_start_transaction(fwd_conn_t * conn, int first) {
+    fwd_mail_t * fwd = conn->conn_mail;
+    int          state;
+
+    if (RSET == first) {
+        INFO_MSG2("Reusing forward connection to %s", conn->conn_addr);
+    }
+    conn->conn_state    = first;
+    conn->conn_trycount = 1;
+    conn->conn_batch    = conn->conn_pipelining;
+    if (!conn->conn_batch) {
+        conn->conn_rcpt = fwd_next_rcpt(fwd, 0);
+        return fwd_send_command(conn, first);
+    }
+    for (state = first; DATA >= state; state++) {
+        for (conn->conn_rcpt = fwd_next_rcpt(fwd, 0); RCPT == state && fwd->fwd_rcpt_count > conn->conn_rcpt;
+                conn->conn_rcpt = fwd_next_rcpt(fwd, conn->conn_rcpt + 1)) {
+            if (FWD_FAIL == fwd_send_command(conn, RCPT)) {
+                return FWD_FAIL;
+            }
+        }
+        if (RCPT != state && FWD_FAIL == fwd_send_command(conn, state)) {
+            return FWD_FAIL;
+        }
+    }
+    conn->conn_rcpt = fwd_next_rcpt(fwd, 0);
+    return FWD_OK;
+}
+
+//! Count the outstanding replies of a batch
+/*!
+ * \param conn The structure of the forward connection.
+ * \return The count of replies to commands of the batch which were sent
+ *         after the command of the current state.
+ */
+static int fwd_outstanding(fwd_conn_t * conn) {
+    fwd_mail_t * fwd   = conn->conn_mail;
+    int          count = 1;
+    int          i;
+
+    if (!conn->conn_batch || DATA <= conn->conn_state) {
+        return 0;
+    }
+    for (i = fwd_next_rcpt(fwd, conn->conn_rcpt + (RCPT == conn->conn_state)); fwd->fwd_rcpt_count > i; i = fwd_next_rcpt(fwd, i + 1)) {
+        count++;
+    }
+    return count;
+}
+
+//! Go on after a mail
+/*!
+ * This is called when the current command of a mail is done. If replies of
+ * a batch are still outstanding, the connection skips them first. Then a
+ * mail which is to be tried again is started again, else the oldest mail
+ * waiting for the same address. If there is none, the connection gets idle.
+ * \param conn        The structure of the forward connection.
+ * \param outstanding The count of replies to skip.
+ * \return FWD_OK on success, FWD_FAIL if the connection cannot be used any
+ *         more.
+ */
+static int fwd_next_mail(fwd_conn_t * conn, int outstanding) {
+    fwd_mail_t ** link;
+    fwd_mail_t *  fwd;
+
+    if (0 < outstanding) {
+        conn->conn_skip  = outstanding;
+        conn->conn_state = SKIP;
+        return FWD_OK;
+    }
+    for (link = &fwd_waiting; NULL == conn->conn_mail && NULL != (fwd = *link); link = &(fwd->fwd_next)) {
+        if (0 == strcmp(fwd->fwd_addr, conn->conn_addr)) {
+            *link           = fwd->fwd_next;
+            fwd->fwd_next   = NULL;
+            conn->conn_mail = fwd;
+        }
+    }
+    if (NULL == conn->conn_mail) {
+        conn->conn_state = IDLE;
+        return FWD_OK;
+    }
+    return fwd_start_transaction(conn, RSET);
+}
+
+//! Finish the mail of a connection
+/*!
+ * This ends the mail of a connection which is done with it (see
+ * fwd_end_mail()) and goes on with fwd_next_mail().
+ * \param conn        The structure of the forward connection.
+ * \param outstanding The count of replies to skip.
+ * \return FWD_OK on success, FWD_FAIL if the connection cannot be used any
+ *         more.
+ */
+static int fwd_finish_mail(fwd_conn_t * conn, int outstanding) {
+    fwd_end_mail(conn->conn_mail);
+    conn->conn_mail = NULL;
+    return fwd_next_mail(conn, outstanding);
+}
+
+//! End the transaction of a mail
+/*!
+ * This is called when the transaction is over for all recipients sent with
+ * it, the recipients accepted by the server got the mail. Recipients which
+ * were refused temporary are sent again with a new transaction, up to
+ * SEND_MAXTRY transactions. Else the mail is done, recipients still refused
+ * stay in the queue.
+ * \param conn        The structure of the forward connection.
+ * \param outstanding The count of replies to skip.
+ * \return FWD_OK on success, FWD_FAIL if the connection cannot be used any
+ *         more.
+ */
+static int fwd_end_transaction(fwd_conn_t * conn, int outstanding) {
+    fwd_mail_t * fwd = conn->conn_mail;
+    int          i;
+
+    for (i = 0; i < fwd->fwd_rcpt_count; i++) {
+        if (RCPT_OK == fwd->fwd_rcpts[i].rcpt_state) {
+            fwd->fwd_rcpts[i].rcpt_state = RCPT_DONE;
+        }
+    }
+    if (0 < fwd_count_rcpts(fwd, RCPT_RETRY) && SEND_MAXTRY > ++fwd->fwd_attempts) {
+        INFO_MSG("Sending the mail again");
+        fwd_set_rcpts(fwd, RCPT_WAIT);
+        return fwd_next_mail(conn, outstanding);
+    }
+    return fwd_finish_mail(conn, outstanding);
+}
+
+//! Handle a refused recipient
+/*!
+ * A recipient which was refused temporary (4xx) is sent again with the next
+ * transaction (see fwd_end_transaction()). On a permanent failture the
+ * sender gets an error report for the recipient if the mail is failable.
+ * The other recipients of the mail are not affected.
+ * \param conn   The structure of the forward connection.
+ * \param status The result of check_cmd_reply() (R_RETRY or R_FAIL).
+ * \param msg    The reply of the server.
+ * \param msglen The length of the reply without null terminator.
+ */
+static void fwd_refused_rcpt(fwd_conn_t * conn, int status, char * msg, ssize_t msglen) {
+    fwd_mail_t * fwd  = conn->conn_mail;
+    fwd_rcpt_t * rcpt = &(fwd->fwd_rcpts[conn->conn_rcpt]);
+    char         buff[1024];
+    int          len;
+
+    len = snprintf(buff, sizeof(buff), "%s: %.*s", rcpt->rcpt_to, (int)msglen, msg);
+    if (len >= (int)sizeof(buff)) {
+        len = sizeof(buff) - 1;
+    }
+    if (R_RETRY == status) {
+        rcpt->rcpt_state = RCPT_RETRY;
+        fwd_set_reason(fwd, "", buff, len);
+        return;
+    }
+    rcpt->rcpt_state = RCPT_DONE;
+    if (fwd->fwd_failable) {
+        fwd_return_failture(fwd, buff, len);
+    }
+}
+
+//! Handle a refused command of a mail
+/*!
+ * This is used if the server refuses MAIL FROM, DATA or the body, so the
+ * mail cannot be sent to any recipient with this transaction.
+ * A temporary failture (4xx) is tried again up to SEND_MAXTRY times: a single
+ * command is sent again, after a batch or the body the whole mail is sent
+ * again after a RSET. After that the mail stays in the queue. On a permanent
+ * failture the sender gets an error report if the mail is failable. The
+ * connection is kept in any case.
+ * \param conn   The structure of the forward connection.
+ * \param status The result of check_cmd_reply() (R_RETRY or R_FAIL).
+ * \param msg    The reply of the server.
+ * \param msglen The length of the reply without null terminator.
+ * \return FWD_OK on success, FWD_FAIL if the connection cannot be used any
+ *         more.
+ */
+static int fwd_refused(fwd_conn_t * conn, int status, char * msg, ssize_t msglen) {
+    fwd_mail_t * fwd         = conn->conn_mail;
+    int          outstanding = fwd_outstanding(conn);
+
+    if (R_RETRY == status) {
+        if (!conn->conn_batch && SEND != conn->conn_state) {
+            if (SEND_MAXTRY > conn->conn_trycount) {
+                conn->conn_trycount++;
+                return fwd_send_command(conn, conn->conn_state);
+            }
+        } else if (SEND_MAXTRY > ++fwd->fwd_attempts) {
+            INFO_MSG("Sending the mail again");
+            fwd_set_rcpts(fwd, RCPT_WAIT);
+            return fwd_next_mail(conn, outstanding);
+        }
+        fwd_set_reason(fwd, "", msg, msglen);
+    } else {
+        fwd_bounce(fwd, msg, msglen);
+    }
+    return fwd_finish_mail(conn, outstanding);
+}
+
+//! Send a mail to its mail server
+/*!
+ * The mail is sent on an idle connection to its address if there is one.
+ * Else a new connection is created, as long as the worker has less than
+ * FWD_CONN_MAX connections to the address. If it has, the mail waits for the
+ * next connection which gets done. The mail is put back into the queue if
+ * the connect fails.
+ * \param fwd The structure of the forward mail, with the address set.
+ */
+static void fwd_dispatch(fwd_mail_t * fwd) {
+    fwd_conn_t *  conn;
+    fwd_mail_t ** link;
+    int           count = 0;
+
+    for (conn = fwd_conns; NULL != conn; conn = conn->conn_next) {
+        if (0 != strcmp(conn->conn_addr, fwd->fwd_addr)) {
+            continue;
+        }
+        if (IDLE == conn->conn_state) {
+            conn->conn_mail = fwd;
+            if (FWD_OK == fwd_start_transaction(conn, RSET)) {
+                fwd_set_timeout(conn);
+                return;
+            }
+            /* the idle timeout closes it */
+            conn->conn_mail  = NULL;
+            conn->conn_state = QUIT;
+        }
+        count++;
+    }
+
+    if (FWD_CONN_MAX <= count) {
+        INFO_MSG2("Mail waits for a connection to %s", fwd->fwd_addr);
+        for (link = &fwd_waiting; NULL != *link; link = &((*link)->fwd_next));
+        *link = fwd;
+        return;
+    }
+
+    if (NULL == (conn = pool_alloc(fwd_conn_pool))) {
+        ERROR_CUSTM("Cannot create forward connection");
+        fwd_set_reason(fwd, FWD_ERROR_CONNECT, fwd->fwd_addr, strlen(fwd->fwd_addr));
+        fwd_end_mail(fwd);
+        return;
+    }
+    memset(conn, '\0', sizeof(fwd_conn_t));
+    conn->conn_state = NEW;
+    conn->conn_mail  = fwd;
+    memcpy(conn->conn_addr, fwd->fwd_addr, sizeof(conn->conn_addr));
+
+    if (CONN_FAIL == (conn->conn_fd = conn_new_fwd_socket(conn->conn_addr, conn))) {
+        ERROR_SYS("Connecting forward host");
+        fwd_set_reason(fwd, FWD_ERROR_CONNECT, fwd->fwd_addr, strlen(fwd->fwd_addr));
+        fwd_end_mail(fwd);
+        pool_release(fwd_conn_pool, conn);
+        return;
+    }
+    conn->conn_next = fwd_conns;
+    fwd_conns       = conn;
+    fwd_set_timeout(conn);
+}
+
+//! Fail the lookup of the target host
+/*!
+ * If the host does not exist, the sender gets an error report if the mail
+ * is failable. Else the lookup failed temporary and the mail is put back
+ * into the queue.
+ * \param fwd    The structure of the forward mail.
+ * \param status The result of the failed query.
+ */
+static void fwd_lookup_failed(fwd_mail_t * fwd, int status) {
+    const char * host = config_get_relayhost();
+    const char * reason = (DNS_NOTFOUND == status ? "Host not found" : "Host lookup failed");
+
+    if (NULL == host) {
+        host = fwd->fwd_domain;
+    }
+    ERROR_CUSTM2("cannot resolve host: %s", host);
+    fwd_set_reason(fwd, FWD_ERROR_CONNECT, reason, strlen(reason));
+    if (DNS_NOTFOUND == status) {
+        fwd_bounce(fwd, fwd->fwd_reason, strlen(fwd->fwd_reason));
+    }
+    fwd_end_mail(fwd);
+}
+
+//! Connect to the target host
+/*!
+ * This is the callback of the A query of the target host.
+ * \param status The result of the query.
+ * \param answer The address of the target host.
+ * \param data   The structure of the forward mail.
+ */
+static void fwd_host_resolved(int status, const char * answer, void * data) {
+    fwd_mail_t * fwd = data;
+
+    if (DNS_CANCELED == status) {
+        fwd_free_mail(fwd);
+        return;
+    }
+    if (DNS_FOUND != status) {
+        fwd_lookup_failed(fwd, status);
+        return;
+    }
+    snprintf(fwd->fwd_addr, sizeof(fwd->fwd_addr), "%s", answer);
+    fwd_dispatch(fwd);
+}
+
+//! Look up the address of the mail exchanger
+/*!
+ * This is the callback of the MX query of the recipients domain. A domain
+ * without a mail exchanger is used itself as mail host (RFC 5321, 5.1).
+ * \param status The result of the query.
+ * \param answer The mail exchanger of the domain.
+ * \param data   The structure of the forward mail.
+ */
+static void fwd_mx_resolved(int status, const char * answer, void * data) {
+    fwd_mail_t * fwd = data;
+
+    if (DNS_CANCELED == status) {
+        fwd_free_mail(fwd);
+        return;
+    }
+    if (DNS_ERROR == status) {
+        fwd_lookup_failed(fwd, status);
+        return;
+    }
+    if (DNS_FAIL == dns_query((DNS_FOUND == status ? answer : fwd->fwd_domain), DNS_A, fwd_host_resolved, fwd)) {
+        fwd_lookup_failed(fwd, DNS_ERROR);
+    }
+}
+
+//! Check if a recipient is in a domain
+/*!
+ * \param to     The adress of the recipient.
+ * \param domain The domain or NULL for any.
+ * \return 1 if the host part of the adress is the domain, 0 else.
+ */
+static inline int fwd_rcpt_in_domain(const char * to, const char * domain) {
+    return (NULL == domain || 0 == strcasecmp(strchr(to, '@') + 1, domain));
+}
+
+//! Build a forward mail to the recipients of a domain
+/*!
+ * This builds the structure of a forward mail to all given recipients in
+ * the domain. The recipients are copied into one allocation with their
+ * states.
+ * \param body     The body of the mail, the forward takes a reference.
  * \param from     The mail adress of the sender.
- * \param to       The adress of the recipient.
+ * \param to       The adresses of the recipients.
+ * \param count    The count of recipients.
+ * \param domain   The domain of the recipients to take or NULL for all.
  * \param failable A flag to tell the forwarder if a error mail should be sent
  *                 back if thr forward fails.
- * \return FWD_OK on success, FWD_FAIL else.
+ * \return The new forward mail or NULL on failture.
  */
-int fwd_queue(body_line_t * body, char * from, char * to, int failable){
-    int          new      = 0;
-    char *       host     = fwd_send_host(to);
-    fwd_mail_t * new_mail = malloc(sizeof(fwd_mail_t));
-    size_t len;
-
+static fwd_mail_t * fwd_new_mail(spool_t * body, char * from, char ** to, int count, const char * domain, int failable){
+    fwd_mail_t * new_mail;
+    fwd_rcpt_t * rcpt;
+    char *       pos;
+    size_t       len;
+    int          i;
+
+    if (NULL == (new_mail = pool_alloc(fwd_pool))) {
+        return NULL;
+    }
     memset(new_mail, '\0', sizeof(fwd_mail_t));
+    fwd_active++;
 
     INFO_MSG("Queue new forward message!");
 
-    if( -1 == (new = conn_new_fwd_socket(host, new_mail)) ) {
-	ERROR_SYS("Connecting forward host");
-        return FWD_FAIL;
-    }
-    
-    new_mail->fwd_writeback_fd = new;
-    new_mail->fwd_state        = NEW;
-    new_mail->fwd_trycount     = 0;
-    new_mail->fwd_body         = copy_body(body);
+    new_mail->fwd_body         = spool_ref(body);
     new_mail->fwd_failable     = failable;
+    new_mail->fwd_created      = time(NULL);
 
     len = strlen(from) +1;
     new_mail->fwd_from = malloc(sizeof(char) * len);
     memcpy(new_mail->fwd_from, from, len);
 
-    len = strlen(to) +1;
-    new_mail->fwd_to = malloc(sizeof(char) * len);
-    memcpy(new_mail->fwd_to, to, len);
+    len = 0;
+    for (i = 0; i < count; i++) {
+        if (fwd_rcpt_in_domain(to[i], domain)) {
+            len += sizeof(fwd_rcpt_t) + strlen(to[i]) + 1;
+            new_mail->fwd_rcpt_count++;
+        }
+    }
+    new_mail->fwd_rcpts = malloc(len);
+    rcpt = new_mail->fwd_rcpts;
+    pos  = (char *)(new_mail->fwd_rcpts + new_mail->fwd_rcpt_count);
+    for (i = 0; i < count; i++) {
+        if (fwd_rcpt_in_domain(to[i], domain)) {
+            len = strlen(to[i]) + 1;
+            memcpy(pos, to[i], len);
+            rcpt->rcpt_to    = pos;
+            rcpt->rcpt_state = RCPT_WAIT;
+            rcpt++;
+            pos += len;
+        }
+    }
+    new_mail->fwd_domain = strchr(new_mail->fwd_rcpts[0].rcpt_to, '@') + 1;
+    return new_mail;
+}
 
-    free(host);
+//! Start sending a mail
+/*!
+ * This starts the lookup of the target host: the relay host is used if one
+ * is given, else the mail exchanger of the domain. The mail is put back into
+ * the queue if the lookup cannot be started.
+ * \param fwd The structure of the forward mail.
+ */
+static void fwd_resolve(fwd_mail_t * fwd){
+    int query;
+
+    if (NULL != config_get_relayhost()) {
+        query = dns_query(config_get_relayhost(), DNS_A, fwd_host_resolved, fwd);
+    } else {
+        query = dns_query(fwd->fwd_domain, DNS_MX, fwd_mx_resolved, fwd);
+    }
+    if (DNS_FAIL == query) {
+        fwd_lookup_failed(fwd, DNS_ERROR);
+    }
+}
+
+//! Build the forward mails of a mail
+/*!
+ * This groups the recipients by their domain and builds one forward mail for
+ * each domain, or one for all if a relay host is given.
+ * \param body     The body of the mail, each forward takes a reference.
+ * \param from     The mail adress of the sender.
+ * \param to       The adresses of the recipients, each must contain a @.
+ * \param count    The count of recipients.
+ * \param failable A flag to tell the forwarder if a error mail should be sent
+ *                 back if thr forward fails.
+ * \param mails    The place to store the mails at, room for \p count ones.
+ *                 A mail which cannot be built is NULL.
+ * \return The count of mails.
+ */
+static int fwd_new_mails(spool_t * body, char * from, char ** to, int count, int failable, fwd_mail_t ** mails){
+    char * domain;
+    int    num = 0;
+    int    i;
+    int    j;
+
+    if (NULL != config_get_relayhost()) {
+        mails[num++] = fwd_new_mail(body, from, to, count, NULL, failable);
+        return num;
+    }
+    for (i = 0; i < count; i++) {
+        domain = strchr(to[i], '@') + 1;
+        /* skip a domain which was taken with a recipient before */
+        for (j = 0; j < i && !fwd_rcpt_in_domain(to[j], domain); j++);
+        if (j == i) {
+            mails[num++] = fwd_new_mail(body, from, to, count, domain, failable);
+        }
+    }
+    return num;
+}
+
+//! Queue a message to forward
+/*! 
+ * This is the start point for a forward message. The recipients are grouped
+ * by their domain, for each one forward mail is created which is sent with
+ * one transaction to all its recipients. If a relay host is given, all
+ * recipients are sent in one mail to it. The mails are stored in the queue
+ * before this returns, so they survive a restart. They are not sent before
+ * fwd_send_queued() is called, so the caller can commit the transaction
+ * started with mbox_begin() first (or drop them with fwd_drop_queued() if
+ * it is rolled back). Mails over the FWD_QUEUE_ACTIVE ones the worker sends
+ * are left in the queue for fwd_queue_run().
+ * The addresses will be copied, so they can be freed outside. The body is
+ * taken over without copying and shared by the forward mails, it is freed
+ * with the last one, also if queueing fails.
+ * \param body     The body of the mail.
+ * \param from     The mail adress of the sender.
+ * \param to       The adresses of the recipients.
+ * \param count    The count of recipients.
+ * \param failable A flag to tell the forwarder if a error mail should be sent
+ *                 back if thr forward fails.
+ * \return FWD_OK on success, FWD_FAIL if the mail cannot be queued.
+ */
+int fwd_queue(spool_t * body, char * from, char ** to, int count, int failable){
+    fwd_mail_t ** mails;
+    fwd_mail_t ** link;
+    char **       rcpts;
+    long long *   ids;
+    int           ret = FWD_OK;
+    int           num = 0;
+    int           active;
+    int           i;
+
+    for (i = 0; i < count; i++) {
+        if (NULL == strchr(to[i], '@')) {
+            spool_free(body);
+            return FWD_FAIL;
+        }
+    }
+
+    mails = malloc(sizeof(fwd_mail_t *) * count);
+    rcpts = malloc(sizeof(char *) * count);
+    ids   = malloc(sizeof(long long) * count);
+    if (NULL == mails || NULL == rcpts || NULL == ids) {
+        ret = FWD_FAIL;
+    } else {
+        num = fwd_new_mails(body, from, to, count, failable, mails);
+    }
+    for (i = 0; i < num; i++) {
+        rcpts[i] = NULL;
+        if (NULL == mails[i] || NULL == (rcpts[i] = fwd_rcpt_list(mails[i]))) {
+            ret = FWD_FAIL;
+        }
+    }
+
+    active = FWD_QUEUE_ACTIVE - fwd_active + num;
+    if (FWD_OK == ret && MAILBOX_OK != mbox_queue_push(from, rcpts, num, failable, active, body, ids)) {
+        ERROR_CUSTM2("Cannot queue the mail: %s", mbox_get_error_msg());
+        ret = FWD_FAIL;
+    }
+    for (link = &fwd_pending; NULL != *link; link = &((*link)->fwd_next));
+    for (i = 0; i < num; i++) {
+        if (FWD_OK == ret && i < active) {
+            mails[i]->fwd_id = ids[i];
+            *link = mails[i];
+            link  = &(mails[i]->fwd_next);
+        } else {
+            fwd_free_mail(mails[i]);
+        }
+        free(rcpts[i]);
+    }
+    if (FWD_OK == ret && active < num) {
+        INFO_MSG2("%d mail(s) wait in the queue", num - active);
+    }
+    free(mails);
+    free(rcpts);
+    free(ids);
+    spool_free(body);
+    return ret;
+}
+
+//! Send the queued mails
+/*!
+ * This starts sending the mails stored by fwd_queue() since the last call.
+ * The rows of the mails must be committed before.
+ */
+void fwd_send_queued(){
+    fwd_mail_t * fwd;
+
+    while (NULL != (fwd = fwd_pending)) {
+        fwd_pending   = fwd->fwd_next;
+        fwd->fwd_next = NULL;
+        fwd_resolve(fwd);
+    }
+}
+
+//! Drop the queued mails
+/*!
+ * This frees the mails stored by fwd_queue() since the last call without
+ * sending them, as their rows were rolled back.
+ */
+void fwd_drop_queued(){
+    fwd_mail_t * fwd;
+
+    while (NULL != (fwd = fwd_pending)) {
+        fwd_pending = fwd->fwd_next;
+        fwd_free_mail(fwd);
+    }
+}
+
+//! Load a mail from the queue
+/*!
+ * This builds the forward mail of a queued mail the worker claimed and
+ * starts sending it. If the recipients are in more domains than one and no
+ * relay host is given (the mail was queued while one was), the mail is split
+ * like fwd_queue() does it and the other parts are sent by the next look into
+ * the queue. If that is not possible, the mail is put back.
+ * \param id The id of the queued mail.
+ */
+static void fwd_load(long long id){
+    fwd_mail_t ** mails = NULL;
+    char **       rcpts = NULL;
+    spool_t *     body;
+    char *        from;
+    char *        list;
+    char **       to;
+    char *        pos;
+    time_t        created;
+    int           attempts;
+    int           failable;
+    int           count = 1;
+    int           num   = 0;
+    int           ok    = 0;
+    int           i;
+
+    if (MAILBOX_OK != mbox_queue_load(id, &from, &list, &failable, &created, &attempts, &body)) {
+        ERROR_CUSTM2("Cannot load a queued mail: %s", mbox_get_error_msg());
+        mbox_queue_unclaim(id, time(NULL) + FWD_RETRY_MIN);
+        return;
+    }
+    for (pos = strchr(list, '\n'); NULL != pos; pos = strchr(pos + 1, '\n')) {
+        count++;
+    }
+    to    = malloc(sizeof(char *) * count);
+    mails = malloc(sizeof(fwd_mail_t *) * count);
+    rcpts = malloc(sizeof(char *) * count);
+    if (NULL != to && NULL != mails && NULL != rcpts) {
+        to[0] = list;
+        for (i = 1, pos = strchr(list, '\n'); NULL != pos; pos = strchr(pos + 1, '\n')) {
+            *pos      = '\0';
+            to[i++] = pos + 1;
+        }
+        for (i = 0; i < count && NULL != strchr(to[i], '@'); i++);
+        if (i == count) {
+            num = fwd_new_mails(body, from, to, count, failable, mails);
+            ok  = 1;
+        }
+    }
+    for (i = 0; i < num; i++) {
+        rcpts[i] = NULL;
+        if (NULL == mails[i] || (1 < num && NULL == (rcpts[i] = fwd_rcpt_list(mails[i])))) {
+            ok = 0;
+        }
+    }
+    if (ok && 1 < num && MAILBOX_OK != mbox_queue_split(id, rcpts, num)) {
+        ERROR_CUSTM2("Cannot split a queued mail: %s", mbox_get_error_msg());
+        ok = 0;
+    }
+
+    if (ok) {
+        INFO_MSG2("Sending a queued mail again to %s", mails[0]->fwd_domain);
+        if (1 < num) {
+            INFO_MSG2("The queued mail was split into %d mails", num);
+        }
+        mails[0]->fwd_id      = id;
+        mails[0]->fwd_created = created;
+        mails[0]->fwd_retries = attempts;
+        fwd_resolve(mails[0]);
+    } else {
+        ERROR_CUSTM("Cannot load a queued mail");
+        mbox_queue_unclaim(id, time(NULL) + FWD_RETRY_MIN);
+    }
+    for (i = (ok ? 1 : 0); i < num; i++) {
+        fwd_free_mail(mails[i]);
+    }
+    for (i = 0; i < num; i++) {
+        free(rcpts[i]);
+    }
+    free(to);
+    free(mails);
+    free(rcpts);
+    free(from);
+    free(list);
+    spool_free(body);
+}
+
+//! Look into the queue
+/*!
+ * This is the handler of the queue timer of a worker. The worker claims the
+ * queued mails which are due, as many as it can send with less than
+ * FWD_QUEUE_ACTIVE mails at the same time, and sends them. Then the timer is
+ * set to the next time a mail is due, but at most FWD_QUEUE_POLL, as other
+ * workers put mails back too. If the worker sends FWD_QUEUE_ACTIVE mails, it
+ * looks again when one is done (see fwd_free_mail()).
+ * \param data Not used.
+ */
+static void fwd_queue_run(void * data){
+    long long ids[FWD_QUEUE_ACTIVE];
+    time_t    now   = time(NULL);
+    time_t    next;
+    int       msecs = FWD_QUEUE_POLL;
+    int       count;
+    int       i;
+
+    if (FWD_QUEUE_ACTIVE <= fwd_active) {
+        wheel_arm(&fwd_queue_timer, msecs);
+        return;
+    }
+    count = mbox_queue_claim(ids, FWD_QUEUE_ACTIVE - fwd_active, now);
+    if (MAILBOX_ERROR == count) {
+        ERROR_CUSTM2("Cannot read the queue: %s", mbox_get_error_msg());
+        count = 0;
+    }
+    for (i = 0; i < count; i++) {
+        fwd_load(ids[i]);
+    }
+    /* after the loads, as a split mail left its other parts due */
+    if (FWD_QUEUE_ACTIVE > fwd_active && 0 < (next = mbox_queue_next())) {
+        if (next <= now) {
+            msecs = 0;
+        } else if (next - now < FWD_QUEUE_POLL / 1000) {
+            msecs = (next - now) * 1000;
+        }
+    }
+    wheel_arm(&fwd_queue_timer, msecs);
+}
+
+//! Init the forward module of a worker
+/*!
+ * This creates the pools of forward mails and connections of the calling
+ * worker. The worker looks into the queue as soon as its main loop runs.
+ * \return FWD_OK on success, FWD_FAIL else.
+ */
+int fwd_init(){
+    if (NULL == (fwd_pool = pool_new("forward", sizeof(fwd_mail_t), FWD_POOL))) {
+        return FWD_FAIL;
+    }
+    if (NULL == (fwd_conn_pool = pool_new("forward conn", sizeof(fwd_conn_t), FWD_POOL))) {
+        pool_free(fwd_pool);
+        fwd_pool = NULL;
+        return FWD_FAIL;
+    }
+    fwd_seed = time(NULL) ^ (unsigned int)(size_t)&fwd_seed;
+    wheel_timer_init(&fwd_queue_timer, fwd_queue_run, NULL);
+    wheel_arm(&fwd_queue_timer, 0);
     return FWD_OK;
 }
 
+//! Stop the forward module of a worker
+/*!
+ * After this the mails of the worker are only freed, they stay active in the
+ * queue and are sent again after the next start (see mbox_init_queue()). It
+ * must be called before dns_close() and conn_close().
+ */
+void fwd_stop(){
+    fwd_stopped = 1;
+    wheel_cancel(&fwd_queue_timer);
+}
+
+//! Close the forward module of a worker
+/*!
+ * This frees the mails still waiting for a connection and the pools of the
+ * calling worker, it must be called after conn_close().
+ */
+void fwd_close(){
+    fwd_mail_t * fwd;
+
+    while (NULL != (fwd = fwd_waiting)) {
+        fwd_waiting = fwd->fwd_next;
+        fwd_free_mail(fwd);
+    }
+    wheel_cancel(&fwd_queue_timer);
+    pool_free(fwd_conn_pool);
+    pool_free(fwd_pool);
+    fwd_conn_pool = NULL;
+    fwd_pool      = NULL;
+}
+
+//! Quit a connection after a refused greeting
+/*!
+ * This is used if the server refuses the greeting, EHLO or HELO. On a
+ * permanent failture the sender gets an error report if the mail is
+ * failable, else the mail is put back into the queue when it is freed with
+ * the connection.
+ * \param conn   The structure of the forward connection.
+ * \param status The result of check_cmd_reply() (R_RETRY or R_FAIL).
+ * \param msg    The reply of the server.
+ * \param msglen The length of the reply without null terminator.
+ * \return CONN_QUIT in any case.
+ */
+static int fwd_quit_refused(fwd_conn_t * conn, int status, char * msg, ssize_t msglen) {
+    if (R_RETRY == status) {
+        fwd_set_reason(conn->conn_mail, "", msg, msglen);
+    } else {
+        fwd_bounce(conn->conn_mail, msg, msglen);
+    }
+    conn->conn_state = QUIT;
+    return CONN_QUIT;
+}
+
 //! Process inpot of a forward connection
 /*!
  * This is the callack which is executed is any data is readable from a forward
- * fd. It tracks the state of the forard message and processes the readed data
+ * fd. It tracks the state of the forard connection and processes the readed data
  * right. It alo triggers the actions related to some data at a specivic state
  * and manage the transitions between other states.
- * It also handles the error if one will be raised in any action.
+ * It also handles the error if one will be raised in any action. A mail
+ * refused by the server is reported to the sender and the connection is kept
+ * for the next mail. If the EHLO reply announces PIPELINING, the commands
+ * of a mail are sent as one batch (see fwd_start_transaction()).
  * \param msg    The readed data as char sequence.
  * \param msglen The length of the data without null terminator.
- * \param fwd    The structure of the forward mail.
+ * \param conn   The structure of the forward connection.
  * \return CONN_CONT if the connection should be alive abter this data, 
  *         CONN_QUIT if the connection module schould close the socket and free
  *         all related resources.
  */
-int fwd_process_input(char * msg, ssize_t msglen, fwd_mail_t * fwd){
+int fwd_process_input(char * msg, ssize_t msglen, fwd_conn_t * conn){
     int status;
 
 
-    switch (fwd->fwd_state) {
+    switch (conn->conn_state) {
 
-        /* New con, no data readed before, waiting for 220 greet, send HELO */
+        /* New con, no data readed before, waiting for 220 greet, send EHLO */
         case NEW:
             status = check_cmd_reply(msg, 220);
-            if (R_OK != status && R_NOP != status){
-                status = R_FAIL;
-            } else {
-                const char * myhost = "localhost";
-
-                if (NULL != config_get_hostname()) {
-                    myhost = config_get_hostname();
-                }
-                if (FWD_FAIL == fwd_write_command(fwd->fwd_writeback_fd, "HELO ", myhost)) {
+            if (R_OK == status) {
+                conn->conn_trycount = 1;
+                conn->conn_state    = EHLO;
+                if (FWD_FAIL == fwd_send_command(conn, EHLO)) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = HELO;
+            } else if (R_NOP != status) {
+                return fwd_quit_refused(conn, status, msg, msglen);
             }
             break;
 
-        /* Greet reded, HELO sended, wait for 250 reply, send MAIL FROM */
+        /* Greet reded, EHLO or HELO sended, wait for 250 reply, start the
+         * mail. A server which does not know EHLO gets HELO (RFC 5321,
+         * 4.1.4). */
+        case EHLO:
         case HELO:
+            if (EHLO == conn->conn_state && 4 < msglen
+                    && 0 == strncasecmp(msg + 4, "PIPELINING", 10)
+                    && (isspace((unsigned char)msg[14]) || '\0' == msg[14])) {
+                conn->conn_pipelining = 1;
+            }
             status = check_cmd_reply(msg, 250);
             if (R_OK == status) {
-                fwd->fwd_trycount = 0;
-                if (FWD_FAIL == fwd_write_command(fwd->fwd_writeback_fd, "MAIL FROM:", fwd->fwd_from)) {
+                if (FWD_FAIL == fwd_start_transaction(conn, MAIL)) {
+                    return CONN_QUIT;
+                }
+            } else if (R_FAIL == status && EHLO == conn->conn_state) {
+                conn->conn_trycount = 1;
+                conn->conn_state    = HELO;
+                if (FWD_FAIL == fwd_send_command(conn, HELO)) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = MAIL;
+            } else if (R_RETRY == status && SEND_MAXTRY > conn->conn_trycount) {
+                conn->conn_trycount++;
+                if (FWD_FAIL == fwd_send_command(conn, conn->conn_state)) {
+                    return CONN_QUIT;
+                }
+            } else if (R_NOP != status) {
+                return fwd_quit_refused(conn, status, msg, msglen);
             }
-            if (R_RETRY == status){
-                fwd->fwd_state = NEW;
-            } 
             break;
 
-        /* MAIL FROM sended, wait for wait for 250 reply, send RCPT TO */
+        /* RSET before the next mail, MAIL FROM and DATA sended, one after
+         * the other or as one batch with the RCPT TOs. The replies come in
+         * order, wait for the 250 reply (354 for DATA) of the current command
+         * and send the next one or the body. If RSET fails the connection is
+         * broken, fwd_free_conn() sends the mail on another one. If no
+         * recipient of a batch was accepted, the transaction ends with DATA
+         * and an empty mail is ended if DATA is accepted anyway (RFC 2920,
+         * 3.1). */
+        case RSET:
         case MAIL:
-            status = check_cmd_reply(msg, 250);
-            if (R_OK == status) {
-                fwd->fwd_trycount = 0;
-                if (FWD_FAIL == fwd_write_command(fwd->fwd_writeback_fd, "RCPT TO:", fwd->fwd_to)) {
+        case DATA:
+            status = check_cmd_reply(msg, (DATA == conn->conn_state ? 354 : 250));
+            if (R_NOP == status) {
+                break;
+            }
+            if (DATA == conn->conn_state && 0 == fwd_count_rcpts(conn->conn_mail, RCPT_OK)) {
+                if (R_OK == status && FWD_FAIL == fwd_write_command(conn->conn_fd, ".", "")) {
+                    return CONN_QUIT;
+                }
+                if (FWD_FAIL == fwd_end_transaction(conn, (R_OK == status ? 1 : 0))) {
+                    return CONN_QUIT;
+                }
+                break;
+            }
+            if (R_OK != status) {
+                if (RSET == conn->conn_state || FWD_FAIL == fwd_refused(conn, status, msg, msglen)) {
+                    return CONN_QUIT;
+                }
+                break;
+            }
+            if (DATA == conn->conn_state) {
+                conn->conn_state = SEND;
+                if (FWD_FAIL == fwd_write_body(conn)) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = RCPT;
+                break;
+            }
+            conn->conn_state++;
+            conn->conn_trycount = 1;
+            if (!conn->conn_batch && FWD_FAIL == fwd_send_command(conn, conn->conn_state)) {
+                return CONN_QUIT;
             }
-            if (R_RETRY == status){
-                fwd->fwd_state = HELO;
-            } 
             break;
 
-        /* RCPT TO sended, wait for wait for 250 reply, send DATA */
+        /* RCPT TO sended for each recipient, wait for the 250 reply. A
+         * refused recipient does not affect the others, DATA follows the
+         * last one. Without a batch a temporary failture is tried again at
+         * once and DATA is not sent if no recipient was accepted. */
         case RCPT:
             status = check_cmd_reply(msg, 250);
+            if (R_NOP == status) {
+                break;
+            }
+            if (R_RETRY == status && !conn->conn_batch && SEND_MAXTRY > conn->conn_trycount) {
+                conn->conn_trycount++;
+                if (FWD_FAIL == fwd_send_command(conn, RCPT)) {
+                    return CONN_QUIT;
+                }
+                break;
+            }
             if (R_OK == status) {
-                fwd->fwd_trycount = 0;
-                if (FWD_FAIL == fwd_write_command(fwd->fwd_writeback_fd, "DATA", "")) {
+                conn->conn_mail->fwd_rcpts[conn->conn_rcpt].rcpt_state = RCPT_OK;
+            } else {
+                fwd_refused_rcpt(conn, status, msg, msglen);
+            }
+            conn->conn_trycount = 1;
+            conn->conn_rcpt     = fwd_next_rcpt(conn->conn_mail, conn->conn_rcpt + 1);
+            if (conn->conn_mail->fwd_rcpt_count > conn->conn_rcpt) {
+                if (!conn->conn_batch && FWD_FAIL == fwd_send_command(conn, RCPT)) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = DATA;
+                break;
+            }
+            if (!conn->conn_batch && 0 == fwd_count_rcpts(conn->conn_mail, RCPT_OK)) {
+                if (FWD_FAIL == fwd_end_transaction(conn, 0)) {
+                    return CONN_QUIT;
+                }
+                break;
+            }
+            conn->conn_state = DATA;
+            if (!conn->conn_batch && FWD_FAIL == fwd_send_command(conn, DATA)) {
+                return CONN_QUIT;
             }
-            if (R_RETRY == status){
-                fwd->fwd_state = MAIL;
-            } 
             break;
 
-        /* DATA sended, wait for wait for 354  reply, send the body data */
-        case DATA:
-            status = check_cmd_reply(msg, 354);
+        /* Body data dended, wait for wait for 250 reply, go on with the next
+         * mail or wait for one */
+        case SEND:
+            status = check_cmd_reply(msg, 250);
             if (R_OK == status) {
-                fwd->fwd_trycount = 0;
-                if (FWD_FAIL == fwd_write_body(fwd->fwd_writeback_fd, fwd->fwd_body)) {
+                INFO_MSG("Forward successful");
+                if (FWD_FAIL == fwd_end_transaction(conn, 0)) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = SEND;
+            } else if (R_NOP != status && FWD_FAIL == fwd_refused(conn, status, msg, msglen)) {
+                return CONN_QUIT;
             }
-            if (R_RETRY == status){
-                fwd->fwd_state = RCPT;
-            } 
             break;
 
-        /* Body data dended, wait for wait for 250 reply, send QUIT */
-        case SEND:
-            status = check_cmd_reply(msg, 250);
+        /* A command of a batch was refused, wait for the replies to the rest.
+         * If DATA is accepted anyway, the empty mail is ended (RFC 2920,
+         * 3.1). */
+        case SKIP:
+            status = check_cmd_reply(msg, 354);
             if (R_OK == status) {
-                fwd->fwd_trycount = 0;
-                if (FWD_FAIL == fwd_write_command(fwd->fwd_writeback_fd, "QUIT", "")) {
+                if (FWD_FAIL == fwd_write_command(conn->conn_fd, ".", "")) {
                     return CONN_QUIT;
                 }
-                fwd->fwd_trycount++;
-                fwd->fwd_state = QUIT;
+            } else if (R_NOP != status && 0 == --conn->conn_skip
+                    && FWD_FAIL == fwd_next_mail(conn, 0)) {
+                return CONN_QUIT;
             }
-            if (R_RETRY == status){
-                fwd->fwd_state = DATA;
-            }    
             break;
 
+        /* No mail, the server closes the connection (421) */
+        case IDLE:
+            conn->conn_state = QUIT;
+            return CONN_QUIT;
+
         /* QUIT sended, wait for wait for 221 reply, return with CONN_QUIT */
         case QUIT:
             status = check_cmd_reply(msg, 221);
@@ -569,37 +1669,106 @@ int fwd_process_input(char * msg, ssize_t msglen, fwd_mail_t * fwd){
 
     }
 
-    if (R_FAIL == status) {
-        if (fwd->fwd_failable) {
-            fwd_return_failture(fwd, msg, msglen);
+    fwd_set_timeout(conn);
+    return CONN_OK;
+}
+
+//! Handle a failed connect
+/*!
+ * This is called by the connection module if the connection to the relay host
+ * cannot be established (refused, unreachable or timed out). The connection
+ * module closes the socket and frees the connection afterwards, the mail is
+ * put back into the queue then.
+ * \param conn   The structure of the forward connection.
+ * \param reason The reason of the failture as char sequence (null terminated).
+ * \return FWD_OK in any case.
+ */
+int fwd_connect_failed(fwd_conn_t * conn, const char * reason){
+    if (NULL != conn->conn_mail) {
+        fwd_set_reason(conn->conn_mail, FWD_ERROR_CONNECT, reason, strlen(reason));
+    }
+    conn->conn_state = QUIT;
+    return FWD_OK;
+}
+
+//! Handle a reply timeout
+/*!
+ * This is called by the connection module if the mail server did not reply
+ * within the timeout of the current state. The mail is put back into the
+ * queue when it is freed with the connection. An idle connection is quit.
+ * \param conn The structure of the forward connection.
+ * \return CONN_CONT if the connection waits for the reply to QUIT,
+ *         CONN_QUIT else.
+ */
+int fwd_timeout(fwd_conn_t * conn){
+    if (IDLE == conn->conn_state) {
+        INFO_MSG2("Closing idle forward connection to %s", conn->conn_addr);
+        conn->conn_state = QUIT;
+        if (FWD_FAIL == fwd_write_command(conn->conn_fd, "QUIT", "")) {
+            return CONN_QUIT;
         }
-        /* handle error mail srtuff */
-        fwd->fwd_state = QUIT;
+        fwd_set_timeout(conn);
+        return CONN_CONT;
+    }
+    ERROR_CUSTM("Timeout waiting for the forward host");
+    /* the mail is sent on another connection by fwd_free_conn() */
+    if (RSET == conn->conn_state || SKIP == conn->conn_state) {
         return CONN_QUIT;
     }
-
-    return CONN_OK;
+    if (QUIT != conn->conn_state && NULL != conn->conn_mail) {
+        fwd_set_reason(conn->conn_mail, "", FWD_ERROR_TIMEOUT, strlen(FWD_ERROR_TIMEOUT));
+    }
+    conn->conn_state = QUIT;
+    return CONN_QUIT;
 }
 
-//! Frees all reources assigned to a forwarded mail
+//! Frees all reources assigned to a forward connection
 /*! 
  * This is the cleanup callback for the connection module. it will be called if
- * a connection will be cleaned up. Every heap data of the forward mail should
- * be freed here.
- * \param fwd The structure of the forward mail.
+ * a connection will be cleaned up. The mail of the connection is ended with
+ * fwd_end_mail(), so it is put back into the queue if it is not done. But a
+ * mail which was to be sent after a RSET is sent again, as the server may
+ * have closed the connection while it was idle. This is also done for a mail
+ * which is to be tried again after a batch. The oldest mail waiting for
+ * a connection to the same address is sent again too, so it gets a new one.
+ * \param conn The structure of the forward connection.
  * \return FWD_OK in any vases for the moment.
  */
-int fwd_free_mail(fwd_mail_t * fwd) {
-    if (NULL != fwd){
-        if (NULL != fwd->fwd_to)
-            free(fwd->fwd_to);
-        if (NULL != fwd->fwd_from)
-            free(fwd->fwd_from);
-        if (NULL != fwd->fwd_body)
-            fwd_delete_body_lines(fwd->fwd_body);
-        free(fwd);
+int fwd_free_conn(fwd_conn_t * conn) {
+    fwd_conn_t ** link;
+    fwd_mail_t ** mail;
+    fwd_mail_t *  fwd;
+
+    for (link = &fwd_conns; NULL != *link; link = &((*link)->conn_next)) {
+        if (conn == *link) {
+            *link = conn->conn_next;
+            break;
+        }
     }
-    INFO_MSG("Forward data cleaned");
+
+    if (NULL != conn->conn_mail) {
+        if (RSET == conn->conn_state || SKIP == conn->conn_state) {
+            fwd_redispatch(conn->conn_mail);
+        } else {
+            /* the reason of a failture is set before the state is QUIT */
+            if (QUIT != conn->conn_state) {
+                fwd_set_reason(conn->conn_mail, "", FWD_ERROR_LOST, strlen(FWD_ERROR_LOST));
+            }
+            fwd_end_mail(conn->conn_mail);
+        }
+    }
+
+    for (mail = &fwd_waiting; NULL != (fwd = *mail); mail = &(fwd->fwd_next)) {
+        if (0 == strcmp(fwd->fwd_addr, conn->conn_addr)) {
+            *mail         = fwd->fwd_next;
+            fwd->fwd_next = NULL;
+            fwd_redispatch(fwd);
+            break;
+        }
+    }
+
+    pool_release(fwd_conn_pool, conn);
+    INFO_MSG("Forward connection cleaned");
     return FWD_OK;
 }
 
@@ -42,22 +42,30 @@
 #define FWD_POSTMASTER      "postmaster"
 #define FWD_ERROR_REPLY1    "An error has occured while sending your mail:"
 #define FWD_ERROR_REPLY2    "Your mail was:"
+#define FWD_ERROR_CONNECT   "Could not connect to the mail server: "
+#define FWD_ERROR_TIMEOUT   "Timeout while waiting for the reply of the mail server"
+#define FWD_ERROR_LOST      "The connection to the mail server was lost"
+#define FWD_ERROR_EXPIRED   "The mail could not be delivered in time, the last error was: "
 #define FWD_ERROR_HEAD_FROM "From: \"Mail Delivery System\" " FWD_POSTMASTER "@"
 #define FWD_ERROR_HEAD_TO   "To: "
 #define FWD_ERROR_HEAD_SUBJ "Subject: Undelivered Mail Returned to Sender"
+#define FWD_ERROR_HEAD      FWD_ERROR_HEAD_FROM "%s\r\n" FWD_ERROR_HEAD_TO "%s\r\n" \
+                            FWD_ERROR_HEAD_SUBJ "\r\n\r\n" FWD_ERROR_REPLY1 "\r\n%.*s\r\n" FWD_ERROR_REPLY2 "\r\n"
 
-typedef struct body_line body_line_t;
 typedef struct fwd_mail fwd_mail_t;
+typedef struct fwd_conn fwd_conn_t;
 
-struct body_line {
-    char * line_data;
-    int    line_len;
-    body_line_t * line_next;
-};
+struct spool;
 
 
-int fwd_queue(body_line_t * body, char * from, char * to, int failable);
-int fwd_process_input(char * msg, ssize_t msglen, fwd_mail_t * fwd);
-int fwd_free_mail(fwd_mail_t * fwd);
-inline void fwd_delete_body_lines(body_line_t * start);
+int fwd_init();
+void fwd_stop();
+void fwd_close();
+int fwd_queue(struct spool * body, char * from, char ** to, int count, int failable);
+void fwd_send_queued();
+void fwd_drop_queued();
+int fwd_process_input(char * msg, ssize_t msglen, fwd_conn_t * conn);
+int fwd_connect_failed(fwd_conn_t * conn, const char * reason);
+int fwd_timeout(fwd_conn_t * conn);
+int fwd_free_conn(fwd_conn_t * conn);
 
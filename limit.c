@@ -0,0 +1,269 @@
+/* limit.c
+ *
+ * The client limit module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "limit.h"
+#include "config.h"
+#include "fail.h"
+
+/*!
+ * \defgroup limit Client Limit Module
+ * This limits the connections of a single client, so one host cannot take all
+ * the resources of the server. The clients are grouped by their address with
+ * the prefix length of config_get_client_prefix(). For each group the count of
+ * open connections is limited to config_get_client_conns() and the rate of new
+ * connections to config_get_client_rate() per second, with bursts up to
+ * config_get_client_burst() (token bucket).
+ * The counters are shared by all workers, so the limits hold no matter which
+ * worker the kernel gives a connection to.
+ * @{
+ */
+
+//! The count of buckets of the hash table (must be a power of 2)
+#define LIMIT_BUCKETS 4096
+
+//! The precision of the token buckets, one connect costs this many units
+#define LIMIT_UNIT    1000
+
+typedef struct limit_entry limit_entry_t;
+
+//! The counters of a client group
+struct limit_entry {
+    limit_entry_t * entry_next;     //!< The next entry of the hash bucket.
+    uint32_t        entry_net;      //!< The network of the group (host order).
+    unsigned        entry_conns;    //!< The count of open connections.
+    uint64_t        entry_tokens;   //!< The tokens of the bucket in LIMIT_UNIT.
+    uint64_t        entry_time;     //!< The time of the last refill in milliseconds.
+};
+
+limit_entry_t ** limit_table = NULL; //! The hash table of the client groups.
+
+pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER; //! The lock of the table.
+
+uint32_t limit_mask  = 0; //! The netmask of a client group (host order).
+
+unsigned limit_conns = 0; //! The max count of open connections or 0.
+
+uint64_t limit_rate  = 0; //! The tokens per millisecond in LIMIT_UNIT or 0.
+
+uint64_t limit_burst = 0; //! The max tokens of a bucket in LIMIT_UNIT.
+
+//! Get the current time
+/*!
+ * \return The time of the monotonic clock in milliseconds.
+ */
+static inline uint64_t limit_now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//! Get the hash bucket of a network
+/*!
+ * \param net The network (host order).
+ * \return The link to the first entry of the bucket.
+ */
+static inline limit_entry_t ** limit_bucket(uint32_t net){
+    return &limit_table[((net * 2654435761U) >> 20) & (LIMIT_BUCKETS - 1)];
+}
+
+//! Refill the token bucket of an entry
+/*!
+ * \param entry The entry.
+ * \param now   The current time.
+ */
+static inline void limit_refill(limit_entry_t * entry, uint64_t now){
+    entry->entry_tokens += (now - entry->entry_time) * limit_rate;
+    if (entry->entry_tokens > limit_burst) {
+        entry->entry_tokens = limit_burst;
+    }
+    entry->entry_time = now;
+}
+
+//! Init the limit module
+/*!
+ * This reads the limits from the config and allocates the table. Nothing is
+ * allocated if all limits are off.
+ * This should be called once at application start, before the workers run.
+ * \return LIMIT_OK on success, LIMIT_CONNS if the memory is exhausted.
+ */
+int limit_init_app(){
+    int prefix = config_get_client_prefix();
+
+    limit_mask  = (0 == prefix ? 0 : 0xffffffffU << (32 - prefix));
+    limit_conns = config_get_client_conns();
+    limit_rate  = (uint64_t)config_get_client_rate() * LIMIT_UNIT / 1000;
+    limit_burst = (uint64_t)config_get_client_burst() * LIMIT_UNIT;
+
+    if (0 == limit_conns && 0 == limit_rate) {
+        return LIMIT_OK;
+    }
+    if (NULL == (limit_table = calloc(LIMIT_BUCKETS, sizeof(limit_entry_t *)))) {
+        ERROR_SYS("Allocating the client limits");
+        return LIMIT_CONNS;
+    }
+    return LIMIT_OK;
+}
+
+//! Shut down the limit module
+/*!
+ * This frees the table. It must be called after all workers are done.
+ */
+void limit_close_app(){
+    limit_entry_t * entry;
+    int             i;
+
+    if (NULL == limit_table) {
+        return;
+    }
+    for (i = 0; i < LIMIT_BUCKETS; i++) {
+        while (NULL != (entry = limit_table[i])) {
+            limit_table[i] = entry->entry_next;
+            free(entry);
+        }
+    }
+    free(limit_table);
+    limit_table = NULL;
+}
+
+//! Count a new connection
+/*!
+ * This checks the limits of the group of a client and counts the connection
+ * if it is allowed. Entries without connections and with a full bucket are
+ * dropped on the way, so the table only holds active clients.
+ * Each LIMIT_OK must be paired with a limit_release(). If the entry cannot be
+ * allocated, the connection is refused like one over the limit, as it could
+ * not be released later.
+ * \param addr The address of the client.
+ * \return LIMIT_OK if the connection is allowed, LIMIT_CONNS if the client has
+ *         too many connections, LIMIT_RATE if it connects too fast.
+ */
+int limit_acquire(const struct sockaddr_in * addr){
+    uint32_t         net = ntohl(addr->sin_addr.s_addr) & limit_mask;
+    uint64_t         now;
+    limit_entry_t ** link;
+    limit_entry_t *  entry;
+    int              ret = LIMIT_OK;
+
+    if (NULL == limit_table) {
+        return LIMIT_OK;
+    }
+    now = limit_now();
+
+    pthread_mutex_lock(&limit_lock);
+    link = limit_bucket(net);
+    while (NULL != (entry = *link)) {
+        if (net == entry->entry_net) {
+            break;
+        }
+        limit_refill(entry, now);
+        if (0 == entry->entry_conns && limit_burst == entry->entry_tokens) {
+            *link = entry->entry_next;
+            free(entry);
+            continue;
+        }
+        link = &(entry->entry_next);
+    }
+
+    if (NULL == entry) {
+        if (NULL != (entry = malloc(sizeof(limit_entry_t)))) {
+            entry->entry_next   = *limit_bucket(net);
+            entry->entry_net    = net;
+            entry->entry_conns  = 0;
+            entry->entry_tokens = limit_burst;
+            entry->entry_time   = now;
+            *limit_bucket(net)  = entry;
+        } else {
+            ERROR_SYS("Allocating a client limit");
+            ret = LIMIT_CONNS;
+        }
+    } else {
+        limit_refill(entry, now);
+    }
+
+    if (NULL != entry) {
+        if (0 != limit_conns && limit_conns <= entry->entry_conns) {
+            ret = LIMIT_CONNS;
+        } else if (0 != limit_rate && LIMIT_UNIT > entry->entry_tokens) {
+            ret = LIMIT_RATE;
+        } else {
+            entry->entry_tokens -= (0 != limit_rate ? LIMIT_UNIT : 0);
+            entry->entry_conns++;
+        }
+    }
+    pthread_mutex_unlock(&limit_lock);
+    return ret;
+}
+
+//! Uncount a connection
+/*!
+ * This is called when a connection counted by limit_acquire() is closed.
+ * \param addr The address of the client.
+ */
+void limit_release(const struct sockaddr_in * addr){
+    uint32_t         net = ntohl(addr->sin_addr.s_addr) & limit_mask;
+    limit_entry_t ** link;
+    limit_entry_t *  entry;
+
+    if (NULL == limit_table) {
+        return;
+    }
+
+    pthread_mutex_lock(&limit_lock);
+    for (link = limit_bucket(net); NULL != (entry = *link); link = &(entry->entry_next)) {
+        if (net == entry->entry_net) {
+            if (0 < entry->entry_conns) {
+                entry->entry_conns--;
+            }
+            /* without a rate limit there is nothing more to remember */
+            if (0 == entry->entry_conns && 0 == limit_rate) {
+                *link = entry->entry_next;
+                free(entry);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/** @} */
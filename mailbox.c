@@ -39,6 +39,7 @@
 #include <sqlite3.h>
 
 #include "mailbox.h"
+#include "spool.h"
 #include "config.h"
 #include "fail.h"
 
@@ -49,10 +50,46 @@
 
 
 #define STATEMENT_PUSH   "INSERT INTO mail (user,data,size,date) VALUES (?,?,?,?)"
+#define STATEMENT_COPY   "INSERT INTO mail (user,data,size,date) SELECT ?,data,size,date FROM mail WHERE id = ?"
 #define STATEMENT_FETCH  "SELECT data FROM mail WHERE id = ?"
 #define STATEMENT_COUNT  "SELECT count(id) AS num, sum(data) AS siz FROM mail WHERE user = ?"
 #define STATEMENT_STAT   "SELECT id, size FROM mail WHERE user = ?"
 #define STATEMENT_DELETE "DELETE FROM mail WHERE id = ?"
+#define STATEMENT_BEGIN    "BEGIN IMMEDIATE"
+#define STATEMENT_COMMIT   "COMMIT"
+#define STATEMENT_ROLLBACK "ROLLBACK"
+
+/** \name Outbound queue
+ * The mails to forward are stored in the table queue until they are sent,
+ * one row per mail server transaction with the recipients separated by
+ * line feeds. A row a worker sends is marked active, all others wait for
+ * their next time to be tried. The index on (active, next) finds both
+ * without a scan.
+ * @{ */
+#define STATEMENT_QUEUE_TABLE  "CREATE TABLE IF NOT EXISTS queue (id INTEGER PRIMARY KEY, sender TEXT, rcpts TEXT, " \
+                               "data BLOB, size INTEGER, failable INTEGER, created INTEGER, next INTEGER, " \
+                               "attempts INTEGER, active INTEGER);" \
+                               "CREATE INDEX IF NOT EXISTS queue_next ON queue (active, next)"
+#define STATEMENT_QUEUE_RESUME "UPDATE queue SET active = 0 WHERE active = 1"
+#define STATEMENT_QUEUE_PUSH   "INSERT INTO queue (sender,rcpts,data,size,failable,created,next,attempts,active) " \
+                               "VALUES (?,?,?,?,?,?,?,0,?)"
+#define STATEMENT_QUEUE_COPY   "INSERT INTO queue (sender,rcpts,data,size,failable,created,next,attempts,active) " \
+                               "SELECT sender,?,data,size,failable,created,next,0,? FROM queue WHERE id = ?"
+#define STATEMENT_QUEUE_DUE    "SELECT id FROM queue WHERE active = 0 AND next <= ? ORDER BY next LIMIT ?"
+#define STATEMENT_QUEUE_CLAIM  "UPDATE queue SET active = 1 WHERE id = ? AND active = 0 AND next <= ?"
+#define STATEMENT_QUEUE_NEXT   "SELECT next FROM queue WHERE active = 0 ORDER BY next LIMIT 1"
+#define STATEMENT_QUEUE_LOAD   "SELECT sender, rcpts, failable, created, attempts, size FROM queue WHERE id = ?"
+#define STATEMENT_QUEUE_DELAY  "UPDATE queue SET rcpts = ?, next = ?, attempts = ?, active = 0 WHERE id = ?"
+#define STATEMENT_QUEUE_DONE   "DELETE FROM queue WHERE id = ?"
+#define STATEMENT_QUEUE_BACK   "UPDATE queue SET active = 0, next = ? WHERE id = ?"
+#define STATEMENT_QUEUE_RCPTS  "UPDATE queue SET rcpts = ? WHERE id = ?"
+/** @} */
+
+//! The size of the pieces a spooled body is copied to the database with
+#define MBOX_STREAM_BUFFER 16384
+
+//! How long (in ms) to wait for the database lock held by another worker
+#define MBOX_BUSY_TIMEOUT 5000
 
 //! Mail structure
 /*! 
@@ -79,34 +116,453 @@ struct mailbox {
 } ;
 
 
-sqlite3 * database;              //! The Database connection. Only one per Application.
-sqlite3_stmt * statement_push;   //! Prepared statement for push new mails.
-sqlite3_stmt * statement_fetch;  //! Prepared statement for fetching a whole mail.
-sqlite3_stmt * statement_stat;   //! Prepared statement for fetching metadata of a mail.
-sqlite3_stmt * statement_count;  //! Prepared statement for counting new mails;
-sqlite3_stmt * statement_delete; //! Prepared statement for deleting marked mails;
+__thread sqlite3 * database;              //! The Database connection. Only one per worker thread.
+__thread sqlite3_stmt * statement_push;   //! Prepared statement for push new mails.
+__thread sqlite3_stmt * statement_copy;   //! Prepared statement for copy a pushed mail to another user.
+__thread sqlite3_stmt * statement_fetch;  //! Prepared statement for fetching a whole mail.
+__thread sqlite3_stmt * statement_stat;   //! Prepared statement for fetching metadata of a mail.
+__thread sqlite3_stmt * statement_count;  //! Prepared statement for counting new mails;
+__thread sqlite3_stmt * statement_delete; //! Prepared statement for deleting marked mails;
+__thread sqlite3_stmt * statement_queue_push;  //! Prepared statement for queueing a mail to forward.
+__thread sqlite3_stmt * statement_queue_copy;  //! Prepared statement for queueing a queued mail to other recipients.
+__thread sqlite3_stmt * statement_queue_due;   //! Prepared statement for finding the queued mails to send.
+__thread sqlite3_stmt * statement_queue_claim; //! Prepared statement for marking a queued mail active.
+__thread sqlite3_stmt * statement_queue_next;  //! Prepared statement for the next time a queued mail is to be sent.
+__thread sqlite3_stmt * statement_queue_load;  //! Prepared statement for fetching a queued mail.
+__thread sqlite3_stmt * statement_queue_delay; //! Prepared statement for putting a queued mail back.
+__thread sqlite3_stmt * statement_queue_done;  //! Prepared statement for removing a queued mail.
+__thread sqlite3_stmt * statement_queue_back;  //! Prepared statement for putting a claimed mail back.
+__thread sqlite3_stmt * statement_queue_rcpts; //! Prepared statement for changing the recipients of a queued mail.
+
+
+//! Stream a spooled body into the row inserted last
+/*!
+ * This copies a body from its spool file piece by piece into the blob of the
+ * last inserted mail, which was created with the right size.
+ * \param table The table of the mail (mail or queue).
+ * \param body  The mail body.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+static int mbox_stream_body(const char * table, spool_t * body){
+    char           buf[MBOX_STREAM_BUFFER];
+    sqlite3_blob * blob;
+    size_t         offset = 0;
+    ssize_t        len;
+    int            ret    = MAILBOX_OK;
+
+    if (SQLITE_OK != sqlite3_blob_open(database, "main", table, "data",
+                sqlite3_last_insert_rowid(database), 1, &blob)) {
+        return MAILBOX_ERROR;
+    }
+    while (offset < spool_len(body)) {
+        if (0 >= (len = spool_read(body, offset, buf, sizeof(buf)))
+                || SQLITE_OK != sqlite3_blob_write(blob, buf, len, offset)) {
+            ret = MAILBOX_ERROR;
+            break;
+        }
+        offset += len;
+    }
+    if (SQLITE_OK != sqlite3_blob_close(blob)) {
+        ret = MAILBOX_ERROR;
+    }
+    return ret;
+}
+
+//! Start a transaction
+/*!
+ * The mails pushed and queued until mbox_commit() are stored together or,
+ * after mbox_rollback(), not at all.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_begin(){
+    return (SQLITE_OK == sqlite3_exec(database, STATEMENT_BEGIN, NULL, NULL, NULL) ? MAILBOX_OK : MAILBOX_ERROR);
+}
+
+//! Commit a transaction
+/*!
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else. The transaction has to
+ *         be rolled back then.
+ */
+int mbox_commit(){
+    return (SQLITE_OK == sqlite3_exec(database, STATEMENT_COMMIT, NULL, NULL, NULL) ? MAILBOX_OK : MAILBOX_ERROR);
+}
 
+//! Roll back a transaction
+/*!
+ * Nothing happens if there is none.
+ */
+void mbox_rollback(){
+    if (!sqlite3_get_autocommit(database)) {
+        sqlite3_exec(database, STATEMENT_ROLLBACK, NULL, NULL, NULL);
+    }
+}
 
 //! Push a Mail in a box
 /*!
- * This is the function to push a new mail in a specific user-mailbox.
- * \param user The name of the user the mail should be delivered to as
- *             nullterminated char sequence.
- * \param data The mail-blob as null terminated char sequence.
- * \param size The size of the mail blob. If size will be 0, the actual 
- *             strlen() + 1 will be used.
- */
-void mbox_push_mail(char * user, char * data, size_t size){
-    if (0 == size) {
-        size = strlen(data);
-    }
-    time_t now = time(NULL);
-    sqlite3_bind_text(statement_push, 1, user, -1, SQLITE_TRANSIENT);
-    sqlite3_bind_blob(statement_push, 2, data, size, SQLITE_TRANSIENT);
+ * This is the function to push a new mail in the mailboxes of some users.
+ * A body in memory is stored at once. A body in a spool file is inserted as
+ * zeroed blob of its size first and then streamed into it, so it is never
+ * in memory as a whole. The mail of the other users is copied from the first
+ * one inside the database, so the spool file is read only once. All is done
+ * in one transaction, so no one sees a mail before all are complete. Inside
+ * a transaction started with mbox_begin() that one is used.
+ * \param users The names of the users the mail should be delivered to as
+ *              nullterminated char sequences.
+ * \param count The count of users.
+ * \param body  The mail body.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_push_mail(char ** users, int count, spool_t * body){
+    const char *  data = spool_mem(body);
+    size_t        size = spool_len(body);
+    time_t        now  = time(NULL);
+    int           own  = ((NULL == data || 1 < count) && sqlite3_get_autocommit(database));
+    int           ret  = MAILBOX_OK;
+    int           i;
+    sqlite3_int64 id;
+
+    if (own && SQLITE_OK != sqlite3_exec(database, STATEMENT_BEGIN, NULL, NULL, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    sqlite3_bind_text(statement_push, 1, users[0], -1, SQLITE_TRANSIENT);
+    if (NULL == data) {
+        sqlite3_bind_zeroblob(statement_push, 2, size);
+    } else {
+        sqlite3_bind_blob(statement_push, 2, data, size, SQLITE_STATIC);
+    }
     sqlite3_bind_int(statement_push, 3, size);
     sqlite3_bind_int(statement_push, 4, now);
-    sqlite3_step(statement_push);
+    if (SQLITE_DONE != sqlite3_step(statement_push)) {
+        ret = MAILBOX_ERROR;
+    }
     sqlite3_reset(statement_push);
+    id = sqlite3_last_insert_rowid(database);
+
+    if (NULL == data && MAILBOX_OK == ret) {
+        ret = mbox_stream_body("mail", body);
+    }
+    for (i = 1; i < count && MAILBOX_OK == ret; i++) {
+        sqlite3_bind_text(statement_copy, 1, users[i], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(statement_copy, 2, id);
+        if (SQLITE_DONE != sqlite3_step(statement_copy)) {
+            ret = MAILBOX_ERROR;
+        }
+        sqlite3_reset(statement_copy);
+    }
+
+    if (own && (MAILBOX_OK != ret || MAILBOX_OK != mbox_commit())) {
+        mbox_rollback();
+        ret = MAILBOX_ERROR;
+    }
+    return ret;
+}
+
+//! Queue a mail to forward
+/*!
+ * This stores a mail to forward in the queue, as one row for each mail
+ * server transaction. The body is stored like in mbox_push_mail(), the other
+ * rows are copied from the first one. All rows are stored in one
+ * transaction (or the one started with mbox_begin()). They are to be sent
+ * at once, the first \p active ones are marked active for the caller.
+ * \param from     The mail adress of the sender.
+ * \param rcpts    The recipients of each row, separated by line feeds.
+ * \param count    The count of rows.
+ * \param failable The flag to tell if the sender gets an error report.
+ * \param active   The count of rows the caller sends itself.
+ * \param body     The mail body.
+ * \param ids      The place to store the ids of the rows at.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_push(char * from, char ** rcpts, int count, int failable, int active, spool_t * body, long long * ids){
+    const char * data = spool_mem(body);
+    size_t       size = spool_len(body);
+    time_t       now  = time(NULL);
+    int          own  = ((NULL == data || 1 < count) && sqlite3_get_autocommit(database));
+    int          ret  = MAILBOX_OK;
+    int          i;
+
+    if (own && MAILBOX_OK != mbox_begin()) {
+        return MAILBOX_ERROR;
+    }
+    sqlite3_bind_text(statement_queue_push, 1, from, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(statement_queue_push, 2, rcpts[0], -1, SQLITE_TRANSIENT);
+    if (NULL == data) {
+        sqlite3_bind_zeroblob(statement_queue_push, 3, size);
+    } else {
+        sqlite3_bind_blob(statement_queue_push, 3, data, size, SQLITE_STATIC);
+    }
+    sqlite3_bind_int64(statement_queue_push, 4, size);
+    sqlite3_bind_int(statement_queue_push, 5, failable);
+    sqlite3_bind_int64(statement_queue_push, 6, now);
+    sqlite3_bind_int64(statement_queue_push, 7, now);
+    sqlite3_bind_int(statement_queue_push, 8, (0 < active));
+    if (SQLITE_DONE != sqlite3_step(statement_queue_push)) {
+        ret = MAILBOX_ERROR;
+    }
+    sqlite3_reset(statement_queue_push);
+    ids[0] = sqlite3_last_insert_rowid(database);
+
+    if (NULL == data && MAILBOX_OK == ret) {
+        ret = mbox_stream_body("queue", body);
+    }
+    for (i = 1; i < count && MAILBOX_OK == ret; i++) {
+        sqlite3_bind_text(statement_queue_copy, 1, rcpts[i], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(statement_queue_copy, 2, (i < active));
+        sqlite3_bind_int64(statement_queue_copy, 3, ids[0]);
+        if (SQLITE_DONE != sqlite3_step(statement_queue_copy)) {
+            ret = MAILBOX_ERROR;
+        }
+        sqlite3_reset(statement_queue_copy);
+        ids[i] = sqlite3_last_insert_rowid(database);
+    }
+
+    if (own && (MAILBOX_OK != ret || MAILBOX_OK != mbox_commit())) {
+        mbox_rollback();
+        ret = MAILBOX_ERROR;
+    }
+    return ret;
+}
+
+//! Claim the queued mails which are due
+/*!
+ * This marks up to \p max of the queued mails to be sent until \p now as
+ * active, the oldest first. A mail claimed by another worker in between, or
+ * put back by it already, is skipped.
+ * \param ids The place to store the ids of the claimed mails at.
+ * \param max The max count of mails to claim.
+ * \param now The current time.
+ * \return The count of claimed mails or MAILBOX_ERROR.
+ */
+int mbox_queue_claim(long long * ids, int max, time_t now){
+    int count = 0;
+    int claimed = 0;
+    int i;
+
+    sqlite3_bind_int64(statement_queue_due, 1, now);
+    sqlite3_bind_int(statement_queue_due, 2, max);
+    while (count < max && SQLITE_ROW == sqlite3_step(statement_queue_due)) {
+        ids[count++] = sqlite3_column_int64(statement_queue_due, 0);
+    }
+    sqlite3_reset(statement_queue_due);
+    if (0 == count) {
+        return 0;
+    }
+
+    if (MAILBOX_OK != mbox_begin()) {
+        return MAILBOX_ERROR;
+    }
+    for (i = 0; i < count; i++) {
+        sqlite3_bind_int64(statement_queue_claim, 1, ids[i]);
+        sqlite3_bind_int64(statement_queue_claim, 2, now);
+        if (SQLITE_DONE != sqlite3_step(statement_queue_claim)) {
+            sqlite3_reset(statement_queue_claim);
+            mbox_rollback();
+            return MAILBOX_ERROR;
+        }
+        sqlite3_reset(statement_queue_claim);
+        if (1 == sqlite3_changes(database)) {
+            ids[claimed++] = ids[i];
+        }
+    }
+    if (MAILBOX_OK != mbox_commit()) {
+        mbox_rollback();
+        return MAILBOX_ERROR;
+    }
+    return claimed;
+}
+
+//! The next time a queued mail is to be sent
+/*!
+ * \return The time or 0 if no mail waits.
+ */
+time_t mbox_queue_next(){
+    time_t next = 0;
+
+    if (SQLITE_ROW == sqlite3_step(statement_queue_next)) {
+        next = sqlite3_column_int64(statement_queue_next, 0);
+    }
+    sqlite3_reset(statement_queue_next);
+    return next;
+}
+
+//! Load the body of a queued mail
+/*!
+ * The blob is copied piece by piece into a new spool, so a big one is never
+ * in memory as a whole.
+ * \param id   The id of the queued mail.
+ * \param size The size of the body.
+ * \return The body or NULL on failture.
+ */
+static spool_t * mbox_queue_body(sqlite3_int64 id, size_t size){
+    char           buf[MBOX_STREAM_BUFFER];
+    sqlite3_blob * blob;
+    spool_t *      body;
+    size_t         offset = 0;
+    size_t         len;
+
+    if (SQLITE_OK != sqlite3_blob_open(database, "main", "queue", "data", id, 0, &blob)) {
+        return NULL;
+    }
+    body = spool_new();
+    while (NULL != body && offset < size) {
+        len = (size - offset < sizeof(buf) ? size - offset : sizeof(buf));
+        if (SQLITE_OK != sqlite3_blob_read(blob, buf, len, offset)
+                || SPOOL_OK != spool_append(body, buf, len)) {
+            spool_free(body);
+            body = NULL;
+        }
+        offset += len;
+    }
+    sqlite3_blob_close(blob);
+    return body;
+}
+
+//! Load a queued mail
+/*!
+ * The sender and the recipients are returned in new allocated memory, the
+ * caller has to free them and the body.
+ * \param id       The id of the queued mail.
+ * \param from     The place to store the sender at.
+ * \param rcpts    The place to store the recipients at, separated by line
+ *                 feeds.
+ * \param failable The place to store the failable flag at.
+ * \param created  The place to store the time the mail was queued at.
+ * \param attempts The place to store the count of failed attempts at.
+ * \param body     The place to store the body at.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_load(long long id, char ** from, char ** rcpts, int * failable, time_t * created, int * attempts, spool_t ** body){
+    int ret = MAILBOX_ERROR;
+
+    *from  = NULL;
+    *rcpts = NULL;
+    *body  = NULL;
+    sqlite3_bind_int64(statement_queue_load, 1, id);
+    if (SQLITE_ROW == sqlite3_step(statement_queue_load)
+            && NULL != sqlite3_column_text(statement_queue_load, 0)
+            && NULL != sqlite3_column_text(statement_queue_load, 1)) {
+        *from     = strdup((const char *)sqlite3_column_text(statement_queue_load, 0));
+        *rcpts    = strdup((const char *)sqlite3_column_text(statement_queue_load, 1));
+        *failable = sqlite3_column_int(statement_queue_load, 2);
+        *created  = sqlite3_column_int64(statement_queue_load, 3);
+        *attempts = sqlite3_column_int(statement_queue_load, 4);
+        *body     = mbox_queue_body(id, sqlite3_column_int64(statement_queue_load, 5));
+        if (NULL != *from && NULL != *rcpts && NULL != *body) {
+            ret = MAILBOX_OK;
+        }
+    }
+    sqlite3_reset(statement_queue_load);
+    if (MAILBOX_OK != ret) {
+        free(*from);
+        free(*rcpts);
+        spool_free(*body);
+    }
+    return ret;
+}
+
+//! Put a queued mail back
+/*!
+ * The mail is not active any more and is sent again at \p next to the given
+ * recipients.
+ * \param id       The id of the queued mail.
+ * \param rcpts    The recipients still to be sent to, separated by line
+ *                 feeds.
+ * \param next     The time to send the mail again.
+ * \param attempts The count of failed attempts.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_delay(long long id, char * rcpts, time_t next, int attempts){
+    int ret = MAILBOX_OK;
+
+    sqlite3_bind_text(statement_queue_delay, 1, rcpts, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(statement_queue_delay, 2, next);
+    sqlite3_bind_int(statement_queue_delay, 3, attempts);
+    sqlite3_bind_int64(statement_queue_delay, 4, id);
+    if (SQLITE_DONE != sqlite3_step(statement_queue_delay)) {
+        ret = MAILBOX_ERROR;
+    }
+    sqlite3_reset(statement_queue_delay);
+    return ret;
+}
+
+//! Put a claimed mail back unchanged
+/*!
+ * This is done if a claimed mail cannot be loaded or sent, so it is tried
+ * again at \p next.
+ * \param id   The id of the queued mail.
+ * \param next The time to send the mail again.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_unclaim(long long id, time_t next){
+    int ret = MAILBOX_OK;
+
+    sqlite3_bind_int64(statement_queue_back, 1, next);
+    sqlite3_bind_int64(statement_queue_back, 2, id);
+    if (SQLITE_DONE != sqlite3_step(statement_queue_back)) {
+        ret = MAILBOX_ERROR;
+    }
+    sqlite3_reset(statement_queue_back);
+    return ret;
+}
+
+//! Split a queued mail
+/*!
+ * This splits a claimed mail into one row for each mail server transaction,
+ * like mbox_queue_push() stores them. The mail keeps the first recipients
+ * and stays claimed, the other rows are copied from it and are due at once.
+ * \param id    The id of the queued mail.
+ * \param rcpts The recipients of each row, separated by line feeds.
+ * \param count The count of rows.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_split(long long id, char ** rcpts, int count){
+    int ret = MAILBOX_OK;
+    int i;
+
+    if (MAILBOX_OK != mbox_begin()) {
+        return MAILBOX_ERROR;
+    }
+    for (i = 1; i < count && MAILBOX_OK == ret; i++) {
+        sqlite3_bind_text(statement_queue_copy, 1, rcpts[i], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(statement_queue_copy, 2, 0);
+        sqlite3_bind_int64(statement_queue_copy, 3, id);
+        if (SQLITE_DONE != sqlite3_step(statement_queue_copy)) {
+            ret = MAILBOX_ERROR;
+        }
+        sqlite3_reset(statement_queue_copy);
+    }
+    if (MAILBOX_OK == ret) {
+        sqlite3_bind_text(statement_queue_rcpts, 1, rcpts[0], -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(statement_queue_rcpts, 2, id);
+        if (SQLITE_DONE != sqlite3_step(statement_queue_rcpts)) {
+            ret = MAILBOX_ERROR;
+        }
+        sqlite3_reset(statement_queue_rcpts);
+    }
+
+    if (MAILBOX_OK != ret || MAILBOX_OK != mbox_commit()) {
+        mbox_rollback();
+        ret = MAILBOX_ERROR;
+    }
+    return ret;
+}
+
+//! Remove a queued mail
+/*!
+ * This is done when the mail was sent to all recipients or the sender got
+ * an error report.
+ * \param id The id of the queued mail.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_queue_done(long long id){
+    int ret = MAILBOX_OK;
+
+    sqlite3_bind_int64(statement_queue_done, 1, id);
+    if (SQLITE_DONE != sqlite3_step(statement_queue_done)) {
+        ret = MAILBOX_ERROR;
+    }
+    sqlite3_reset(statement_queue_done);
+    return ret;
 }
 
 //! Get the error String
@@ -120,13 +576,38 @@ const char * mbox_get_error_msg(){
 
 
 
+//! Prepare the outbound queue
+/*!
+ * This creates the queue table if the database has none and puts back the
+ * mails which were active when the application stopped, so they are sent
+ * again. Only these rows are touched, found by the index. It must be called
+ * once at app initialization, before the workers start.
+ * \return MAILBOX_OK on success, MAILBOX_ERROR else.
+ */
+int mbox_init_queue(){
+    sqlite3 * db;
+    int       ret = MAILBOX_ERROR;
+
+    if (SQLITE_OK != sqlite3_open_v2(config_get_dbfile(), &db, SQLITE_OPEN_READWRITE, NULL)) {
+        ERROR_CUSTM2("Cannot open the database: %s", sqlite3_errmsg(db));
+    } else if (SQLITE_OK != sqlite3_exec(db, STATEMENT_QUEUE_TABLE, NULL, NULL, NULL)
+            || SQLITE_OK != sqlite3_exec(db, STATEMENT_QUEUE_RESUME, NULL, NULL, NULL)) {
+        ERROR_CUSTM2("Cannot prepare the queue: %s", sqlite3_errmsg(db));
+    } else {
+        INFO_MSG2("%d queued mail(s) resumed", sqlite3_changes(db));
+        ret = MAILBOX_OK;
+    }
+    sqlite3_close(db);
+    return ret;
+}
+
 //! Initializion of the Mailbox Module
 /*!
  * This function initialize the Mailbox Module. It create the Connection to the 
  * Database and prepare the Statements for faster execution. It must be called
  * before the first call to any other mbox_* function. The best way is to call
  * it at app initialization. There should also be _only_one_ call per
- * application!
+ * worker thread, each thread gets its own database connection!
  * \return MAILBOX_OK on success, MAILBOX_ERROR else.
  */
 int mbox_init_app(){
@@ -135,11 +616,15 @@ int mbox_init_app(){
     if( SQLITE_OK != sqlite3_open_v2(config_get_dbfile(), &database, SQLITE_OPEN_READWRITE, NULL) ) {
         return MAILBOX_ERROR;
     }
+    sqlite3_busy_timeout(database, MBOX_BUSY_TIMEOUT);
 
     /* Preparing Statements */
     if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_PUSH, strlen(STATEMENT_PUSH)+1, &statement_push, NULL)) {
         return MAILBOX_ERROR;
     }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_COPY, strlen(STATEMENT_COPY)+1, &statement_copy, NULL)) {
+        return MAILBOX_ERROR;
+    }
     if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_FETCH, strlen(STATEMENT_FETCH)+1, &statement_fetch, NULL)) {
         return MAILBOX_ERROR;
     }
@@ -152,6 +637,36 @@ int mbox_init_app(){
     if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_DELETE, strlen(STATEMENT_DELETE)+1, &statement_delete, NULL)) {
         return MAILBOX_ERROR;
     }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_PUSH, strlen(STATEMENT_QUEUE_PUSH)+1, &statement_queue_push, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_COPY, strlen(STATEMENT_QUEUE_COPY)+1, &statement_queue_copy, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_DUE, strlen(STATEMENT_QUEUE_DUE)+1, &statement_queue_due, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_CLAIM, strlen(STATEMENT_QUEUE_CLAIM)+1, &statement_queue_claim, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_NEXT, strlen(STATEMENT_QUEUE_NEXT)+1, &statement_queue_next, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_LOAD, strlen(STATEMENT_QUEUE_LOAD)+1, &statement_queue_load, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_DELAY, strlen(STATEMENT_QUEUE_DELAY)+1, &statement_queue_delay, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_DONE, strlen(STATEMENT_QUEUE_DONE)+1, &statement_queue_done, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_BACK, strlen(STATEMENT_QUEUE_BACK)+1, &statement_queue_back, NULL)) {
+        return MAILBOX_ERROR;
+    }
+    if (SQLITE_OK != sqlite3_prepare_v2(database, STATEMENT_QUEUE_RCPTS, strlen(STATEMENT_QUEUE_RCPTS)+1, &statement_queue_rcpts, NULL)) {
+        return MAILBOX_ERROR;
+    }
 
     INFO_MSG("mailbox init ok");
     return MAILBOX_OK;
@@ -248,20 +763,18 @@ size_t mbox_mail_size(mailbox_t * mbox, int mailnum){
 
 //! Uid of a Mail
 /*!
- * This returns a unique id of a given mail as char sewuwnce.
- * The returned buffer must be freed manually. 
+ * This returns a unique id of a given mail. The POP3 module sends it as a
+ * zero padded number of 18 digits.
  * \param mbox    The mailbox.
  * \param mailnum The optional number of the mail in the mailbox.
- * \return NULL on faulture or a buffer with the UID.
+ * \return -1 on faulture or the UID.
  */
-char * mbox_mail_uid(mailbox_t * mbox, int mailnum) {
+int mbox_mail_uid(mailbox_t * mbox, int mailnum) {
     if (mailnum > 0 && mailnum <= mbox->mbox_mailcount) {
-       char * buf = malloc(sizeof(char) * 20);
        int offset = mailnum - 1;
-       snprintf(buf, 19, "%018d",mbox->mbox_map[offset].mail_id);
-       return buf;
+       return mbox->mbox_map[offset].mail_id;
     } else {
-        return NULL;
+        return -1;
     }
 }
 
@@ -396,14 +909,25 @@ void mbox_close(mailbox_t * mbox, int has_quit){
 //! Shut down the mailbox module
 /*! 
  * This closes all resources of the mailbox module. This shoulb be valled
- * before exitting of the application 
+ * before exitting of the application (by each worker thread).
  */
 void mbox_close_app(){
     /* close database, etc */
+    sqlite3_finalize(statement_queue_rcpts);
+    sqlite3_finalize(statement_queue_back);
+    sqlite3_finalize(statement_queue_done);
+    sqlite3_finalize(statement_queue_delay);
+    sqlite3_finalize(statement_queue_load);
+    sqlite3_finalize(statement_queue_next);
+    sqlite3_finalize(statement_queue_claim);
+    sqlite3_finalize(statement_queue_due);
+    sqlite3_finalize(statement_queue_copy);
+    sqlite3_finalize(statement_queue_push);
     sqlite3_finalize(statement_delete);
     sqlite3_finalize(statement_stat);
     sqlite3_finalize(statement_count);
     sqlite3_finalize(statement_fetch);
+    sqlite3_finalize(statement_copy);
     sqlite3_finalize(statement_push);
     sqlite3_close(database);
     INFO_MSG("Mailbox module closed");
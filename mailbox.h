@@ -34,6 +34,7 @@
  */
 
 #include <stdlib.h>
+#include <time.h>
 
 #define MAILBOX_ERROR -1
 #define MAILBOX_OK 0
@@ -41,11 +42,37 @@
 
 typedef struct mailbox  mailbox_t;
 
+struct spool;
 
-void mbox_push_mail(char * user, char * data, size_t size);
+
+int mbox_begin();
+
+int mbox_commit();
+
+void mbox_rollback();
+
+int mbox_push_mail(char ** users, int count, struct spool * body);
+
+int mbox_queue_push(char * from, char ** rcpts, int count, int failable, int active, struct spool * body, long long * ids);
+
+int mbox_queue_claim(long long * ids, int max, time_t now);
+
+time_t mbox_queue_next();
+
+int mbox_queue_load(long long id, char ** from, char ** rcpts, int * failable, time_t * created, int * attempts, struct spool ** body);
+
+int mbox_queue_delay(long long id, char * rcpts, time_t next, int attempts);
+
+int mbox_queue_unclaim(long long id, time_t next);
+
+int mbox_queue_split(long long id, char ** rcpts, int count);
+
+int mbox_queue_done(long long id);
 
 const char * mbox_get_error_msg();
 
+int mbox_init_queue();
+
 int mbox_init_app();
 
 mailbox_t * mbox_init(char* user);
@@ -56,7 +83,7 @@ int mbox_count(mailbox_t * mbox);
 
 size_t mbox_mail_size(mailbox_t * mbox, int mailnum);
 
-char * mbox_mail_uid(mailbox_t * mbox, int mailnum);
+int mbox_mail_uid(mailbox_t * mbox, int mailnum);
 
 int mbox_mark_deleted(mailbox_t * mbox, int mailnum);
 
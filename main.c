@@ -39,10 +39,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "mailbox.h"
 #include "connection.h"
+#include "smtp.h"
+#include "pop3.h"
+#include "forward.h"
+#include "dns.h"
+#include "limit.h"
+#include "spool.h"
+#include "pool.h"
+#include "wheel.h"
 #include "ssl.h"
 #include "fail.h"
 
@@ -60,6 +69,13 @@
     #define REVISION_MAIN "180"
 #endif
 
+//! The msecs between two reports of the statistics of a worker.
+#ifndef STATS_INTERVAL
+    #define STATS_INTERVAL 300000
+#endif
+
+__thread wheel_timer_t stats_timer; //! The timer of the statistics report of the worker.
+
 //! Print a help message
 /*! 
  * This pints a help message for the priogram.
@@ -75,7 +91,16 @@ void print_help(const char * bin_name) {
    printf("\t-u <filename>        Specify the filename of the CSV file.\n");
    printf("\t-H <hostname>        Specify the hostname of the server.\n");
    printf("\t-R <hostname>        Specify the hostname of the relay server.\n");
+   printf("\t-N <ip[:port]>       Specify the nameserver (default from resolv.conf).\n");
    printf("\t-d <dbfile>          Specify the database file of the mailbox.\n");
+   printf("\t-w <workers>         Specify the count of worker threads (default 1).\n");
+   printf("\t-e <epoll|uring>     Specify the event backend (default epoll).\n");
+   printf("\t-b <backlog>         Specify the listen backlog (default 1024).\n");
+   printf("\t-c <max[/prefix]>    Specify the max connections per client (default 50, 0 is unlimited).\n");
+   printf("\t-r <rate[:burst]>    Specify the max new connections per client and second (default 0, unlimited).\n");
+   printf("\t-s <maxsize>         Specify the max size of a mail in KiB (default 10240, 0 is unlimited).\n");
+   printf("\t-t <spooldir>        Specify the directory for big mails (default /tmp).\n");
+   printf("\t-m <window[:budget]> Specify the KiB of memory per mail and of all mails (default 1024:65536).\n");
    printf("\n");
 }
 
@@ -117,7 +142,7 @@ int preprocess_options(int argc, char * argv[]){
        tmp_buf[i]=argv[i];
    }
 
-   while ((c = getopt (argc, tmp_buf, "d:p:u:H:R:Vh")) != -1){
+   while ((c = getopt (argc, tmp_buf, "d:p:u:H:R:N:w:e:b:c:r:t:m:s:Vh")) != -1){
        switch (c) {
            case 'V':
                print_version(argv[0]);
@@ -138,12 +163,50 @@ int preprocess_options(int argc, char * argv[]){
    return ret;
 }
 
-static void exit_sig_handler(int signr){
-  INFO_MSG("Signal recived, exit!");
-  conn_close();
-  ssl_app_destroy();
-  mbox_close_app();
-  exit(0);
+//! Report the statistics of a worker
+/*!
+ * This is the handler of the statistics timer. It logs the occupancy of the
+ * object pools and the DNS cache counters of the worker.
+ * \param data Not used.
+ */
+static void worker_report(void * data){
+    pool_report();
+    dns_report();
+    wheel_arm(&stats_timer, STATS_INTERVAL);
+}
+
+//! A worker thread
+/*!
+ * Each worker has its own database connection, listeners and event loop. If
+ * the worker cannot start, the app is stopped.
+ * \param arg Not used.
+ * \return NULL in any case.
+ */
+static void * worker_main(void * arg){
+    if (MAILBOX_OK != mbox_init_app()) {
+        ERROR_CUSTM("Cannot open the mailbox database");
+        kill(getpid(), SIGTERM);
+        return NULL;
+    }
+
+    if (SMTP_OK == smtp_init() && POP3_OK == pop3_init() && FWD_OK == fwd_init()
+            && CONN_OK == conn_init() && DNS_OK == dns_init()) {
+        wheel_timer_init(&stats_timer, worker_report, NULL);
+        wheel_arm(&stats_timer, STATS_INTERVAL);
+        conn_wait_loop();
+        wheel_cancel(&stats_timer);
+    } else {
+        kill(getpid(), SIGTERM);
+    }
+    fwd_stop();
+    dns_close();
+    conn_close();
+    fwd_close();
+    pop3_close();
+    smtp_close();
+
+    mbox_close_app();
+    return NULL;
 }
 
 
@@ -153,24 +216,72 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    pthread_t * threads;
+    sigset_t    sigs;
+    int         sig;
+    int         num;
+    int         i;
+
+    /* the signals are only taken by sigwait() below, not by the workers */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGQUIT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGABRT, exit_sig_handler);
-    signal(SIGINT, exit_sig_handler);
-    signal(SIGQUIT, exit_sig_handler);
-    signal(SIGTERM, exit_sig_handler);
 
-    config_init(argc, argv);
-    mbox_init_app(config_get_dbfile()); 
-    
+    if (CONFIG_OK != config_init(argc, argv)) {
+        ERROR_CUSTM("Invalid or missing options (-u is required), see -h");
+        return 1;
+    }
+
     ssl_app_init();
+
+    if (DNS_OK != dns_init_app()) {
+        return 1;
+    }
     
-    conn_init();
-    conn_wait_loop();
-    conn_close();
+    if (LIMIT_OK != limit_init_app()) {
+        return 1;
+    }
 
-    ssl_app_destroy();
+    if (SPOOL_OK != spool_init_app()) {
+        return 1;
+    }
 
-    mbox_close_app();
+    if (MAILBOX_OK != mbox_init_queue()) {
+        return 1;
+    }
+
+    if (CONN_OK != conn_init_app()) {
+        return 1;
+    }
+
+    num     = config_get_workers();
+    threads = malloc(sizeof(pthread_t) * num);
+    for (i = 0; i < num; i++) {
+        if (0 != pthread_create(&threads[i], NULL, worker_main, NULL)) {
+            ERROR_SYS("Worker creation");
+            num = i;
+            kill(getpid(), SIGTERM);
+            break;
+        }
+    }
+    INFO_MSG2("%d worker(s) started", num);
+
+    sigwait(&sigs, &sig);
+    INFO_MSG("Signal recived, exit!");
+
+    conn_stop();
+    for (i = 0; i < num; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    conn_close_app();
+    limit_close_app();
+    ssl_app_destroy();
 
     return 0;
 }
@@ -0,0 +1,244 @@
+/* pool.c
+ *
+ * The pool module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+
+#include "pool.h"
+#include "fail.h"
+
+/*!
+ * \defgroup pool Pool Module
+ * This keeps objects of one size (like the socket or session structs) in
+ * slabs, so a new connection takes an object from a free list instead of
+ * calling malloc(). A pool starts with one slab of a given count of objects
+ * and grows by one slab of the same count when it is empty. Released objects
+ * go back to the free list, the slabs are only freed with the pool.
+ * A pool is not thread safe, each worker has its own pools. The pools of a
+ * worker are listed, so pool_report() can log their occupancy at runtime.
+ * @{
+ */
+
+//! The alignment of the objects.
+#define POOL_ALIGN 16
+
+//! A slab of a pool
+/*!
+ * The objects follow this struct, which is a multiple of POOL_ALIGN bytes.
+ */
+struct pool_slab {
+    struct pool_slab * slab_next;   //!< The next slab of the pool.
+    char               slab_pad[POOL_ALIGN - sizeof(struct pool_slab *)]; //!< Aligns the objects.
+};
+
+//! A free object of a pool, the first bytes of it link the free list.
+struct pool_free {
+    struct pool_free * free_next;   //!< The next free object.
+};
+
+//! A pool of objects of one size
+struct pool {
+    const char *       pool_name;   //!< The name of the pool, used for the statistics.
+    size_t             pool_obj;    //!< The size of an object, rounded up to POOL_ALIGN.
+    size_t             pool_count;  //!< The count of objects per slab.
+    size_t             pool_size;   //!< The count of objects in all slabs.
+    size_t             pool_used;   //!< The count of handed out objects.
+    size_t             pool_peak;   //!< The max of pool_used.
+    struct pool_slab * pool_slabs;  //!< The slabs of the pool.
+    struct pool_free * pool_free;   //!< The free objects.
+    pool_t *           pool_next;   //!< The next pool of the worker.
+};
+
+__thread pool_t * pool_list = NULL; //! The pools of the worker.
+
+//! Add a slab to a pool
+/*!
+ * \param pool The pool.
+ * \return 0 on success, -1 if there is no memory.
+ */
+static int pool_grow(pool_t * pool){
+    struct pool_slab * slab = malloc(sizeof(struct pool_slab) + pool->pool_obj * pool->pool_count);
+    struct pool_free * obj;
+    char *             pos;
+    size_t             i;
+
+    if (NULL == slab) {
+        ERROR_SYS("Growing an object pool");
+        return -1;
+    }
+    slab->slab_next  = pool->pool_slabs;
+    pool->pool_slabs = slab;
+
+    /* link the objects backwards, so they are handed out in order */
+    pos = (char *)(slab + 1) + pool->pool_obj * pool->pool_count;
+    for (i = 0; i < pool->pool_count; i++) {
+        pos            -= pool->pool_obj;
+        obj             = (struct pool_free *)pos;
+        obj->free_next  = pool->pool_free;
+        pool->pool_free = obj;
+    }
+    pool->pool_size += pool->pool_count;
+    return 0;
+}
+
+//! Create a pool
+/*!
+ * \param name  The name of the pool, it is not copied.
+ * \param size  The size of the objects.
+ * \param count The count of objects allocated at once.
+ * \return The pool or NULL if there is no memory.
+ */
+pool_t * pool_new(const char * name, size_t size, size_t count){
+    pool_t * pool = malloc(sizeof(pool_t));
+
+    if (NULL == pool) {
+        ERROR_SYS("Creating an object pool");
+        return NULL;
+    }
+    if (size < sizeof(struct pool_free)) {
+        size = sizeof(struct pool_free);
+    }
+    pool->pool_name  = name;
+    pool->pool_obj   = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->pool_count = (0 == count ? 1 : count);
+    pool->pool_size  = 0;
+    pool->pool_used  = 0;
+    pool->pool_peak  = 0;
+    pool->pool_slabs = NULL;
+    pool->pool_free  = NULL;
+
+    if (0 != pool_grow(pool)) {
+        free(pool);
+        return NULL;
+    }
+    pool->pool_next = pool_list;
+    pool_list       = pool;
+    return pool;
+}
+
+//! Take an object from a pool
+/*!
+ * The content of the object is undefined.
+ * \param pool The pool.
+ * \return The object or NULL if the pool is empty and cannot grow.
+ */
+void * pool_alloc(pool_t * pool){
+    struct pool_free * obj;
+
+    if (NULL == pool->pool_free && 0 != pool_grow(pool)) {
+        return NULL;
+    }
+    obj             = pool->pool_free;
+    pool->pool_free = obj->free_next;
+
+    if (++(pool->pool_used) > pool->pool_peak) {
+        pool->pool_peak = pool->pool_used;
+    }
+    return obj;
+}
+
+//! Give an object back to its pool
+/*!
+ * \param pool The pool the object was taken from.
+ * \param obj  The object, may be NULL.
+ */
+void pool_release(pool_t * pool, void * obj){
+    struct pool_free * elem = obj;
+
+    if (NULL == elem) {
+        return;
+    }
+    elem->free_next = pool->pool_free;
+    pool->pool_free = elem;
+    pool->pool_used--;
+}
+
+//! Get the occupancy of a pool
+/*!
+ * \param pool The pool.
+ * \param used The count of objects in use is stored here.
+ * \param size The count of allocated objects is stored here.
+ * \param peak The max count of objects in use at once is stored here.
+ */
+void pool_stats(pool_t * pool, size_t * used, size_t * size, size_t * peak){
+    *used = pool->pool_used;
+    *size = pool->pool_size;
+    *peak = pool->pool_peak;
+}
+
+//! Log the occupancy of the pools
+/*!
+ * This logs the occupancy of all pools of the calling worker, see
+ * pool_stats().
+ */
+void pool_report(){
+    pool_t * pool;
+    size_t   used;
+    size_t   size;
+    size_t   peak;
+
+    for (pool = pool_list; NULL != pool; pool = pool->pool_next) {
+        pool_stats(pool, &used, &size, &peak);
+        INFO_MSG5("Pool %s: %lu of %lu objects in use, peak %lu", pool->pool_name,
+                (unsigned long)used, (unsigned long)size, (unsigned long)peak);
+    }
+}
+
+//! Free a pool
+/*!
+ * This frees all slabs of a pool, objects still in use are gone too. The
+ * occupancy of the pool is logged before.
+ * \param pool The pool, may be NULL.
+ */
+void pool_free(pool_t * pool){
+    struct pool_slab * slab;
+    pool_t **          link;
+
+    if (NULL == pool) {
+        return;
+    }
+    for (link = &pool_list; pool != *link; link = &((*link)->pool_next));
+    *link = pool->pool_next;
+    INFO_MSG4("Pool %s: peak %lu of %lu objects", pool->pool_name,
+            (unsigned long)pool->pool_peak, (unsigned long)pool->pool_size);
+    while (NULL != (slab = pool->pool_slabs)) {
+        pool->pool_slabs = slab->slab_next;
+        free(slab);
+    }
+    free(pool);
+}
+
+/** @} */
@@ -44,12 +44,23 @@
 #include "pop3.h"
 #include "mailbox.h"
 #include "fail.h"
+#include "arena.h"
+#include "pool.h"
 
 /*!
  * \defgroup pop3 POP3 Module
  * @{
  */
 
+//! The time in milliseconds to wait for the next command before the login
+#define POP3_TIMEOUT_AUTH 60000
+
+//! The time in milliseconds to wait for the next command after the login (RFC 1939, 3)
+#define POP3_TIMEOUT_IDLE 600000
+
+//! The count of sessions a worker allocates at once
+#define POP3_POOL 16
+
 //! The states of a pop3 session
 /*!
  * Used to track the state of a pop3 sesseion.
@@ -78,13 +89,15 @@ enum pop3_checks {
  */
 struct pop3_session {
    int              session_writeback_fd;       //!< The fd to write data back to the client.
-   conn_writeback_t session_writeback_fkt;      //!< The function used by the connection module to write data to the client.
    enum pop3_states session_state;              //!< The state of the session.
    int              session_authorized;         //!< Flag indicates if a session is authoized.
    char *           session_user;               //!< Authorized user.
    mailbox_t *      session_mailbox;            //!< Mailbox object of the session.
+   arena_t *        session_arena;              //!< The arena for the strings of the session.
 };
 
+__thread pool_t * pop3_pool = NULL; //! The sessions of the worker.
+
 //! Type of command processing functions
 typedef  int (* pop3_command_fkt_t)(pop3_session_t*, char *);
 
@@ -144,23 +157,22 @@ static const pop3_command_t auth_commands[] = {
  * itself is a \p printf format string.
  * The values for the placeholders can be given as a arglist after the format
  * string.
- * The message is written with the \p write_fkt to enable transparent plain/ssl
- * writing.
- * \param write_fkt The function to write data to the client.
+ * The message is formatted directly into the output buffer of the connection,
+ * so the many lines of a LIST or UIDL are written with a few syscalls.
  * \param write_fd  The filedescriptor to the client.
  * \param msg       The format string of the message.
  * \param ...       The values of the msg placeholders.
  * \return POP3_OK on success, POP3_FAIL else.
  */
-static int pop3_write_client_msg(conn_writeback_t write_fkt, int write_fd, char * msg, ...){
-    static char buf[2048];
+static int pop3_write_client_msg(int write_fd, char * msg, ...){
     va_list arglist;
-    va_start(arglist, msg);
-    size_t len;
+    int     ret;
 
-    len = vsnprintf(buf, 2048, msg, arglist);
+    va_start(arglist, msg);
+    ret = conn_vprintf(write_fd, msg, arglist);
+    va_end(arglist);
 
-    if(write_fkt(write_fd, buf, len) <= 0)
+    if(CONN_FAIL == ret)
 	return POP3_FAIL;
 
     return POP3_OK;
@@ -170,16 +182,15 @@ static int pop3_write_client_msg(conn_writeback_t write_fkt, int write_fd, char
 /*! 
  * This writes a message terminator:
  * \code<cr><lf>.<cr><lf>\endcode 
- * to the client. The data is written with the write_fkt to enable transparent
- * plain/ssl writing. If the \p start_nl flag is set to 0, the \p \<cr>\<lf> at the
+ * to the client. If the \p start_nl flag is set to 0, the \p \<cr>\<lf> at the
  * start will not be written.
  *
  */
-static inline int pop3_write_client_term(conn_writeback_t write_fkt, int write_fd, int start_nl) {
+static inline int pop3_write_client_term(int write_fd, int start_nl) {
     char * term = (start_nl ? "\r\n.\r\n" : ".\r\n");
     int    len  = (start_nl ? 5 : 3);
 
-    if(write_fkt(write_fd, term, len) <= 0)
+    if(CONN_FAIL == conn_enqueue(write_fd, term, len))
         return POP3_FAIL;
 
     return POP3_OK;
@@ -220,7 +231,7 @@ static inline int pop3_strip_newlines(char * orig, int origlen) {
         l--;
     }
 
-    if (orig[origlen - 2] == '\r'){
+    if (origlen > 1 && orig[origlen - 2] == '\r'){
         orig[origlen - 2] = '\0';
         l--;
     }
@@ -237,13 +248,13 @@ static inline int pop3_strip_newlines(char * orig, int origlen) {
  * \return CHECK_OK on success, CHECK_FAIL else.
  */
 static inline int pop3_init_mbox(pop3_session_t * session){
-    if (config_user_locked(session->session_user)) {
+    if (CONFIG_OK != config_lock_mbox(session->session_user)) {
         return CHECK_FAIL;
     }
     if (NULL == (session->session_mailbox = mbox_init(session->session_user))) {
+        config_unlock_mbox(session->session_user);
         return CHECK_FAIL;
     }
-    config_lock_mbox(session->session_user);
     return CHECK_OK;
 }
 
@@ -265,49 +276,45 @@ static inline int pop3_init_mbox(pop3_session_t * session){
 static int pop3_check_passwd(pop3_session_t * session, char * passwd){
 
     if (NULL == session->session_user) {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_PASS_ERR_USER);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_PASS_ERR_USER);
         return CHECK_FAIL;
     }
 
     if( config_verify_user_passwd(session->session_user, passwd) ){
         session->session_authorized = 1;
         if ( CHECK_OK != pop3_init_mbox(session) ) {
-            pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_PASS_ERR_LOCK);
+            pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_PASS_ERR_LOCK);
             return CHECK_QUIT;
         }
         session->session_state = START;
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_PASS_OK);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_PASS_OK);
         INFO_MSG2("POP3 User %s Authenticated", session->session_user);
         return CHECK_OK;
     }
 
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_PASS_ERR_PASS);
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_PASS_ERR_PASS);
     return CHECK_FAIL;
 }
 
 //! Check a user
 /*!
  * This checks if a given user exist in the user table. If it exist, the user
- * will be added to the session struct.
+ * will be added to the session struct. A user of a previous USER command is
+ * released from the session arena before.
  * \param session The current session.
  * \param usr     The user argument of the USER command.
  * \return CHECK_OK on success, CHECK_FAIL else.
  */
 static int pop3_check_user(pop3_session_t * session, char * usr){
-    char * buf;
-    int l;
-
-    l = strlen(usr) + 1;
+    arena_release(session->session_arena, NULL);
+    session->session_user = NULL;
 
-    if (config_has_user(usr)) {
-        buf = malloc(sizeof(char) * (l));
-        memcpy(buf, usr, l);
-        session->session_user = buf;
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_USER_OK);
+    if (config_has_user(usr) && NULL != (session->session_user = arena_strndup(session->session_arena, usr, strlen(usr)))) {
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_USER_OK);
         return CHECK_OK;
     }
 
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_USER_ERR);
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_USER_ERR);
     return CHECK_FAIL;
 }
 
@@ -335,7 +342,7 @@ static int pop3_quit_session(pop3_session_t * session, char * foo) {
         }
     }
     session->session_state = QUIT;
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_QUIT);
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_QUIT);
     return CHECK_QUIT;
 }
 
@@ -351,7 +358,7 @@ static int pop3_stat_mailbox(pop3_session_t * session, char * arg) {
     if (NULL == session->session_mailbox) {
         return CHECK_FAIL;
     }
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_STAT, mbox_count(session->session_mailbox), mbox_size(session->session_mailbox));
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_STAT, mbox_count(session->session_mailbox), mbox_size(session->session_mailbox));
     return CHECK_OK;
 }
 
@@ -378,19 +385,19 @@ static int pop3_list_mailbox(pop3_session_t * session, char * arg) {
         if (mbox_count(session->session_mailbox) >= i &&
                 0 < i &&
                 ! mbox_is_msg_deleted(session->session_mailbox, i)) {
-            pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_LIST, i, mbox_mail_size(session->session_mailbox, i));
+            pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_LIST, i, mbox_mail_size(session->session_mailbox, i));
         } else {
-            pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_LIST_ERR);
+            pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_LIST_ERR);
             return CHECK_FAIL;
         }
     } else {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_LIST_OK, mbox_count(session->session_mailbox), mbox_size(session->session_mailbox)); 
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_LIST_OK, mbox_count(session->session_mailbox), mbox_size(session->session_mailbox)); 
         for (i = 1; i <= mbox_count(session->session_mailbox); i++){
             if (! mbox_is_msg_deleted(session->session_mailbox, i)) {
-                pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_LIST_LINE, i, mbox_mail_size(session->session_mailbox, i));
+                pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_LIST_LINE, i, mbox_mail_size(session->session_mailbox, i));
             }
         }
-        pop3_write_client_term(session->session_writeback_fkt, session->session_writeback_fd, 0);
+        pop3_write_client_term(session->session_writeback_fd, 0);
     }
     return CHECK_OK;
 }
@@ -407,7 +414,6 @@ static int pop3_list_mailbox(pop3_session_t * session, char * arg) {
 static int pop3_uidl_mailbox(pop3_session_t * session, char * arg) {
     int    i;
     int    l = strlen(arg);
-    char * buf;
    
     if (NULL == session->session_mailbox) {
          return CHECK_FAIL;
@@ -418,23 +424,19 @@ static int pop3_uidl_mailbox(pop3_session_t * session, char * arg) {
         if (mbox_count(session->session_mailbox) >= i &&
                 0 < i &&
                 ! mbox_is_msg_deleted(session->session_mailbox, i)) {
-            buf = mbox_mail_uid(session->session_mailbox, i);
-            pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_UIDL, i, buf);
-            free(buf);
+            pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_UIDL, i, mbox_mail_uid(session->session_mailbox, i));
         } else {
-            pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_UIDL_ERR);
+            pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_UIDL_ERR);
             return CHECK_FAIL;
         }
     } else {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_UIDL_OK); 
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_UIDL_OK); 
         for (i = 1; i <= mbox_count(session->session_mailbox); i++){
             if (! mbox_is_msg_deleted(session->session_mailbox, i)) {
-                buf = mbox_mail_uid(session->session_mailbox, i);
-                pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_UIDL_LINE, i, buf);
-                free(buf);
+                pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_UIDL_LINE, i, mbox_mail_uid(session->session_mailbox, i));
             }
         }
-        pop3_write_client_term(session->session_writeback_fkt, session->session_writeback_fd, 0);
+        pop3_write_client_term(session->session_writeback_fd, 0);
     }
     return CHECK_OK;
 }
@@ -456,7 +458,7 @@ static int pop3_retr_mailbox(pop3_session_t * session, char * arg) {
     }
 
     if (0 == l) {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_DELE_ERR);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_DELE_ERR);
         return CHECK_FAIL;
     }
     i = atoi(arg);
@@ -466,15 +468,17 @@ static int pop3_retr_mailbox(pop3_session_t * session, char * arg) {
             ! mbox_is_msg_deleted(session->session_mailbox, i)) {
 
         mbox_get_mail(session->session_mailbox, i, &buf, &l);
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_RETR_OK, mbox_mail_size(session->session_mailbox, i));
-        if (session->session_writeback_fkt(session->session_writeback_fd, buf, l) <= 0)
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_RETR_OK, mbox_mail_size(session->session_mailbox, i));
+        if (CONN_FAIL == conn_enqueue(session->session_writeback_fd, buf, l)) {
+            free(buf);
             return CHECK_FAIL;
+        }
         free(buf);
-        pop3_write_client_term(session->session_writeback_fkt, session->session_writeback_fd, 1);
+        pop3_write_client_term(session->session_writeback_fd, 1);
         return CHECK_OK;
 
     } else {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_RETR_ERR);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_RETR_ERR);
         return CHECK_FAIL;
     }
 }
@@ -495,7 +499,7 @@ static int pop3_dele_mailbox(pop3_session_t * session, char * arg) {
     }
 
     if (0 == l) {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_DELE_ERR);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_DELE_ERR);
         return CHECK_FAIL;
     }
     i = atoi(arg);
@@ -504,10 +508,10 @@ static int pop3_dele_mailbox(pop3_session_t * session, char * arg) {
             0 < i &&
             ! mbox_is_msg_deleted(session->session_mailbox, i)) {
         mbox_mark_deleted(session->session_mailbox, i);
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_DELE_OK, i);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_DELE_OK, i);
         return CHECK_OK;
     } else {
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_DELE_ERR);
+        pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_DELE_ERR);
         return CHECK_FAIL;
     }
 }
@@ -526,7 +530,7 @@ static int pop3_rset_mailbox(pop3_session_t * session, char * arg) {
     }
 
     mbox_reset(session->session_mailbox);
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_RSET);
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_RSET);
 
     return CHECK_OK;
 }
@@ -539,7 +543,7 @@ static int pop3_rset_mailbox(pop3_session_t * session, char * arg) {
  * \return CHECK_OK in any case.
  */
 static int pop3_noop_mailbox(pop3_session_t * session, char * arg) {
-    pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, POP3_MSG_NOOP);
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_NOOP);
     return CHECK_OK;
 }
 /** @} */
@@ -612,44 +616,69 @@ static inline int pop3_process_cmd_list(char * msg, ssize_t msglen, pop3_session
         }
     }
     if (0 == t)
-        pop3_write_client_msg(session->session_writeback_fkt, session->session_writeback_fd, "-ERR\r\n");
+        pop3_write_client_msg(session->session_writeback_fd, "-ERR\r\n");
     return CONN_CONT;
 }
 
 /** \name Session creation
  * @{ */
 
+//! Init the POP3 module of a worker
+/*!
+ * This creates the session pool of the calling worker.
+ * \return POP3_OK on success, POP3_FAIL else.
+ */
+int pop3_init(){
+    if (NULL == (pop3_pool = pool_new("pop3", sizeof(pop3_session_t), POP3_POOL))) {
+        return POP3_FAIL;
+    }
+    return POP3_OK;
+}
+
+//! Close the POP3 module of a worker
+/*!
+ * This frees the session pool of the calling worker, it must be called
+ * after conn_close().
+ */
+void pop3_close(){
+    pool_free(pop3_pool);
+    pop3_pool = NULL;
+}
+
 //! Create a pop3 session
 /*!
- * Creates a new session and initialize all data. It also sets the correct
- * writeback function for the connection type.
+ * Creates a new session and initialize all data. The greeting is queued to
+ * the client.
  * \param writeback_socket The filedescriptor to the client.
- * \param ssl              Flag if it is a plain or a ssl session.
  * \return a new session or NULL on failture.
  */
-pop3_session_t * pop3_create_session(int writeback_socket, int ssl){
+pop3_session_t * pop3_create_session(int writeback_socket){
     pop3_session_t * new = NULL;
-    conn_writeback_t fkt = ( ssl ? conn_writeback_ssl : conn_writeback);
     const char * myhost  = "localhost";
 
     if (NULL != config_get_hostname()) {
 	myhost = config_get_hostname();
     }
 
-    if (POP3_FAIL == pop3_write_client_msg(fkt, writeback_socket, POP3_MSG_GREET, myhost)){
+    if (POP3_FAIL == pop3_write_client_msg(writeback_socket, POP3_MSG_GREET, myhost)){
 	ERROR_SYS("Writeback fail on pop3 init");
         return new;
     }
 
-    new = malloc(sizeof(pop3_session_t)); 
+    new = pool_alloc(pop3_pool); 
+    if (NULL == new || NULL == (new->session_arena = arena_new())) {
+        ERROR_SYS("Allocate a POP3 session");
+        pool_release(pop3_pool, new);
+        return NULL;
+    }
 
     new->session_writeback_fd  = writeback_socket;
-    new->session_writeback_fkt = fkt;
     new->session_state         = AUTH;
     new->session_authorized    = 0;
     new->session_user          = NULL;
     new->session_mailbox       = NULL;
 
+    conn_set_timeout(writeback_socket, POP3_TIMEOUT_AUTH);
     INFO_MSG("POP3 Session created");
 
     return new;
@@ -657,24 +686,26 @@ pop3_session_t * pop3_create_session(int writeback_socket, int ssl){
 
 //! Create a plain POP3 session
 /*!
- * Simply calls pop3_create_session with ssl = 0.
+ * Simply calls pop3_create_session(), the encryption is done by the
+ * connection module.
  * \param writeback_socket The filedescriptor to the client.
  * \return a new session or NULL on failture.
  * \sa pop3_create_session()
  */
 pop3_session_t * pop3_create_normal_session(int writeback_socket){
-    return pop3_create_session(writeback_socket, 0);
+    return pop3_create_session(writeback_socket);
 }
 
 //! Create a ssl POP3 Session
 /*!
- * Simply calls pop3_create_session with ssl = 1.
+ * Simply calls pop3_create_session(), the encryption is done by the
+ * connection module.
  * \param writeback_soket The filedescriptor to the client.
  * \return a new session or NULL on failture.
  * \sa pop3_create_session()
  */
 pop3_session_t * pop3_create_ssl_session(int writeback_soket) {
-    return pop3_create_session(writeback_soket, 1);
+    return pop3_create_session(writeback_soket);
 }
 
 /** @} */
@@ -704,9 +735,28 @@ int pop3_process_input(char * msg, ssize_t msglen, pop3_session_t * session){
             return CONN_QUIT;
             break;
     }
+    if (CONN_CONT == ret) {
+        conn_set_timeout(session->session_writeback_fd,
+                (START == session->session_state ? POP3_TIMEOUT_IDLE : POP3_TIMEOUT_AUTH));
+    }
     return ret;
 }
 
+//! Handle the timeout of a POP3 connection
+/*!
+ * This is called by the connection module if the client did not send a
+ * command within the timeout. As defined in RFC 1939 the session ends without
+ * entering the update state, so no message is deleted.
+ * \param session The session of the connection.
+ * \return CONN_QUIT in any case.
+ */
+int pop3_timeout(pop3_session_t * session){
+    INFO_MSG("POP3 Session timed out");
+    session->session_state = QUIT;
+    pop3_write_client_msg(session->session_writeback_fd, POP3_MSG_TIMEOUT);
+    return CONN_QUIT;
+}
+
 //! Destroys a pop3 session
 /*!
  * This destroys a pop3 session, quits the mailbox, releases the lock and frees
@@ -720,10 +770,8 @@ int pop3_destroy_session(pop3_session_t * session){
             mbox_close(session->session_mailbox,0);        
             config_unlock_mbox(session->session_user);
         }
-        if (NULL != session->session_user) {  
-            free(session->session_user);
-        }
-        free(session);
+        arena_free(session->session_arena);
+        pool_release(pop3_pool, session);
     }
     INFO_MSG("POP3 Session destroyed");
 
@@ -50,9 +50,9 @@
 #define POP3_MSG_LIST_LINE      "%d %d\r\n"                             // Count, Size
 #define POP3_MSG_LIST_ERR	"-ERR No such message\r\n"
 
-#define POP3_MSG_UIDL		"+OK %d %s\r\n"				// Count, UID
+#define POP3_MSG_UIDL		"+OK %d %018d\r\n"			// Count, UID
 #define POP3_MSG_UIDL_OK	"+OK\r\n"
-#define POP3_MSG_UIDL_LINE      "%d %s\r\n"                             // Count, UID
+#define POP3_MSG_UIDL_LINE      "%d %018d\r\n"                          // Count, UID
 #define POP3_MSG_UIDL_ERR	"-ERR No such message\r\n"
 
 #define POP3_MSG_RETR_OK	"+OK %d Octets\r\n"			// Msg size
@@ -67,14 +67,21 @@
 
 #define POP3_MSG_QUIT		"+OK Bye\r\n"
 
+#define POP3_MSG_LIMIT		"-ERR %s Too many connections from your host\r\n"	// Hostname
+
+#define POP3_MSG_TIMEOUT	"-ERR Autologout, idle for too long\r\n"
+
 #define POP3_OK    0
 #define POP3_FAIL -1
 
 
 typedef struct pop3_session pop3_session_t;
 
+int pop3_init();
+void pop3_close();
 pop3_session_t * pop3_create_normal_session(int writeback_socket);
 pop3_session_t * pop3_create_ssl_session(int writeback_soket);
 int pop3_process_input(char * msg, ssize_t msglen, pop3_session_t * data);
 int pop3_destroy_session(pop3_session_t * session);
+int pop3_timeout(pop3_session_t * session);
 
@@ -0,0 +1,319 @@
+/* scan.c
+ *
+ * The scan module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#endif
+
+#include "scan.h"
+
+/*!
+ * \defgroup scan Scan Module
+ * @{
+ */
+
+//! Function prototype for the LF search
+typedef const char * (* scan_lf_t)(const char * buf, size_t len);
+
+//! Function prototype for the DATA terminator search
+typedef const char * (* scan_end_t)(const char * buf, size_t len, size_t * complete);
+
+//! Check for a terminator line
+/*!
+ * Checks if at \p pos starts the line \p ".\<cr>\<lf>".
+ * \param pos The start of the line.
+ * \param end The end of the buffer.
+ * \return 1 if a terminator line starts at pos, 0 else.
+ */
+static inline int scan_is_term(const char * pos, const char * end){
+    return (end - pos >= 3 && '.' == pos[0] && '\r' == pos[1] && '\n' == pos[2]);
+}
+
+/** \name Functions: Scalar implementation
+ * @{ */
+
+//! Find the first LF (scalar)
+static const char * scan_lf_scalar(const char * buf, size_t len){
+    return memchr(buf, '\n', len);
+}
+
+//! Search the DATA terminator from a position on (scalar)
+/*!
+ * Checks every LF from \p pos on if it is followed by the terminator line.
+ * \param pos  The position to start.
+ * \param end  The end of the buffer.
+ * \param last Place to store the last found LF, untouched if there is none.
+ * \return A pointer to the dot of the terminator line or NULL.
+ */
+static inline const char * scan_data_end_tail(const char * pos, const char * end, const char ** last){
+    while (NULL != (pos = memchr(pos, '\n', end - pos))) {
+        *last = pos++;
+        if (scan_is_term(pos, end)) {
+            return pos;
+        }
+    }
+    return NULL;
+}
+
+//! Find the DATA terminator (scalar)
+static const char * scan_data_end_scalar(const char * buf, size_t len, size_t * complete){
+    const char * last = NULL;
+    const char * term;
+
+    if (scan_is_term(buf, buf + len)) {
+        return buf;
+    }
+    if (NULL != (term = scan_data_end_tail(buf, buf + len, &last))) {
+        return term;
+    }
+    *complete = (NULL == last ? 0 : last + 1 - buf);
+    return NULL;
+}
+
+/** @} */
+
+#ifdef SCAN_HAVE_X86
+
+/** \name Functions: SSE2 implementation
+ * @{ */
+
+//! Find the first LF (SSE2)
+__attribute__((target("sse2")))
+static const char * scan_lf_sse2(const char * buf, size_t len){
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t        i  = 0;
+    int           m;
+
+    for (; i + 16 <= len; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), lf));
+        if (m) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+    return scan_lf_scalar(buf + i, len - i);
+}
+
+//! Find the DATA terminator (SSE2)
+/*!
+ * A candidate is a LF directly followed by a dot, both are compared in one
+ * step by loading the block a second time shifted by one byte.
+ */
+__attribute__((target("sse2")))
+static const char * scan_data_end_sse2(const char * buf, size_t len, size_t * complete){
+    const __m128i lf   = _mm_set1_epi8('\n');
+    const __m128i dot  = _mm_set1_epi8('.');
+    const char *  end  = buf + len;
+    const char *  last = NULL;
+    const char *  tail;
+    size_t        i    = 0;
+    unsigned      mlf, mdot, m;
+
+    if (scan_is_term(buf, end)) {
+        return buf;
+    }
+    for (; i + 17 <= len; i += 16) {
+        mlf  = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), lf));
+        if (0 == mlf) {
+            continue;
+        }
+        mdot = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), dot));
+        for (m = mlf & mdot; m; m &= m - 1) {
+            if (scan_is_term(buf + i + __builtin_ctz(m) + 1, end)) {
+                return buf + i + __builtin_ctz(m) + 1;
+            }
+        }
+        last = buf + i + 31 - __builtin_clz(mlf);
+    }
+
+    if (NULL != (tail = scan_data_end_tail(buf + i, end, &last))) {
+        return tail;
+    }
+    *complete = (NULL == last ? 0 : last + 1 - buf);
+    return NULL;
+}
+
+/** @} */
+
+/** \name Functions: AVX2 implementation
+ * @{ */
+
+//! Find the first LF (AVX2)
+__attribute__((target("avx2")))
+static const char * scan_lf_avx2(const char * buf, size_t len){
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t        i  = 0;
+    unsigned      m;
+
+    for (; i + 32 <= len; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), lf));
+        if (m) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+    return scan_lf_sse2(buf + i, len - i);
+}
+
+//! Find the DATA terminator (AVX2)
+/*!
+ * Works like scan_data_end_sse2() with 32 byte blocks.
+ */
+__attribute__((target("avx2")))
+static const char * scan_data_end_avx2(const char * buf, size_t len, size_t * complete){
+    const __m256i lf   = _mm256_set1_epi8('\n');
+    const __m256i dot  = _mm256_set1_epi8('.');
+    const char *  end  = buf + len;
+    const char *  last = NULL;
+    const char *  tail;
+    size_t        i    = 0;
+    unsigned      mlf, mdot, m;
+
+    if (scan_is_term(buf, end)) {
+        return buf;
+    }
+    for (; i + 33 <= len; i += 32) {
+        mlf  = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), lf));
+        if (0 == mlf) {
+            continue;
+        }
+        mdot = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), dot));
+        for (m = mlf & mdot; m; m &= m - 1) {
+            if (scan_is_term(buf + i + __builtin_ctz(m) + 1, end)) {
+                return buf + i + __builtin_ctz(m) + 1;
+            }
+        }
+        last = buf + i + 31 - __builtin_clz(mlf);
+    }
+
+    if (NULL != (tail = scan_data_end_tail(buf + i, end, &last))) {
+        return tail;
+    }
+    *complete = (NULL == last ? 0 : last + 1 - buf);
+    return NULL;
+}
+
+/** @} */
+
+#endif
+
+static const char * scan_lf_init(const char * buf, size_t len);
+static const char * scan_data_end_init(const char * buf, size_t len, size_t * complete);
+
+static scan_lf_t    scan_lf_impl       = scan_lf_init;          //!< The chosen LF search.
+static scan_end_t   scan_data_end_impl = scan_data_end_init;    //!< The chosen DATA terminator search.
+static const char * scan_name          = "scalar";              //!< The name of the chosen implementation.
+
+//! Choose the implementation
+/*!
+ * This chooses the best implementation the cpu supports. It is called once on
+ * the first use of the module.
+ */
+static void scan_choose_impl(){
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_name          = "avx2";
+        scan_data_end_impl = scan_data_end_avx2;
+        scan_lf_impl       = scan_lf_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        scan_name          = "sse2";
+        scan_data_end_impl = scan_data_end_sse2;
+        scan_lf_impl       = scan_lf_sse2;
+        return;
+    }
+#endif
+    scan_data_end_impl = scan_data_end_scalar;
+    scan_lf_impl       = scan_lf_scalar;
+}
+
+//! First call of scan_lf()
+static const char * scan_lf_init(const char * buf, size_t len){
+    scan_choose_impl();
+    return scan_lf_impl(buf, len);
+}
+
+//! First call of scan_data_end()
+static const char * scan_data_end_init(const char * buf, size_t len, size_t * complete){
+    scan_choose_impl();
+    return scan_data_end_impl(buf, len, complete);
+}
+
+//! Find the next line end
+/*!
+ * Searches the first LF char in the buffer. This is the same as memchr(), but
+ * uses the vector unit of the cpu if available.
+ * \param buf The buffer to search.
+ * \param len The length of the buffer.
+ * \return A pointer to the LF or NULL if there is none.
+ */
+const char * scan_lf(const char * buf, size_t len){
+    return scan_lf_impl(buf, len);
+}
+
+//! Find the end of a mail body
+/*!
+ * This searches the terminator line \p ".\<cr>\<lf>" of a SMTP DATA block in
+ * one pass over the buffer. The buffer must start at the begin of a line.
+ * If the terminator is not found, \p *complete is set to the length of the
+ * complete lines in the buffer (up to and including the last LF), this part
+ * is body data for sure.
+ * \param buf      The buffer to search.
+ * \param len      The length of the buffer.
+ * \param complete Place to store the length of the complete lines.
+ * \return A pointer to the dot of the terminator line or NULL.
+ */
+const char * scan_data_end(const char * buf, size_t len, size_t * complete){
+    *complete = 0;
+    return scan_data_end_impl(buf, len, complete);
+}
+
+//! Name of the used implementation
+/*!
+ * \return The name of the implementation chosen for this cpu.
+ */
+const char * scan_impl_name(){
+    if (scan_lf_init == scan_lf_impl) {
+        scan_choose_impl();
+    }
+    return scan_name;
+}
+
+/** @} */
@@ -36,6 +36,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <netdb.h>
@@ -54,12 +56,35 @@
 #include "config.h"
 #include "fail.h"
 #include "mailbox.h"
+#include "scan.h"
+#include "dns.h"
+#include "spool.h"
+#include "arena.h"
+#include "pool.h"
 
 /*!
  * \defgroup smtp SMTP Module
  * @{
  */
 
+//! Lines of the DATA block longer than this are stored in pieces.
+#define SMTP_MAX_LINE 4096
+
+//! The time in milliseconds a new client has to say HELO or EHLO
+#define SMTP_TIMEOUT_GREET   60000
+
+//! The time in milliseconds to wait for the next command (RFC 5321, 4.5.3.2.7)
+#define SMTP_TIMEOUT_COMMAND 300000
+
+//! The time in milliseconds to wait for the next data of the DATA block (RFC 5321, 4.5.3.2.7)
+#define SMTP_TIMEOUT_DATA    180000
+
+//! The count of sessions a worker allocates at once
+#define SMTP_POOL 64
+
+//! The max count of recipients of a mail (RFC 5321, 4.5.3.1.8)
+#define SMTP_MAX_RCPT 100
+
 //! States of a check
 /*! 
  * These are the states a check of a client committed command can have after
@@ -101,8 +126,9 @@ enum session_states {
     HELO,       //!< A session after HELO (if it is a ESMTP session, a valid auth has already happened here), waiting for MAIL FROM.
     EHLO,       //!< A session after EHLO (waiting for AUTH).
     FROM,       //!< A session after MAIL FROM, waiting for RCPT TO.
-    RCPT,       //!< A session after RCPT TO, waiting for DATA.
+    RCPT,       //!< A session after RCPT TO, waiting for DATA or further RCPT TO.
     DATA,       //!< A session after DATA, waiting for the data block, terminated with \p '\<cr>\<lf>.\<cr>\<lf>'.
+    BDAT,       //!< A session receiving the body in BDAT chunks, waiting for the next chunk.
     AUTH,       //!< A session waiting for auth credentials.
     QUIT,       //!< A terminated session.
 };
@@ -126,6 +152,19 @@ enum smtp_types {
     ESMTP	//!< A extended smtp session.
 };
 
+typedef struct smtp_rcpt smtp_rcpt_t;
+
+//! A recipient of a mail
+/*!
+ * The recipients of a mail are kept in a list in the order they were given,
+ * allocated from the session arena.
+ */
+struct smtp_rcpt {
+    char *              rcpt_addr;		//!< The address given by RCPT TO.
+    int                 rcpt_local;		//!< A Flag if the recipient is local or not.
+    smtp_rcpt_t *       rcpt_next;		//!< The next recipient or NULL.
+};
+
 //! The smtp session structure
 /*! 
  * This structure contains all informations of a smtp session. It will be
@@ -138,106 +177,44 @@ struct smtp_session {
     char *              session_host;		//!< The hostname of the session, given by HELO.
     int                 session_authenticated;	//!< Flag indicates if a session is authorized or not.
     char *              session_from;		//!< The sender given by MAIL FROM.
-    char *              session_to;		//!< The recipient of the mail given by RCPT TO.
+    char *              session_to;		//!< The recipient given by the RCPT TO which is checked.
     int                 session_writeback_fd;	//!< The fd to write messages back to the client.
-    int                 session_rcpt_local;	//!< A Flag if the given recipient is local or not.
-    body_line_t *       session_data;		//!< The data of the current mail.
+    smtp_rcpt_t *       session_rcpts;		//!< The accepted recipients of the mail.
+    int                 session_rcpt_count;	//!< The count of accepted recipients.
+    int                 session_rcpt_local;	//!< The count of accepted local recipients.
+    spool_t *           session_data;		//!< The data of the current mail or NULL.
+    int                 session_data_midline;	//!< Flag indicates that the stored data ends in the middle of a line.
+    int                 session_data_oversize;	//!< Flag indicates that the mail exceeded the max size, the rest of the body is dropped.
+    size_t              session_chunk;		//!< The bytes of the current BDAT chunk still to read.
+    size_t              session_chunk_size;	//!< The size of the current BDAT chunk.
+    int                 session_chunk_last;	//!< Flag indicates that the current BDAT chunk ends the mail.
+    int                 session_chunk_drop;	//!< Flag indicates that the current BDAT chunk is rejected and only read.
+    int                 session_query;		//!< The DNS query of a address verification or -1.
+    arena_t *           session_arena;		//!< The arena for the strings of the session and its mails.
+    void *              session_mark;		//!< The mark in session_arena the data of a mail starts at.
 };
 
+__thread pool_t * smtp_pool = NULL; //! The sessions of the worker.
 
 
-//! Resolve MX host.
-/*!
- * This resolve a mx host of a given address with the libc resolver. This is a
- * bit magic and hard to understand because it is barely documented.
- * The code used here is inspired by some code of the clamav virus scanner.
- * The main problem is that it works with blocking io, so the server blocks
- * until a mx entry is found (or the timeout is over). I think for this piece of
- * software, which is only intended to steal the time of the students (yes, we
- * already implemented a mail server in ,,Systemprogrammierung'') this is ok.
- * \param host The address to resolve a mx entry.
- * \return The mx entry as (null terminated) char sequence or NULL.
- */
-char * smtp_resolve_mx(const char * host){
-    u_char *p, *end;
-    char name[MAXHOSTNAMELEN + 1];
-    char buf[1024];
-    char * ret = NULL;
-    union {
-        HEADER h;
-        u_char u[PACKETSZ];
-    } q;
-    const HEADER *hp;
-    int len, i;
-
-    strncpy(name,host,MAXHOSTNAMELEN);
-
-    len = res_query(name, C_IN, T_MX, (u_char *)&q, sizeof(q));
-    if(len < 0) {
-        return ret; /* Host has no MX records */
-    }
-
-    if((unsigned int)len > sizeof(q)) 
-    {
-        return ret;
-    }
-
-    hp = &(q.h);
-    p = q.u + HFIXEDSZ;
-    end = q.u + len;
-
-    for(i = ntohs(hp->qdcount); i--; p += len + QFIXEDSZ)
-        if((len = dn_skipname(p, end)) < 0) {
-            return ret;
-        }
-
-    i = ntohs(hp->ancount);
-
-    while((--i >= 0) && (p < end)) 
-    {
-        u_short type, pref;
-        u_long ttl;     /* unused */
-
-        if((len = dn_expand(q.u, end, p, buf, sizeof(buf) - 1)) < 0)
-        {
-            return ret;
-        }
-        p += len;
-        GETSHORT(type, p);
-        p += INT16SZ;
-        GETLONG(ttl, p);
-        GETSHORT(len, p);
-        if(type != T_MX) {
-            p += len;
-            continue;
-        }
-        GETSHORT(pref, p);
-        if((len = dn_expand(q.u, end, p, buf, sizeof(buf) - 1)) < 0)
-        {
-            return ret;
-        }
-
-        len = strlen(buf) + 1;        
-        ret = malloc(sizeof(char) * len);
-        memcpy(ret, buf, len);
-        return ret;
-    }
-    return ret;
-}
 
 //! Base64 decode a string
 /*!
  * This decodes a base64 encoded char sequence. It uses the openssl lib to 
  * decode.
+ * \param arena  The arena to allocate the result from.
  * \param input  The input char sequence.
  * \param length The length of the input sequence.
- * \return The decoded char sequence.
+ * \return The decoded char sequence or NULL if there is no memory.
  */
-char * smtp_unbase64(unsigned char *input, int length)
+char * smtp_unbase64(arena_t * arena, unsigned char *input, int length)
 {
     BIO *b64, *bmem;
 
-    char * buffer = malloc(sizeof(char) * length);
+    char * buffer = arena_alloc(arena, length);
+    if (NULL == buffer) {
+        return NULL;
+    }
     memset(buffer, 0, length);
 
     b64 = BIO_new(BIO_f_base64());
@@ -259,6 +236,8 @@ char * smtp_unbase64(unsigned char *input, int length)
  * The message must be a snprintf() format string. It must contain a %d for the
  * status and optional a %s for the optional argument.
  * If the argument is NULL, it will not be added.
+ * The message is formatted into the output buffer of the connection, so the
+ * lines of a multi-line reply are written together.
  * \param fd     The file descriptor  to write the message.
  * \param status The return status for the client.
  * \param msg    The message (format string).
@@ -266,25 +245,14 @@ char * smtp_unbase64(unsigned char *input, int length)
  * \return SMTP_OK on success, SMTP_FAIL else.
  */
 int smtp_write_client_msg(int fd, int status, const char *msg, const char *add){
-    int len, ret = SMTP_FAIL;
-    char *buff;
+    int ret;
 
     if(add == NULL){
-        len = strlen(msg)+10;
-    } else {
-        len = strlen(msg) + strlen(add) + 20;
-    }
-    buff = malloc(sizeof(char) * len);
-    if(add == NULL){
-        len = snprintf(buff, len - 1, msg , status);
+        ret = conn_printf(fd, msg, status);
     } else {
-        len = snprintf(buff, len - 1, msg , status, add);
-    }
-    if(conn_writeback(fd, buff, len+1) > 0){
-        ret = SMTP_OK;
+        ret = conn_printf(fd, msg, status, add);
     }
-    free(buff);
-    return ret;
+    return (CONN_OK == ret ? SMTP_OK : SMTP_FAIL);
 }
 
 //! Check if a Prefix is correct
@@ -322,10 +290,11 @@ static inline int smtp_check_prefix(char *buf,  char *prefix) {
  * \param check_fkt The function to validate the argument.
  * \param val	    A pointer to some space where the pointer of the argument
  *                  should be placed.
+ * \param arena     The arena to allocate the copy of the argument from.
  * \return CHECK_OK on success, CHECK_DELIM if delimiter not found, CHECK_PREF
  *                  if prefix is not ok, CHECK_ARG if argument check failed.
  */
-static int smtp_check_input(char *buff,  char *prefix, char delim, int (*check_fkt)(char *), char **val){
+static int smtp_check_input(char *buff,  char *prefix, char delim, int (*check_fkt)(char *), char **val, arena_t * arena){
     char *arg;
     int check;
     int len = strlen(buff);
@@ -334,6 +303,10 @@ static int smtp_check_input(char *buff,  char *prefix, char delim, int (*check_f
     if(val != NULL){
         *val = NULL;
     }
+    /* a shorter line cannot match, the search would start behind its end */
+    if(len < plen){
+        return CHECK_PREF;
+    }
     if((arg = strchr(buff+plen, delim)) == NULL){
         return CHECK_DELIM;
     }
@@ -358,10 +331,8 @@ static int smtp_check_input(char *buff,  char *prefix, char delim, int (*check_f
             return (check == ARG_BAD_MSG ? CHECK_ARG_MSG : CHECK_ARG);
         }
 
-        if(val != NULL){
-            len = strlen(arg) + 1;
-            *val = malloc(sizeof(char) * len);
-            memcpy(*val, arg, len);
+        if(val != NULL && NULL == (*val = arena_strndup(arena, arg, strlen(arg)))){
+            return CHECK_ABRT;
         }
     } else {
     }
@@ -373,41 +344,43 @@ static int smtp_check_input(char *buff,  char *prefix, char delim, int (*check_f
  * This clean a session structure from all mail specific content. This is used
  * to free space after delivery of a mail, reset of or abort of a session.
  * After this function a new mail can be sent with the same session structure.
+ * All data allocated from the session arena after the session mark is
+ * released at once.
  * \param session The session structure.
  */
 static void smtp_clean_mail_fields(smtp_session_t * session) {
     session->session_state = HELO;
-    if (NULL != session->session_user)
-        free(session->session_user);
-    session->session_user = NULL;
-    if (NULL != session->session_from)
-        free(session->session_from);
-    session->session_from = NULL;
-    if (NULL != session->session_to)
-        free(session->session_to);
-    session->session_to = NULL;
+    session->session_user  = NULL;
+    session->session_from  = NULL;
+    session->session_to    = NULL;
+    session->session_rcpts = NULL;
+    session->session_rcpt_count = 0;
     session->session_rcpt_local = 0;
+    arena_release(session->session_arena, session->session_mark);
+}
+
+//! Keep the data of a session
+/*!
+ * This moves the session mark behind the data allocated so far, like the
+ * HELO name and the authorized user, so it is not released with the data of
+ * a mail by smtp_clean_mail_fields().
+ * \param session The session structure.
+ */
+static inline void smtp_mark_session(smtp_session_t * session) {
+    session->session_mark = arena_mark(session->session_arena);
 }
 
 
-//! Deletes all body lines of a session
+//! Deletes the body of a session
 /*!
- * This deletes all body content of a given session and set the session_data
+ * This frees the body data of a given session and set the session_data
  * field to NULL.
  * \param session The session structure.
  */
-static void smtp_delete_body_lines(smtp_session_t * session){
-    body_line_t * tmp1 = session->session_data;
-    body_line_t * tmp2 = session->session_data;
-
-    while (NULL != tmp1){
-        tmp2 = tmp1;
-        tmp1 = tmp1->line_next;
-        if (NULL != tmp2->line_data && 0 != tmp2->line_len)
-            free(tmp2->line_data);
-        free(tmp2);
-    }
-    session->session_data = NULL;
+static void smtp_delete_body(smtp_session_t * session){
+    spool_free(session->session_data);
+    session->session_data          = NULL;
+    session->session_data_oversize = 0;
 }
 
 //! Resets a session for new mail.
@@ -418,7 +391,7 @@ static void smtp_delete_body_lines(smtp_session_t * session){
 static inline void smtp_reset_session(smtp_session_t * session) {
     if (QUIT != session->session_state) {
         smtp_clean_mail_fields(session);
-	smtp_delete_body_lines(session);
+	smtp_delete_body(session);
     }
 }
 
@@ -435,23 +408,27 @@ static inline void smtp_reset_session(smtp_session_t * session) {
  * \return CHECK_OK on successful auth, CHECK_ABRT else.
  */
 static int smtp_process_auth_line(char * buf, ssize_t buflen,  smtp_session_t * session){
-    char * plain = smtp_unbase64((unsigned char *)buf, buflen);
-    char * auth = strchr(plain, '\0') + 1;
-    char * pass = strchr(auth, '\0') + 1;
-    int    ret = CHECK_ABRT;
-    int    len = 0;
+    char * plain = smtp_unbase64(session->session_arena, (unsigned char *)buf, buflen);
+    char * auth;
+    char * pass;
+
+    if (NULL == plain) {
+        return CHECK_ABRT;
+    }
+    auth = strchr(plain, '\0') + 1;
+    pass = strchr(auth, '\0') + 1;
 
     if (config_has_user(auth) && config_verify_user_passwd(auth, pass)) {
         session->session_authenticated = 1;
-        len = strlen(auth) + 1;
-        session->session_user = malloc(sizeof(char) * len);
-        memcpy(session->session_user, auth, len);
+        memset(pass, 0, strlen(pass));
+        /* the user name stays in the decoded buffer */
+        session->session_user = auth;
         INFO_MSG2("SMTP User %s authenticated", session->session_user);
-        ret = CHECK_OK;
+        return CHECK_OK;
     }
 
-    free(plain);
-    return ret;
+    arena_release(session->session_arena, plain);
+    return CHECK_ABRT;
 }
 
 //! Process a client input line
@@ -484,13 +461,13 @@ static int smtp_process_input_line(char * buf, ssize_t buflen, char *prefix, cha
     int fd = session->session_writeback_fd;
 
     /* strip \r\n from input */
-    if ('\r' == buf[buflen - 2])
+    if (1 < buflen && '\r' == buf[buflen - 2])
         buf[buflen - 2] = '\0';
     if ('\n' == buf[buflen - 1])
         buf[buflen - 1] = '\0';
 
     /* Process Prefix checks */
-    check = smtp_check_input(buf, prefix, delim, check_fkt, val);
+    check = smtp_check_input(buf, prefix, delim, check_fkt, val, session->session_arena);
     if (check == CHECK_OK  || check == CHECK_ARG_MSG){
         return check;
     }
@@ -498,38 +475,38 @@ static int smtp_process_input_line(char * buf, ssize_t buflen, char *prefix, cha
         smtp_write_client_msg(fd, 501, SMTP_MSG_SYNTAX_ARG, NULL);
         return CHECK_ARG;
     }
-    if(smtp_check_input(buf, "RSET", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "RSET", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 250, SMTP_MSG_RESET, NULL);
         smtp_reset_session(session);
         return CHECK_RESET;
     }
-    if(smtp_check_input(buf, "QUIT", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "QUIT", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 250, SMTP_MSG_BYE, NULL);
         session->session_state = QUIT;
         return CHECK_QUIT;
     }
-    if(smtp_check_input(buf, "NOOP", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "NOOP", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 250, SMTP_MSG_NOOP, NULL);
         return CHECK_ABRT;
     }
-    if(smtp_check_input(buf, "VRFY", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "VRFY", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 502, SMTP_MSG_NOT_IMPL, "VRFY");
         return CHECK_ABRT;
     }
-    if(smtp_check_input(buf, "EXPN", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "EXPN", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 502, SMTP_MSG_NOT_IMPL, "EXPN");
         return CHECK_ABRT;
     }
-    if(smtp_check_input(buf, "HELP", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "HELP", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 502, SMTP_MSG_NOT_IMPL, "HELP");
         return CHECK_ABRT;
     }
-    if(smtp_check_input(buf, "HELO", '\0', NULL, val) == CHECK_OK
-            || smtp_check_input(buf, "AUTH", '\0', NULL, val) == CHECK_OK
-            || smtp_check_input(buf, "EHLO", '\0', NULL, val) == CHECK_OK
-            || smtp_check_input(buf, "MAIL FROM", '\0', NULL, val) == CHECK_OK
-            || smtp_check_input(buf, "DATA", '\0', NULL, val) == CHECK_OK
-            || smtp_check_input(buf, "RCPT TO", '\0', NULL, val) == CHECK_OK){
+    if(smtp_check_input(buf, "HELO", '\0', NULL, val, session->session_arena) == CHECK_OK
+            || smtp_check_input(buf, "AUTH", '\0', NULL, val, session->session_arena) == CHECK_OK
+            || smtp_check_input(buf, "EHLO", '\0', NULL, val, session->session_arena) == CHECK_OK
+            || smtp_check_input(buf, "MAIL FROM", '\0', NULL, val, session->session_arena) == CHECK_OK
+            || smtp_check_input(buf, "DATA", '\0', NULL, val, session->session_arena) == CHECK_OK
+            || smtp_check_input(buf, "RCPT TO", '\0', NULL, val, session->session_arena) == CHECK_OK){
         smtp_write_client_msg(fd, 503, SMTP_MSG_SEQ, NULL);
         return CHECK_ABRT;
     }
@@ -540,43 +517,25 @@ static int smtp_process_input_line(char * buf, ssize_t buflen, char *prefix, cha
 //! Extracts the mbox user from a mail address
 /*!
  * This extracts the part before the @ of a mail address and store it in new
- * memory.
- * \param addr The mail address.
+ * memory of the given arena.
+ * \param arena The arena to allocate from.
+ * \param addr  The mail address.
  * \return The part before the @ or NULL.
  */
-static inline char * smtp_extraxt_mbox_user(const char * addr) {
-    int len = strchr(addr, '@') - addr;
-    char * buf = malloc(sizeof(char) * len +1);
-    memcpy(buf, addr, len);
-    buf[len ] = '\0';
-    return buf;
-}
-
-//! Check if a sequence is a valid hostname
-/*!
- * This simple checks with gethostbyname() if the given hostnmame is valid.
- */
-static int smtp_check_addr(char * addr){
-    if (gethostbyname(addr) == NULL) {
-        return ARG_BAD;
-    }
-
-    return  ARG_OK;
+static inline char * smtp_extraxt_mbox_user(arena_t * arena, const char * addr) {
+    return arena_strndup(arena, addr, strchr(addr, '@') - addr);
 }
 
 //! Check basically if a given sequence is a mail address
 /*!
- * Checks is a given address is a valid mail address. The requirements are:
- * - 2 chars before the @;
- * - @ exists;
- * - part after @ is a valid hostname or have a mx record;
- * if the address is enclosed by <>, the two chrs will be stripped.
+ * Checks is a given address looks like a mail address, it must contain a @.
+ * If the address is enclosed by <>, the two chrs will be stripped.
+ * If the host part exists is checked later by smtp_verify_addr().
  * \param addr The address to check.
  * \return ARG_OK on a valid address, ARG_BAD else.
- * \sa smtp_check_addr(), smtp_resolve_mx()
+ * \sa smtp_verify_addr()
  */
 static int smtp_check_mail(char * addr){
-    char *pos;
     int len;
     int i;
 
@@ -589,21 +548,87 @@ static int smtp_check_mail(char * addr){
         addr[len-2] = '\0';
     }
 
-        
-    pos = strchr(addr, '@');
-    if(pos != NULL){
-        if (smtp_check_addr(pos+1) == ARG_OK){
-            if ((pos - addr) > 2){
-                return ARG_OK;
+    if (NULL == strchr(addr, '@') || '\0' == *(strchr(addr, '@') + 1)) {
+        return ARG_BAD;
+    }
+    return ARG_OK;
+}
+
+//! Cut the parameters of a MAIL FROM line
+/*!
+ * This separates the ESMTP parameters (RFC 1869) from the address of a
+ * \p MAIL \p FROM line, so the address can be checked as before. The address
+ * ends at the closing \p > or, without brackets, at the first blank.
+ * \param msg    The line from the client.
+ * \param msglen The length of the line.
+ * \return The parameters as null terminated char sequence (within msg) or
+ *         NULL if the line has none.
+ */
+static char * smtp_cut_mail_params(char * msg, int msglen){
+    char * end = msg + msglen;
+    char * pos = memchr(msg, ':', msglen);
+
+    if (NULL == pos) {
+        return NULL;
+    }
+    for (pos++; pos < end && (' ' == *pos || '\t' == *pos); pos++);
+    if (pos < end && '<' == *pos) {
+        if (NULL == (pos = memchr(pos, '>', end - pos))) {
+            return NULL;
+        }
+        pos++;
+    } else {
+        for (; pos < end && !isspace(*pos); pos++);
+    }
+    if (pos >= end || (' ' != *pos && '\t' != *pos)) {
+        return NULL;
+    }
+    *pos++ = '\0';
+
+    for (; pos < end && (' ' == *pos || '\t' == *pos); pos++);
+    for (; end > pos && ('\r' == end[-1] || '\n' == end[-1]); end--) {
+        end[-1] = '\0';
+    }
+    return (pos < end ? pos : NULL);
+}
+
+//! Check the parameters of a MAIL FROM line
+/*!
+ * This checks the ESMTP parameters given with \p MAIL \p FROM. A \p SIZE
+ * (RFC 1870) larger than config_get_max_size() is rejected at once, before
+ * the client sends the data. \p AUTH (RFC 4954) is accepted and ignored, any
+ * other parameter is unknown.
+ * \param params The parameters, separated by blanks.
+ * \return 0 if the parameters are fine, else the reply code: 552 if the mail
+ *         is too big, 501 on a bad SIZE value and 555 on unknown ones.
+ */
+static int smtp_check_mail_params(char * params){
+    char *             param;
+    char *             value;
+    char *             end;
+    unsigned long long size;
+
+    for (param = strtok(params, " \t"); NULL != param; param = strtok(NULL, " \t")) {
+        if (NULL != (value = strchr(param, '='))) {
+            *value++ = '\0';
+        }
+        if (0 == strcasecmp(param, "SIZE")) {
+            if (NULL == value || !isdigit(*value)) {
+                return 501;
+            }
+            errno = 0;
+            size  = strtoull(value, &end, 10);
+            if ('\0' != *end || ERANGE == errno) {
+                return 501;
+            }
+            if (0 != config_get_max_size() && size > (unsigned long long)config_get_max_size() * 1024) {
+                return 552;
             }
-        } 
-        char * mx;
-        if (NULL != (mx = smtp_resolve_mx(pos+1))){
-            free(mx);
-            return ARG_OK;
+        } else if (0 != strcasecmp(param, "AUTH")) {
+            return 555;
         }
     }
-    return ARG_BAD;
+    return 0;
 }
 
 //! Checks if a host is the local host or not
@@ -630,126 +655,667 @@ static inline int smtp_check_mail_host_local(char * addr) {
 /*!
  * Checks is a mail user (the part before the @) exists in the local user table
  * or not. 
- * \param addr The address to check.
+ * \param arena The arena for the temporary copy of the user.
+ * \param addr  The address to check.
  * \return ARG_OK if the user exist local, ARG_BAD else.
  * \sa config_has_user()
  */
-static inline int smtp_check_mail_user_local(char * addr) {
-    char * buf = smtp_extraxt_mbox_user(addr);
+static inline int smtp_check_mail_user_local(arena_t * arena, char * addr) {
+    char * buf = smtp_extraxt_mbox_user(arena, addr);
+    int    ret = ARG_BAD;
 
-    if (config_has_user(buf)) {
-        free(buf);
-        return ARG_OK;
+    if (NULL != buf && config_has_user(buf)) {
+        ret = ARG_OK;
     }
-    free(buf);
-    return ARG_BAD;
+    arena_release(arena, buf);
+    return ret;
 }
 
-//! Build a new mail-body-line
-/*! 
- * This creates a new body_line_t element with the given content and returns a
- * pointer to it.
- * \param line     The content as char sequence.
- * \param line_len The length of the content without \p \\0.
- * \return A pointer to the new body_line_t element.
+//! Get the address field a verification is for
+/*!
+ * The address of MAIL FROM is verified in the state HELO, the one of RCPT TO
+ * in the state FROM.
+ * \param session The session structure.
+ * \return A pointer to session_from or session_to.
  */
-static inline body_line_t * smtp_create_body_line(char * line, int line_len){
-    body_line_t * new = NULL;
-
-    new = malloc(sizeof(body_line_t));
-    new->line_next = NULL;
-    new->line_len  = line_len;
-    new->line_data = malloc(sizeof(char) * (line_len+1));
-    memcpy(new->line_data, line, line_len);
-    new->line_data[line_len] = '\0';
+static inline char ** smtp_verify_field(smtp_session_t * session) {
+    return (HELO == session->session_state ? &(session->session_from) : &(session->session_to));
+}
 
-    return new;
+//! Accept a verified sender
+/*!
+ * \param session The session structure.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ */
+static int smtp_accept_from(smtp_session_t * session) {
+    INFO_MSG2("New sender addr: %s", session->session_from);
+    session->session_state = FROM;
+    if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_SENDER, session->session_from) == SMTP_FAIL){
+        ERROR_SYS("Wrie to Client");
+        return CONN_QUIT;
+    }
+    return CONN_CONT;
 }
 
-//! Append a mailbody line to the body list
+//! Accept a verified recipient
 /*!
- * This appends a new body_line_t element on a given body_line_t element list.
- * The returned pointer points to the new generated element.
- * \param list The existing body_line_t element list.
- * \param line The content of the new element as char sequence.
- * \param line_len The length of the content without \p \\0.
- * \return A pointer to the new body_line_t element.
- * \sa smtp_create_body_line()
+ * Mails to non local recipients are only accepted from authorized sessions.
+ * An accepted recipient is added to the recipients of the mail, if it is
+ * not there already.
+ * \param session The session structure.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
  */
-static inline body_line_t * smtp_append_body_line(body_line_t * list, char * line, int line_len) {
-    body_line_t * new = NULL;
-    body_line_t * tmp = list;
-
-    while(NULL != tmp){
-        if(NULL == tmp->line_next) {
-            new = smtp_create_body_line(line, line_len);
-            tmp->line_next = new;
+static int smtp_accept_rcpt(smtp_session_t * session) {
+    smtp_rcpt_t ** link;
+    int            local = 0;
+    int            known;
+
+    INFO_MSG2("New RCPT addr: %s", session->session_to);
+    if (ARG_OK == smtp_check_mail_host_local(session->session_to) && ARG_OK == smtp_check_mail_user_local(session->session_arena, session->session_to)) {
+        local = 1;
+    }
+    if ( (! session->session_authenticated) && (! local) ) {
+        if(smtp_write_client_msg(session->session_writeback_fd, 554, SMTP_MSG_RELAY_DENIED1, session->session_to) == SMTP_FAIL
+                || smtp_write_client_msg(session->session_writeback_fd, 554, SMTP_MSG_RELAY_DENIED2, NULL) == SMTP_FAIL){
+            ERROR_SYS("Wrie to Client");
+            return CONN_QUIT;
+        }
+        arena_release(session->session_arena, session->session_to);
+        session->session_to = NULL;
+        return CONN_CONT;
+    }
+
+    for (link = &(session->session_rcpts); NULL != *link; link = &((*link)->rcpt_next)) {
+        if (0 == strcmp((*link)->rcpt_addr, session->session_to)) {
             break;
         }
-        tmp = tmp->line_next;
     }
-    return new;
+    if (! (known = (NULL != *link))) {
+        if (NULL == (*link = arena_alloc(session->session_arena, sizeof(smtp_rcpt_t)))) {
+            ERROR_SYS("Allocate a recipient");
+            arena_release(session->session_arena, session->session_to);
+            session->session_to = NULL;
+            return (SMTP_FAIL == smtp_write_client_msg(session->session_writeback_fd, 452, SMTP_MSG_MEM, NULL) ? CONN_QUIT : CONN_CONT);
+        }
+        (*link)->rcpt_addr  = session->session_to;
+        (*link)->rcpt_local = local;
+        (*link)->rcpt_next  = NULL;
+        session->session_rcpt_count++;
+        session->session_rcpt_local += local;
+    }
+    session->session_state = RCPT;
+    if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_RCPT, session->session_to) == SMTP_FAIL){
+        ERROR_SYS("Wrie to Client");
+        return CONN_QUIT;
+    }
+    if (known) {
+        arena_release(session->session_arena, session->session_to);
+    }
+    session->session_to = NULL;
+    return CONN_CONT;
 }
 
-//! Pack all lines of a message in one piece of mem
-/*! 
- * This collapse all body_line_t elements of a given session in one memory
- * block. This is used for saving in the users mailbox.
- * \param session The session the data should used from.
- * \return A pointer to the new message.
+//! Finish the verification of a address
+/*!
+ * This accepts or rejects the address of MAIL FROM or RCPT TO. A rejected
+ * address is dropped from the session.
+ * \param session The session structure.
+ * \param result  ARG_OK if the address is valid, ARG_BAD if not and
+ *                ARG_BAD_MSG if it could not be checked.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ */
+static int smtp_verify_finish(smtp_session_t * session, int result) {
+    char ** field = smtp_verify_field(session);
+    int     ret   = CONN_CONT;
+
+    if (ARG_OK == result) {
+        return (HELO == session->session_state ? smtp_accept_from(session) : smtp_accept_rcpt(session));
+    }
+    if (ARG_BAD == result) {
+        ret = smtp_write_client_msg(session->session_writeback_fd, 501, SMTP_MSG_SYNTAX_ARG, NULL);
+    } else {
+        ret = smtp_write_client_msg(session->session_writeback_fd, 451, SMTP_MSG_ADDR_TEMP, *field);
+    }
+    arena_release(session->session_arena, *field);
+    *field = NULL;
+    return (SMTP_FAIL == ret ? CONN_QUIT : CONN_CONT);
+}
+
+static void smtp_verify_a(int status, const char * answer, void * data);
+static void smtp_verify_mx(int status, const char * answer, void * data);
+
+//! Continue a verification after a DNS answer
+/*!
+ * The input of the client was suspended while the query was running, so it is
+ * resumed here.
+ * \param session The session structure.
+ * \param result  The result for smtp_verify_finish().
+ */
+static inline void smtp_verify_resume(smtp_session_t * session, int result) {
+    /* a failed write ends the connection anyway */
+    smtp_verify_finish(session, result);
+    conn_resume(session->session_writeback_fd);
+}
+
+//! Handle the A answer of a verification
+/*!
+ * The address is valid if the host has a address and the user part has more
+ * than 2 chars, else the host must have a mail exchanger.
+ * \param status The result of the query.
+ * \param answer The address of the host.
+ * \param data   The session structure.
+ */
+static void smtp_verify_a(int status, const char * answer, void * data) {
+    smtp_session_t * session = data;
+    char *           addr    = *smtp_verify_field(session);
+    char *           pos     = strchr(addr, '@');
+
+    session->session_query = -1;
+    if (DNS_CANCELED == status) {
+        return;
+    }
+    if (DNS_FOUND == status && (pos - addr) > 2) {
+        smtp_verify_resume(session, ARG_OK);
+        return;
+    }
+    if (DNS_ERROR == status) {
+        smtp_verify_resume(session, ARG_BAD_MSG);
+        return;
+    }
+    if (DNS_FAIL == (session->session_query = dns_query(pos + 1, DNS_MX, smtp_verify_mx, session))) {
+        session->session_query = -1;
+        smtp_verify_resume(session, ARG_BAD_MSG);
+    }
+}
+
+//! Handle the MX answer of a verification
+/*!
+ * \param status The result of the query.
+ * \param answer The mail exchanger of the host.
+ * \param data   The session structure.
+ */
+static void smtp_verify_mx(int status, const char * answer, void * data) {
+    smtp_session_t * session = data;
+
+    session->session_query = -1;
+    if (DNS_CANCELED == status) {
+        return;
+    }
+    smtp_verify_resume(session, (DNS_FOUND == status ? ARG_OK : (DNS_NOTFOUND == status ? ARG_BAD : ARG_BAD_MSG)));
+}
+
+//! Verify the host of a address
+/*!
+ * This checks if the host part of the address of MAIL FROM or RCPT TO exists.
+ * Addresses of the local host are accepted at once, else the input of the
+ * client is suspended until the DNS answers are there.
+ * \param session The session structure.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ * \sa smtp_verify_a(), smtp_verify_mx()
+ */
+static int smtp_verify_addr(smtp_session_t * session) {
+    char * addr = *smtp_verify_field(session);
+
+    if (ARG_OK == smtp_check_mail_host_local(addr)) {
+        return smtp_verify_finish(session, ARG_OK);
+    }
+    if (DNS_FAIL == (session->session_query = dns_query(strchr(addr, '@') + 1, DNS_A, smtp_verify_a, session))) {
+        session->session_query = -1;
+        return smtp_verify_finish(session, ARG_BAD_MSG);
+    }
+    conn_suspend(session->session_writeback_fd);
+    return CONN_CONT;
+}
+
+//! Get the body of a mail
+/*!
+ * This returns the body of the current mail of a session. It is created with
+ * the first data.
+ * \param session The session.
+ * \return The body or NULL if it cannot be created.
+ */
+static inline spool_t * smtp_get_body(smtp_session_t * session){
+    if (NULL == session->session_data && NULL == (session->session_data = spool_new())) {
+        ERROR_SYS("Creating a mail body");
+    }
+    return session->session_data;
+}
+
+//! Append data to the body of a mail
+/*!
+ * This appends a piece of body data to the sessions session_data spool. It
+ * keeps the body in one piece in memory, big bodies are moved to a file by
+ * the spool module. If the body grows over config_get_max_size(), it is
+ * dropped and the rest of the DATA block is only read to its end.
+ * \param buf     The data.
+ * \param buflen  The length of the data.
+ * \param session The session the data should appended to.
+ * \return CHECK_OK on success, CHECK_ABRT on failture.
+ */
+static inline int smtp_append_body_data(char * buf, int buflen, smtp_session_t * session){
+    size_t    max  = (size_t)config_get_max_size() * 1024;
+    spool_t * body;
+
+    if (session->session_data_oversize) {
+        return CHECK_OK;
+    }
+    if (NULL == (body = smtp_get_body(session)) || SPOOL_OK != spool_append(body, buf, buflen)) {
+        return CHECK_ABRT;
+    }
+    if (0 != max && spool_len(body) > max) {
+        INFO_MSG("Mail exceeds the max size, drop the rest of the body");
+        spool_free(body);
+        session->session_data          = NULL;
+        session->session_data_oversize = 1;
+    }
+    return CHECK_OK;
+}
+
+//! Collect the recipients of a mail
+/*!
+ * This builds an array of the local or of the remote recipients of the
+ * current mail of a session, allocated from the session arena. For local
+ * recipients it holds the mbox users, for remote ones the addresses.
+ * \param session The session of the mail.
+ * \param local   1 for the local recipients, 0 for the remote ones.
+ * \return The array or NULL if there is no memory.
+ */
+static char ** smtp_collect_rcpts(smtp_session_t * session, int local){
+    smtp_rcpt_t * rcpt;
+    char **       list;
+    int           i = 0;
+
+    list = arena_alloc(session->session_arena, sizeof(char *) *
+            (local ? session->session_rcpt_local : session->session_rcpt_count - session->session_rcpt_local));
+    if (NULL == list) {
+        return NULL;
+    }
+    for (rcpt = session->session_rcpts; NULL != rcpt; rcpt = rcpt->rcpt_next) {
+        if (local != rcpt->rcpt_local) {
+            continue;
+        }
+        list[i] = (local ? smtp_extraxt_mbox_user(session->session_arena, rcpt->rcpt_addr) : rcpt->rcpt_addr);
+        if (NULL == list[i++]) {
+            return NULL;
+        }
+    }
+    return list;
+}
+
+//! Deliver a received mail
+/*!
+ * This is called after the end of the DATA block was read. It delivers the
+ * mail to the mailboxes of all local recipients at once and queues it for
+ * forwarding to the remote ones, sends the reply to the client and resets
+ * the session for the next mail. Both are stored in one transaction before
+ * the reply: if any fails, nothing is kept and the client gets a 451 to send
+ * the mail again. A mail over the max size is rejected with 552.
+ * \param session The session of the mail.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ */
+static int smtp_finish_data(smtp_session_t * session){
+    spool_t *    body;
+    char **      rcpts;
+    int          ret  = CONN_CONT;
+    int          code = 250;
+    const char * msg  = SMTP_MSG_DATA_ACK_LOCAL;
+
+    if (session->session_data_oversize) {
+        if(smtp_write_client_msg(session->session_writeback_fd, 552, SMTP_MSG_SIZE, NULL) == SMTP_FAIL){
+            ERROR_SYS("Wrie to Client");
+            ret = CONN_QUIT;
+        }
+        smtp_reset_session(session);
+        return ret;
+    }
+    if (NULL == (body = smtp_get_body(session))) {
+        return CONN_QUIT;
+    }
+    /* the local mails and the forwards are stored together, so the client
+     * can send the mail again if any fails */
+    if (MAILBOX_OK != mbox_begin()) {
+        ERROR_CUSTM2("Cannot deliver the mail: %s", mbox_get_error_msg());
+        code = 451;
+        msg  = SMTP_MSG_DATA_LOCAL_FAIL;
+    }
+    if (250 == code && 0 < session->session_rcpt_local){
+        rcpts = smtp_collect_rcpts(session, 1);
+        if (NULL == rcpts || MAILBOX_OK != mbox_push_mail(rcpts, session->session_rcpt_local, body)) {
+            ERROR_CUSTM2("Cannot deliver the mail: %s", mbox_get_error_msg());
+            code = 451;
+            msg  = SMTP_MSG_DATA_LOCAL_FAIL;
+        }
+    }
+    if (250 == code && session->session_rcpt_local < session->session_rcpt_count) {
+        rcpts = smtp_collect_rcpts(session, 0);
+        /* the forward module takes over the body */
+        session->session_data = NULL;
+        code = 451;
+        msg  = SMTP_MSG_DATA_FAIL;
+        if (NULL == rcpts) {
+            spool_free(body);
+        } else if (FWD_OK == fwd_queue(body, session->session_from, rcpts,
+                    session->session_rcpt_count - session->session_rcpt_local, 1)) {
+            code = 250;
+            msg  = SMTP_MSG_DATA_ACK;
+        }
+    }
+    if (250 == code && MAILBOX_OK != mbox_commit()) {
+        ERROR_CUSTM2("Cannot deliver the mail: %s", mbox_get_error_msg());
+        code = 451;
+        msg  = SMTP_MSG_DATA_LOCAL_FAIL;
+    }
+    /* the forwards are sent only if their rows are there */
+    if (250 == code) {
+        fwd_send_queued();
+    } else {
+        mbox_rollback();
+        fwd_drop_queued();
+    }
+    if(smtp_write_client_msg(session->session_writeback_fd, code, msg, NULL) == SMTP_FAIL){
+        ERROR_SYS("Wrie to Client");
+        ret = CONN_QUIT;
+    }
+
+    smtp_reset_session(session);
+    INFO_MSG("RESET a SMTP session!");
+    return ret;
+}
+
+//! Set the timeout for the next input
+/*!
+ * This sets the timeout matching the state of the session. A new session
+ * keeps the greeting timeout until it said HELO or EHLO, so it cannot stay
+ * with invalid commands.
+ * \param session The session.
+ */
+static inline void smtp_set_timeout(smtp_session_t * session){
+    if (NEW == session->session_state) {
+        return;
+    }
+    conn_set_timeout(session->session_writeback_fd,
+            (DATA == session->session_state || 0 < session->session_chunk ? SMTP_TIMEOUT_DATA : SMTP_TIMEOUT_COMMAND));
+}
+
+//! Append BDAT chunk data to the body of a mail
+/*!
+ * The body is stored in the dot-stuffed form of a DATA block, so the POP3
+ * and forward modules can send it as it is. BDAT data is not stuffed, so a
+ * dot is inserted in front of each line starting with one. Only the line
+ * feeds are searched with memchr(), the data between is appended in one
+ * piece. The session_data_midline flag tracks if the stored data ends in
+ * the middle of a line over the chunk borders.
+ * \param buf     The chunk data.
+ * \param buflen  The length of the data.
+ * \param session The session the data should appended to.
+ * \return CHECK_OK on success, CHECK_ABRT on failture.
+ */
+static int smtp_append_chunk_data(char * buf, size_t buflen, smtp_session_t * session){
+    char * end  = buf + buflen;
+    char * span = buf;
+    char * pos  = buf;
+    char * lf;
+
+    if (session->session_data_oversize) {
+        return CHECK_OK;
+    }
+    if (!session->session_data_midline && '.' == *buf
+            && CHECK_OK != smtp_append_body_data(".", 1, session)) {
+        return CHECK_ABRT;
+    }
+    while (NULL != (lf = memchr(pos, '\n', end - pos))) {
+        pos = lf + 1;
+        if (pos < end && '.' == *pos) {
+            if (CHECK_OK != smtp_append_body_data(span, pos - span, session)
+                    || CHECK_OK != smtp_append_body_data(".", 1, session)) {
+                return CHECK_ABRT;
+            }
+            span = pos;
+        }
+    }
+    session->session_data_midline = ('\n' != end[-1]);
+
+    return smtp_append_body_data(span, end - span, session);
+}
+
+//! Parse a BDAT command
+/*!
+ * This parses a \p BDAT \<size> [LAST] command (rfc 3030). The check is
+ * done without smtp_check_prefix(), so a short line is not changed.
+ * \param msg  The line from the client.
+ * \param size The place to store the chunk size.
+ * \param last The place to store the LAST flag.
+ * \return CHECK_OK on success, CHECK_PREF if the line is no BDAT command and
+ *         CHECK_ARG if the arguments are bad.
  */
-static char * smtp_collapse_body_lines(smtp_session_t * session){
-    ssize_t size  = 0;
-    char *  buf   = NULL;
-    char *  pos   = NULL;
-    body_line_t * line = session->session_data;
+static int smtp_parse_bdat(char * msg, size_t * size, int * last){
+    unsigned long long val;
+    char *             end;
+
+    if (0 != strncasecmp(msg, "BDAT", 4) || (' ' != msg[4] && '\r' != msg[4] && '\n' != msg[4])) {
+        return CHECK_PREF;
+    }
+    msg += 4;
+    while (' ' == *msg) {
+        msg++;
+    }
+    if (!isdigit((unsigned char)*msg)) {
+        return CHECK_ARG;
+    }
+    errno = 0;
+    val   = strtoull(msg, &end, 10);
+    if (ERANGE == errno || (size_t)val != val) {
+        return CHECK_ARG;
+    }
+    while (' ' == *end) {
+        end++;
+    }
+    *last = 0;
+    if (0 == strncasecmp(end, "LAST", 4)) {
+        *last = 1;
+        end  += 4;
+    }
+    if ('\r' == *end) {
+        end++;
+    }
+    if ('\n' != *end && '\0' != *end) {
+        return CHECK_ARG;
+    }
+    *size = val;
+    return CHECK_OK;
+}
 
-    while (NULL != line){
-        size += line->line_len;
-        line = line->line_next;
+//! Finish a BDAT chunk
+/*!
+ * This is called after all data of a BDAT chunk was read. A rejected chunk
+ * is answered with 503 now, the last chunk delivers the mail. A mail over
+ * the max size is rejected with 552 at the first chunk exceeding it, the
+ * client must not send further chunks then (rfc 3030, 4.2).
+ * \param session The session of the chunk.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ */
+static int smtp_finish_chunk(smtp_session_t * session){
+    int  ret = CONN_CONT;
+    char size[24];
+
+    conn_set_bulk(session->session_writeback_fd, 0);
+    if (session->session_chunk_drop) {
+        session->session_chunk_drop = 0;
+        if(smtp_write_client_msg(session->session_writeback_fd, 503, SMTP_MSG_SEQ, NULL) == SMTP_FAIL){
+            ERROR_SYS("Wrie to Client");
+            ret = CONN_QUIT;
+        }
+        return ret;
     }
+    if (session->session_chunk_last) {
+        return smtp_finish_data(session);
+    }
+    if (session->session_data_oversize) {
+        if(smtp_write_client_msg(session->session_writeback_fd, 552, SMTP_MSG_SIZE, NULL) == SMTP_FAIL){
+            ERROR_SYS("Wrie to Client");
+            ret = CONN_QUIT;
+        }
+        smtp_reset_session(session);
+        return ret;
+    }
+    snprintf(size, sizeof(size), "%lu", (unsigned long)session->session_chunk_size);
+    if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_CHUNK, size) == SMTP_FAIL){
+        ERROR_SYS("Wrie to Client");
+        ret = CONN_QUIT;
+    }
+    return ret;
+}
 
-    line = session->session_data;
-    buf = malloc(sizeof(char) * size+1);
-    memset(buf, '\0', size);
-    pos = buf;
+//! Start a BDAT chunk
+/*!
+ * This processes a BDAT command. The chunk is accepted after RCPT TO or a
+ * previous chunk of the same mail. In all other states it is rejected, but
+ * its data is read anyway, so it is not taken as commands. The chunk data
+ * is read in bulk mode by smtp_process_chunk().
+ * \param session The session.
+ * \param check   The result of smtp_parse_bdat().
+ * \param size    The size of the chunk.
+ * \param last    The LAST flag of the chunk.
+ * \return CONN_QUIT if the client cannot be written, CONN_CONT else.
+ */
+static int smtp_start_chunk(smtp_session_t * session, int check, size_t size, int last){
+    if (CHECK_OK != check) {
+        if(smtp_write_client_msg(session->session_writeback_fd, 501, SMTP_MSG_SYNTAX_ARG, NULL) == SMTP_FAIL){
+            ERROR_SYS("Wrie to Client");
+            return CONN_QUIT;
+        }
+        return CONN_CONT;
+    }
 
-    while (NULL != line){
-        memcpy(pos, line->line_data, line->line_len);
-        pos += line->line_len;
-        line = line->line_next;
+    session->session_chunk      = size;
+    session->session_chunk_size = size;
+    session->session_chunk_last = last;
+    session->session_chunk_drop = (RCPT != session->session_state && BDAT != session->session_state);
+    if (RCPT == session->session_state) {
+        session->session_state         = BDAT;
+        session->session_data_midline  = 0;
+        session->session_data_oversize = 0;
     }
-    *pos = '\0';
 
-    return buf;
+    if (0 == size) {
+        return smtp_finish_chunk(session);
+    }
+    conn_set_bulk(session->session_writeback_fd, 1);
+    return CONN_CONT;
 }
 
+//! Reads the data of a BDAT chunk
+/*!
+ * This gets the raw data of a BDAT chunk from smtp_process_body_block().
+ * As the size of the chunk is known, the data is appended as it is without
+ * a search for the end of the block.
+ * \param buf     The buffer with data from the client.
+ * \param buflen  The length of the buffer.
+ * \param session The session the data should appended to.
+ * \return The count of consumed bytes or CONN_QUIT on failture.
+ */
+static ssize_t smtp_process_chunk(char * buf, ssize_t buflen, smtp_session_t * session){
+    size_t used = session->session_chunk;
+
+    if ((size_t)buflen < used) {
+        used = buflen;
+    }
+    if (!session->session_chunk_drop && CHECK_OK != smtp_append_chunk_data(buf, used, session)) {
+        return CONN_QUIT;
+    }
+    session->session_chunk -= used;
+    if (0 == session->session_chunk && CONN_QUIT == smtp_finish_chunk(session)) {
+        return CONN_QUIT;
+    }
+    smtp_set_timeout(session);
+    return used;
+}
 
 //! Reads the body data of a email 
 /*!
- * This reads the mail body data linewise. If a \p ^.\<cr>\<lf>$ is read CHECK_QUIT
- * will be returned to indicate the end of the message block.
- * If normal data is read, it appends it to the sessions session_data list.
+ * This is the bulk handler of the connection module, it gets the raw data
+ * of the DATA block. The data is searched for the terminator line
+ * \p ^.\<cr>\<lf>$ in one pass with scan_data_end(), all complete lines in
+ * front of it are appended to the sessions session_data spool.
+ * An incomplete line at the end is left to the connection module, except it
+ * is longer than SMTP_MAX_LINE.
+ * If the terminator is found, the mail is delivered and the connection is
+ * switched back to line mode.
+ * The data of a BDAT chunk is passed to smtp_process_chunk() instead.
  * \param buf     The buffer with data from the client.
  * \param buflen  The length of the buffer.
  * \param session The session the data should appended to.
- * \return CHECK_QUIT on \p ^.\<cr>\<lf>$, CHECK_OKCHECK_OK on sucessful data read,
- *         CHECK_ABRT on failture
- * \sa smtp_append_body_line(), smtp_process_input()
+ * \return The count of consumed bytes or CONN_QUIT on failture.
+ * \sa smtp_finish_data(), scan_data_end()
  */
-static int smtp_process_body_data(char * buf, int buflen, smtp_session_t * session){
-    body_line_t * new = NULL;
-   
-    if (strncmp(buf, ".\r\n", 3) == 0){
-        return CHECK_QUIT;
+ssize_t smtp_process_body_block(char * buf, ssize_t buflen, smtp_session_t * session){
+    const char * term;
+    size_t       complete;
+
+    if (0 < session->session_chunk) {
+        return smtp_process_chunk(buf, buflen, session);
     }
 
-    if (NULL == session->session_data) {
-        new = session->session_data = smtp_create_body_line(buf, buflen);
-    } else {
-        new = smtp_append_body_line(session->session_data, buf, buflen);
+    /* finish a line stored in pieces, no terminator can start within */
+    if (session->session_data_midline) {
+        if (NULL == (term = scan_lf(buf, buflen))) {
+            complete = buflen;
+        } else {
+            complete = term + 1 - buf;
+            session->session_data_midline = 0;
+        }
+        if (CHECK_OK != smtp_append_body_data(buf, complete, session)) {
+            return CONN_QUIT;
+        }
+        smtp_set_timeout(session);
+        return complete;
+    }
+
+    if (NULL != (term = scan_data_end(buf, buflen, &complete))) {
+        if (term > buf && CHECK_OK != smtp_append_body_data(buf, term - buf, session)) {
+            return CONN_QUIT;
+        }
+        conn_set_bulk(session->session_writeback_fd, 0);
+        if (CONN_QUIT == smtp_finish_data(session)) {
+            return CONN_QUIT;
+        }
+        smtp_set_timeout(session);
+        return term + 3 - buf;
+    }
+
+    if (0 == complete && SMTP_MAX_LINE <= buflen) {
+        complete = buflen;
+        session->session_data_midline = 1;
+    }
+    if (0 < complete) {
+        if (CHECK_OK != smtp_append_body_data(buf, complete, session)) {
+            return CONN_QUIT;
+        }
+        smtp_set_timeout(session);
     }
-   return (NULL == new ? CHECK_ABRT : CHECK_OK);
+    return complete;
+}
+
+//! Init the SMTP module of a worker
+/*!
+ * This creates the session pool of the calling worker.
+ * \return SMTP_OK on success, SMTP_FAIL else.
+ */
+int smtp_init(){
+    if (NULL == (smtp_pool = pool_new("smtp", sizeof(smtp_session_t), SMTP_POOL))) {
+        return SMTP_FAIL;
+    }
+    return SMTP_OK;
+}
+
+//! Close the SMTP module of a worker
+/*!
+ * This frees the session pool of the calling worker, it must be called
+ * after conn_close().
+ */
+void smtp_close(){
+    pool_free(smtp_pool);
+    smtp_pool = NULL;
 }
 
 //! Build a new SMTP session
@@ -775,7 +1341,13 @@ smtp_session_t * smtp_create_session(int writeback_fd) {
         return NULL;
     }
 
-    new = malloc(sizeof(smtp_session_t));
+    new = pool_alloc(smtp_pool);
+    if (NULL == new || NULL == (new->session_arena = arena_new())) {
+        ERROR_SYS("Allocate a SMTP session");
+        pool_release(smtp_pool, new);
+        return NULL;
+    }
+    new->session_mark          = arena_mark(new->session_arena);
     new->session_writeback_fd  = writeback_fd;
     new->session_type          = SMTP;
     new->session_state         = NEW;
@@ -784,8 +1356,18 @@ smtp_session_t * smtp_create_session(int writeback_fd) {
     new->session_authenticated = 0;
     new->session_from          = 0;
     new->session_to            = NULL;
+    new->session_rcpts         = NULL;
+    new->session_rcpt_count    = 0;
     new->session_rcpt_local    = 0;
-
+    new->session_data_midline  = 0;
+    new->session_data_oversize = 0;
+    new->session_chunk         = 0;
+    new->session_chunk_size    = 0;
+    new->session_chunk_last    = 0;
+    new->session_chunk_drop    = 0;
+    new->session_query         = -1;
+
+    conn_set_timeout(writeback_fd, SMTP_TIMEOUT_GREET);
     INFO_MSG("SMTP session created");
 
     return new;
@@ -799,9 +1381,13 @@ smtp_session_t * smtp_create_session(int writeback_fd) {
  */
 int smtp_destroy_session(smtp_session_t * session) {
     if (NULL != session) {
+        if (-1 != session->session_query) {
+            dns_cancel(session->session_query);
+        }
         smtp_clean_mail_fields(session);
-        smtp_delete_body_lines(session);
-        free(session);
+        smtp_delete_body(session);
+        arena_free(session->session_arena);
+        pool_release(smtp_pool, session);
     }
     INFO_MSG("SMTP session cleaned");
     return 0;
@@ -821,8 +1407,23 @@ int smtp_destroy_session(smtp_session_t * session) {
  *         CONN_CONT else.
  */
 int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
-    int ehlo;
-    int result;
+    int    ehlo;
+    int    result = CHECK_ABRT;
+    int    code;
+    char * params;
+    char   size[24];
+    size_t chunk;
+    int    last;
+
+    /* BDAT is checked in every state, a rejected chunk has to be read too */
+    if (ESMTP == session->session_type && AUTH != session->session_state
+            && CHECK_PREF != (code = smtp_parse_bdat(msg, &chunk, &last))) {
+        if (CONN_QUIT == smtp_start_chunk(session, code, chunk, last)) {
+            return CONN_QUIT;
+        }
+        smtp_set_timeout(session);
+        return CONN_CONT;
+    }
 
     switch (session->session_state) {
 
@@ -832,10 +1433,15 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
             if (CHECK_OK == ehlo) {
                 result = smtp_process_input_line(msg, msglen, "EHLO", ' ', NULL, &(session->session_host), session);
                 if ( CHECK_OK == result ) {
+                    smtp_mark_session(session);
                     session->session_state = EHLO;
                     session->session_type  = ESMTP;
+                    snprintf(size, sizeof(size), "%lu", (unsigned long)config_get_max_size() * 1024);
                     if( smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO, session->session_host) == SMTP_FAIL
-                            || smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO_EXT1, session->session_host) == SMTP_FAIL ) {
+                            || smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO_EXT1, NULL) == SMTP_FAIL
+                            || smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO_EXT2, NULL) == SMTP_FAIL
+                            || smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO_EXT3, NULL) == SMTP_FAIL
+                            || smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_EHLLO_EXT4, size) == SMTP_FAIL ) {
                         ERROR_SYS("Wrie to Client");
                         return CONN_QUIT;
                     }
@@ -843,6 +1449,7 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
             } else {
                 result = smtp_process_input_line(msg, msglen, "HELO", ' ', NULL, &(session->session_host), session);
                 if ( CHECK_OK == result ) {
+                    smtp_mark_session(session);
                     session->session_state = HELO;
                     if( smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_HELLO, session->session_host) == SMTP_FAIL){
                         ERROR_SYS("Wrie to Client");
@@ -859,31 +1466,30 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
                 result = smtp_process_input_line(msg, msglen, "AUTH PLAIN", ' ', NULL, &tmp, session);
                 if ( CHECK_OK == result ) {
                     int len = strlen(tmp);
-                    char * tmp2 = malloc(sizeof(char) * (len + 2));
-
-                    memcpy(tmp2, tmp, len);
-                    tmp2[len]   = '\r';
-                    tmp2[len+1] = '\n';
-                    tmp2[len+2] = '\0';
+                    char * tmp2 = arena_alloc(session->session_arena, len + 3);
 
-                    if(CHECK_OK == smtp_process_auth_line(tmp2, strlen(tmp2), session)) {
+                    if (NULL != tmp2) {
+                        memcpy(tmp2, tmp, len);
+                        tmp2[len]   = '\r';
+                        tmp2[len+1] = '\n';
+                        tmp2[len+2] = '\0';
+                    }
 
+                    if(NULL != tmp2 && CHECK_OK == smtp_process_auth_line(tmp2, strlen(tmp2), session)) {
+                        smtp_mark_session(session);
                         if (smtp_write_client_msg(session->session_writeback_fd, 235, SMTP_MSG_AUTH_OK, NULL) == SMTP_FAIL){
                             ERROR_SYS("Wrie to Client");
                             return CONN_QUIT;
                         }
                         session->session_state = HELO;
                     } else {
+                        arena_release(session->session_arena, tmp);
                         if (smtp_write_client_msg(session->session_writeback_fd, 535, SMTP_MSG_AUTH_NOK, NULL) == SMTP_FAIL){
                             ERROR_SYS("Wrie to Client");
                             return CONN_QUIT;
                         }
                     }
-
-                    free(tmp2);
                 }
-                if (NULL != tmp)
-                    free(tmp);
             } else {
                 result = smtp_process_input_line(msg, msglen, "AUTH PLAIN", '\0', NULL, NULL, session);
                 if ( CHECK_OK == result ) {
@@ -898,93 +1504,76 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
 
         /* wait for MAIL FROM */
         case HELO:
+            /* only a MAIL FROM line is cut, other commands stay as they are */
+            params = (0 == strncasecmp(msg, "MAIL FROM", 9) ? smtp_cut_mail_params(msg, msglen) : NULL);
             result = smtp_process_input_line(msg, msglen, "MAIL FROM", ':', smtp_check_mail, &(session->session_from), session);
-            if ( CHECK_OK ==result ) {
-                INFO_MSG2("New sender addr: %s", session->session_from);
-                session->session_state = FROM;
-                if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_SENDER, session->session_from) == SMTP_FAIL){
+            if ( CHECK_OK == result && NULL != params && 0 != (code = smtp_check_mail_params(params)) ) {
+                arena_release(session->session_arena, session->session_from);
+                session->session_from = NULL;
+                if (smtp_write_client_msg(session->session_writeback_fd, code,
+                            (552 == code ? SMTP_MSG_SIZE : (555 == code ? SMTP_MSG_PARAM : SMTP_MSG_SYNTAX_ARG)), NULL) == SMTP_FAIL){
                     ERROR_SYS("Wrie to Client");
                     return CONN_QUIT;
                 }
+                break;
+            }
+            if ( CHECK_OK == result && CONN_QUIT == smtp_verify_addr(session) ) {
+                return CONN_QUIT;
             } 
             break;
 
-        /* wait for RCPT TO */
+        /* wait for RCPT TO, after the first one for further RCPT TO or DATA */
         case FROM:
-
-            result = smtp_process_input_line(msg, msglen, "RCPT TO", ':', smtp_check_mail, &(session->session_to), session);
-            if ( CHECK_OK == result ) {
-                INFO_MSG2("New RCPT addr: %s", session->session_to);
-                if (ARG_OK == smtp_check_mail_host_local(session->session_to) && ARG_OK == smtp_check_mail_user_local(session->session_to)) {
-                    session->session_rcpt_local = 1;
-                }
-                if ( (! session->session_authenticated) && (! session->session_rcpt_local) ) {
-                    if(smtp_write_client_msg(session->session_writeback_fd, 554, SMTP_MSG_RELAY_DENIED1, session->session_to) == SMTP_FAIL
-                            || smtp_write_client_msg(session->session_writeback_fd, 554, SMTP_MSG_RELAY_DENIED2, NULL) == SMTP_FAIL){
-                        ERROR_SYS("Wrie to Client");
-                        return CONN_QUIT;
-                    }
-                } else {
-                    session->session_state = RCPT;
-                    if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_RCPT, session->session_to) == SMTP_FAIL){
+        case RCPT:
+            if (FROM == session->session_state || 0 == strncasecmp(msg, "RCPT", 4)) {
+                result = smtp_process_input_line(msg, msglen, "RCPT TO", ':', smtp_check_mail, &(session->session_to), session);
+                if ( CHECK_OK == result && SMTP_MAX_RCPT <= session->session_rcpt_count ) {
+                    arena_release(session->session_arena, session->session_to);
+                    session->session_to = NULL;
+                    if (smtp_write_client_msg(session->session_writeback_fd, 452, SMTP_MSG_RCPT_MAX, NULL) == SMTP_FAIL){
                         ERROR_SYS("Wrie to Client");
                         return CONN_QUIT;
                     }
+                    break;
                 }
-            } 
-            break;
-
-        /* wait for DATA */
-        case RCPT:
+                if ( CHECK_OK == result && CONN_QUIT == smtp_verify_addr(session) ) {
+                    return CONN_QUIT;
+                } 
+                break;
+            }
             result = smtp_process_input_line(msg, msglen, "DATA", '\0', NULL, NULL, session);
             if ( CHECK_OK ==result ) {
                 session->session_state = DATA;
-                if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_DATA, NULL) == SMTP_FAIL){
+                session->session_data_midline  = 0;
+                session->session_data_oversize = 0;
+                conn_set_bulk(session->session_writeback_fd, 1);
+                if(smtp_write_client_msg(session->session_writeback_fd, 354, SMTP_MSG_DATA, NULL) == SMTP_FAIL){
                     ERROR_SYS("Wrie to Client");
                     return CONN_QUIT;
                 }
             } 
             break;
 
-        /* Eating data lines and waiting for <cr><lf> */
-        case DATA:
-            result = smtp_process_body_data(msg, msglen, session);
-            if (CHECK_QUIT == result) {
-                char * full_msg = smtp_collapse_body_lines(session);
-
-                if (session->session_rcpt_local){
-                    char * user = smtp_extraxt_mbox_user(session->session_to);
-                    mbox_push_mail(user, full_msg, 0);
-                    if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_DATA_ACK_LOCAL, NULL) == SMTP_FAIL){
-                        ERROR_SYS("Wrie to Client");
-                        free(full_msg);
-                        return CONN_QUIT;
-                    }
-                } else {
-                    if (FWD_OK == fwd_queue(session->session_data, session->session_from, session->session_to, 1)) {
-
-                        if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_DATA_ACK, NULL) == SMTP_FAIL){
-                            ERROR_SYS("Wrie to Client");
-                            free(full_msg);
-                            return CONN_QUIT;
-                        }
-                    } else {
-                        if(smtp_write_client_msg(session->session_writeback_fd, 250, SMTP_MSG_DATA_FAIL, NULL) == SMTP_FAIL){
-                            ERROR_SYS("Wrie to Client");
-                            free(full_msg);
-                            return CONN_QUIT;
-                        }
-                    }
-
+        /* wait for the next BDAT chunk, other commands are out of sequence */
+        case BDAT:
+            /* valid BDAT commands are taken above, a line which still looks
+             * like one (e.g. BDATX) is answered here too */
+            result = smtp_process_input_line(msg, msglen, "BDAT", ' ', NULL, NULL, session);
+            if ( CHECK_OK == result || CHECK_ARG_MSG == result ) {
+                result = CHECK_ABRT;
+                if(smtp_write_client_msg(session->session_writeback_fd, 503, SMTP_MSG_SEQ, NULL) == SMTP_FAIL){
+                    ERROR_SYS("Wrie to Client");
+                    return CONN_QUIT;
                 }
+            }
+            break;
 
-                free(full_msg);
-                result = CHECK_RESET;
-            } 
-            if (CHECK_ABRT == result) {
-                /* EOM */
-                result = CHECK_QUIT;
+        /* Eating data lines, normally they are passed in bulk mode */
+        case DATA:
+            if (CONN_QUIT == smtp_process_body_block(msg, msglen, session)) {
+                return CONN_QUIT;
             }
+            return CONN_CONT;
             break;
 
         /* quit state, session should never reach this */
@@ -996,6 +1585,7 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
         case AUTH:
             result = smtp_process_auth_line(msg, msglen, session);
             if ( CHECK_OK == result ) {
+                smtp_mark_session(session);
                 if (smtp_write_client_msg(session->session_writeback_fd, 235, SMTP_MSG_AUTH_OK, NULL) == SMTP_FAIL){
                     ERROR_SYS("Wrie to Client");
                     return CONN_QUIT;
@@ -1026,7 +1616,28 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t * session) {
         return CONN_QUIT;
     }
 
+    smtp_set_timeout(session);
     return CONN_CONT;
 }
 
+//! Handle the timeout of a SMTP connection
+/*!
+ * This is called by the connection module if the client did not send
+ * anything within the timeout set for the state of the session. The client
+ * is told with a 421 reply before the connection is closed.
+ * \param session The session of the connection.
+ * \return CONN_QUIT in any case.
+ */
+int smtp_timeout(smtp_session_t * session) {
+    const char * hostname = "localhost";
+
+    if (NULL != config_get_hostname()) {
+        hostname = config_get_hostname();
+    }
+    INFO_MSG("SMTP session timed out");
+    session->session_state = QUIT;
+    smtp_write_client_msg(session->session_writeback_fd, 421, SMTP_MSG_TIMEOUT, hostname);
+    return CONN_QUIT;
+}
+
 /** @} */
@@ -40,11 +40,14 @@ typedef struct smtp_session smtp_session_t;
 #define SMTP_FAIL -1
 
 
-char * smtp_resolve_mx(const char * host);
+int smtp_init();
+void smtp_close();
 smtp_session_t * smtp_create_session(int writeback_fd);
 int smtp_destroy_session(smtp_session_t * session);
 
 int smtp_process_input(char * msg, int msglen, smtp_session_t *);
+ssize_t smtp_process_body_block(char * buf, ssize_t buflen, smtp_session_t * session);
+int smtp_timeout(smtp_session_t * session);
 
 
 #define SMTP_MSG_GREET          "%d %s SMTP Relay by Jan Losinski\r\n"
@@ -60,15 +63,26 @@ int smtp_process_input(char * msg, int msglen, smtp_session_t *);
 #define SMTP_MSG_NOT_IMPL       "%d %s Command not implemented\r\n"
 #define SMTP_MSG_SYNTAX         "%d Syntax error or command unrecognized\r\n"
 #define SMTP_MSG_SYNTAX_ARG     "%d syntax error in parameters or arguments\r\n"
+#define SMTP_MSG_ADDR_TEMP      "%d Cannot verify %s, try again later\r\n"
 #define SMTP_MSG_SENDER         "%d Sender %s OK\r\n"
 #define SMTP_MSG_HELLO          "%d Hello %s!\r\n"
 #define SMTP_MSG_EHLLO          "%d-Hello %s!\r\n"
-#define SMTP_MSG_EHLLO_EXT1     "%d AUTH PLAIN\r\n"
+#define SMTP_MSG_EHLLO_EXT1     "%d-AUTH PLAIN\r\n"
+#define SMTP_MSG_EHLLO_EXT2     "%d-PIPELINING\r\n"
+#define SMTP_MSG_EHLLO_EXT3     "%d-CHUNKING\r\n"
+#define SMTP_MSG_EHLLO_EXT4     "%d SIZE %s\r\n"
 #define SMTP_MSG_RCPT           "%d RCPT %s seems to be OK\r\n"
+#define SMTP_MSG_RCPT_MAX       "%d Too many recipients\r\n"
 #define SMTP_MSG_DATA           "%d Waiting for Data, End with <CR><LF>.<CR><LF>\r\n"
+#define SMTP_MSG_CHUNK          "%d %s octets received\r\n"
 #define SMTP_MSG_DATA_ACK       "%d Message Accepted and forwarded\r\n"
 #define SMTP_MSG_DATA_ACK_LOCAL "%d Message Accepted and delivered\r\n"
-#define SMTP_MSG_DATA_FAIL      "%d Message Accepted but forward failed\r\n"
+#define SMTP_MSG_DATA_FAIL      "%d Message could not be queued, try again later\r\n"
+#define SMTP_MSG_DATA_LOCAL_FAIL "%d Local delivery failed, try again later\r\n"
+#define SMTP_MSG_SIZE           "%d Message size exceeds fixed maximum message size\r\n"
+#define SMTP_MSG_PARAM          "%d MAIL FROM parameters not recognized or not implemented\r\n"
 #define SMTP_MSG_MEM            "%d Requested mail action aborted: exceeded storage allocation\r\n"
+#define SMTP_MSG_LIMIT         "421 %s Too many connections from your host, try again later\r\n"
+#define SMTP_MSG_TIMEOUT       "%d %s Error: timeout exceeded, closing connection\r\n"
 #define SMTP_MSG_SEQ            "%d Bad Sequence of Commands\r\n"
 #define SMTP_MSG_PROTO          "%d-Poto: %s\r\n"
@@ -0,0 +1,383 @@
+/* spool.c
+ *
+ * The spool module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "spool.h"
+#include "config.h"
+#include "fail.h"
+
+/*!
+ * \defgroup spool Spool Module
+ * This holds the body of a mail while it is received. Small bodies are kept
+ * in memory in one piece. A body growing over config_get_spool_window() KiB
+ * is moved to an unlinked temporary file in config_get_spooldir() and only a
+ * small write buffer stays in memory. The memory of all bodies of all workers
+ * is limited to config_get_spool_budget() KiB, if it is used up, new data
+ * goes to a file even if the body is smaller than the window.
+ * The file vanishes with spool_free(), also if the server crashes.
+ * A body can be shared by the forwards of a mail to several hosts, each
+ * takes a reference with spool_ref() and the body is freed with the last
+ * spool_free().
+ * @{
+ */
+
+//! The first allocation of a body in memory, it is doubled each time it is full, up to the window.
+#define SPOOL_CHUNK  4096
+
+//! The size of the write buffer of a body in a file.
+#define SPOOL_BUFFER 65536
+
+//! The body of a mail
+/*!
+ * While the body is in memory, spool_data holds it completely. When it is in
+ * a file, spool_data holds the data which is not written to the file yet.
+ */
+struct spool {
+    char * spool_data;      //!< The data in memory.
+    size_t spool_buffered;  //!< The count of bytes in spool_data.
+    size_t spool_size;      //!< The allocated size of spool_data.
+    size_t spool_len;       //!< The length of the whole body.
+    int    spool_fd;        //!< The temporary file or -1 while the body is in memory.
+    int    spool_refs;      //!< The count of references, the body is freed with the last.
+};
+
+size_t spool_max_body   = 0; //! The max size of a body in memory.
+
+size_t spool_max_memory = 0; //! The max size of the memory of all bodies.
+
+size_t spool_memory     = 0; //! The allocated memory of all bodies (changed atomic).
+
+//! Open a temporary file
+/*!
+ * This opens a file in the spool directory, which has no name and vanishes
+ * when it is closed. If the filesystem does not support O_TMPFILE, a named
+ * file is created and unlinked at once.
+ * \return The fd of the file or -1 on failture.
+ */
+static int spool_open_file(){
+    const char * dir = config_get_spooldir();
+    char *       path;
+    int          fd;
+
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (-1 != fd || (EOPNOTSUPP != errno && EISDIR != errno)) {
+        return fd;
+    }
+
+    path = malloc(strlen(dir) + sizeof("/mailtool.XXXXXX"));
+    sprintf(path, "%s/mailtool.XXXXXX", dir);
+    if (-1 != (fd = mkostemp(path, O_CLOEXEC))) {
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+//! Write data to a file
+/*!
+ * \param fd  The file.
+ * \param buf The data.
+ * \param len The length of the data.
+ * \return SPOOL_OK on success, SPOOL_FAIL else.
+ */
+static int spool_write_file(int fd, const char * buf, size_t len){
+    ssize_t res;
+
+    while (0 < len) {
+        if (-1 == (res = write(fd, buf, len))) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return SPOOL_FAIL;
+        }
+        buf += res;
+        len -= res;
+    }
+    return SPOOL_OK;
+}
+
+//! Resize the memory of a body
+/*!
+ * This resizes spool_data and accounts the change in the budget. The budget
+ * is only checked when the memory grows.
+ * \param spool The body.
+ * \param size  The new size of the memory.
+ * \return SPOOL_OK on success, SPOOL_FAIL if the budget is used up or no
+ *         memory is left.
+ */
+static int spool_resize(spool_t * spool, size_t size){
+    char * data;
+
+    if (size > spool->spool_size
+            && __sync_add_and_fetch(&spool_memory, size - spool->spool_size) > spool_max_memory) {
+        __sync_sub_and_fetch(&spool_memory, size - spool->spool_size);
+        return SPOOL_FAIL;
+    }
+    if (NULL == (data = realloc(spool->spool_data, size))) {
+        if (size > spool->spool_size) {
+            __sync_sub_and_fetch(&spool_memory, size - spool->spool_size);
+        }
+        return SPOOL_FAIL;
+    }
+    if (size < spool->spool_size) {
+        __sync_sub_and_fetch(&spool_memory, spool->spool_size - size);
+    }
+    spool->spool_data = data;
+    spool->spool_size = size;
+    return SPOOL_OK;
+}
+
+//! Move a body to a file
+/*!
+ * This writes the data of a body to a new temporary file and shrinks the
+ * memory to the write buffer.
+ * \param spool The body.
+ * \return SPOOL_OK on success, SPOOL_FAIL else.
+ */
+static int spool_spill(spool_t * spool){
+    if (-1 == (spool->spool_fd = spool_open_file())) {
+        ERROR_SYS("Creating a spool file");
+        return SPOOL_FAIL;
+    }
+    INFO_MSG2("Spool a body of %zu bytes to a file", spool->spool_len);
+    if (SPOOL_FAIL == spool_write_file(spool->spool_fd, spool->spool_data, spool->spool_buffered)) {
+        ERROR_SYS("Writing a spool file");
+        return SPOOL_FAIL;
+    }
+    spool->spool_buffered = 0;
+    if (spool->spool_size != SPOOL_BUFFER) {
+        spool_resize(spool, SPOOL_BUFFER);
+    }
+    return SPOOL_OK;
+}
+
+//! Write the buffered data of a body to its file
+/*!
+ * \param spool The body.
+ * \return SPOOL_OK on success, SPOOL_FAIL else.
+ */
+static int spool_flush(spool_t * spool){
+    if (-1 == spool->spool_fd || 0 == spool->spool_buffered) {
+        return SPOOL_OK;
+    }
+    if (SPOOL_FAIL == spool_write_file(spool->spool_fd, spool->spool_data, spool->spool_buffered)) {
+        ERROR_SYS("Writing a spool file");
+        return SPOOL_FAIL;
+    }
+    spool->spool_buffered = 0;
+    return SPOOL_OK;
+}
+
+//! Init the spool module
+/*!
+ * This reads the limits from the config and checks that temporary files can
+ * be created in the spool directory.
+ * This should be called once at application start, before the workers run.
+ * \return SPOOL_OK on success, SPOOL_FAIL else.
+ */
+int spool_init_app(){
+    int fd;
+
+    spool_max_body   = (size_t)config_get_spool_window() * 1024;
+    spool_max_memory = (size_t)config_get_spool_budget() * 1024;
+
+    if (-1 == (fd = spool_open_file())) {
+        ERROR_SYS("Creating a file in the spool directory");
+        return SPOOL_FAIL;
+    }
+    close(fd);
+    return SPOOL_OK;
+}
+
+//! Create a new body
+/*!
+ * \return The new empty body or NULL if no memory is left.
+ */
+spool_t * spool_new(){
+    spool_t * new = malloc(sizeof(spool_t));
+
+    if (NULL != new) {
+        memset(new, 0, sizeof(spool_t));
+        new->spool_fd   = -1;
+        new->spool_refs = 1;
+    }
+    return new;
+}
+
+//! Append data to a body
+/*!
+ * This appends data to the end of a body. The body is moved to a file if it
+ * grows over the window or the memory budget is used up.
+ * \param spool The body.
+ * \param buf   The data.
+ * \param len   The length of the data.
+ * \return SPOOL_OK on success, SPOOL_FAIL else.
+ */
+int spool_append(spool_t * spool, const char * buf, size_t len){
+    size_t need = spool->spool_buffered + len;
+    size_t size = spool->spool_size;
+
+    if (-1 == spool->spool_fd && need > size) {
+        if (0 == size) {
+            size = SPOOL_CHUNK;
+        }
+        while (need > size) {
+            size *= 2;
+        }
+        if (size > spool_max_body) {
+            size = spool_max_body;
+        }
+    }
+    /* the window is checked on each append, the memory never exceeds it */
+    if (-1 == spool->spool_fd && (need > spool_max_body
+                || (need > spool->spool_size && SPOOL_FAIL == spool_resize(spool, size)))) {
+        if (SPOOL_FAIL == spool_spill(spool)) {
+            return SPOOL_FAIL;
+        }
+    }
+
+    if (-1 != spool->spool_fd && spool->spool_buffered + len > spool->spool_size) {
+        if (SPOOL_FAIL == spool_flush(spool)) {
+            return SPOOL_FAIL;
+        }
+        /* too big for the buffer, write it directly */
+        if (len > spool->spool_size) {
+            if (SPOOL_FAIL == spool_write_file(spool->spool_fd, buf, len)) {
+                ERROR_SYS("Writing a spool file");
+                return SPOOL_FAIL;
+            }
+            spool->spool_len += len;
+            return SPOOL_OK;
+        }
+    }
+
+    memcpy(spool->spool_data + spool->spool_buffered, buf, len);
+    spool->spool_buffered += len;
+    spool->spool_len      += len;
+    return SPOOL_OK;
+}
+
+//! Get the length of a body
+/*!
+ * \param spool The body.
+ * \return The length of the whole body.
+ */
+size_t spool_len(spool_t * spool){
+    return spool->spool_len;
+}
+
+//! Get the memory of a body
+/*!
+ * This gives direct access to a body, if it is in memory.
+ * \param spool The body.
+ * \return The data of the body, which is spool_len() bytes long, or NULL if
+ *         the body is in a file (or empty).
+ */
+const char * spool_mem(spool_t * spool){
+    return (-1 == spool->spool_fd ? spool->spool_data : NULL);
+}
+
+//! Read a part of a body
+/*!
+ * This reads a part of a body, no matter if it is in memory or in a file.
+ * \param spool  The body.
+ * \param offset The offset of the first byte to read.
+ * \param buf    The buffer to read into.
+ * \param len    The size of the buffer.
+ * \return The count of readed bytes, 0 at the end of the body or -1 on
+ *         failture.
+ */
+ssize_t spool_read(spool_t * spool, size_t offset, char * buf, size_t len){
+    ssize_t res;
+
+    if (offset >= spool->spool_len) {
+        return 0;
+    }
+    if (len > spool->spool_len - offset) {
+        len = spool->spool_len - offset;
+    }
+    if (-1 == spool->spool_fd) {
+        memcpy(buf, spool->spool_data + offset, len);
+        return len;
+    }
+    if (SPOOL_FAIL == spool_flush(spool)) {
+        return -1;
+    }
+    while (-1 == (res = pread(spool->spool_fd, buf, len, offset)) && EINTR == errno);
+    return res;
+}
+
+//! Take a reference to a body
+/*!
+ * The body stays until the reference is given back with spool_free(). A body
+ * is only used by the worker which received it, so this is not atomic.
+ * \param spool The body.
+ * \return The body.
+ */
+spool_t * spool_ref(spool_t * spool){
+    spool->spool_refs++;
+    return spool;
+}
+
+//! Free a body
+/*!
+ * This gives back a reference to a body. With the last one the memory of the
+ * body is freed and its file closed.
+ * \param spool The body, may be NULL.
+ */
+void spool_free(spool_t * spool){
+    if (NULL == spool || 0 < --spool->spool_refs) {
+        return;
+    }
+    if (-1 != spool->spool_fd) {
+        close(spool->spool_fd);
+    }
+    free(spool->spool_data);
+    __sync_sub_and_fetch(&spool_memory, spool->spool_size);
+    free(spool);
+}
+
+/** @} */
@@ -0,0 +1,54 @@
+/* spool.h
+ *
+ * The spool module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define SPOOL_OK    0
+#define SPOOL_FAIL -1
+
+typedef struct spool spool_t;
+
+int spool_init_app();
+spool_t * spool_new();
+int spool_append(spool_t * spool, const char * buf, size_t len);
+size_t spool_len(spool_t * spool);
+const char * spool_mem(spool_t * spool);
+ssize_t spool_read(spool_t * spool, size_t offset, char * buf, size_t len);
+spool_t * spool_ref(spool_t * spool);
+void spool_free(spool_t * spool);
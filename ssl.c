@@ -141,6 +141,9 @@ SSL_CTX * ssl_initialize_ctx(char *keyfile, char *password){
     meth=SSLv23_method();
     ctx=SSL_CTX_new(meth);
 
+    /* the connection module writes from a queue which may be moved */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
     /* Load our keys and certificates*/
     if(!(SSL_CTX_use_certificate_chain_file(ctx,
 		    keyfile)))
@@ -253,30 +256,30 @@ void ssl_quit_client(SSL * ssl, int socket){
 
 //! Read data from a SSL connection
 /*!
+ * This reads the available data of the connection, not more than \p buflen
+ * bytes. The data is not null terminated.
  * \param socket The socket of the connection.
  * \param ssl    The SSL data of the session.
  * \param buf    The buffer for reading.
  * \param buflen The max. length of the buffer.
- * \return >0 on success.
+ * \return The count of readed bytes, 0 if the connection is closed or
+ *         SSL_AGAIN if no complete record is available on the (non blocking)
+ *         socket.
  */
 int ssl_read(int socket, SSL * ssl, char * buf, int buflen){
     int r, e;
-    BIO *io,*ssl_bio;
-
-    io=BIO_new(BIO_f_buffer());
-    ssl_bio=BIO_new(BIO_f_ssl());
-    BIO_set_ssl(ssl_bio,ssl,BIO_CLOSE);
-    BIO_push(io,ssl_bio);
 
-    r=BIO_gets(io, buf ,buflen - 1);
+    r = SSL_read(ssl, buf, buflen);
 
     e = SSL_get_error(ssl,r);
 
     switch (e) {
 	case SSL_ERROR_NONE:
 	    return r;
-	case SSL_ERROR_ZERO_RETURN:
 	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    return SSL_AGAIN;
+	case SSL_ERROR_ZERO_RETURN:
 	case SSL_ERROR_SYSCALL:
 	    return 0;
 	default:
@@ -289,37 +292,43 @@ int ssl_read(int socket, SSL * ssl, char * buf, int buflen){
     return -1;
 }
 
+//! Check for buffered data
+/*!
+ * Data which is already decrypted and buffered by openssl is not reported by
+ * the event loop, so this should be checked after each ssl_read().
+ * \param ssl The SSL data of the session.
+ * \return The count of bytes which can be readed without waiting.
+ */
+int ssl_pending(SSL * ssl){
+    return SSL_pending(ssl);
+}
+
 //! Write data to a SSL connection
 /*!
+ * This writes as much of the data as the (non blocking) socket takes. If
+ * SSL_AGAIN is returned, the call must be repeated with at least the same
+ * data when the socket is writable. The buffer may be moved meanwhile.
  * \param socket The socket of the connection.
  * \param ssl    The SSL data of the session.
  * \param buf    The buffer with the data.
  * \param buflen The length of the buffer.
- * \return >0 on success.
+ * \return The count of written bytes, SSL_AGAIN if the socket is not writable
+ *         or -1 on failture.
  */
-int ssl_write(int socket, SSL * ssl, char * buf, int buflen){
+int ssl_write(int socket, SSL * ssl, const char * buf, int buflen){
     int r;
-    BIO *io,*ssl_bio;
-    static char tmp[4096*4];
-
-    io=BIO_new(BIO_f_buffer());
-    ssl_bio=BIO_new(BIO_f_ssl());
-    BIO_set_ssl(ssl_bio,ssl,BIO_CLOSE);
-    BIO_push(io,ssl_bio);
 
-    if (buflen+1 > 4096*4)
-	return -1;
+    r = SSL_write(ssl, buf, buflen);
 
-    memcpy(tmp, buf, buflen);
-    tmp[buflen] = '\0';
-
-    if ((r=BIO_puts(io, tmp))<=0)
-	ssl_err_exit("Write error");
-
-    if (BIO_flush(io)<0)
-	ssl_err_exit("Error flushing BIO");
-
-    return r;
+    switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_NONE:
+	    return r;
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    return SSL_AGAIN;
+	default:
+	    return -1;
+    }
 }
 
 /** @} */
@@ -36,6 +36,9 @@
 
 #include <openssl/ssl.h>
 
+//! Returned by ssl_read() and ssl_write() if the socket would block
+#define SSL_AGAIN -2
+
 typedef struct ssl_data {
     void * ssl_data;
     SSL  * ssl_ssl;
@@ -47,4 +50,5 @@ void ssl_app_destroy();
 SSL * ssl_accept_client(int socket);
 void ssl_quit_client(SSL * ssl, int socket);
 int ssl_read(int socket, SSL * ssl, char * buf, int buflen);
-int ssl_write(int socket, SSL * ssl, char * buf, int buflen);
+int ssl_pending(SSL * ssl);
+int ssl_write(int socket, SSL * ssl, const char * buf, int buflen);
@@ -0,0 +1,375 @@
+/* uring.c
+ *
+ * The io_uring module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "fail.h"
+
+/*!
+ * \defgroup uring Uring Module
+ * This is a small wrapper of the io_uring syscalls, just what the connection
+ * module needs: a ring, one shot submission and provided buffer rings.
+ * @{
+ */
+
+//! The setup flags, tried in this order until the kernel takes them.
+static const unsigned uring_setup_flags[] = {
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+    IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+    0
+};
+
+//! Create a ring
+/*!
+ * This creates a new io_uring and maps its rings. The ring must only be used
+ * by the thread which created it.
+ * \param ring       The ring to init.
+ * \param entries    The count of submission entries, a power of 2.
+ * \param cq_entries The count of completion entries, a power of 2.
+ * \return URING_OK on success, URING_FAIL if the kernel has no (usable)
+ *         io_uring support.
+ */
+int uring_init(uring_t * ring, unsigned entries, unsigned cq_entries){
+    struct io_uring_params p;
+    size_t                 sq_size;
+    size_t                 cq_size;
+    char *                 mem;
+    unsigned               i;
+
+    memset(ring, 0, sizeof(uring_t));
+    ring->ring_fd = -1;
+
+    for (i = 0; i < sizeof(uring_setup_flags) / sizeof(unsigned); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags      = uring_setup_flags[i] | IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        ring->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (-1 != ring->ring_fd || EINVAL != errno) {
+            break;
+        }
+    }
+    if (-1 == ring->ring_fd) {
+        ERROR_SYS("io_uring setup");
+        return URING_FAIL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+            || !(p.features & IORING_FEAT_EXT_ARG)) {
+        ERROR_CUSTM("io_uring of the kernel is too old");
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+        return URING_FAIL;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_mem_size  = (sq_size > cq_size ? sq_size : cq_size);
+    ring->ring_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    mem = mmap(NULL, ring->ring_mem_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == mem) {
+        ERROR_SYS("io_uring mapping");
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+        return URING_FAIL;
+    }
+    ring->ring_sqes = mmap(NULL, ring->ring_sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->ring_sqes) {
+        ERROR_SYS("io_uring mapping");
+        munmap(mem, ring->ring_mem_size);
+        close(ring->ring_fd);
+        ring->ring_fd = -1;
+        return URING_FAIL;
+    }
+
+    ring->ring_mem        = mem;
+    ring->ring_sq_head    = (unsigned *)(mem + p.sq_off.head);
+    ring->ring_sq_tail    = (unsigned *)(mem + p.sq_off.tail);
+    ring->ring_sq_array   = (unsigned *)(mem + p.sq_off.array);
+    ring->ring_sq_mask    = *(unsigned *)(mem + p.sq_off.ring_mask);
+    ring->ring_sq_entries = p.sq_entries;
+    ring->ring_sq_local   = *ring->ring_sq_tail;
+    ring->ring_cq_head    = (unsigned *)(mem + p.cq_off.head);
+    ring->ring_cq_tail    = (unsigned *)(mem + p.cq_off.tail);
+    ring->ring_cq_mask    = *(unsigned *)(mem + p.cq_off.ring_mask);
+    ring->ring_cqes       = (struct io_uring_cqe *)(mem + p.cq_off.cqes);
+
+    /* each slot of the ring always points to the entry with the same index */
+    for (i = 0; i < p.sq_entries; i++) {
+        ring->ring_sq_array[i] = i;
+    }
+    return URING_OK;
+}
+
+//! Destroy a ring
+/*!
+ * This closes the ring, the kernel cancels all requests which are still
+ * pending.
+ * \param ring The ring.
+ */
+void uring_exit(uring_t * ring){
+    if (-1 == ring->ring_fd) {
+        return;
+    }
+    munmap(ring->ring_sqes, ring->ring_sqes_size);
+    munmap(ring->ring_mem, ring->ring_mem_size);
+    close(ring->ring_fd);
+    ring->ring_fd = -1;
+}
+
+//! Get the count of free submission entries
+/*!
+ * \param ring The ring.
+ * \return The count of entries which can be taken with uring_get_sqe() before
+ *         the ring has to be submitted.
+ */
+unsigned uring_sq_space(uring_t * ring){
+    return ring->ring_sq_entries
+        - (ring->ring_sq_local - __atomic_load_n(ring->ring_sq_head, __ATOMIC_ACQUIRE));
+}
+
+//! Get a submission entry
+/*!
+ * This returns the next free submission entry, cleared. If the submission
+ * ring is full, the pending entries are submitted first. The entry is handed
+ * to the kernel with the next uring_submit().
+ * \param ring The ring.
+ * \return The entry or NULL if the ring is full and cannot be submitted.
+ */
+struct io_uring_sqe * uring_get_sqe(uring_t * ring){
+    struct io_uring_sqe * sqe;
+
+    if (0 == uring_sq_space(ring) && 0 > uring_submit(ring, 0)) {
+        ERROR_SYS("io_uring submission");
+        return NULL;
+    }
+
+    sqe = &(ring->ring_sqes[ring->ring_sq_local & ring->ring_sq_mask]);
+    ring->ring_sq_local++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+//! Submit the new entries and wait
+/*!
+ * This hands all entries taken since the last call to the kernel and waits
+ * for at least \p wait completions, all with one syscall.
+ * \param ring The ring.
+ * \param wait The count of completions to wait for, 0 to return at once.
+ * \return The count of submitted entries or -1 with errno set.
+ */
+int uring_submit(uring_t * ring, unsigned wait){
+    unsigned pending;
+
+    __atomic_store_n(ring->ring_sq_tail, ring->ring_sq_local, __ATOMIC_RELEASE);
+    pending = ring->ring_sq_local - __atomic_load_n(ring->ring_sq_head, __ATOMIC_ACQUIRE);
+
+    return syscall(__NR_io_uring_enter, ring->ring_fd, pending, wait,
+            (0 < wait ? IORING_ENTER_GETEVENTS : 0), NULL, 0);
+}
+
+//! Submit the new entries and wait with a timeout
+/*!
+ * Like uring_submit() with \p wait 1, but returns after \p timeout
+ * milliseconds if nothing is completed until then.
+ * \param ring    The ring.
+ * \param timeout The max time to wait in milliseconds or -1 to wait forever.
+ * \return The count of submitted entries or -1 with errno set (ETIME if the
+ *         timeout expired).
+ */
+int uring_wait(uring_t * ring, int timeout){
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    unsigned                      pending;
+
+    if (0 > timeout) {
+        return uring_submit(ring, 1);
+    }
+
+    __atomic_store_n(ring->ring_sq_tail, ring->ring_sq_local, __ATOMIC_RELEASE);
+    pending = ring->ring_sq_local - __atomic_load_n(ring->ring_sq_head, __ATOMIC_ACQUIRE);
+
+    ts.tv_sec  = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    return syscall(__NR_io_uring_enter, ring->ring_fd, pending, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+//! Get the next completion
+/*!
+ * \param ring The ring.
+ * \return The next completion or NULL if there is none. It must be released
+ *         with uring_cqe_seen() after use.
+ */
+struct io_uring_cqe * uring_peek_cqe(uring_t * ring){
+    unsigned head = *(ring->ring_cq_head);
+
+    if (head == __atomic_load_n(ring->ring_cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &(ring->ring_cqes[head & ring->ring_cq_mask]);
+}
+
+//! Release a completion
+/*!
+ * This gives the completion returned by uring_peek_cqe() back to the kernel.
+ * \param ring The ring.
+ */
+void uring_cqe_seen(uring_t * ring){
+    __atomic_store_n(ring->ring_cq_head, *(ring->ring_cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+//! Put a buffer to a buffer ring
+/*!
+ * \param bufs The buffer ring.
+ * \param id   The id of the buffer.
+ */
+static inline void uring_bufs_add(uring_bufs_t * bufs, unsigned id){
+    struct io_uring_buf * buf = &(bufs->bufs_ring->bufs[bufs->bufs_tail & (bufs->bufs_count - 1)]);
+
+    buf->addr = (uintptr_t)(bufs->bufs_data + (size_t)id * bufs->bufs_size);
+    buf->len  = bufs->bufs_size;
+    buf->bid  = id;
+    bufs->bufs_tail++;
+}
+
+//! Create a buffer ring
+/*!
+ * This allocates \p count buffers of \p size bytes and registers them as
+ * buffer group \p group at the ring.
+ * \param ring  The ring.
+ * \param bufs  The buffer ring to init.
+ * \param group The buffer group id used with IOSQE_BUFFER_SELECT.
+ * \param count The count of buffers, a power of 2.
+ * \param size  The size of each buffer.
+ * \return URING_OK on success, URING_FAIL if the kernel has no buffer rings.
+ */
+int uring_bufs_init(uring_t * ring, uring_bufs_t * bufs, uint16_t group, unsigned count, unsigned size){
+    struct io_uring_buf_reg reg;
+    unsigned                i;
+
+    memset(bufs, 0, sizeof(uring_bufs_t));
+
+    if (0 != posix_memalign((void **)&(bufs->bufs_ring), sysconf(_SC_PAGESIZE),
+                count * sizeof(struct io_uring_buf))) {
+        ERROR_SYS("buffer ring allocation");
+        return URING_FAIL;
+    }
+    if (NULL == (bufs->bufs_data = malloc((size_t)count * size))) {
+        ERROR_SYS("buffer ring allocation");
+        free(bufs->bufs_ring);
+        bufs->bufs_ring = NULL;
+        return URING_FAIL;
+    }
+    memset(bufs->bufs_ring, 0, count * sizeof(struct io_uring_buf));
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uintptr_t)bufs->bufs_ring;
+    reg.ring_entries = count;
+    reg.bgid         = group;
+    if (0 != syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        ERROR_SYS("buffer ring registration");
+        free(bufs->bufs_data);
+        free(bufs->bufs_ring);
+        memset(bufs, 0, sizeof(uring_bufs_t));
+        return URING_FAIL;
+    }
+
+    bufs->bufs_count = count;
+    bufs->bufs_size  = size;
+    bufs->bufs_group = group;
+    for (i = 0; i < count; i++) {
+        uring_bufs_add(bufs, i);
+    }
+    __atomic_store_n(&(bufs->bufs_ring->tail), bufs->bufs_tail, __ATOMIC_RELEASE);
+    return URING_OK;
+}
+
+//! Destroy a buffer ring
+/*!
+ * This unregisters the buffer ring and frees the buffers. There must be no
+ * pending reads from this group.
+ * \param ring The ring.
+ * \param bufs The buffer ring.
+ */
+void uring_bufs_exit(uring_t * ring, uring_bufs_t * bufs){
+    struct io_uring_buf_reg reg;
+
+    if (NULL == bufs->bufs_ring) {
+        return;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bufs->bufs_group;
+    syscall(__NR_io_uring_register, ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+
+    free(bufs->bufs_data);
+    free(bufs->bufs_ring);
+    memset(bufs, 0, sizeof(uring_bufs_t));
+}
+
+//! Get the memory of a buffer
+/*!
+ * \param bufs The buffer ring.
+ * \param id   The buffer id from the completion.
+ * \return The buffer.
+ */
+char * uring_bufs_get(uring_bufs_t * bufs, unsigned id){
+    return bufs->bufs_data + (size_t)id * bufs->bufs_size;
+}
+
+//! Give a buffer back
+/*!
+ * This puts a buffer used by a read back to the buffer ring, so the kernel
+ * can use it for the next read.
+ * \param bufs The buffer ring.
+ * \param id   The buffer id from the completion.
+ */
+void uring_bufs_recycle(uring_bufs_t * bufs, unsigned id){
+    uring_bufs_add(bufs, id);
+    __atomic_store_n(&(bufs->bufs_ring->tail), bufs->bufs_tail, __ATOMIC_RELEASE);
+}
+
+/** @} */
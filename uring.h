@@ -0,0 +1,94 @@
+/* uring.h
+ *
+ * The io_uring module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define URING_FAIL -1
+#define URING_OK    0
+
+//! An io_uring instance
+/*!
+ * This holds the file descriptor of the ring and the pointers into the memory
+ * it shares with the kernel. The fields are only used by the uring module.
+ */
+typedef struct uring {
+    int                   ring_fd;        //!< The file descriptor of the ring.
+    void *                ring_mem;       //!< The mapped submission and completion ring.
+    size_t                ring_mem_size;  //!< The size of ring_mem.
+    struct io_uring_sqe * ring_sqes;      //!< The mapped submission entries.
+    size_t                ring_sqes_size; //!< The size of ring_sqes.
+    unsigned *            ring_sq_head;   //!< The head of the submission ring, moved by the kernel.
+    unsigned *            ring_sq_tail;   //!< The tail of the submission ring, moved by us.
+    unsigned *            ring_sq_array;  //!< The index array of the submission ring.
+    unsigned              ring_sq_mask;   //!< The mask for submission ring indices.
+    unsigned              ring_sq_entries;//!< The count of submission entries.
+    unsigned              ring_sq_local;  //!< The tail including the not yet published entries.
+    unsigned *            ring_cq_head;   //!< The head of the completion ring, moved by us.
+    unsigned *            ring_cq_tail;   //!< The tail of the completion ring, moved by the kernel.
+    unsigned              ring_cq_mask;   //!< The mask for completion ring indices.
+    struct io_uring_cqe * ring_cqes;      //!< The mapped completion entries.
+} uring_t;
+
+//! A provided buffer ring
+/*!
+ * A group of equal sized buffers the kernel picks from for reads with
+ * \p IOSQE_BUFFER_SELECT. The id of the used buffer is returned with the
+ * completion, the buffer must be given back with uring_bufs_recycle().
+ */
+typedef struct uring_bufs {
+    struct io_uring_buf_ring * bufs_ring;   //!< The ring shared with the kernel.
+    char *                     bufs_data;   //!< The memory of the buffers.
+    unsigned                   bufs_count;  //!< The count of buffers, a power of 2.
+    unsigned                   bufs_size;   //!< The size of each buffer.
+    uint16_t                   bufs_group;  //!< The buffer group id.
+    uint16_t                   bufs_tail;   //!< The tail of the ring.
+} uring_bufs_t;
+
+
+int uring_init(uring_t * ring, unsigned entries, unsigned cq_entries);
+void uring_exit(uring_t * ring);
+unsigned uring_sq_space(uring_t * ring);
+struct io_uring_sqe * uring_get_sqe(uring_t * ring);
+int uring_submit(uring_t * ring, unsigned wait);
+int uring_wait(uring_t * ring, int timeout);
+struct io_uring_cqe * uring_peek_cqe(uring_t * ring);
+void uring_cqe_seen(uring_t * ring);
+int uring_bufs_init(uring_t * ring, uring_bufs_t * bufs, uint16_t group, unsigned count, unsigned size);
+void uring_bufs_exit(uring_t * ring, uring_bufs_t * bufs);
+char * uring_bufs_get(uring_bufs_t * bufs, unsigned id);
+void uring_bufs_recycle(uring_bufs_t * bufs, unsigned id);
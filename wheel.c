@@ -0,0 +1,317 @@
+/* wheel.c
+ *
+ * The timer wheel module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "wheel.h"
+
+/*!
+ * \defgroup wheel Timer Wheel Module
+ * This is a hierarchical timer wheel for the timeouts of a worker. The time
+ * is divided into ticks of WHEEL_TICK milliseconds. Each level has
+ * WHEEL_SLOTS slots, a slot of level n covers WHEEL_SLOTS^n ticks. A timer is
+ * put into the level which matches its distance, so arming and cancelling is
+ * O(1). When the lower level wrapped around, the timers of the next slot of
+ * the upper level are moved down (cascaded).
+ * Each worker has its own wheel, the timers must be armed, cancelled and
+ * expired by the thread of the worker.
+ * @{
+ */
+
+//! The length of a tick in milliseconds
+#define WHEEL_TICK   10
+
+//! The count of bits of the slot index of a level
+#define WHEEL_BITS   6
+
+//! The count of slots of a level
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+
+//! The count of levels
+#define WHEEL_LEVELS 4
+
+//! The max distance of a timer in ticks (about 46 hours)
+#define WHEEL_MAX    ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+//! The wheel of a worker
+typedef struct wheel {
+    wheel_timer_t * wheel_slots[WHEEL_LEVELS][WHEEL_SLOTS]; //!< The timers of each slot.
+    uint64_t        wheel_used[WHEEL_LEVELS];  //!< Bitmap of the slots with timers.
+    uint64_t        wheel_tick;                //!< The last processed tick.
+    unsigned        wheel_count;               //!< The count of armed timers.
+} wheel_t;
+
+__thread wheel_t wheel; //! The wheel of the worker.
+
+//! Get the current tick
+/*!
+ * \return The ticks of the monotonic clock.
+ */
+static inline uint64_t wheel_now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK;
+}
+
+//! Put a timer into its slot
+/*!
+ * \param timer The timer, timer_expires must be set and later than the
+ *              current tick.
+ */
+static inline void wheel_insert(wheel_timer_t * timer){
+    uint64_t         delta = timer->timer_expires - wheel.wheel_tick;
+    int              level = 0;
+    int              slot;
+    wheel_timer_t ** head;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = (timer->timer_expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    head = &(wheel.wheel_slots[level][slot]);
+
+    timer->timer_next  = *head;
+    timer->timer_pprev = head;
+    if (NULL != *head) {
+        (*head)->timer_pprev = &(timer->timer_next);
+    }
+    *head = timer;
+    wheel.wheel_used[level] |= 1ULL << slot;
+}
+
+//! Remove a timer from its slot
+/*!
+ * \param timer The armed timer.
+ */
+static inline void wheel_remove(wheel_timer_t * timer){
+    *(timer->timer_pprev) = timer->timer_next;
+    if (NULL != timer->timer_next) {
+        timer->timer_next->timer_pprev = timer->timer_pprev;
+    }
+    timer->timer_next  = NULL;
+    timer->timer_pprev = NULL;
+}
+
+//! Mark a slot as empty if it has no timers
+/*!
+ * \param level The level of the slot.
+ * \param slot  The index of the slot.
+ */
+static inline void wheel_update_used(int level, int slot){
+    if (NULL == wheel.wheel_slots[level][slot]) {
+        wheel.wheel_used[level] &= ~(1ULL << slot);
+    }
+}
+
+//! Init a timer
+/*!
+ * \param timer   The timer.
+ * \param handler The callback, it is called by wheel_expire().
+ * \param data    The data for the callback.
+ */
+void wheel_timer_init(wheel_timer_t * timer, wheel_handler_t handler, void * data){
+    memset(timer, 0, sizeof(wheel_timer_t));
+    timer->timer_handler = handler;
+    timer->timer_data    = data;
+}
+
+//! Arm a timer
+/*!
+ * An armed timer is moved. The timer expires at the first wheel_expire()
+ * after the time is over, it never expires within this call.
+ * \param timer The timer.
+ * \param msecs The time until the timer expires in milliseconds.
+ */
+void wheel_arm(wheel_timer_t * timer, int msecs){
+    uint64_t ticks = (msecs + WHEEL_TICK - 1) / WHEEL_TICK;
+
+    if (NULL != timer->timer_pprev) {
+        wheel_remove(timer);
+        wheel.wheel_count--;
+    }
+    /* a wheel without timers was not advanced */
+    if (0 == wheel.wheel_count) {
+        wheel.wheel_tick = wheel_now();
+    }
+    if (1 > ticks) {
+        ticks = 1;
+    }
+    if (WHEEL_MAX < ticks) {
+        ticks = WHEEL_MAX;
+    }
+    timer->timer_expires = wheel.wheel_tick + ticks;
+    wheel_insert(timer);
+    wheel.wheel_count++;
+}
+
+//! Cancel a timer
+/*!
+ * Nothing happens if the timer is not armed.
+ * \param timer The timer.
+ */
+void wheel_cancel(wheel_timer_t * timer){
+    int level;
+
+    if (NULL == timer->timer_pprev) {
+        return;
+    }
+    wheel_remove(timer);
+    wheel.wheel_count--;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (0 != wheel.wheel_used[level]) {
+            wheel_update_used(level, (timer->timer_expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+        }
+    }
+}
+
+//! Check if a timer is armed
+/*!
+ * \param timer The timer.
+ * \return 1 if the timer is armed, 0 else.
+ */
+int wheel_armed(wheel_timer_t * timer){
+    return (NULL != timer->timer_pprev);
+}
+
+//! Move the timers of a slot to the lower levels
+/*!
+ * \param level The level of the slot.
+ * \param slot  The index of the slot.
+ */
+static inline void wheel_cascade(int level, int slot){
+    wheel_timer_t * timer;
+
+    while (NULL != (timer = wheel.wheel_slots[level][slot])) {
+        wheel_remove(timer);
+        wheel_insert(timer);
+    }
+    wheel_update_used(level, slot);
+}
+
+//! Get the wait timeout of the main loop
+/*!
+ * The result may be earlier than the next expiry, as timers of the upper
+ * levels are cascaded first.
+ * \return The milliseconds until the wheel must be processed again or -1 if no
+ *         timer is armed.
+ */
+int wheel_timeout(){
+    uint64_t next = UINT64_MAX;
+    uint64_t block;
+    uint64_t rotated;
+    uint64_t at;
+    uint64_t now;
+    int      level;
+    int      shift;
+    int      pos;
+
+    if (0 == wheel.wheel_count) {
+        return -1;
+    }
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (0 == wheel.wheel_used[level]) {
+            continue;
+        }
+        /* the first used slot after the current one, in wheel order */
+        shift   = WHEEL_BITS * level;
+        block   = wheel.wheel_tick >> shift;
+        pos     = (block + 1) & (WHEEL_SLOTS - 1);
+        rotated = (wheel.wheel_used[level] >> pos) | (0 == pos ? 0 : wheel.wheel_used[level] << (WHEEL_SLOTS - pos));
+        at      = (block + 1 + __builtin_ctzll(rotated)) << shift;
+        if (at < next) {
+            next = at;
+        }
+    }
+    now = wheel_now();
+    if (next <= now) {
+        return 0;
+    }
+    return (int)((next - now) * WHEEL_TICK);
+}
+
+//! Process the expired timers
+/*!
+ * This advances the wheel to the current time and calls the callbacks of all
+ * expired timers. A timer is not armed anymore when its callback is called,
+ * the callbacks may arm and cancel timers.
+ */
+void wheel_expire(){
+    uint64_t        now = wheel_now();
+    uint64_t        next;
+    wheel_timer_t * timer;
+    int             slot;
+    int             level;
+
+    while (wheel.wheel_tick < now) {
+        if (0 == wheel.wheel_count) {
+            wheel.wheel_tick = now;
+            break;
+        }
+        /* skip to the next wrap of level 0 if it has no timers */
+        if (0 == wheel.wheel_used[0]) {
+            next = ((wheel.wheel_tick >> WHEEL_BITS) + 1) << WHEEL_BITS;
+            if (next > now) {
+                wheel.wheel_tick = now;
+                break;
+            }
+            wheel.wheel_tick = next;
+        } else {
+            wheel.wheel_tick++;
+        }
+
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (0 != (wheel.wheel_tick & ((1ULL << (WHEEL_BITS * level)) - 1))) {
+                break;
+            }
+            wheel_cascade(level, (wheel.wheel_tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+        }
+
+        slot = wheel.wheel_tick & (WHEEL_SLOTS - 1);
+        while (NULL != (timer = wheel.wheel_slots[0][slot])) {
+            wheel_remove(timer);
+            wheel.wheel_count--;
+            (timer->timer_handler)(timer->timer_data);
+        }
+        wheel_update_used(0, slot);
+    }
+}
+
+/** @} */
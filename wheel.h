@@ -0,0 +1,65 @@
+/* wheel.h
+ *
+ * The timer wheel module for the "Beleg Rechnernetze/Kommunikationssysteme".
+ *
+ * (c) 2008, 2009 by Jan Losinski
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * is provided AS IS, WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE, and
+ * NON-INFRINGEMENT.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+typedef struct wheel_timer wheel_timer_t;
+
+//! Function prototype for the callbacks of expired timers
+typedef void (* wheel_handler_t)(void * data);
+
+//! A timer
+/*!
+ * The timer is embedded in the structure it belongs to and must be
+ * initialized with wheel_timer_init() before it is used. The fields are only
+ * used by the wheel module.
+ */
+struct wheel_timer {
+    wheel_timer_t *  timer_next;     //!< The next timer in the slot.
+    wheel_timer_t ** timer_pprev;    //!< The link pointing to this timer or NULL if the timer is not armed.
+    uint64_t         timer_expires;  //!< The tick the timer expires.
+    wheel_handler_t  timer_handler;  //!< The callback.
+    void *           timer_data;     //!< The data passed to the callback.
+};
+
+void wheel_timer_init(wheel_timer_t * timer, wheel_handler_t handler, void * data);
+void wheel_arm(wheel_timer_t * timer, int msecs);
+void wheel_cancel(wheel_timer_t * timer);
+int wheel_armed(wheel_timer_t * timer);
+int wheel_timeout();
+void wheel_expire();